@@ -21,22 +21,43 @@
 #define __DEFS_H
 
 #define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE   700
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <dirent.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <unistr.h>
 #include <unistdio.h>
 #include <uniwidth.h>
+#include <zlib.h>
+
+#include "slweb-plugin.h"
 
 #define PROGRAMNAME   "slweb"
 #define VERSION       "0.3.8"
@@ -48,6 +69,48 @@
 #define SMALL_ARGSIZE 256
 #define DATEBUFSIZE   12
 
+#define INCLUDE_CACHE_MAGIC   "slweb-include-cache"
+#define INCLUDE_CACHE_VERSION 1
+
+#define DOC_CACHE_MAGIC       "slwebdoc"
+#define DOC_CACHE_VERSION     5
+#define DOC_CACHE_BYTE_ORDER  0x01020304
+
+#define STREAM_WINDOW_SIZE 65536
+
+#define BLOCK_PARALLEL_MIN 1048576
+#define BLOCK_SIZE_MIN     65536
+#define BLOCKS_PER_JOB     4
+#define BLOCK_MISMATCH     255
+
+#define GZIP_CHUNK_SIZE 16384
+
+#define CSV_TABLE_CHUNK_SIZE 4096
+
+#define COMMAND_READ_SIZE 65536
+
+#define MATH_COMMAND_MAX 32
+#define MATH_DEPTH_MAX   64
+
+#define MINIFY_TAG_SIZE 16
+
+#define INLINE_CSS_LIMIT 8192
+
+#define INCDIR_MORE "&hellip;"
+
+#define FEED_RSS_FILENAME     "rss.xml"
+#define FEED_ATOM_FILENAME    "atom.xml"
+#define FEED_SITEMAP_FILENAME "sitemap.xml"
+
+#define ASSETS_HEADER_MAP   "headers.map"
+#define ASSETS_CACHE_HEADER "public, max-age=31536000, immutable"
+
+#define SERVE_DEFAULT_HOST  "127.0.0.1"
+#define SERVE_DEFAULT_PORT  "8080"
+#define SERVE_BACKLOG       16
+#define SERVE_CACHE_ENTRIES 64
+#define SERVE_REQUEST_SIZE  8192
+
 static const char timestamp_format[]     = "d.m.y";
 static const char timestamp_output_ext[] = ".html";
 
@@ -56,6 +119,25 @@ static const char* CMD_GIT_LOG_ARGS[]
     = { "xargs", "-I{}", "git", "log", "-1", 
         "--pretty=format:{} %h %ci (%cn) %d", NULL };
 
+static const char* minify_block_tags[] 
+    = { "!doctype", "address", "article", "aside", "blockquote", "body", "br",
+        "dd", "details", "div", "dl", "dt", "figcaption", "figure", "footer",
+        "form", "h1", "h2", "h3", "h4", "h5", "h6", "head", "header", "hr",
+        "html", "li", "link", "main", "meta", "nav", "ol", "p", "pre",
+        "script", "section", "style", "table", "tbody", "td", "tfoot", "th",
+        "thead", "title", "tr", "ul", NULL };
+static const char* minify_raw_tags[] 
+    = { "code", "pre", "script", "style", "textarea", NULL };
+
+/* Fills the <details> of a lazy incdir from its fragment when opened */
+static const char INCDIR_LAZY_SCRIPT[] =
+    "document.querySelectorAll('details[data-fragment]').forEach(function(d){"
+    "if(d.dataset.bound)return;d.dataset.bound=1;"
+    "d.addEventListener('toggle',function(){"
+    "if(!d.open||d.dataset.loaded)return;d.dataset.loaded=1;"
+    "fetch(d.dataset.fragment).then(function(r){return r.text()})"
+    ".then(function(t){d.lastElementChild.innerHTML=t})})})";
+
 static const char CMD_KATEX[]               = "katex";
 static const char* CMD_KATEX_INLINE_ARGS[]  = { "katex", NULL };
 static const char* CMD_KATEX_DISPLAY_ARGS[] = { "katex", "-d", NULL };
@@ -72,9 +154,16 @@ typedef unsigned long ULONG;
 typedef enum
 {
     CMD_NONE,
+    CMD_ASSETS,
     CMD_BODY_ONLY,
     CMD_BASEDIR,
+    CMD_DEFS,
+    CMD_DOC_CACHE,
+    CMD_FEED,
     CMD_HELP,
+    CMD_INCLUDE_CACHE,
+    CMD_PLUGIN,
+    CMD_SERVE,
     CMD_VERSION
 } Command;
 
@@ -84,9 +173,1057 @@ typedef struct
     uint8_t* value;
     size_t   value_size;
     BOOL     seen;    /* for use with macros */
+    BOOL     kept;    /* macro kept from an include; value belongs to the
+                         include cache */
 } KeyValue;
 
+/*
+ * Macro bodies are collected line by line as a rope: a list of segments with
+ * known lengths, joined into the macro's value only once, when the body ends.
+ */
+typedef struct
+{
+    uint8_t* text;
+    size_t   len;
+} RopeSegment;
+
+typedef struct
+{
+    RopeSegment* segments;
+    size_t       segments_count;
+    size_t       segments_size;
+    size_t       len;
+} Rope;
+
+/* Text built up by appending, with its length kept along */
+typedef struct
+{
+    uint8_t* text;
+    size_t   len;
+    size_t   size;
+} StrBuf;
+
+/*
+ * A page being compressed as it is printed: the emitter writes into a pipe,
+ * and a thread reads it, copying the HTML to one file and its gzip to another
+ */
+typedef struct
+{
+    int       input;          /* read end of the pipe */
+    int       html;           /* uncompressed copy, or -1 */
+    int       gz;
+    int       level;
+    int       result;
+    pthread_t thread;
+} GzipJob;
+
+/*
+ * A CSV file being streamed into a table by {csv-table}, a field at a time;
+ * cell text goes out in chunks, so that memory doesn't grow with the file
+ */
+typedef struct
+{
+    FILE*         output;
+    const size_t* columns;        /* to output, ascending; NULL for all */
+    size_t        columns_count;
+    size_t        column;         /* of the field being read, from 1 */
+    size_t        next_selected;  /* index into columns */
+    BOOL          selected;       /* the field is output */
+    size_t        row;            /* 0 for the header */
+    size_t        cells;          /* output in the row so far */
+    size_t        header_cells;
+    BOOL          body_started;
+    uint8_t       chunk[CSV_TABLE_CHUNK_SIZE];
+    size_t        chunk_len;
+} CsvTable;
+
+/* A directive registered by a plugin loaded with --plugin */
+typedef struct
+{
+    char*          name;
+    SlwebDirective function;
+    int            flags;         /* SLWEB_DIRECTIVE_THREADED */
+    void*          data;
+} PluginDirective;
+
+/*
+ * A threaded plugin directive found by the first pass, run before the page
+ * is output
+ */
+typedef struct
+{
+    uint8_t* text;
+    size_t   directive;           /* index into plugin_directives */
+    BOOL     rendered;
+    int      result;
+    StrBuf   html;
+} PluginCall;
+
+/* Where a plugin directive writes: the page, or the text of a PluginCall */
+struct SlwebSink
+{
+    FILE*   output;
+    StrBuf* buffer;
+};
+
+/* Threads running the PluginCalls, each taking the next one not started */
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t          next;
+} PluginPool;
+
+/*
+ * State of --minify, kept across the writes of a page. Whitespace between words
+ * collapses to one space, and disappears next to block-level tags; comments
+ * and the content of the tags in minify_raw_tags are copied as is.
+ */
+typedef enum
+{
+    MINIFY_TEXT,
+    MINIFY_TAG_NAME,          /* after '<', the name not yet complete */
+    MINIFY_TAG,               /* attributes, up to '>' */
+    MINIFY_RAW                /* inside one of minify_raw_tags */
+} MinifyState;
+
+typedef struct
+{
+    StrBuf      text;         /* formatted by print_output */
+    StrBuf      out;          /* minified, to be written */
+    MinifyState state;
+    BOOL        space_pending;
+    BOOL        after_block;  /* the last tag written is block-level */
+    BOOL        end_tag;
+    BOOL        block;        /* the tag being read is block-level */
+    BOOL        tag_space;
+    char        quote;
+    char        tag[MINIFY_TAG_SIZE];
+    size_t      tag_len;
+    char        raw_end[MINIFY_TAG_SIZE + 2]; /* "</pre" or "-->" */
+    size_t      raw_matched;
+} Minify;
+
+typedef struct
+{
+    UBYTE    kind;    /* 'v' variable, 'm' macro, 'f' file */
+    uint8_t* key;
+    uint64_t hash;    /* of the value seen by the include, 0 if none */
+    BOOL     seen;
+} IncludeDep;
+
+typedef struct
+{
+    char*       filename;
+    uint64_t    content_hash;
+    uint8_t*    data;         /* serialized form, everything below points here */
+    size_t      data_len;
+    uint8_t*    fragment;
+    size_t      fragment_len;
+    BOOL        is_volatile;  /* uses {git-log} or {incdir}, never cached */
+    IncludeDep* deps;
+    size_t      deps_count;
+    KeyValue*   def_vars;
+    size_t      def_vars_count;
+    KeyValue*   def_macros;
+    size_t      def_macros_count;
+    KeyValue*   def_links;
+    size_t      def_links_count;
+} IncludeCacheEntry;
+
+/* A page found by --feed, described by its front matter only */
+typedef struct
+{
+    char*    filename;
+    char*    url;
+    uint8_t* title;
+    uint8_t* date;
+    uint8_t* desc;
+    uint8_t* author;
+    time_t   time;        /* from date, or the modification time */
+    BOOL     dated;
+} FeedEntry;
+
+/* A rule of a stylesheet read for --inline-css */
+typedef struct
+{
+    uint8_t* media;       /* enclosing @media or @supports, or NULL */
+    uint8_t* selector;    /* selector list, or the prelude of an at-rule */
+    uint8_t* body;
+    BOOL     always;      /* an at-rule such as @font-face */
+} CssRule;
+
+/* Stylesheets are parsed once per run, unless they change */
+typedef struct
+{
+    char*    key;         /* file name and modification time */
+    uint8_t* text;        /* minified */
+    size_t   len;
+    CssRule* rules;
+    size_t   rules_count;
+} Stylesheet;
+
+/* A bundle or other asset published under --assets, by the files it's from */
+typedef struct
+{
+    char*  key;   /* file names and modification times */
+    size_t key_len;
+    char*  url;
+} AssetEntry;
+
+typedef struct
+{
+    char*    filename;
+    char*    dirname;
+    char*    basedir;
+    uint8_t* buffer;
+    uint64_t content_hash;
+} IncludeJob;
+
+typedef struct
+{
+    char*              filename;
+    IncludeCacheEntry* rendered;  /* the page as a fragment, with the files
+                                     it read as dependencies */
+    time_t             mtime;
+    off_t              size;
+    uint64_t           hash;
+    ULONG              last_used;
+} PageCacheEntry;
+
+typedef struct
+{
+    const char* ext;
+    const char* type;
+} MimeType;
+
+static const MimeType mime_types[] = {
+    { ".css",   "text/css; charset=utf-8" },
+    { ".csv",   "text/csv; charset=utf-8" },
+    { ".gif",   "image/gif" },
+    { ".html",  "text/html; charset=utf-8" },
+    { ".ico",   "image/x-icon" },
+    { ".jpeg",  "image/jpeg" },
+    { ".jpg",   "image/jpeg" },
+    { ".js",    "text/javascript; charset=utf-8" },
+    { ".json",  "application/json" },
+    { ".pdf",   "application/pdf" },
+    { ".png",   "image/png" },
+    { ".svg",   "image/svg+xml" },
+    { ".txt",   "text/plain; charset=utf-8" },
+    { ".webp",  "image/webp" },
+    { ".woff",  "font/woff" },
+    { ".woff2", "font/woff2" },
+    { ".xml",   "application/xml" },
+    { NULL,     "application/octet-stream" }
+};
+
+/*
+ * Parsed document: a flat array of nodes in document order, produced by
+ * parse_document and printed by emit_html. Strings referred to by nodes
+ * (text, link targets, directive arguments) are kept in a single text pool,
+ * NUL-terminated, and nodes hold only offsets into it, so the node array
+ * contains no pointers. Offset 0 of the pool is the empty string.
+ *
+ * The pool holds copies rather than the spans being offsets into the source:
+ * a token is not always a run of the source (escaping backslashes are dropped,
+ * link targets and macro bodies come from definitions elsewhere), and
+ * --stream parses into a window whose contents are replaced as the input is
+ * read. Each token is copied once, with a single memcpy, when its node is
+ * added.
+ *
+ * Whatever the parser can decide (paragraph state, footnote numbers, link
+ * targets, whether a macro is being defined or expanded) is decided before
+ * emission; the emitter keeps no parser state of its own.
+ */
+typedef enum
+{
+    NODE_HEAD,                /* <!DOCTYPE>, <head>, stylesheets, <body> */
+    NODE_ARTICLE_HEADER,      /* <header> built from front matter; number,
+                                 count: variables and macros defined when
+                                 parsing started; NODE_FLAG_SITE to also
+                                 use site definitions */
+    NODE_TEXT,                /* text: printed as is */
+    NODE_NEWLINE,
+    NODE_PARA_START,          /* <p> */
+    NODE_PARA_END,            /* </p> */
+    NODE_PARA_BREAK,          /* </p> and a newline */
+    NODE_HEADING_START,       /* number: level */
+    NODE_HEADING_END,         /* text: heading text; number: level */
+    NODE_LIST_START,
+    NODE_LIST_END,
+    NODE_NUMLIST_START,
+    NODE_NUMLIST_END,
+    NODE_LIST_ITEM_START,
+    NODE_LIST_ITEM_END,       /* NODE_FLAG_PARA_OPEN */
+    NODE_BOLD,                /* NODE_FLAG_END for the closing tag */
+    NODE_ITALIC,
+    NODE_CODE,
+    NODE_KBD,
+    NODE_BLOCKQUOTE,
+    NODE_PRE,
+    NODE_HORIZONTAL_RULE,     /* NODE_FLAG_PARA_OPEN */
+    NODE_TABLE_START,
+    NODE_TABLE_HEADER_START,
+    NODE_TABLE_HEADER_CELL,
+    NODE_TABLE_HEADER_END,
+    NODE_TABLE_BODY_START,    /* NODE_FLAG_START_ROW */
+    NODE_TABLE_BODY_ROW_START,
+    NODE_TABLE_BODY_CELL,
+    NODE_TABLE_BODY_ROW_END,
+    NODE_TABLE_END,
+    NODE_LINK,                /* text: link text; arg: URL; prefix: macro */
+    NODE_IMAGE,               /* text: alt text; arg: URL; NODE_FLAG_LINK,
+                                 NODE_FLAG_FIGCAPTION */
+    NODE_FOOTNOTE_REF,        /* number: footnote number */
+    NODE_INLINE_FOOTNOTE_REF, /* number: footnote number */
+    NODE_FORMULA,             /* text: TeX; NODE_FLAG_DISPLAY */
+    NODE_TAG,                 /* text: tag name, id and class; NODE_FLAG_END */
+    NODE_MACRO,               /* number: index into macros, or into site
+                                 macros with NODE_FLAG_SITE */
+    NODE_MACRO_DEFINITION,    /* number: index into macros */
+    NODE_CSV_START,           /* text: CSV filename; number: row limit */
+    NODE_CSV_END,             /* NODE_FLAG_RENDER to print the rows */
+    NODE_CSV_TABLE,           /* text: directive */
+    NODE_INCLUDE,             /* text: directive */
+    NODE_INCDIR,              /* text: directive */
+    NODE_GIT_LOG,
+    NODE_MADE_BY,
+    NODE_PLUGIN,              /* text: directive */
+    NODE_FOOTNOTES,           /* NODE_FLAG_PARA_OPEN, NODE_FLAG_FOOTNOTE_DIV */
+    NODE_END_HTML
+} NodeType;
+
+#define NODE_FLAG_END          1
+#define NODE_FLAG_DISPLAY      1
+#define NODE_FLAG_START_ROW    1
+#define NODE_FLAG_RENDER       1
+#define NODE_FLAG_PARA_OPEN    (1 << 1)
+#define NODE_FLAG_LINK         (1 << 2)
+#define NODE_FLAG_FIGCAPTION   (1 << 3)
+#define NODE_FLAG_FOOTNOTE_DIV (1 << 4)
+#define NODE_FLAG_SITE         (1 << 5)
+
+typedef enum
+{
+    TIMING_DEFINITIONS,       /* first pass: front matter, macros, links */
+    TIMING_PARSE,             /* second pass: building the node array */
+    TIMING_EMIT,              /* printing HTML, including directives */
+    TIMING_LOAD,              /* mapping and checking a cached document */
+    TIMING_COUNT
+} Timing;
+
+typedef struct
+{
+    uint32_t offset;
+    uint32_t len;
+} Span;
+
+typedef struct
+{
+    UBYTE    type;
+    UBYTE    flags;
+    uint32_t lineno;
+    uint32_t number;
+    uint32_t count;
+    Span     text;
+    Span     arg;
+    Span     prefix;
+} Node;
+
+typedef struct
+{
+    Node*    nodes;
+    size_t   nodes_count;
+    size_t   nodes_size;
+    uint8_t* pool;
+    size_t   pool_len;
+    size_t   pool_size;
+    BOOL     continued;       /* follows an earlier chunk of the document */
+} ParsedDoc;
+
+/*
+ * A document parsed a chunk at a time: where the chunk ends and what
+ * parse_document carries from one line to the next, kept between calls
+ */
+typedef struct
+{
+    uint8_t* end;             /* the chunk stops here; what follows is only
+                                 looked ahead at */
+    BOOL     continued;       /* an earlier chunk was parsed */
+    BOOL     last;            /* no text follows the chunk */
+    size_t   lineno;
+    uint8_t* token;
+    uint8_t* ptoken;
+    size_t   token_size;
+    uint8_t* link_text;
+    size_t   link_size;
+    uint8_t* link_macro;
+    UBYTE    heading_level;
+    BOOL     end_tag;
+    BOOL     first_line_in_doc;
+    BOOL     skip_change_first_line_in_doc;
+    BOOL     keep_token;
+    BOOL     previous_line_blank;
+    BOOL     add_image_links;
+    BOOL     add_figcaption;
+    BOOL     add_footnote_div;
+    BOOL     footnote_at_line_start;
+} ParseChunk;
+
+/* A formula found by the first pass, rendered before the page is output */
+typedef struct
+{
+    uint8_t* text;
+    BOOL     display;
+    BOOL     rendered;
+    int      result;          /* exit status of the renderer */
+    StrBuf   html;
+} Formula;
+
+/*
+ * An external command run with its standard input given and its standard
+ * output and error collected, alongside others
+ */
+typedef struct
+{
+    const char*  command;
+    const char** arguments;
+    StrBuf       input;
+    size_t       input_sent;
+    StrBuf       output;
+    StrBuf       errors;
+    pid_t        pid;          /* -1 when not running */
+    int          fds[3];       /* pipes to stdin, stdout and stderr, -1 once
+                                  closed */
+    int          status;       /* exit status, 1 if it could not be run */
+    int          spawn_error;  /* why it could not be run */
+} CommandJob;
+
+/*
+ * Where a block of a large document starts, as found by the first pass: the
+ * second pass parses blocks in separate processes, each starting from here
+ */
+typedef struct
+{
+    uint8_t*   start;
+    ParseChunk chunk;         /* zero for the first block */
+    ULONG      state;
+    size_t     current_footnote;
+    size_t     current_inline_footnote;
+    size_t     macros_count;  /* macros defined before the block */
+} BlockStart;
+
+/*
+ * Document cache file: both passes of a parsed document together with the
+ * definitions they leave behind, laid out so that the file can be mapped and
+ * emitted from directly. The header is followed by sections, each starting at
+ * an 8-byte aligned offset from the start of the file. Node arrays and pools
+ * are used in place; definitions refer to the strings section by spans.
+ * Integers are in host byte order, so a file is only valid on the kind of
+ * machine which wrote it.
+ */
+typedef enum
+{
+    DOC_SECTION_DEFS_NODES,   /* first pass, as Node */
+    DOC_SECTION_DEFS_POOL,
+    DOC_SECTION_NODES,        /* second pass, as Node */
+    DOC_SECTION_POOL,
+    DOC_SECTION_VARS,         /* as DocDef */
+    DOC_SECTION_MACROS,
+    DOC_SECTION_LINKS,
+    DOC_SECTION_FOOTNOTES,
+    DOC_SECTION_INLINE_FOOTNOTES, /* as Span */
+    DOC_SECTION_STRINGS,
+    DOC_SECTION_COUNT
+} DocSectionType;
+
+#define DOC_DEF_VALUE 1       /* value is set, even if empty */
+#define DOC_DEF_SEEN  (1 << 1)
+
+typedef struct
+{
+    uint64_t offset;
+    uint64_t count;           /* of elements, or bytes for pools and strings */
+} DocSection;
+
+typedef struct
+{
+    Span     key;
+    Span     value;
+    uint32_t flags;
+} DocDef;
+
+typedef struct
+{
+    char       magic[8];
+    uint32_t   version;
+    uint32_t   byte_order;
+    uint32_t   header_size;
+    uint32_t   node_size;
+    uint64_t   source_hash;   /* of the source and what the parse depends on */
+    uint64_t   body_hash;     /* of everything after the header */
+    uint64_t   file_len;
+    uint64_t   defs_state;    /* parser state after each pass */
+    uint64_t   state;
+    uint64_t   current_footnote;
+    uint64_t   current_inline_footnote;
+    DocSection sections[DOC_SECTION_COUNT];
+} DocCacheHeader;
+
+static const size_t doc_section_sizes[DOC_SECTION_COUNT] = {
+    sizeof(Node), 1, sizeof(Node), 1, 
+    sizeof(DocDef), sizeof(DocDef), sizeof(DocDef), sizeof(DocDef),
+    sizeof(Span), 1
+};
+
+/* Elements printed for each node type, for --inline-css */
+static const char* node_elements[NODE_END_HTML + 1] = {
+    [NODE_HEAD]               = "html head body",
+    [NODE_ARTICLE_HEADER]     = "header h1 h2 h3 h4 h5 h6 p address a",
+    [NODE_PARA_START]         = "p",
+    [NODE_PARA_BREAK]         = "p",
+    [NODE_LIST_START]         = "ul",
+    [NODE_NUMLIST_START]      = "ol",
+    [NODE_LIST_ITEM_START]    = "li",
+    [NODE_BOLD]               = "strong",
+    [NODE_ITALIC]             = "em",
+    [NODE_CODE]               = "code",
+    [NODE_KBD]                = "kbd",
+    [NODE_BLOCKQUOTE]         = "blockquote",
+    [NODE_PRE]                = "pre",
+    [NODE_HORIZONTAL_RULE]    = "hr",
+    [NODE_TABLE_START]        = "table",
+    [NODE_TABLE_HEADER_START] = "thead tr th",
+    [NODE_TABLE_BODY_START]   = "tbody tr td",
+    [NODE_LINK]               = "a",
+    [NODE_IMAGE]              = "img a .image figure figcaption",
+    [NODE_FOOTNOTE_REF]       = "a sup p",
+    [NODE_INLINE_FOOTNOTE_REF] = "a sup p",
+    [NODE_CSV_TABLE]          = "table thead tbody tr th td",
+    [NODE_INCDIR]             = "ul li a .incdir .timestamp",
+    [NODE_GIT_LOG]            = "div #git-log",
+    [NODE_MADE_BY]            = "div #made-by",
+    [NODE_FOOTNOTES]          = "div .footnotes p hr",
+};
+
+/* Classes of the spans put around highlighted code */
+typedef enum
+{
+    HL_NONE,
+    HL_KEYWORD,
+    HL_STRING,
+    HL_COMMENT,
+    HL_NUMBER,
+    HL_META,
+    HL_TAG,
+    HL_ATTR,
+    HL_VARIABLE,
+    HL_ADDED,
+    HL_REMOVED,
+    HL_END
+} HighlightClass;
+
+static const char* highlight_classes[HL_END] = {
+    [HL_KEYWORD]  = "hl-keyword",
+    [HL_STRING]   = "hl-string",
+    [HL_COMMENT]  = "hl-comment",
+    [HL_NUMBER]   = "hl-number",
+    [HL_META]     = "hl-meta",
+    [HL_TAG]      = "hl-tag",
+    [HL_ATTR]     = "hl-attr",
+    [HL_VARIABLE] = "hl-variable",
+    [HL_ADDED]    = "hl-added",
+    [HL_REMOVED]  = "hl-removed",
+};
+
+#define LANG_PREPROCESSOR  (1 << 0)  /* # starts a directive line */
+#define LANG_TRIPLE_QUOTES (1 << 1)  /* """ and ''' strings span lines */
+#define LANG_VARIABLES     (1 << 2)  /* $name and ${name}; strings span lines
+                                        and '...' has no escapes */
+#define LANG_MARKUP        (1 << 3)  /* tags, attributes and comments */
+#define LANG_DIFF          (1 << 4)  /* whole lines by their first character */
+#define LANG_CSS           (1 << 5)  /* selectors, properties and at-rules */
+
+/* How the code of a fenced block is highlighted, by its language */
+typedef struct
+{
+    const char*  names;          /* separated by spaces; the first one is
+                                    used for the class of <pre> */
+    const char** keywords;
+    const char*  line_comment;
+    const char*  block_comment;
+    const char*  block_comment_end;
+    const char*  quotes;
+    UBYTE        flags;
+} Language;
+
+static const char* c_keywords[]
+    = { "auto", "bool", "break", "case", "catch", "char", "class", "const",
+        "continue", "default", "delete", "do", "double", "else", "enum",
+        "extern", "false", "float", "for", "goto", "if", "inline", "int",
+        "long", "namespace", "new", "nullptr", "private", "protected",
+        "public", "register", "restrict", "return", "short", "signed",
+        "sizeof", "static", "struct", "switch", "template", "this", "throw",
+        "true", "try", "typedef", "typename", "union", "unsigned", "using",
+        "virtual", "void", "volatile", "while", "NULL", "_Bool", NULL };
+static const char* sh_keywords[]
+    = { "alias", "break", "case", "cd", "continue", "do", "done", "echo",
+        "elif", "else", "esac", "eval", "exec", "exit", "export", "fi", "for",
+        "function", "if", "in", "local", "printf", "read", "readonly",
+        "return", "set", "shift", "source", "test", "then", "trap", "unset",
+        "until", "while", NULL };
+static const char* python_keywords[]
+    = { "False", "None", "True", "and", "as", "assert", "async", "await",
+        "break", "class", "continue", "def", "del", "elif", "else", "except",
+        "finally", "for", "from", "global", "if", "import", "in", "is",
+        "lambda", "nonlocal", "not", "or", "pass", "raise", "return", "self",
+        "try", "while", "with", "yield", NULL };
+static const char* js_keywords[]
+    = { "async", "await", "break", "case", "catch", "class", "const",
+        "continue", "debugger", "default", "delete", "do", "else", "export",
+        "extends", "false", "finally", "for", "function", "if", "import", "in",
+        "instanceof", "let", "new", "null", "of", "return", "static", "super",
+        "switch", "this", "throw", "true", "try", "typeof", "undefined",
+        "var", "void", "while", "with", "yield", NULL };
+
+static const Language languages[] = {
+    { "c h cpp c++ cc cxx hpp", c_keywords, "//", "/*", "*/", "\"'",
+        LANG_PREPROCESSOR },
+    { "sh bash shell zsh ksh", sh_keywords, "#", NULL, NULL, "\"'`",
+        LANG_VARIABLES },
+    { "python py python3", python_keywords, "#", NULL, NULL, "\"'",
+        LANG_TRIPLE_QUOTES },
+    { "js javascript mjs json", js_keywords, "//", "/*", "*/", "\"'`", 0 },
+    { "html xml xhtml svg", NULL, NULL, NULL, NULL, "\"'", LANG_MARKUP },
+    { "css", NULL, NULL, "/*", "*/", "\"'", LANG_CSS },
+    { "diff patch", NULL, NULL, NULL, NULL, NULL, LANG_DIFF },
+    { NULL, NULL, NULL, NULL, NULL, NULL, 0 }
+};
+
+/* What a TeX command of a formula becomes in MathML */
+typedef enum
+{
+    MATH_IDENTIFIER,          /* <mi> */
+    MATH_UPRIGHT,             /* <mi mathvariant="normal">, capital Greek */
+    MATH_OPERATOR,            /* <mo> */
+    MATH_FENCE,               /* <mo> which doesn't stretch, \langle */
+    MATH_LARGE_OPERATOR,      /* <mo> with limits in display math, \sum */
+    MATH_INTEGRAL,            /* <mo> with scripts at its side, \int */
+    MATH_FUNCTION,            /* <mi> applied to what follows, \sin */
+    MATH_LIMIT_FUNCTION,      /* as above, with limits in display math */
+    MATH_SPACE,               /* <mspace>, with text being the width */
+    MATH_ACCENT,              /* <mover> of the argument and text */
+    MATH_WIDE_ACCENT,         /* as above, stretching over the argument */
+    MATH_UNDER_ACCENT,        /* <munder> of the argument and text */
+    MATH_FONT,                /* letters and digits of the argument */
+    MATH_FONT_SWITCH,         /* as above, for the rest of the group */
+    MATH_TEXT,                /* <mtext> */
+    MATH_BIG,                 /* a delimiter of size text */
+    MATH_FRACTION,            /* <mfrac>, with text being displaystyle */
+    MATH_BINOMIAL,            /* as above, without a line and in parens */
+    MATH_ROOT,                /* <msqrt> or <mroot> */
+    MATH_OVERSET,             /* <mover> or <munder>, text being which */
+    MATH_LEFT,                /* \left ... \right */
+    MATH_BEGIN,               /* \begin{matrix} ... \end{matrix} */
+    MATH_STYLE,               /* the rest of the group, with text being
+                                 displaystyle */
+    MATH_LIMITS,              /* \limits and \nolimits */
+    MATH_OPERATOR_NAME,       /* \operatorname{name} */
+    MATH_BMOD,
+    MATH_PMOD,
+} MathKind;
+
+typedef struct
+{
+    const char* name;
+    const char* text;
+    MathKind    kind;
+} MathSymbol;
+
+/* TeX commands known to the built-in renderer; others are left to katex */
+static const MathSymbol math_symbols[] = {
+    { "alpha", "α", MATH_IDENTIFIER },
+    { "beta", "β", MATH_IDENTIFIER },
+    { "gamma", "γ", MATH_IDENTIFIER },
+    { "delta", "δ", MATH_IDENTIFIER },
+    { "epsilon", "ϵ", MATH_IDENTIFIER },
+    { "varepsilon", "ε", MATH_IDENTIFIER },
+    { "zeta", "ζ", MATH_IDENTIFIER },
+    { "eta", "η", MATH_IDENTIFIER },
+    { "theta", "θ", MATH_IDENTIFIER },
+    { "vartheta", "ϑ", MATH_IDENTIFIER },
+    { "iota", "ι", MATH_IDENTIFIER },
+    { "kappa", "κ", MATH_IDENTIFIER },
+    { "lambda", "λ", MATH_IDENTIFIER },
+    { "mu", "μ", MATH_IDENTIFIER },
+    { "nu", "ν", MATH_IDENTIFIER },
+    { "xi", "ξ", MATH_IDENTIFIER },
+    { "pi", "π", MATH_IDENTIFIER },
+    { "varpi", "ϖ", MATH_IDENTIFIER },
+    { "rho", "ρ", MATH_IDENTIFIER },
+    { "varrho", "ϱ", MATH_IDENTIFIER },
+    { "sigma", "σ", MATH_IDENTIFIER },
+    { "varsigma", "ς", MATH_IDENTIFIER },
+    { "tau", "τ", MATH_IDENTIFIER },
+    { "upsilon", "υ", MATH_IDENTIFIER },
+    { "phi", "ϕ", MATH_IDENTIFIER },
+    { "varphi", "φ", MATH_IDENTIFIER },
+    { "chi", "χ", MATH_IDENTIFIER },
+    { "psi", "ψ", MATH_IDENTIFIER },
+    { "omega", "ω", MATH_IDENTIFIER },
+    { "Gamma", "Γ", MATH_UPRIGHT },
+    { "Delta", "Δ", MATH_UPRIGHT },
+    { "Theta", "Θ", MATH_UPRIGHT },
+    { "Lambda", "Λ", MATH_UPRIGHT },
+    { "Xi", "Ξ", MATH_UPRIGHT },
+    { "Pi", "Π", MATH_UPRIGHT },
+    { "Sigma", "Σ", MATH_UPRIGHT },
+    { "Upsilon", "Υ", MATH_UPRIGHT },
+    { "Phi", "Φ", MATH_UPRIGHT },
+    { "Psi", "Ψ", MATH_UPRIGHT },
+    { "Omega", "Ω", MATH_UPRIGHT },
+    { "infty", "∞", MATH_IDENTIFIER },
+    { "partial", "∂", MATH_IDENTIFIER },
+    { "nabla", "∇", MATH_IDENTIFIER },
+    { "ell", "ℓ", MATH_IDENTIFIER },
+    { "hbar", "ℏ", MATH_IDENTIFIER },
+    { "imath", "ı", MATH_IDENTIFIER },
+    { "jmath", "ȷ", MATH_IDENTIFIER },
+    { "aleph", "ℵ", MATH_IDENTIFIER },
+    { "Re", "ℜ", MATH_IDENTIFIER },
+    { "Im", "ℑ", MATH_IDENTIFIER },
+    { "wp", "℘", MATH_IDENTIFIER },
+    { "emptyset", "∅", MATH_IDENTIFIER },
+    { "varnothing", "∅", MATH_IDENTIFIER },
+    { "angle", "∠", MATH_IDENTIFIER },
+    { "top", "⊤", MATH_IDENTIFIER },
+    { "bot", "⊥", MATH_IDENTIFIER },
+    { "prime", "′", MATH_OPERATOR },
+    { "pm", "±", MATH_OPERATOR },
+    { "mp", "∓", MATH_OPERATOR },
+    { "times", "×", MATH_OPERATOR },
+    { "div", "÷", MATH_OPERATOR },
+    { "cdot", "⋅", MATH_OPERATOR },
+    { "ast", "∗", MATH_OPERATOR },
+    { "star", "⋆", MATH_OPERATOR },
+    { "circ", "∘", MATH_OPERATOR },
+    { "bullet", "∙", MATH_OPERATOR },
+    { "oplus", "⊕", MATH_OPERATOR },
+    { "ominus", "⊖", MATH_OPERATOR },
+    { "otimes", "⊗", MATH_OPERATOR },
+    { "odot", "⊙", MATH_OPERATOR },
+    { "cup", "∪", MATH_OPERATOR },
+    { "cap", "∩", MATH_OPERATOR },
+    { "setminus", "∖", MATH_OPERATOR },
+    { "wedge", "∧", MATH_OPERATOR },
+    { "land", "∧", MATH_OPERATOR },
+    { "vee", "∨", MATH_OPERATOR },
+    { "lor", "∨", MATH_OPERATOR },
+    { "neg", "¬", MATH_OPERATOR },
+    { "lnot", "¬", MATH_OPERATOR },
+    { "forall", "∀", MATH_OPERATOR },
+    { "exists", "∃", MATH_OPERATOR },
+    { "nexists", "∄", MATH_OPERATOR },
+    { "lt", "&lt;", MATH_OPERATOR },
+    { "gt", "&gt;", MATH_OPERATOR },
+    { "le", "≤", MATH_OPERATOR },
+    { "leq", "≤", MATH_OPERATOR },
+    { "ge", "≥", MATH_OPERATOR },
+    { "geq", "≥", MATH_OPERATOR },
+    { "ne", "≠", MATH_OPERATOR },
+    { "neq", "≠", MATH_OPERATOR },
+    { "ll", "≪", MATH_OPERATOR },
+    { "gg", "≫", MATH_OPERATOR },
+    { "approx", "≈", MATH_OPERATOR },
+    { "equiv", "≡", MATH_OPERATOR },
+    { "sim", "∼", MATH_OPERATOR },
+    { "simeq", "≃", MATH_OPERATOR },
+    { "cong", "≅", MATH_OPERATOR },
+    { "propto", "∝", MATH_OPERATOR },
+    { "perp", "⊥", MATH_OPERATOR },
+    { "parallel", "∥", MATH_OPERATOR },
+    { "mid", "∣", MATH_OPERATOR },
+    { "in", "∈", MATH_OPERATOR },
+    { "notin", "∉", MATH_OPERATOR },
+    { "ni", "∋", MATH_OPERATOR },
+    { "subset", "⊂", MATH_OPERATOR },
+    { "subseteq", "⊆", MATH_OPERATOR },
+    { "supset", "⊃", MATH_OPERATOR },
+    { "supseteq", "⊇", MATH_OPERATOR },
+    { "to", "→", MATH_OPERATOR },
+    { "rightarrow", "→", MATH_OPERATOR },
+    { "leftarrow", "←", MATH_OPERATOR },
+    { "gets", "←", MATH_OPERATOR },
+    { "leftrightarrow", "↔", MATH_OPERATOR },
+    { "Rightarrow", "⇒", MATH_OPERATOR },
+    { "Leftarrow", "⇐", MATH_OPERATOR },
+    { "Leftrightarrow", "⇔", MATH_OPERATOR },
+    { "implies", "⟹", MATH_OPERATOR },
+    { "iff", "⟺", MATH_OPERATOR },
+    { "mapsto", "↦", MATH_OPERATOR },
+    { "uparrow", "↑", MATH_OPERATOR },
+    { "downarrow", "↓", MATH_OPERATOR },
+    { "colon", ":", MATH_OPERATOR },
+    { "ldots", "…", MATH_OPERATOR },
+    { "dots", "…", MATH_OPERATOR },
+    { "cdots", "⋯", MATH_OPERATOR },
+    { "vdots", "⋮", MATH_OPERATOR },
+    { "ddots", "⋱", MATH_OPERATOR },
+    { "%", "%", MATH_OPERATOR },
+    { "#", "#", MATH_OPERATOR },
+    { "&", "&amp;", MATH_OPERATOR },
+    { "$", "$", MATH_OPERATOR },
+    { "_", "_", MATH_OPERATOR },
+    { "{", "{", MATH_FENCE },
+    { "}", "}", MATH_FENCE },
+    { "lbrace", "{", MATH_FENCE },
+    { "rbrace", "}", MATH_FENCE },
+    { "|", "‖", MATH_FENCE },
+    { "Vert", "‖", MATH_FENCE },
+    { "vert", "|", MATH_FENCE },
+    { "lvert", "|", MATH_FENCE },
+    { "rvert", "|", MATH_FENCE },
+    { "lVert", "‖", MATH_FENCE },
+    { "rVert", "‖", MATH_FENCE },
+    { "langle", "⟨", MATH_FENCE },
+    { "rangle", "⟩", MATH_FENCE },
+    { "lfloor", "⌊", MATH_FENCE },
+    { "rfloor", "⌋", MATH_FENCE },
+    { "lceil", "⌈", MATH_FENCE },
+    { "rceil", "⌉", MATH_FENCE },
+    { "sum", "∑", MATH_LARGE_OPERATOR },
+    { "prod", "∏", MATH_LARGE_OPERATOR },
+    { "coprod", "∐", MATH_LARGE_OPERATOR },
+    { "bigcup", "⋃", MATH_LARGE_OPERATOR },
+    { "bigcap", "⋂", MATH_LARGE_OPERATOR },
+    { "bigoplus", "⨁", MATH_LARGE_OPERATOR },
+    { "bigotimes", "⨂", MATH_LARGE_OPERATOR },
+    { "bigvee", "⋁", MATH_LARGE_OPERATOR },
+    { "bigwedge", "⋀", MATH_LARGE_OPERATOR },
+    { "int", "∫", MATH_INTEGRAL },
+    { "iint", "∬", MATH_INTEGRAL },
+    { "iiint", "∭", MATH_INTEGRAL },
+    { "oint", "∮", MATH_INTEGRAL },
+    { "sin", "sin", MATH_FUNCTION },
+    { "cos", "cos", MATH_FUNCTION },
+    { "tan", "tan", MATH_FUNCTION },
+    { "cot", "cot", MATH_FUNCTION },
+    { "sec", "sec", MATH_FUNCTION },
+    { "csc", "csc", MATH_FUNCTION },
+    { "arcsin", "arcsin", MATH_FUNCTION },
+    { "arccos", "arccos", MATH_FUNCTION },
+    { "arctan", "arctan", MATH_FUNCTION },
+    { "sinh", "sinh", MATH_FUNCTION },
+    { "cosh", "cosh", MATH_FUNCTION },
+    { "tanh", "tanh", MATH_FUNCTION },
+    { "coth", "coth", MATH_FUNCTION },
+    { "exp", "exp", MATH_FUNCTION },
+    { "log", "log", MATH_FUNCTION },
+    { "ln", "ln", MATH_FUNCTION },
+    { "lg", "lg", MATH_FUNCTION },
+    { "arg", "arg", MATH_FUNCTION },
+    { "deg", "deg", MATH_FUNCTION },
+    { "dim", "dim", MATH_FUNCTION },
+    { "ker", "ker", MATH_FUNCTION },
+    { "hom", "hom", MATH_FUNCTION },
+    { "lim", "lim", MATH_LIMIT_FUNCTION },
+    { "liminf", "lim inf", MATH_LIMIT_FUNCTION },
+    { "limsup", "lim sup", MATH_LIMIT_FUNCTION },
+    { "max", "max", MATH_LIMIT_FUNCTION },
+    { "min", "min", MATH_LIMIT_FUNCTION },
+    { "sup", "sup", MATH_LIMIT_FUNCTION },
+    { "inf", "inf", MATH_LIMIT_FUNCTION },
+    { "det", "det", MATH_LIMIT_FUNCTION },
+    { "gcd", "gcd", MATH_LIMIT_FUNCTION },
+    { "Pr", "Pr", MATH_LIMIT_FUNCTION },
+    { ",", "0.1667em", MATH_SPACE },
+    { "thinspace", "0.1667em", MATH_SPACE },
+    { ":", "0.2222em", MATH_SPACE },
+    { ">", "0.2222em", MATH_SPACE },
+    { ";", "0.2778em", MATH_SPACE },
+    { "!", "-0.1667em", MATH_SPACE },
+    { " ", "0.3333em", MATH_SPACE },
+    { "quad", "1em", MATH_SPACE },
+    { "qquad", "2em", MATH_SPACE },
+    { "hat", "^", MATH_ACCENT },
+    { "check", "ˇ", MATH_ACCENT },
+    { "tilde", "~", MATH_ACCENT },
+    { "acute", "ˊ", MATH_ACCENT },
+    { "grave", "ˋ", MATH_ACCENT },
+    { "dot", "˙", MATH_ACCENT },
+    { "ddot", "¨", MATH_ACCENT },
+    { "breve", "˘", MATH_ACCENT },
+    { "bar", "ˉ", MATH_ACCENT },
+    { "vec", "→", MATH_ACCENT },
+    { "widehat", "^", MATH_WIDE_ACCENT },
+    { "widetilde", "~", MATH_WIDE_ACCENT },
+    { "overline", "‾", MATH_WIDE_ACCENT },
+    { "overrightarrow", "→", MATH_WIDE_ACCENT },
+    { "overleftarrow", "←", MATH_WIDE_ACCENT },
+    { "underline", "‾", MATH_UNDER_ACCENT },
+    { "mathrm", "normal", MATH_FONT },
+    { "mathit", "italic", MATH_FONT },
+    { "mathbf", "bold", MATH_FONT },
+    { "boldsymbol", "bold", MATH_FONT },
+    { "mathbb", "double-struck", MATH_FONT },
+    { "mathcal", "script", MATH_FONT },
+    { "mathscr", "script", MATH_FONT },
+    { "mathfrak", "fraktur", MATH_FONT },
+    { "mathsf", "sans-serif", MATH_FONT },
+    { "mathtt", "monospace", MATH_FONT },
+    { "rm", "normal", MATH_FONT_SWITCH },
+    { "it", "italic", MATH_FONT_SWITCH },
+    { "bf", "bold", MATH_FONT_SWITCH },
+    { "cal", "script", MATH_FONT_SWITCH },
+    { "sf", "sans-serif", MATH_FONT_SWITCH },
+    { "tt", "monospace", MATH_FONT_SWITCH },
+    { "text", NULL, MATH_TEXT },
+    { "textrm", NULL, MATH_TEXT },
+    { "textnormal", NULL, MATH_TEXT },
+    { "mbox", NULL, MATH_TEXT },
+    { "big", "1.2em", MATH_BIG },
+    { "bigl", "1.2em", MATH_BIG },
+    { "bigr", "1.2em", MATH_BIG },
+    { "Big", "1.8em", MATH_BIG },
+    { "Bigl", "1.8em", MATH_BIG },
+    { "Bigr", "1.8em", MATH_BIG },
+    { "bigg", "2.4em", MATH_BIG },
+    { "biggl", "2.4em", MATH_BIG },
+    { "biggr", "2.4em", MATH_BIG },
+    { "Bigg", "3em", MATH_BIG },
+    { "Biggl", "3em", MATH_BIG },
+    { "Biggr", "3em", MATH_BIG },
+    { "frac", NULL, MATH_FRACTION },
+    { "dfrac", "true", MATH_FRACTION },
+    { "cfrac", "true", MATH_FRACTION },
+    { "tfrac", "false", MATH_FRACTION },
+    { "binom", NULL, MATH_BINOMIAL },
+    { "dbinom", "true", MATH_BINOMIAL },
+    { "tbinom", "false", MATH_BINOMIAL },
+    { "sqrt", NULL, MATH_ROOT },
+    { "overset", "mover", MATH_OVERSET },
+    { "stackrel", "mover", MATH_OVERSET },
+    { "underset", "munder", MATH_OVERSET },
+    { "left", NULL, MATH_LEFT },
+    { "begin", NULL, MATH_BEGIN },
+    { "displaystyle", "true", MATH_STYLE },
+    { "textstyle", "false", MATH_STYLE },
+    { "limits", "true", MATH_LIMITS },
+    { "nolimits", "false", MATH_LIMITS },
+    { "operatorname", NULL, MATH_OPERATOR_NAME },
+    { "bmod", NULL, MATH_BMOD },
+    { "pmod", NULL, MATH_PMOD },
+    { NULL, NULL, 0 }
+};
+
+/* Alphabets of the Mathematical Alphanumeric Symbols block */
+typedef struct
+{
+    const char* variant;
+    ucs4_t      upper;        /* code point of A, or 0 if none */
+    ucs4_t      lower;        /* code point of a, or 0 if none */
+    ucs4_t      digit;        /* code point of 0, or 0 if none */
+} MathFont;
+
+static const MathFont math_fonts[] = {
+    { "italic", 0x1D434, 0x1D44E, 0 },
+    { "bold", 0x1D400, 0x1D41A, 0x1D7CE },
+    { "double-struck", 0x1D538, 0x1D552, 0x1D7D8 },
+    { "script", 0x1D49C, 0x1D4B6, 0 },
+    { "fraktur", 0x1D504, 0x1D51E, 0 },
+    { "sans-serif", 0x1D5A0, 0x1D5BA, 0x1D7E2 },
+    { "monospace", 0x1D670, 0x1D68A, 0x1D7F6 },
+    { NULL, 0, 0, 0 }
+};
+
+/* Letters missing from the block, found in Letterlike Symbols instead */
+static const struct
+{
+    const char* variant;
+    char        letter;
+    ucs4_t      code_point;
+} math_font_holes[] = {
+    { "italic", 'h', 0x210E },
+    { "double-struck", 'C', 0x2102 },
+    { "double-struck", 'H', 0x210D },
+    { "double-struck", 'N', 0x2115 },
+    { "double-struck", 'P', 0x2119 },
+    { "double-struck", 'Q', 0x211A },
+    { "double-struck", 'R', 0x211D },
+    { "double-struck", 'Z', 0x2124 },
+    { "script", 'B', 0x212C },
+    { "script", 'E', 0x2130 },
+    { "script", 'F', 0x2131 },
+    { "script", 'H', 0x210B },
+    { "script", 'I', 0x2110 },
+    { "script", 'L', 0x2112 },
+    { "script", 'M', 0x2133 },
+    { "script", 'R', 0x211B },
+    { "script", 'e', 0x212F },
+    { "script", 'g', 0x210A },
+    { "script", 'o', 0x2134 },
+    { "fraktur", 'C', 0x212D },
+    { "fraktur", 'H', 0x210C },
+    { "fraktur", 'I', 0x2111 },
+    { "fraktur", 'R', 0x211C },
+    { "fraktur", 'Z', 0x2128 },
+    { NULL, 0, 0 }
+};
+
+/* Environments of \begin, as tables between fences */
+typedef struct
+{
+    const char* name;
+    const char* open;
+    const char* close;
+    const char* columnalign;
+} MathEnvironment;
+
+static const MathEnvironment math_environments[] = {
+    { "matrix", NULL, NULL, NULL },
+    { "pmatrix", "(", ")", NULL },
+    { "bmatrix", "[", "]", NULL },
+    { "Bmatrix", "{", "}", NULL },
+    { "vmatrix", "|", "|", NULL },
+    { "Vmatrix", "‖", "‖", NULL },
+    { "cases", "{", NULL, "left left" },
+    { "aligned", NULL, NULL, "right left" },
+    { "align*", NULL, NULL, "right left" },
+    { "gathered", NULL, NULL, NULL },
+    { NULL, NULL, NULL, NULL }
+};
+
+/* Where the conversion of a formula to MathML is */
+typedef struct
+{
+    const uint8_t* tex;
+    BOOL           display;
+    const char*    variant;   /* of letters and digits, set by \mathbf etc. */
+    size_t         depth;     /* of groups, limited by MATH_DEPTH_MAX */
+} MathState;
+
 typedef int (*csv_callback_t)(FILE* output, uint8_t** csv_header, uint8_t** csv_register);
+typedef int (*child_callback_t)(FILE* output, void* arg);
+typedef int (*feed_writer_t)(FILE* output, FeedEntry* entries, 
+        size_t entries_count, const uint8_t* site_url, const char* urlpath);
+typedef int (*directive_handler_t)(uint8_t* token, ParsedDoc* doc,
+        BOOL read_yaml_macros_and_links, BOOL* skip_eol, BOOL end_tag);
+
+/* A directive such as {git-log} or {csv "file"}, named by its first word */
+typedef struct
+{
+    const char*         name;
+    directive_handler_t handler;
+} Directive;
+
+/*
+ * Slot of a directive name, from its first and last bytes and length; the
+ * built-in names are chosen to land in distinct slots, so that finding
+ * one takes a single comparison
+ */
+#define DIRECTIVE_SLOTS 16
+#define DIRECTIVE_HASH(first, last, len) \
+    ((((first) + (len)) * 2 + (last)) & (DIRECTIVE_SLOTS - 1))
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-const-variable"
@@ -0,0 +1,72 @@
+/*
+ *    slweb - Simple static webpage generator
+ *    Copyright (C) 2020, 2021 Страхиња Радић
+ *
+ *    This program is free software: you can redistribute it and/or modify it
+ *    under the terms of the GNU General Public License as published by the Free
+ *    Software Foundation, either version 3 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *    or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *    for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Interface of plugins, shared objects loaded with --plugin.  A plugin
+ * defines
+ *
+ *     int slweb_plugin_init(const SlwebHost* host);
+ *
+ * which is called once after loading and registers the plugin's directives
+ * with host->register_directive; a nonzero result is an error.  For
+ * {name arg...} in a page, the directive's function is called with argv[0]
+ * set to name and the arguments split at spaces, a double-quoted argument
+ * being one without its quotes.  What it writes to sink goes into the page
+ * in place of the directive; a nonzero result is reported as a warning.
+ */
+
+#ifndef __SLWEB_PLUGIN_H
+#define __SLWEB_PLUGIN_H
+
+#include <stddef.h>
+
+#define SLWEB_PLUGIN_VERSION 1
+
+/*
+ * The directive may run in a worker thread, together with others, before
+ * the page is output.  It is then run once for each distinct text of the
+ * directive, and its output has to depend only on its arguments, variables
+ * and macros.  Threaded or not, a directive sees the variables and macros
+ * of the whole page, which are read before any of it is output: a macro
+ * defined, or kept from an include, after the directive is already set.
+ */
+#define SLWEB_DIRECTIVE_THREADED 1
+
+typedef struct SlwebSink SlwebSink;
+typedef struct SlwebHost SlwebHost;
+
+typedef int (*SlwebDirective)(const SlwebHost* host, SlwebSink* sink,
+        int argc, char** argv, void* data);
+
+struct SlwebHost
+{
+    int         version;      /* SLWEB_PLUGIN_VERSION */
+
+    /* Values of the page's variables and macros, or NULL; read-only */
+    const char* (*get_var)(const char* name);
+    const char* (*get_macro)(const char* name);
+
+    int         (*write)(SlwebSink* sink, const char* text, size_t len);
+
+    /* Only from slweb_plugin_init; data is passed back to function */
+    int         (*register_directive)(const char* name,
+                    SlwebDirective function, int flags, void* data);
+};
+
+#endif /* __SLWEB_PLUGIN_H */
@@ -42,11 +42,73 @@ static size_t current_footnote        = 0;
 static u_int8_t** inline_footnotes    = NULL;
 static size_t inline_footnote_count   = 0;
 static size_t current_inline_footnote = 0;
-static uint8_t* csv_template          = NULL;
-static size_t csv_template_size       = 0;
+static FILE* footnote_spill           = NULL;
+static size_t footnotes_spilled       = 0;
+static FILE* inline_footnote_spill    = NULL;
+static size_t inline_footnotes_spilled = 0;
+static StrBuf csv_template;
+static StrBuf footnote_text;
 static char* csv_filename             = NULL;
 static long csv_iter                  = 0;
 static ULONG state                    = ST_NONE;
+static PageCacheEntry* page_cache     = NULL;
+static ULONG page_cache_tick          = 0;
+static BOOL serve_body_only           = FALSE;
+static char* include_cache_dir        = NULL;
+static char* doc_cache_dir            = NULL;
+static char* site_defs_filename       = NULL;
+static uint64_t site_defs_hash        = 0;
+static KeyValue* site_vars            = NULL;
+static size_t site_vars_count         = 0;
+static KeyValue* site_macros          = NULL;
+static size_t site_macros_count       = 0;
+static KeyValue* site_links           = NULL;
+static size_t site_links_count        = 0;
+static BOOL site_defs_hidden          = FALSE;
+static IncludeCacheEntry** include_cache = NULL;
+static size_t include_cache_count     = 0;
+static IncludeDep* include_deps       = NULL;
+static size_t include_deps_count      = 0;
+static BOOL include_recording         = FALSE;
+static BOOL include_volatile          = FALSE;
+static size_t include_vars_base       = 0;
+static size_t include_macros_base     = 0;
+static BOOL show_timings              = FALSE;
+static BOOL stream_input              = FALSE;
+static long parse_jobs                = 0;
+static Formula* formulas              = NULL;
+static size_t formulas_count          = 0;
+static size_t formulas_native         = 0;
+static size_t formulas_katex          = 0;
+static BOOL use_katex                 = FALSE;
+static BOOL use_gzip                  = FALSE;
+static int gzip_level                 = Z_DEFAULT_COMPRESSION;
+static BOOL minify_output             = FALSE;
+static Minify* output_minify          = NULL;
+static char* assets_dir               = NULL;
+static AssetEntry* assets             = NULL;
+static size_t assets_count            = 0;
+static BOOL inline_css                = FALSE;
+static size_t inline_css_limit        = INLINE_CSS_LIMIT;
+static Stylesheet** stylesheets       = NULL;
+static size_t stylesheets_count       = 0;
+static BOOL feed_content              = FALSE;
+static Rope macro_rope;
+static BOOL macros_kept               = FALSE;
+static BOOL csv_body_emitting         = FALSE;
+static const Language* code_language  = NULL;
+static StrBuf code_text;
+static Directive* registered_directives = NULL;
+static size_t registered_directives_count = 0;
+static const uint8_t* parse_rest_of_line   = NULL;
+static const uint8_t* parse_rest_of_buffer = NULL;
+static PluginDirective* plugin_directives = NULL;
+static size_t plugin_directives_count = 0;
+static uint64_t plugin_directives_hash = 0;
+static BOOL plugins_loading           = FALSE;
+static PluginCall* plugin_calls       = NULL;
+static size_t plugin_calls_count      = 0;
+static double timings[TIMING_COUNT];
 
 #define CHECKEXITNOMEM(ptr) { if (!ptr) exit(error(ENOMEM, \
                 (uint8_t*)"Memory allocation failed (out of memory?)")); }
@@ -64,13 +126,27 @@ static ULONG state                    = ST_NONE;
 #define CHECKCOPY(token, ptoken, token_size, pline) { \
     if (ptoken + 2 > token + token_size) \
     { \
-        size_t old_size = token_size; \
-        token_size += BUFSIZE; \
+        size_t token_len = ptoken - token; \
+        token_size *= 2; \
         REALLOC(token, uint8_t, token_size) \
-        ptoken = token + old_size - 1; \
+        ptoken = token + token_len; \
     } \
     *ptoken++ = *pline++; }
 
+#define CHECKAPPEND(token, ptoken, token_size, text) { \
+    size_t text_len = u8_strlen(text); \
+    if (ptoken + text_len + 1 > token + token_size) \
+    { \
+        size_t token_len = ptoken - token; \
+        while (token_len + text_len + 1 > token_size) \
+            token_size *= 2; \
+        REALLOC(token, uint8_t, token_size) \
+        ptoken = token + token_len; \
+    } \
+    memcpy(ptoken, text, text_len); \
+    ptoken += text_len; \
+    *ptoken = 0; }
+
 #define RESET_TOKEN(token, ptoken, token_size) { \
     token_size = BUFSIZE; \
     REALLOC(token, uint8_t, token_size) \
@@ -90,7 +166,14 @@ int
 usage()
 {
     printf("Usage: %s [-b|--body-only] [-d|--basedir <dir>] [-h|--help]"
-        " [-v|--version] [filename]\n", PROGRAMNAME);
+        " [-v|--version] [--assets <dir>] [--defs <file>]"
+        " [--doc-cache <dir>] [--feed <dir>] [--feed-content]"
+        " [--front-matter[=json|tsv]] [--gzip[=<level>]]"
+        " [--include-cache <dir>] [--inline-css[=<bytes>]] [--jobs=<n>]"
+        " [--katex] [--minify] [--plugin <lib.so>] [--serve <[host:]port>]"
+        " [--stream] [--timings]"
+        " [filename...]\n",
+        PROGRAMNAME);
     return 0;
 }
 
@@ -129,7 +212,7 @@ free_keyvalue(KeyValue** list, size_t list_count)
     for (size_t index = 0; index < list_count; index++)
     {
         KeyValue* current = *list + index;
-        if (current->value)
+        if (current->value && !current->kept)
             free(current->value);
         if (current->key)
             free(current->key);
@@ -167,34 +250,168 @@ startswith(const char* s, const char* what)
     if (!s || !what)
         return 0;
 
-    char* subs = substr(s, 0, strlen(what));
-    BOOL result = !strcmp(subs, what);
+    return !strncmp(s, what, strlen(what));
+}
 
-    free(subs);
+uint64_t
+hash_buffer(const uint8_t* data, size_t len)
+{
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    const uint8_t* pdata = data;
 
-    return result;
+    while (pdata < data + len)
+    {
+        hash ^= *pdata++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
 }
 
-uint8_t*
-get_value(KeyValue* list, size_t list_count, uint8_t* key, BOOL* seen)
+uint64_t
+hash_words(const uint8_t* data, size_t len)
 {
-    KeyValue* plist = list;
-    while (plist < list + list_count)
+    /* FNV-1a over 64-bit words, for large binary images */
+    uint64_t hash = 14695981039346656037ULL;
+    const uint8_t* pdata = data;
+    uint64_t word = 0;
+
+    while (pdata + sizeof(word) <= data + len)
+    {
+        memcpy(&word, pdata, sizeof(word));
+        hash ^= word;
+        hash *= 1099511628211ULL;
+        pdata += sizeof(word);
+    }
+    return hash ^ hash_buffer(pdata, data + len - pdata);
+}
+
+uint64_t
+hash_file(const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    uint8_t buf[BUFSIZE];
+    size_t nread = 0;
+    uint64_t hash = 14695981039346656037ULL;
+
+    if (!file)
+        return 0;
+
+    while ((nread = fread(buf, 1, BUFSIZE, file)) > 0)
     {
-        if (!u8_strcmp(plist->key, key))
+        uint8_t* pbuf = buf;
+        while (pbuf < buf + nread)
         {
-            if (seen)
-            {
-                *seen = plist->seen;
-                plist->seen = TRUE;
-            }
-            return plist->value;
+            hash ^= *pbuf++;
+            hash *= 1099511628211ULL;
         }
+    }
+    fclose(file);
+
+    return hash | 1;
+}
+
+KeyValue*
+find_keyvalue(KeyValue* list, size_t list_count, const uint8_t* key)
+{
+    KeyValue* plist = list;
+    while (plist && plist < list + list_count)
+    {
+        if (plist->key && !u8_strcmp(plist->key, key))
+            return plist;
         plist++;
     }
     return NULL;
 }
 
+uint64_t
+hash_value(const uint8_t* value)
+{
+    return value ? hash_buffer(value, u8_strlen(value)) | 1 : 0;
+}
+
+int
+record_include_dep(UBYTE kind, const uint8_t* key, uint64_t hash)
+{
+    IncludeDep* pdep = include_deps;
+    KeyValue* kv = NULL;
+
+    if (!include_recording)
+        return 0;
+
+    while (pdep < include_deps + include_deps_count)
+    {
+        if (pdep->kind == kind && !u8_strcmp(pdep->key, key))
+            return 0;
+        pdep++;
+    }
+
+    include_deps_count++;
+    REALLOCARRAY(include_deps, IncludeDep, include_deps_count)
+    pdep = include_deps + include_deps_count - 1;
+    pdep->kind = kind;
+    pdep->key = u8_strdup(key);
+    CHECKEXITNOMEM(pdep->key)
+    pdep->hash = hash;
+    pdep->seen = FALSE;
+
+    /* Only definitions inherited from the including file are dependencies */
+    if (kind == 'v')
+    {
+        kv = find_keyvalue(vars, include_vars_base, key);
+        pdep->hash = kv ? hash_value(kv->value) : 0;
+    }
+    else if (kind == 'm')
+    {
+        kv = find_keyvalue(macros, include_macros_base, key);
+        pdep->hash = kv ? hash_value(kv->value) : 0;
+        pdep->seen = kv ? kv->seen : FALSE;
+    }
+
+    return 0;
+}
+
+KeyValue*
+find_site_keyvalue(KeyValue* list, const uint8_t* key)
+{
+    /* The definitions pass's article header sees only the page's own */
+    if (site_defs_hidden)
+        return NULL;
+    if (list == vars)
+        return find_keyvalue(site_vars, site_vars_count, key);
+    if (list == macros)
+        return find_keyvalue(site_macros, site_macros_count, key);
+    if (list == links)
+        return find_keyvalue(site_links, site_links_count, key);
+    return NULL;
+}
+
+uint8_t*
+get_value(KeyValue* list, size_t list_count, uint8_t* key, BOOL* seen)
+{
+    KeyValue* plist = NULL;
+
+    if (include_recording && (list == vars || list == macros))
+        record_include_dep(list == vars ? 'v' : 'm', key, 0);
+
+    plist = find_keyvalue(list, list_count, key);
+    if (!plist)
+    {
+        /* Site definitions are read-only and count as already seen */
+        plist = find_site_keyvalue(list, key);
+        if (plist && seen)
+            *seen = TRUE;
+        return plist ? plist->value : NULL;
+    }
+
+    if (seen)
+    {
+        *seen = plist->seen;
+        plist->seen = TRUE;
+    }
+    return plist->value;
+}
+
 int
 set_basedir(char* arg, char** basedir, size_t* basedir_size)
 {
@@ -209,7 +426,8 @@ set_basedir(char* arg, char** basedir, size_t* basedir_size)
         *basedir_size = arg_len+1;
         REALLOC(*basedir, char, *basedir_size)
     }
-    strncpy(*basedir, arg, *basedir_size-1);
+    /* An include may be given the current basedir itself */
+    memmove(*basedir, arg, arg_len);
     *(*basedir + arg_len) = 0;
     basedir_len = strlen(*basedir);
     if (*(*basedir + basedir_len - 1) == '/')
@@ -237,3454 +455,10691 @@ strip_ext(const char* fn)
 }
 
 int
-print_output(FILE* output, char* fmt, ...)
+strbuf_reserve(StrBuf* buf, size_t len)
 {
-    uint8_t buf[BUFSIZE];
-    va_list args;
-
-    if (!output || !fmt)
-        exit(error(EINVAL, (uint8_t*)"print_output: Invalid argument"));
-
-    va_start(args, fmt);
-    if (state & ST_CSV_BODY)
+    if (buf->len + len + 1 > buf->size)
     {
-        size_t buf_len = 0;
-        vsnprintf((char*)buf, BUFSIZE, fmt, args);
-        buf_len = u8_strlen(buf);
-        if (!csv_template)
-        {
-            csv_template_size = BUFSIZE;
-            CALLOC(csv_template, uint8_t, csv_template_size)
-            u8_strncpy(csv_template, buf, BUFSIZE-1);
-            *(csv_template + buf_len) = 0;
-        }
-        else
-        {
-            if (u8_strlen(csv_template) + buf_len > csv_template_size)
-            {
-                csv_template_size += BUFSIZE;
-                REALLOC(csv_template, uint8_t, csv_template_size)
-            }
-            u8_strncat(csv_template, buf, csv_template_size
-                    - u8_strlen(csv_template) - 1);
-        }
+        if (!buf->size)
+            buf->size = BUFSIZE;
+        while (buf->len + len + 1 > buf->size)
+            buf->size *= 2;
+        REALLOC(buf->text, uint8_t, buf->size)
     }
-    else
-        vfprintf(output, fmt, args);
-    va_end(args);
     return 0;
 }
 
-#define PIPE_READ_INDEX  0
-#define PIPE_WRITE_INDEX 1
-
 int
-print_command(const char* command,
-        const uint8_t* pass_arguments[], const uint8_t* pipe_arguments[],
-        FILE* output, BOOL strip_newlines)
+strbuf_append(StrBuf* buf, const uint8_t* text, size_t len)
 {
-    if (!command || !pass_arguments)
-        exit(error(EINVAL, (uint8_t*)"print_command: Invalid argument"));
+    strbuf_reserve(buf, len);
+    memcpy(buf->text + buf->len, text, len);
+    buf->len += len;
+    *(buf->text + buf->len) = 0;
+    return 0;
+}
 
-    pid_t pid = 0;
-    int arg_pipe_fds[2];
-    int output_pipe_fds[2];
-    int pstatus = 0;
+int
+strbuf_vprintf(StrBuf* buf, const char* fmt, va_list args)
+{
+    va_list args_copy;
+    int len = 0;
 
-    pipe(arg_pipe_fds);
-    pipe(output_pipe_fds);
-    pid = fork();
-    if (pid == 0)
-    {
-        close(arg_pipe_fds[PIPE_WRITE_INDEX]);
-        close(output_pipe_fds[PIPE_READ_INDEX]);
+    va_copy(args_copy, args);
+    len = vsnprintf(NULL, 0, fmt, args_copy);
+    va_end(args_copy);
+    if (len < 0)
+        return 1;
 
-        prctl(PR_SET_PDEATHSIG, SIGTERM);
+    strbuf_reserve(buf, len);
+    vsnprintf((char*)buf->text + buf->len, len + 1, fmt, args);
+    buf->len += len;
+    return 0;
+}
 
-        dup2(arg_pipe_fds[PIPE_READ_INDEX], STDIN_FILENO);
-        dup2(output_pipe_fds[PIPE_WRITE_INDEX],  STDOUT_FILENO);
+/* Hands the text over to the caller, leaving the buffer empty */
+uint8_t*
+strbuf_detach(StrBuf* buf, size_t* size)
+{
+    uint8_t* text = buf->text;
 
-        execvp(command, (char* const*)pass_arguments);
-        exit(1);
-    }
-    else if (pid < 0)
-        exit(error(errno, (uint8_t*)"Fork failed"));
+    *size = buf->size;
+    buf->text = NULL;
+    buf->len = buf->size = 0;
+    return text;
+}
 
-    /* Parent */
-    close(arg_pipe_fds[PIPE_READ_INDEX]);
-    close(output_pipe_fds[PIPE_WRITE_INDEX]);
-    FILE* cmd_input = fdopen(arg_pipe_fds[PIPE_WRITE_INDEX], "w");
-    FILE* cmd_output = fdopen(output_pipe_fds[PIPE_READ_INDEX], "r");
+int
+free_strbuf(StrBuf* buf)
+{
+    free(buf->text);
+    buf->text = NULL;
+    buf->len = buf->size = 0;
+    return 0;
+}
 
-    if (!cmd_input || !cmd_output)
-        exit(error(1, (uint8_t*)"Cannot fdopen"));
+int
+rope_append(Rope* rope, const uint8_t* text, size_t len)
+{
+    RopeSegment* segment = NULL;
 
-    if (pipe_arguments)
-    {
-        const uint8_t** ppipe_argument = pipe_arguments;
-        while (ppipe_argument && *ppipe_argument)
-        {
-            fprintf(cmd_input, "%s\n", *ppipe_argument);
-            ppipe_argument++;
-        }
-    }
-    fclose(cmd_input);
+    if (!len)
+        return 0;
 
-    uint8_t* cmd_output_line = NULL;
-    CALLOC(cmd_output_line, uint8_t, BUFSIZE)
-    while (!feof(cmd_output))
+    if (rope->segments_count == rope->segments_size)
     {
-        if (!fgets((char*)cmd_output_line, BUFSIZE, cmd_output))
-            continue;
-
-        char* eol = strchr((char*)cmd_output_line, '\n');
-        if (eol)
-            *eol = 0;
-
-        print_output(output, "%s%s", cmd_output_line,
-                strip_newlines ? "" : "\n");
+        rope->segments_size = rope->segments_size ? rope->segments_size * 2 
+            : BUFSIZE / sizeof(RopeSegment);
+        REALLOCARRAY(rope->segments, RopeSegment, rope->segments_size)
     }
-    free(cmd_output_line);
-
-    fclose(cmd_output);
 
-    kill(pid, SIGKILL);
-    pid_t wpid = waitpid(pid, &pstatus, 0);
-    if (wpid < 0)
-        warning(pstatus, (uint8_t*)"Child returned nonzero status, errno = %d", 
-                errno);
-    if (WIFEXITED(pstatus))
-        return WEXITSTATUS(pstatus);
-
-    return wpid;
+    segment = rope->segments + rope->segments_count++;
+    CALLOC(segment->text, uint8_t, len)
+    memcpy(segment->text, text, len);
+    segment->len = len;
+    rope->len += len;
+    return 0;
 }
 
 int
-read_file_into_buffer(uint8_t** buffer, size_t* buffer_size, char* input_filename, 
-        char** input_dirname, FILE** input)
+free_rope(Rope* rope)
 {
-    struct stat fs;
-    char* slash = NULL;
-
-    *input = fopen(input_filename, "r");
-    if (!*input)
-        return error(ENOENT, (uint8_t*)"No such file: %s", input_filename);
+    RopeSegment* psegment = rope->segments;
 
-    fstat(fileno(*input), &fs);
-    if (*buffer)
-        free(*buffer);
-    *buffer_size = fs.st_size+1;
-    CALLOC(*buffer, uint8_t, *buffer_size)
-    fread((void*)*buffer, 1, *buffer_size, *input);
+    while (psegment < rope->segments + rope->segments_count)
+        free((psegment++)->text);
+    free(rope->segments);
+    memset(rope, 0, sizeof(Rope));
+    return 0;
+}
 
-    if (*input_dirname)
-        free(*input_dirname);
+uint8_t*
+rope_join(Rope* rope, size_t* size)
+{
+    RopeSegment* psegment = rope->segments;
+    uint8_t* joined       = NULL;
+    uint8_t* pjoined      = NULL;
 
-    slash = strrchr(input_filename, '/');
-    if (slash)
-    {
-        CALLOC(*input_dirname, char, strlen(input_filename)+1)
-        char* pinput_dirname = *input_dirname;
-        char* pinput_filename = input_filename;
-        while (pinput_filename && *pinput_filename
-                && pinput_filename != slash)
-            *pinput_dirname++ = *pinput_filename++;
-    }
-    else
+    CALLOC(joined, uint8_t, rope->len + 1)
+    pjoined = joined;
+    while (psegment < rope->segments + rope->segments_count)
     {
-        CALLOC(*input_dirname, char, 2)
-        **input_dirname = '.';
+        memcpy(pjoined, psegment->text, psegment->len);
+        pjoined += psegment->len;
+        psegment++;
     }
-
-    fclose(*input);
-
-    return 0;
+    *size = rope->len + 1;
+    free_rope(rope);
+    return joined;
 }
 
 int
-read_csv(FILE* output, const char* filename, csv_callback_t callback);
-
-int
-print_meta_var(FILE* output, uint8_t** csv_header, uint8_t** csv_register)
+init_parsed_doc(ParsedDoc* doc)
 {
-    if (*csv_register && *(csv_register+1))
-    {
-        uint8_t* pvalue = *(csv_register+1);
-        size_t value_len = u8_strlen(pvalue);
-        if (*pvalue == '%' && *(pvalue+value_len-1) == '%')
-        {
-            uint8_t* var_name = NULL;
-            var_name = u8_strdup(pvalue+1);
-            *(var_name+value_len-2) = 0;
-            uint8_t* value = get_value(vars, vars_count, var_name, NULL);
+    doc->nodes_size = BUFSIZE;
+    doc->nodes_count = 0;
+    CALLOC(doc->nodes, Node, doc->nodes_size)
 
-            if (value)
-                print_output(output, "<meta name=\"%s\" content=\"%s\" />\n",
-                        *csv_register, value);
+    /* Offset 0 is the empty string */
+    doc->pool_size = BUFSIZE;
+    doc->pool_len = 1;
+    CALLOC(doc->pool, uint8_t, doc->pool_size)
+    doc->continued = FALSE;
 
-            free(var_name);
-        }
-        else
-            print_output(output, "<meta name=\"%s\" content=\"%s\" />\n",
-                    *csv_register, *(csv_register+1));
-    }
     return 0;
 }
 
 int
-process_heading_start(FILE* output, UBYTE heading_level)
+free_parsed_doc(ParsedDoc* doc)
 {
-    print_output(output, "<h%d>", heading_level);
+    free(doc->nodes);
+    free(doc->pool);
+    doc->nodes = NULL;
+    doc->pool = NULL;
+    doc->nodes_count = doc->nodes_size = 0;
+    doc->pool_len = doc->pool_size = 0;
     return 0;
 }
 
-int
-process_heading(uint8_t* token, FILE* output, UBYTE heading_level)
+Span
+add_span(ParsedDoc* doc, const uint8_t* text)
 {
-    if (!token || u8_strlen(token) < 1)
-        warning(1, (uint8_t*)"Empty heading");
+    Span span  = { 0, 0 };
+    size_t len = text ? u8_strlen(text) : 0;
 
-    print_output(output, "%s</h%d>", 
-            token ? (char*)token : "", heading_level);
+    if (!len)
+        return span;
 
-    return 0;
+    if (doc->pool_len + len + 1 > doc->pool_size)
+    {
+        while (doc->pool_len + len + 1 > doc->pool_size)
+            doc->pool_size *= 2;
+        REALLOC(doc->pool, uint8_t, doc->pool_size)
+    }
+    memcpy(doc->pool + doc->pool_len, text, len);
+    *(doc->pool + doc->pool_len + len) = 0;
+
+    span.offset = doc->pool_len;
+    span.len = len;
+    doc->pool_len += len + 1;
+    return span;
 }
 
-int
-process_git_log(FILE* output)
+uint8_t*
+span_text(const ParsedDoc* doc, Span span)
 {
-    if (!input_filename)
-        return warning(1, (uint8_t*)"Cannot use 'git-log' in stdin");
-
-    char* basename = NULL;
-    size_t basename_size = strlen(input_filename)+1;
-    CALLOC(basename, char, basename_size)
-    char* slash = strrchr(input_filename, '/');
-    pid_t result = 0;
+    return doc->pool + span.offset;
+}
 
-    if (slash)
-        strncpy(basename, slash+1, basename_size-1);
-    else
-        strncpy(basename, input_filename, basename_size-1);
+Node*
+add_node(ParsedDoc* doc, UBYTE type, UBYTE flags)
+{
+    Node* node = NULL;
 
-    uint8_t* pipe_args[] = { (uint8_t*)basename, NULL };
+    if (doc->nodes_count == doc->nodes_size)
+    {
+        doc->nodes_size *= 2;
+        REALLOCARRAY(doc->nodes, Node, doc->nodes_size)
+    }
 
-    print_output(output, "<div id=\"git-log\">\nPrevious commit:\n");
-    result = print_command(CMD_GIT_LOG, 
-            (const uint8_t**)CMD_GIT_LOG_ARGS,
-            (const uint8_t**)pipe_args, output, FALSE);
+    node = doc->nodes + doc->nodes_count++;
+    memset(node, 0, sizeof(Node));
+    node->type = type;
+    node->flags = flags;
+    node->lineno = lineno;
+    return node;
+}
 
-    print_output(output, "</div><!--git-log-->\n");
+Node*
+add_text_node(ParsedDoc* doc, UBYTE type, UBYTE flags, const uint8_t* text)
+{
+    Span span = add_span(doc, text);
+    Node* node = add_node(doc, type, flags);
 
-    free(basename);
+    node->text = span;
+    return node;
+}
 
-    return result ? warning(result, (uint8_t*)"git-log: Cannot run git") : 0;
+BOOL
+in_list(const char** list, const char* name)
+{
+    for (const char** pitem = list; *pitem; pitem++)
+        if (!strcasecmp(*pitem, name))
+            return TRUE;
+    return FALSE;
 }
 
-#define PRINTIF(format, arg) { \
-    if ((ALL(csv_state, ST_CS_COND_NONEMPTY) \
-                && *csv_register[conditional_index-1]) \
-             || (ALL(csv_state, ST_CS_COND_EMPTY) \
-                && !*csv_register[conditional_index-1]) \
-             || !ANY(csv_state, ST_CS_COND_EMPTY | ST_CS_COND_NONEMPTY)) \
-    { fprintf(output, format, arg); } }
+/*
+ * Minified output is put in minify->out, with room for it reserved by
+ * write_output: at most the text being written, plus a tag name held over
+ * from the previous write
+ */
+#define MINIFY_PUT(minify, c) { \
+    *((minify)->out.text + (minify)->out.len++) = (c); }
 
 int
-print_csv_row(FILE* output, uint8_t** csv_header, uint8_t** csv_register)
+minify_put_string(Minify* minify, const char* text)
 {
-    uint8_t* pcsv_template  = csv_template;
-    UBYTE csv_state         = ST_CS_NONE;
-    UBYTE num               = 0;
-    UBYTE conditional_index = 0;
+    size_t len = strlen(text);
 
-    while (*pcsv_template)
-    {
-        if (csv_state & ST_CS_ESCAPE)
-        {
-            PRINTIF("%c", *pcsv_template)
-            csv_state &= ~ST_CS_ESCAPE;
-            pcsv_template++;
-            continue;
-        }
-
-        switch (*pcsv_template)
-        {
-        case '\\':
-            csv_state |= ST_CS_ESCAPE;
-            pcsv_template++;
-            break;
-        case '$':
-            if (csv_state & ST_CS_REGISTER)
-            {
-                PRINTIF("%c", '$')
-                csv_state &= ~ST_CS_REGISTER;
-            }
-            else
-                csv_state |= ST_CS_REGISTER;
-            pcsv_template++;
-            break;
-        case '#':
-            if (csv_state & ST_CS_HEADER)
-            {
-                error(1, (uint8_t*)"csv: Invalid header register mark");
-                csv_state &= ~(ST_CS_REGISTER | ST_CS_HEADER);
-            }
-            else if (csv_state & ST_CS_REGISTER)
-            {
-                csv_state &= ~ST_CS_REGISTER;
-                csv_state |= ST_CS_HEADER;
-            }
-            else
-                PRINTIF("%c", '#')
-            pcsv_template++;
-            break;
-        case '?':
-            if (csv_state & ST_CS_COND)
-            {
-                error(1, (uint8_t*)"csv: Invalid conditional mark");
-                csv_state &= ~ST_CS_COND;
-            }
-            else if (csv_state & ST_CS_REGISTER)
-            {
-                csv_state &= ~ST_CS_REGISTER;
-                csv_state |= ST_CS_COND;
-            }
-            else
-                PRINTIF("%c", '?')
-            pcsv_template++;
-            break;
-        case '!':
-            if (ALL(csv_state, ST_CS_COND | ST_CS_COND_NONEMPTY))
-            {
-                csv_state &= ~(ST_CS_COND | ST_CS_COND_NONEMPTY);
-                csv_state |= ST_CS_COND_EMPTY;
-            }
-            else if (csv_state & ST_CS_COND)
-            {
-                error(1, (uint8_t*)"Empty conditional before/without nonempty"
-                        " conditional");
-                csv_state &= ~(ST_CS_COND | ST_CS_COND_EMPTY);
-            }
-            else
-                PRINTIF("%c", '!')
-            pcsv_template++;
-            break;
-        case '/':
-            if (ALL(csv_state, ST_CS_COND | ST_CS_COND_EMPTY))
-                csv_state &= ~(ST_CS_COND | ST_CS_COND_EMPTY);
-            else if (ALL(csv_state, ST_CS_COND))
-                csv_state &= ~(ST_CS_COND | ST_CS_COND_NONEMPTY);
-            else
-                PRINTIF("%c", '/')
-            pcsv_template++;
-            break;
-        case '1': case '2': case '3': case '4': case '5': 
-        case '6': case '7': case '8': case '9':
-            if (csv_state & ST_CS_COND)
-            {
-                conditional_index = *pcsv_template - '0';
-                csv_state &= ~ST_CS_COND;
-                csv_state |= ST_CS_COND_NONEMPTY;
-            }
-            else if (csv_state & ST_CS_HEADER)
-            {
-                num = *pcsv_template - '0';
-                PRINTIF("%s", csv_header[num-1])
-                csv_state &= ~ST_CS_HEADER;
-            }
-            else if (csv_state & ST_CS_REGISTER)
-            {
-                num = *pcsv_template - '0';
-                PRINTIF("%s", csv_register[num-1])
-                csv_state &= ~ST_CS_REGISTER;
-            }
-            else
-                PRINTIF("%c", *pcsv_template)
-            pcsv_template++;
-            break;
-        default:
-            if (csv_state & ST_CS_HEADER)
-            {
-                error(1, (uint8_t*)"csv: Invalid header register mark");
-                csv_state &= ~ST_CS_HEADER;
-            }
-            else if (csv_state & ST_CS_REGISTER)
-            {
-                error(1, (uint8_t*)"csv: Invalid register mark");
-                csv_state &= ~ST_CS_REGISTER;
-            }
-            else
-                PRINTIF("%c", *pcsv_template)
-            pcsv_template++;
-        }
-    }
+    memcpy(minify->out.text + minify->out.len, text, len);
+    minify->out.len += len;
     return 0;
 }
 
 int
-read_csv(FILE* output, const char* filename, csv_callback_t callback)
+minify_space_before(Minify* minify, BOOL block)
 {
-    if (!callback)
-        exit(error(EINVAL, (uint8_t*)"read_csv: Invalid callback argument"));
-
-    FILE* csv                                 = NULL;
-    size_t csv_lineno                         = 0;
-    uint8_t* bufline                          = NULL;
-    uint8_t* pbufline                         = NULL;
-    uint8_t* token                            = NULL;
-    uint8_t* ptoken                           = NULL;
-    size_t token_size                         = 0;
-    UBYTE csv_state                           = ST_CS_NONE;
-    uint8_t* csv_header[MAX_CSV_REGISTERS];
-    UBYTE current_header                      = 0;
-    uint8_t* csv_register[MAX_CSV_REGISTERS];
-    UBYTE current_register                    = 0;
-    uint8_t* csv_delimiter                    = get_value(vars, vars_count,
-            (uint8_t*)"csv-delimiter", NULL);
-
-    if (!(csv = fopen(filename, "rt")))
-        exit(error(ENOENT, (uint8_t*)"csv: No such file: %s", filename));
+    if (minify->space_pending && !block && !minify->after_block)
+        MINIFY_PUT(minify, ' ')
+    minify->space_pending = FALSE;
+    return 0;
+}
 
-    CALLOC(bufline, uint8_t, BUFSIZE)
-    token_size = BUFSIZE;
-    CALLOC(token, uint8_t, token_size)
-    for (UBYTE i = 0; i < MAX_CSV_REGISTERS; i++)
-        CALLOC(csv_header[i], uint8_t, BUFSIZE)
-    for (UBYTE i = 0; i < MAX_CSV_REGISTERS; i++)
-        CALLOC(csv_register[i], uint8_t, BUFSIZE)
+int
+minify_char(Minify* minify, char c)
+{
+    BOOL space = c == ' ' || c == '\t' || c == '\n' || c == '\r';
 
-    while (!feof(csv) && (!csv_iter || csv_lineno <= csv_iter))
+    switch (minify->state)
     {
-        uint8_t* eol = NULL;
-        if (!fgets((char*)bufline, BUFSIZE, csv))
-            break;
-        eol = u8_strchr(bufline, (ucs4_t)'\n');
-        if (eol)
-            *eol = 0;
+    case MINIFY_TEXT:
+        if (c == '<')
+        {
+            minify->state = MINIFY_TAG_NAME;
+            minify->tag_len = 0;
+            minify->end_tag = FALSE;
+        }
+        else if (space)
+            minify->space_pending = TRUE;
+        else
+        {
+            minify_space_before(minify, FALSE);
+            minify->after_block = FALSE;
+            MINIFY_PUT(minify, c)
+        }
+        break;
 
-        pbufline = bufline;
-        RESET_TOKEN(token, ptoken, token_size)
-        current_register = 0;
-        while (*pbufline)
+    case MINIFY_TAG_NAME:
+        if (!minify->tag_len && !minify->end_tag && c == '/')
         {
-            switch (*pbufline)
+            minify->end_tag = TRUE;
+            break;
+        }
+        /* A name too long for the buffer can't be one of the listed ones,
+         * and the rest of it is printed as part of the tag */
+        if (minify->tag_len < MINIFY_TAG_SIZE - 1 && (minify->tag_len
+                ? isalnum((unsigned char)c) || c == '-'
+                : isalpha((unsigned char)c) || (c == '!' && !minify->end_tag)))
+        {
+            minify->tag[minify->tag_len++] = c;
+            minify->tag[minify->tag_len] = 0;
+
+            if (!strcmp(minify->tag, "!--"))
             {
-            case '"':
-                if (csv_state & ST_CS_QUOTE)
-                    csv_state &= ~ST_CS_QUOTE;
-                else
-                    csv_state |= ST_CS_QUOTE;
-                pbufline++;
-                break;
-            case ';':
-            case ',':
-                if (csv_state & ST_CS_QUOTE)
-                    CHECKCOPY(token, ptoken, token_size, pbufline)
-                else
-                {
-                    *ptoken = 0;
-                    if (csv_lineno > 0)
-                    {
-                        if (current_register < MAX_CSV_REGISTERS)
-                            u8_strncpy(csv_register[current_register++], token,
-                                    BUFSIZE-1);
-                    }
-                    else
-                    {
-                        if (current_header < MAX_CSV_REGISTERS)
-                            u8_strncpy(csv_header[current_header++], token, 
-                                    BUFSIZE-1);
-                    }
-                    RESET_TOKEN(token, ptoken, token_size)
-                    pbufline++;
-                }
-                break;
-            default:
-                if (csv_state & ST_CS_QUOTE)
-                    CHECKCOPY(token, ptoken, token_size, pbufline)
-                else
-                {
-                    if (csv_delimiter && *pbufline == *csv_delimiter)
-                    {
-                        *ptoken = 0;
-                        if (csv_lineno > 0)
-                        {
-                            if (current_register < MAX_CSV_REGISTERS)
-                                u8_strncpy(csv_register[current_register++], token,
-                                        BUFSIZE-1);
-                        }
-                        else
-                        {
-                            if (current_header < MAX_CSV_REGISTERS)
-                                u8_strncpy(csv_header[current_header++], token, 
-                                        BUFSIZE-1);
-                        }
-                        RESET_TOKEN(token, ptoken, token_size)
-                        pbufline++;
-                    }
-                    else
-                        CHECKCOPY(token, ptoken, token_size, pbufline)
-                }
+                minify_space_before(minify, FALSE);
+                minify_put_string(minify, "<!--");
+                strcpy(minify->raw_end, "-->");
+                minify->raw_matched = 0;
+                minify->state = MINIFY_RAW;
             }
+            break;
         }
-        *ptoken = 0;
-        if (csv_lineno > 0)
+
+        /* Not a tag after all, as in "a < b" */
+        if (!minify->tag_len)
         {
-            if (current_register < MAX_CSV_REGISTERS)
-                u8_strncpy(csv_register[current_register++], token, 
-                        BUFSIZE-1);
+            minify_space_before(minify, FALSE);
+            minify->after_block = FALSE;
+            minify_put_string(minify, minify->end_tag ? "</" : "<");
+            minify->state = MINIFY_TEXT;
+            return minify_char(minify, c);
+        }
+
+        minify->block = in_list(minify_block_tags, minify->tag);
+        minify_space_before(minify, minify->block);
+        minify_put_string(minify, minify->end_tag ? "</" : "<");
+        minify_put_string(minify, minify->tag);
+        minify->tag_space = FALSE;
+        minify->quote = 0;
+        minify->state = MINIFY_TAG;
+        return minify_char(minify, c);
+
+    case MINIFY_TAG:
+        if (minify->quote)
+        {
+            if (c == minify->quote)
+                minify->quote = 0;
+            MINIFY_PUT(minify, c)
+        }
+        else if (space)
+            minify->tag_space = TRUE;
+        else if (c == '>')
+        {
+            MINIFY_PUT(minify, c)
+            minify->after_block = minify->block;
+            minify->state = MINIFY_TEXT;
+            if (!minify->end_tag && in_list(minify_raw_tags, minify->tag))
+            {
+                sprintf(minify->raw_end, "</%s", minify->tag);
+                for (char* pend = minify->raw_end; *pend; pend++)
+                    *pend = tolower((unsigned char)*pend);
+                minify->raw_matched = 0;
+                minify->state = MINIFY_RAW;
+            }
         }
         else
         {
-            if (current_header < MAX_CSV_REGISTERS)
-                u8_strncpy(csv_header[current_header++], token, BUFSIZE-1);
+            if (minify->tag_space)
+                MINIFY_PUT(minify, ' ')
+            minify->tag_space = FALSE;
+            if (c == '"' || c == '\'')
+                minify->quote = c;
+            MINIFY_PUT(minify, c)
         }
-        RESET_TOKEN(token, ptoken, token_size)
+        break;
 
-        if (csv_lineno > 0 && pbufline != bufline)
-            (*callback)(output, csv_header, csv_register);
+    case MINIFY_RAW:
+        MINIFY_PUT(minify, c)
+        c = tolower((unsigned char)c);
+        if (c == minify->raw_end[minify->raw_matched])
+            minify->raw_matched++;
+        else
+            minify->raw_matched = c == minify->raw_end[0] ? 1 : 0;
 
-        for (UBYTE i = 0; i < MAX_CSV_REGISTERS; i++)
-            *csv_register[i] = 0;
-        csv_lineno++;
+        if (!minify->raw_end[minify->raw_matched])
+        {
+            /* The rest of the end tag is read as any other */
+            minify->end_tag = TRUE;
+            minify->tag_space = FALSE;
+            minify->quote = 0;
+            minify->state = *minify->raw_end == '<' ? MINIFY_TAG : MINIFY_TEXT;
+        }
+        break;
     }
-    fclose(csv);
-    for (UBYTE i = MAX_CSV_REGISTERS; i > 0; i--)
-        free(csv_register[i-1]);
-    for (UBYTE i = MAX_CSV_REGISTERS; i > 0; i--)
-        free(csv_header[i-1]);
-    free(token);
-    free(bufline);
-
     return 0;
 }
 
+/*
+ * Writes emitted HTML to the page; with --minify, its whitespace is collapsed
+ * here, as it is written
+ */
 int
-process_csv(uint8_t* arg_token, FILE* output, BOOL read_yaml_macros_and_links, 
-        BOOL end_tag)
+write_output(FILE* output, const uint8_t* text, size_t len)
 {
-    if (end_tag)
-    {
-        state &= ~ST_CSV_BODY;
-
-        if (read_yaml_macros_and_links)
-            return 0;
+    Minify* minify       = output_minify;
+    const uint8_t* ptext = text;
+    const uint8_t* end   = text + len;
 
-        read_csv(output, csv_filename, &print_csv_row);
+    if (!minify)
+        return fwrite(text, 1, len, output) == len ? 0 : 1;
 
-        free(csv_filename);
-        csv_filename = NULL;
-        free(csv_template);
-        csv_template = NULL;
-        csv_template_size = 0;
-    }
-    else
+    minify->out.len = 0;
+    strbuf_reserve(&minify->out, len + MINIFY_TAG_SIZE + 4);
+    while (ptext < end)
     {
-        if (state & ST_CSV_BODY)
-            exit(error(1, (uint8_t*)"Can't nest csv directives"));
-
-        state |= ST_CSV_BODY;
-
-        if (read_yaml_macros_and_links)
-            return 0;
-
-        csv_iter = 0;
-        uint8_t* saveptr = NULL;
-        uint8_t* args = u8_strtok(arg_token, (uint8_t*)" ", &saveptr);
-        args = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
-        if (!args)
-            exit(error(EINVAL, (uint8_t*)"csv: Arguments required"));
-        size_t args_len = u8_strlen(args);
-        if (*args != '"' || *(args + args_len - 1) != '"')
-            exit(error(EINVAL, (uint8_t*)"csv: First argument must be a string"));
-        if (!csv_filename)
-            CALLOC(csv_filename, uint8_t, BUFSIZE)
-        uint8_t* args_base = u8_strdup(args+1);
-        *(args_base + u8_strlen(args_base) - 1) = 0;
-        snprintf(csv_filename, BUFSIZE, "%s/%s.csv", input_dirname, (char*)args_base);
-        free(args_base);
-        args = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
-        if (args)
+        const uint8_t* run = ptext;
+
+        /* Words are copied whole, only what is around them needs looking at */
+        if (minify->state == MINIFY_TEXT)
+            while (run < end && *run != '<' && *run != ' ' && *run != '\n' 
+                    && *run != '\t' && *run != '\r')
+                run++;
+        if (run == ptext)
         {
-            errno = 0;
-            csv_iter = strtol((char*)args, NULL, 10);
-            if (errno)
-                exit(error(errno, (uint8_t*)"csv: Invalid argument '%s'", args));
+            minify_char(minify, *ptext++);
+            continue;
         }
-    }
 
-    return 0;
+        minify_space_before(minify, FALSE);
+        minify->after_block = FALSE;
+        memcpy(minify->out.text + minify->out.len, ptext, run - ptext);
+        minify->out.len += run - ptext;
+        ptext = run;
+    }
+    return fwrite(minify->out.text, 1, minify->out.len, output) 
+        == minify->out.len ? 0 : 1;
 }
 
 int
-process_include(uint8_t* token, FILE* output, BOOL read_yaml_macros_and_links)
+vprint_html(FILE* output, const char* fmt, va_list args)
 {
-    if (read_yaml_macros_and_links)
-        return 0;    
-
-    if (!input_filename)
-        return warning(1, (uint8_t*)"Cannot use 'include' in stdin");
-
-    uint8_t* ptoken         = u8_strchr(token, (ucs4_t)' ');
-    char* include_filename  = NULL;
-    char* pinclude_filename = NULL;
-    
-    if (!ptoken)
-        exit(error(1, (uint8_t*)"Directive 'include' requires"
-                " an argument"));
-
-    fflush(output);
-    pid_t pid = fork();
-    int pstatus = 0;
-
-    if (pid > 0)
-        wait(&pstatus);
-    else if (pid == 0)
+    Minify* minify = output_minify;
+    va_list args_copy;
+    int len        = 0;
+
+    if (!minify)
+        return vfprintf(output, fmt, args) < 0 ? 1 : 0;
+
+    /* Only formatted when there is something to format */
+    if (!strchr(fmt, '%'))
+        return write_output(output, (const uint8_t*)fmt, strlen(fmt));
+
+    /* Formatted once if it fits, as it mostly does */
+    va_copy(args_copy, args);
+    strbuf_reserve(&minify->text, BUFSIZE);
+    len = vsnprintf((char*)minify->text.text, minify->text.size, fmt, 
+            args_copy);
+    va_end(args_copy);
+    if (len < 0)
+        return 1;
+    if ((size_t)len >= minify->text.size)
     {
-        prctl(PR_SET_PDEATHSIG, SIGTERM);
-
-        CALLOC(include_filename, char, BUFSIZE)
-        pinclude_filename = include_filename;
-        ptoken++;
-        while (ptoken && *ptoken)
-            if (*ptoken != '"')
-                *pinclude_filename++ = *ptoken++;
-            else 
-                ptoken++;
-
-        if (!strcmp(basedir, "."))
-            set_basedir(input_dirname, &basedir, &basedir_size);
-
-        CALLOC(input_filename, char, BUFSIZE)
-        snprintf(input_filename, BUFSIZE, "%s/%s.slw", basedir, include_filename);
-        free(include_filename);
-
-        FILE* input        = NULL;
-        FILE* output       = stdout;
-        uint8_t* buffer    = NULL;
-        size_t buffer_size = 0;
-        int result         = 0;
-        ULONG saved_state  = ST_NONE;
-
-        read_file_into_buffer(&buffer, &buffer_size, input_filename, 
-                &input_dirname, &input);
-
-        free(links);
-        CALLOC(links, KeyValue, 1)
-        links->key = NULL;
-        links->value = NULL;
-        links->value_size = 0;
-        links_count = 0;
-
-        free(footnotes);
-        CALLOC(footnotes, KeyValue, 1)
-        footnotes->key = NULL;
-        footnotes->value = NULL;
-        footnotes->value_size = 0;
-        footnote_count = 0;
-        current_footnote = 0;
-
-        free(inline_footnotes);
-        CALLOC(inline_footnotes, uint8_t*, 1)
-        *inline_footnotes = NULL;
-        inline_footnote_count = 0;
-        current_inline_footnote = 0;
-
-        saved_state = state;
-        state = ST_NONE;
-
-        /* First pass: read YAML, macros and links */
-        result = slweb_parse(buffer, output, TRUE, TRUE);
-
-        if (result)
-        {
-            free(input_filename);
-            free(buffer);
-            return result;
-        }
-        state = ST_NONE;
-        current_footnote = 0;
-        current_inline_footnote = 0;
-
-        /* Second pass: parse and output */
-        result = slweb_parse(buffer, output, TRUE, FALSE);
-
-        state = saved_state;
-
-        free(input_filename);
-        free(buffer);
-        exit(result);
+        strbuf_reserve(&minify->text, len);
+        vsnprintf((char*)minify->text.text, len + 1, fmt, args);
     }
-    else
-        exit(error(1, (uint8_t*)"Fork failed"));
-
-    return 0;
+    return write_output(output, minify->text.text, len);
 }
 
+/* As print_output, but never into a CSV template */
 int
-process_list_start(FILE* output)
+print_html(FILE* output, char* fmt, ...)
 {
-    fprintf(output, "<ul>");
-    return 0;
+    va_list args;
+    int result = 0;
+
+    va_start(args, fmt);
+    result = vprint_html(output, fmt, args);
+    va_end(args);
+    return result;
 }
 
+/* The page is minified as it is emitted from here on */
 int
-process_list_item_start(FILE* output)
+start_minify(Minify* minify)
 {
-    fprintf(output, "\n<li><p>");
-    state |= ST_PARA_OPEN;
+    memset(minify, 0, sizeof(Minify));
+    minify->state = MINIFY_TEXT;
+    minify->after_block = TRUE;
+    output_minify = minify;
     return 0;
 }
 
 int
-process_list_item_end(FILE* output)
+finish_minify(Minify* minify, FILE* output)
 {
-    if (state & ST_PARA_OPEN)
+    output_minify = NULL;
+
+    /* An unfinished tag is printed as it came */
+    if (minify->state == MINIFY_TAG_NAME)
     {
-        state &= ~ST_PARA_OPEN;
-        fprintf(output, "</p>");
+        minify->out.len = 0;
+        strbuf_reserve(&minify->out, MINIFY_TAG_SIZE + 4);
+        minify_space_before(minify, FALSE);
+        minify_put_string(minify, minify->end_tag ? "</" : "<");
+        minify_put_string(minify, minify->tag);
+        fwrite(minify->out.text, 1, minify->out.len, output);
     }
-    fprintf(output, "</li>");
+
+    free_strbuf(&minify->out);
+    free_strbuf(&minify->text);
     return 0;
 }
 
 int
-process_list_end(FILE* output)
+print_output(FILE* output, char* fmt, ...)
 {
-    fprintf(output, "</ul>\n");
+    va_list args;
+
+    if (!output || !fmt)
+        exit(error(EINVAL, (uint8_t*)"print_output: Invalid argument"));
+
+    va_start(args, fmt);
+    if (state & ST_CSV_BODY)
+        strbuf_vprintf(&csv_template, fmt, args);
+    else
+        vprint_html(output, fmt, args);
+    va_end(args);
     return 0;
 }
 
+#define PIPE_READ_INDEX  0
+#define PIPE_WRITE_INDEX 1
+
 int
-process_numlist_start(FILE* output)
+init_command_job(CommandJob* job, const char* command, const char** arguments)
 {
-    fprintf(output, "<ol>");
+    memset(job, 0, sizeof(CommandJob));
+    job->command = command;
+    job->arguments = arguments;
+    job->pid = -1;
+    job->fds[STDIN_FILENO] = job->fds[STDOUT_FILENO] 
+        = job->fds[STDERR_FILENO] = -1;
+    job->status = 1;
     return 0;
 }
 
 int
-process_numlist_end(FILE* output)
+free_command_job(CommandJob* job)
 {
-    fprintf(output, "</ol>\n");
+    free_strbuf(&job->input);
+    free_strbuf(&job->output);
+    free_strbuf(&job->errors);
     return 0;
 }
 
 int
-filter_subdirs(const struct dirent* node)
+close_command_fd(CommandJob* job, int index)
 {
-    if (!node || !strcmp(node->d_name, ".") || !strcmp(node->d_name, ".."))
-        return 0;
-
-    struct stat st;
-    char* nodename = NULL;
-    
-    CALLOC(nodename, char, BUFSIZE)
-    snprintf(nodename, BUFSIZE, "%s/%s", incdir, node->d_name);
-    
-    if (lstat(nodename, &st) < 0 || !S_ISDIR(st.st_mode))
-    {
-        free(nodename);
-        return 0;
-    }
-
-    free(nodename);
-
-    return 1;
+    if (job->fds[index] >= 0)
+        close(job->fds[index]);
+    job->fds[index] = -1;
+    return 0;
 }
 
+/* Spawned rather than forked, so that the memory of a large run is not
+ * copied just to be replaced; returns nonzero if the command cannot run */
 int
-filter_slw(const struct dirent* node)
+start_command_job(CommandJob* job)
 {
-    if (!node || !strcmp(node->d_name, ".") || !strcmp(node->d_name, ".."))
-        return 0;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t default_signals;
+    int pipe_fds[3][2];
+    int index  = 0;
+    int result = 0;
 
-    size_t node_len = strlen(node->d_name);
-    size_t slw_len  = strlen(".slw");
+    for (index = STDIN_FILENO; index <= STDERR_FILENO; index++)
+        if (pipe2(pipe_fds[index], O_CLOEXEC) < 0)
+            exit(error(errno, (uint8_t*)"Cannot create pipe"));
+
+    /* Pipes are written to with SIGPIPE ignored, which the command should
+     * not inherit */
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, 
+            pipe_fds[STDIN_FILENO][PIPE_READ_INDEX], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, 
+            pipe_fds[STDOUT_FILENO][PIPE_WRITE_INDEX], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, 
+            pipe_fds[STDERR_FILENO][PIPE_WRITE_INDEX], STDERR_FILENO);
+
+    result = posix_spawnp(&job->pid, job->command, &actions, &attr,
+            (char* const*)job->arguments, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    close(pipe_fds[STDIN_FILENO][PIPE_READ_INDEX]);
+    close(pipe_fds[STDOUT_FILENO][PIPE_WRITE_INDEX]);
+    close(pipe_fds[STDERR_FILENO][PIPE_WRITE_INDEX]);
+    job->fds[STDIN_FILENO] = pipe_fds[STDIN_FILENO][PIPE_WRITE_INDEX];
+    job->fds[STDOUT_FILENO] = pipe_fds[STDOUT_FILENO][PIPE_READ_INDEX];
+    job->fds[STDERR_FILENO] = pipe_fds[STDERR_FILENO][PIPE_READ_INDEX];
 
-    if (slw_len >= node_len)
-        return 0;
-    return !strcmp(node->d_name + strlen(node->d_name) - slw_len, ".slw");
+    if (result)
+    {
+        job->spawn_error = result;
+        job->pid = -1;
+        for (index = STDIN_FILENO; index <= STDERR_FILENO; index++)
+            close_command_fd(job, index);
+        return result;
+    }
+
+    for (index = STDIN_FILENO; index <= STDERR_FILENO; index++)
+        fcntl(job->fds[index], F_SETFL, 
+                fcntl(job->fds[index], F_GETFL) | O_NONBLOCK);
+    if (!job->input.len)
+        close_command_fd(job, STDIN_FILENO);
+    return 0;
 }
 
-int 
-reverse_alphacompare(const struct dirent** a, const struct dirent** b)
+/* Moves what is ready through one of the job's pipes, closing it at the
+ * end */
+int
+pump_command_job(CommandJob* job, int index, uint8_t* buf)
 {
-    if (!a || !b)
+    ssize_t count = 0;
+
+    if (index == STDIN_FILENO)
+    {
+        count = write(job->fds[index], job->input.text + job->input_sent,
+                job->input.len - job->input_sent);
+        if (count > 0)
+            job->input_sent += count;
+        if ((count < 0 && errno != EAGAIN && errno != EINTR)
+                || job->input_sent == job->input.len)
+            close_command_fd(job, index);
         return 0;
+    }
 
-    return -1 * strcmp((*a)->d_name, (*b)->d_name); 
+    count = read(job->fds[index], buf, COMMAND_READ_SIZE);
+    if (count > 0)
+        strbuf_append(index == STDOUT_FILENO ? &job->output : &job->errors,
+                buf, count);
+    else if (!count || (errno != EAGAIN && errno != EINTR))
+        close_command_fd(job, index);
+    return 0;
 }
 
 int
-process_incdir_subdir(const char* subdirname, FILE* output, BOOL details_open,
-        uint8_t* macro_body)
+finish_command_job(CommandJob* job)
 {
-    print_output(output, "<li>\n<details%s>\n<summary>", 
-            details_open ? " open" : "");
-    if (macro_body)
-        fprintf(stdout, "%s", macro_body);
-    print_output(output, "%s</summary>\n<div>\n", subdirname);
+    int pstatus = 0;
 
-    struct dirent** namelist;
-    struct dirent** pnamelist;
-    long names_total;
-    long names_output;
-    char* abs_subdirname = NULL;
+    /* Nothing more is read, so the rest of the input would not be either */
+    close_command_fd(job, STDIN_FILENO);
 
-    CALLOC(abs_subdirname, char, BUFSIZE)
-    snprintf(abs_subdirname, BUFSIZE, "%s/%s", incdir, subdirname);
+    while (waitpid(job->pid, &pstatus, 0) < 0)
+        if (errno != EINTR)
+        {
+            pstatus = 0;
+            warning(1, (uint8_t*)"Cannot wait for %s, errno = %d", 
+                    job->command, errno);
+            break;
+        }
+    job->status = WIFEXITED(pstatus) ? WEXITSTATUS(pstatus) : 1;
 
-    if ((names_total = scandir(abs_subdirname, &namelist, &filter_slw, 
-                &reverse_alphacompare)) < 0)
-    {
-        perror("scandir");
-        exit(error(errno, (uint8_t*)"incdir_subdir: scandir error"));
-    }
+    /* Passed on in one piece once the command is done */
+    if (job->errors.len)
+        fwrite(job->errors.text, 1, job->errors.len, stderr);
+    return 0;
+}
 
-    pnamelist = namelist;
-    names_output = 0;
-    while (names_output < names_total && pnamelist && *pnamelist)
+/* Runs the jobs, at most max_running at a time, with the pipes of all
+ * running jobs served by one poll() loop */
+int
+run_command_jobs(CommandJob* jobs, size_t jobs_count, size_t max_running)
+{
+    struct pollfd* fds    = NULL;
+    CommandJob** fd_jobs  = NULL;
+    int* fd_indexes       = NULL;
+    uint8_t* buf          = NULL;
+    CommandJob* job       = NULL;
+    size_t next           = 0;
+    size_t running        = 0;
+    size_t fds_count      = 0;
+    size_t fd             = 0;
+    int index             = 0;
+    void (*saved_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+    if (max_running < 1)
+        max_running = 1;
+
+    CALLOC(fds, struct pollfd, max_running * 3)
+    CALLOC(fd_jobs, CommandJob*, max_running * 3)
+    CALLOC(fd_indexes, int, max_running * 3)
+    CALLOC(buf, uint8_t, COMMAND_READ_SIZE)
+
+    while (running || next < jobs_count)
     {
-        fflush(output);
-        pid_t pid = fork();
-        int pstatus = 0;
-
-        if (pid > 0)
-            wait(&pstatus);
-        else if (pid == 0)
-        {
-            set_basedir(abs_subdirname, &basedir, &basedir_size);
-            snprintf(input_filename, BUFSIZE, "%s/%s", abs_subdirname, 
-                    (*pnamelist)->d_name);
-
-            FILE* input        = NULL;
-            FILE* output       = stdout;
-            uint8_t* buffer    = NULL;
-            size_t buffer_size = 0;
-            int result         = 0;
-            ULONG saved_state  = ST_NONE;
-
-            read_file_into_buffer(&buffer, &buffer_size, input_filename, 
-                    &input_dirname, &input);
-
-            free(links);
-            CALLOC(links, KeyValue, 1)
-            links->key = NULL;
-            links->value = NULL;
-            links->value_size = 0;
-            links_count = 0;
-
-            free(footnotes);
-            CALLOC(footnotes, KeyValue, 1)
-            footnotes->key = NULL;
-            footnotes->value = NULL;
-            footnotes->value_size = 0;
-            footnote_count = 0;
-            current_footnote = 0;
-
-            free(inline_footnotes);
-            CALLOC(inline_footnotes, uint8_t*, 1)
-            *inline_footnotes = NULL;
-            inline_footnote_count = 0;
-            current_inline_footnote = 0;
-
-            saved_state = state;
-            state = ST_NONE;
-
-            saved_state = state;
-            state = ST_NONE;
+        while (running < max_running && next < jobs_count)
+            if (!start_command_job(jobs + next++))
+                running++;
 
-            /* First pass: read YAML, macros and links */
-            result = slweb_parse(buffer, output, TRUE, TRUE);
+        fds_count = 0;
+        for (job = jobs; job < jobs + next; job++)
+        {
+            if (job->pid < 0)
+                continue;
 
-            if (result)
+            for (index = STDIN_FILENO; index <= STDERR_FILENO; index++)
             {
-                free(buffer);
-                return result;
+                if (job->fds[index] < 0)
+                    continue;
+                (fds + fds_count)->fd = job->fds[index];
+                (fds + fds_count)->events 
+                    = index == STDIN_FILENO ? POLLOUT : POLLIN;
+                *(fd_jobs + fds_count) = job;
+                *(fd_indexes + fds_count) = index;
+                fds_count++;
             }
+        }
 
-            state = ST_NONE;
-            current_footnote = 0;
-            current_inline_footnote = 0;
+        if (!fds_count)
+            break;
 
-            /* Second pass: parse and output */
-            result = slweb_parse(buffer, output, TRUE, FALSE);
+        if (poll(fds, fds_count, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            exit(error(errno, (uint8_t*)"Cannot poll command pipes"));
+        }
 
-            state = saved_state;
+        for (fd = 0; fd < fds_count; fd++)
+        {
+            if (!(fds + fd)->revents)
+                continue;
 
-            fflush(output);
-            free(buffer);
-            exit(result);
-        }
-        else
-            exit(error(1, (uint8_t*)"Fork failed"));
+            job = *(fd_jobs + fd);
+            if (job->fds[*(fd_indexes + fd)] < 0)
+                continue;
+            pump_command_job(job, *(fd_indexes + fd), buf);
 
-        pnamelist++;
-        names_output++;
+            if (job->pid >= 0 && job->fds[STDOUT_FILENO] < 0 
+                    && job->fds[STDERR_FILENO] < 0)
+            {
+                finish_command_job(job);
+                job->pid = -1;
+                running--;
+            }
+        }
     }
 
-    free(abs_subdirname);
-
-    print_output(output, "</div>\n</details>\n</li>\n");
+    free(buf);
+    free(fd_indexes);
+    free(fd_jobs);
+    free(fds);
+    signal(SIGPIPE, saved_sigpipe);
     return 0;
 }
 
+/* Drops newlines from command output, as when printed line by line */
 int
-process_incdir(uint8_t* token, FILE* output, BOOL read_yaml_macros_and_links)
+strip_command_newlines(StrBuf* buf)
 {
-    if (read_yaml_macros_and_links)
+    uint8_t* from = buf->text;
+    uint8_t* to   = buf->text;
+
+    if (!buf->text)
         return 0;
 
-    uint8_t* saveptr                        = NULL;
-    /* skipping the first token (incdir) */
-    uint8_t* arg                            = u8_strtok(token, (uint8_t*)" ", &saveptr);
-    size_t arg_len                          = 0;
-    long num                                = 5;
-    uint8_t* macro_body                     = NULL;
-    struct dirent** namelist;
-    struct dirent** pnamelist;
-    long names_output;
-    BOOL details_open                       = TRUE;
+    while (from < buf->text + buf->len)
+    {
+        if (*from != '\n')
+            *to++ = *from;
+        from++;
+    }
+    buf->len = to - buf->text;
+    *to = 0;
+    return 0;
+}
 
+int
+print_command(const char* command,
+        const uint8_t* pass_arguments[], const uint8_t* pipe_arguments[],
+        FILE* output, BOOL strip_newlines)
+{
+    CommandJob job;
+    const uint8_t** ppipe_argument = pipe_arguments;
+    int result = 0;
 
-    arg = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
-    if (!arg)
-        exit(error(1, (uint8_t*)"incdir: Arguments required"));
+    if (!command || !pass_arguments)
+        exit(error(EINVAL, (uint8_t*)"print_command: Invalid argument"));
 
-    arg_len = u8_strlen(arg);
+    init_command_job(&job, command, (const char**)pass_arguments);
+    while (ppipe_argument && *ppipe_argument)
+    {
+        strbuf_append(&job.input, *ppipe_argument, 
+                u8_strlen(*ppipe_argument));
+        strbuf_append(&job.input, (uint8_t*)"\n", 1);
+        ppipe_argument++;
+    }
 
-    if (*arg != '"' || *(arg + arg_len - 1) != '"')
-        exit(error(1, (uint8_t*)"incdir: First argument not string"));
+    run_command_jobs(&job, 1, 1);
 
-    incdir = strdup((char*)(arg+1));
-    *(incdir + strlen(incdir) - 1) = 0;
+    if (strip_newlines)
+        strip_command_newlines(&job.output);
+    if (job.output.len)
+        print_output(output, "%s%s", job.output.text, 
+                strip_newlines || *(job.output.text + job.output.len - 1) 
+                    == '\n' ? "" : "\n");
 
-    arg = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
-    if (!arg)
-        exit(error(1, (uint8_t*)"incdir: Second argument required"));
+    result = job.status;
+    free_command_job(&job);
+    return result;
+}
 
-    if (*arg == '=')
-        macro_body = get_value(macros, macros_count, arg+1, NULL);
-    else
+int
+send_all(int fd, const uint8_t* data, size_t len)
+{
+    const uint8_t* pdata = data;
+
+    while (pdata < data + len)
     {
-        uint8_t* parg = arg;
-        while (parg && *parg)
-        {
-            if (*parg < '0' || *parg > '9')
-                exit(error(1, (uint8_t*)"incdir: Non-numeric argument"));
-            parg++;
-        }
-        num = strtol((char*)arg, NULL, 10);
-        if (errno)
-            exit(error(errno, (uint8_t*)"incdir: Invalid parameter 'num'"));
-        arg = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
-        if (arg)
-        {
-            if (*arg != '=')
-                exit(error(1, (uint8_t*)"incdir: Third argument not macro"));
-            macro_body = get_value(macros, macros_count, arg+1, NULL);
-        }
+        ssize_t written = write(fd, pdata, data + len - pdata);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return 1;
+        pdata += written;
     }
+    return 0;
+}
 
-    print_output(output, "<ul class=\"incdir\">\n");
+int
+open_input(char* input_filename, char** input_dirname, FILE** input)
+{
+    char* slash = NULL;
 
-    if (scandir(incdir, &namelist, &filter_subdirs,
-            &reverse_alphacompare) < 0)
+    *input = fopen(input_filename, "r");
+    if (!*input)
+        return error(ENOENT, (uint8_t*)"No such file: %s", input_filename);
+
+    if (*input_dirname)
+        free(*input_dirname);
+
+    slash = strrchr(input_filename, '/');
+    if (slash)
     {
-        perror("scandir");
-        exit(error(errno, (uint8_t*)"incdir: scandir '%s' error", incdir));
+        CALLOC(*input_dirname, char, strlen(input_filename)+1)
+        char* pinput_dirname = *input_dirname;
+        char* pinput_filename = input_filename;
+        while (pinput_filename && *pinput_filename
+                && pinput_filename != slash)
+            *pinput_dirname++ = *pinput_filename++;
     }
-
-    pnamelist = namelist;
-    names_output = 0;
-    while (names_output < num && pnamelist && *pnamelist)
+    else
     {
-        process_incdir_subdir((*pnamelist)->d_name, output, details_open,
-                macro_body);
-        details_open = FALSE;
-        pnamelist++;
-        names_output++;
+        CALLOC(*input_dirname, char, 2)
+        **input_dirname = '.';
     }
-    free(namelist);
-    free(incdir);
-
-    print_output(output, "</ul>\n");
 
     return 0;
 }
 
 int
-process_timestamp(FILE* output, const char* link, uint8_t* permalink_macro,
-        uint8_t* date)
+read_file_into_buffer(uint8_t** buffer, size_t* buffer_size, char* input_filename, 
+        char** input_dirname, FILE** input)
 {
-    uint8_t* day = NULL;
-    uint8_t* month = NULL;
-    uint8_t* year = NULL;
-    uint8_t* formatted_date = NULL;
-    uint8_t* ptr = NULL;
-    const char* ptimestamp_format = NULL;
-    char* in_filename = NULL;
-    char* in_line = NULL;
+    struct stat fs;
+    int result = open_input(input_filename, input_dirname, input);
 
-    CALLOC(formatted_date, uint8_t, DATEBUFSIZE)
-    ptr = NULL;
-    year = u8_strtok(date, (uint8_t*)"-", &ptr);
-    if (year)
-    {
-        month = u8_strtok(NULL, (uint8_t*)"-", &ptr);
-        if (month)
-        {
-            day = u8_strtok(NULL, (uint8_t*)"T", &ptr);
-            if (day)
-            {
-                ptimestamp_format = timestamp_format;
-                while (*ptimestamp_format)
-                {
-                    if (*ptimestamp_format == 'd' 
-                            || *ptimestamp_format == 'D')
-                        u8_strncat(formatted_date, day, 
-                                DATEBUFSIZE-u8_strlen(formatted_date-1));
-                    else if (*ptimestamp_format == 'm' 
-                            || *ptimestamp_format == 'M')
-                        u8_strncat(formatted_date, month, 
-                                DATEBUFSIZE-u8_strlen(formatted_date-1));
-                    else if (*ptimestamp_format == 'y' 
-                            || *ptimestamp_format == 'Y')
-                        u8_strncat(formatted_date, year, 
-                                DATEBUFSIZE-u8_strlen(formatted_date-1));
-                    else
-                        *(formatted_date + u8_strlen(formatted_date)) 
-                            = *ptimestamp_format;
+    if (result)
+        return result;
 
-                    ptimestamp_format++;
-                }
-                print_output(output, "<a href=\"%s\""
-                        " class=\"timestamp\">%s%s</a>\n",
-                        link,
-                        permalink_macro ? (char*)permalink_macro : "",
-                        formatted_date);
-            }
-        }
-    }
+    fstat(fileno(*input), &fs);
+    if (*buffer)
+        free(*buffer);
+    *buffer_size = fs.st_size+1;
+    CALLOC(*buffer, uint8_t, *buffer_size)
+    fread((void*)*buffer, 1, *buffer_size, *input);
 
-    free(formatted_date);
-    free(in_line);
-    free(in_filename);
+    fclose(*input);
 
     return 0;
 }
 
 int
-process_macro(uint8_t* token, FILE* output, BOOL read_yaml_macros_and_links, 
-        BOOL end_tag)
+capture_child_output(child_callback_t callback, void* arg, uint8_t** captured,
+        size_t* captured_len)
 {
-    if (!end_tag)
+    int output_pipe_fds[2];
+    int pstatus = 0;
+    size_t captured_size = BUFSIZE;
+    ssize_t nread = 0;
+
+    if (!callback || !captured || !captured_len)
+        exit(error(EINVAL, (uint8_t*)"capture_child_output: Invalid argument"));
+
+    if (pipe(output_pipe_fds) < 0)
+        exit(error(errno, (uint8_t*)"Cannot create pipe"));
+
+    /* Don't let the child flush our pending output a second time */
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0)
     {
-        if (state & ST_MACRO_BODY)
-            exit(error(1, (uint8_t*)"Macro undefined or nested"));
+        close(output_pipe_fds[PIPE_READ_INDEX]);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
 
-        BOOL seen = FALSE;
-        uint8_t* macro_body = get_value(macros, macros_count, token+1,
-                read_yaml_macros_and_links ? NULL : &seen);
+        /* Minified, if at all, as the parent writes what is captured */
+        output_minify = NULL;
 
-        if (macro_body)
+        FILE* output = fdopen(output_pipe_fds[PIPE_WRITE_INDEX], "w");
+        if (!output)
+            exit(error(1, (uint8_t*)"Cannot fdopen"));
+
+        int result = (*callback)(output, arg);
+        fclose(output);
+        exit(result);
+    }
+    else if (pid < 0)
+        exit(error(errno, (uint8_t*)"Fork failed"));
+
+    close(output_pipe_fds[PIPE_WRITE_INDEX]);
+
+    *captured_len = 0;
+    CALLOC(*captured, uint8_t, captured_size)
+    while ((nread = read(output_pipe_fds[PIPE_READ_INDEX], 
+                    *captured + *captured_len, 
+                    captured_size - *captured_len - 1)) != 0)
+    {
+        if (nread < 0)
         {
-            if (!read_yaml_macros_and_links)
-            {
-                if (seen)
-                    print_output(output, "%s", macro_body);
-                else
-                    state |= ST_MACRO_BODY;
-            }
+            if (errno == EINTR)
+                continue;
+            break;
         }
-        else
+        *captured_len += nread;
+        if (*captured_len + 1 == captured_size)
         {
-            if (read_yaml_macros_and_links)
-            {
-                macros_count++;
-
-                if (macros_count > 1)
-                {
-                    REALLOC(macros, KeyValue, macros_count * sizeof(KeyValue))
-                    pmacros = macros + macros_count - 1;
-                }
-                CALLOC(pmacros->key, uint8_t, KEYSIZE)
-                pmacros->seen = FALSE;
-                u8_strncpy(pmacros->key, token+1, KEYSIZE-1);
-                pmacros->value = NULL;
-                pmacros->value_size = 0;
-            }
-            state |= ST_MACRO_BODY;
+            captured_size *= 2;
+            REALLOC(*captured, uint8_t, captured_size)
         }
     }
-    else
-        state &= ~ST_MACRO_BODY;
+    *(*captured + *captured_len) = 0;
+    close(output_pipe_fds[PIPE_READ_INDEX]);
 
-    return 0;
+    waitpid(pid, &pstatus, 0);
+    if (!WIFEXITED(pstatus))
+        return 1;
+    return WEXITSTATUS(pstatus);
 }
 
 int
-process_tag(uint8_t* token, FILE* output, BOOL read_yaml_macros_and_links, 
-        BOOL* skip_eol, BOOL end_tag)
-{
-    if (!token || u8_strlen(token) < 1)
-        return warning(1, (uint8_t*)"%s:%ld:%ld: Empty tag name",
-                input_filename, lineno, colno);
+read_csv(FILE* output, const char* filename, csv_callback_t callback);
 
-    if (!strcmp((char*)token, "git-log")
-            && !read_yaml_macros_and_links)   /* {git-log} */
-    {
-        process_git_log(output);
-    }
-    else if (!strcmp((char*)token, "made-by")
-            && !read_yaml_macros_and_links)   /* {made-by} */
-    {
-        print_output(output, "<div id=\"made-by\">\n"
-                "Generated by <a href=\"%s\" target=\"_blank\">"
-                "slweb</a>\n"
-                "© %s Strahinya Radich.\n"
-                "</div><!--made-by-->\n",
-                MADEBY_URL,
-                COPYRIGHTYEAR);
-    }
-    else if (startswith((char*)token, "csv"))   /* {csv} */
-    {
-        process_csv(token, output, read_yaml_macros_and_links, end_tag);
-    }
-    else if (startswith((char*)token, "include"))  /* {include} */
-    {
-        process_include(token, output, read_yaml_macros_and_links);
-        *skip_eol = TRUE;
-    }
-    else if (startswith((char*)token, "incdir"))   /* {incdir} */
-    {
-        process_incdir(token, output, read_yaml_macros_and_links);
-        *skip_eol = TRUE;
-    }
-    else if (*token == '=')   /* {=macro} */
-    {
-        process_macro(token, output, read_yaml_macros_and_links, end_tag);
-        *skip_eol = TRUE;
-    }
-    else if (!read_yaml_macros_and_links)   /* general tags */
+int
+print_meta_var(FILE* output, uint8_t** csv_header, uint8_t** csv_register)
+{
+    if (*csv_register && *(csv_register+1))
     {
-        print_output(output, "<");
-        if (end_tag)
-            print_output(output, "/");
-
-        if (*token == '.' || *token == '#')
+        uint8_t* pvalue = *(csv_register+1);
+        size_t value_len = u8_strlen(pvalue);
+        if (*pvalue == '%' && *(pvalue+value_len-1) == '%')
         {
-            print_output(output, "div");
-        }
+            uint8_t* var_name = NULL;
+            var_name = u8_strdup(pvalue+1);
+            *(var_name+value_len-2) = 0;
+            uint8_t* value = get_value(vars, vars_count, var_name, NULL);
 
-        while (*token && *token != '#' && *token != '.')
-            print_output(output, "%c", *token++);
+            if (value)
+                print_output(output, "<meta name=\"%s\" content=\"%s\" />\n",
+                        *csv_register, value);
 
-        if (!end_tag)
-        {
-            if (*token == '#')
-            {
-                token++;
-                print_output(output, " id=\"");
-                while (*token && *token != '.')
-                    print_output(output, "%c", *token++);
-                print_output(output, "\"");
-                if (*token == '.')
-                {
-                    token++;
-                    print_output(output, " class=\"");
-                    while (*token)
-                        print_output(output, "%c", *token++);
-                    print_output(output, "\"");
-                }
-            }
-            else if (*token == '.')
-            {
-                token++;
-                print_output(output, " class=\"");
-                while (*token && *token != '#')
-                    print_output(output, "%c", *token++);
-                print_output(output, "\"");
-                if (*token == '#')
-                {
-                    token++;
-                    print_output(output, " id=\"");
-                    while (*token)
-                        print_output(output, "%c", *token++);
-                    print_output(output, "\"");
-                }
-            }
+            free(var_name);
         }
-        print_output(output, ">");
+        else
+            print_output(output, "<meta name=\"%s\" content=\"%s\" />\n",
+                    *csv_register, *(csv_register+1));
     }
-
     return 0;
 }
 
 int
-process_bold(FILE* output, BOOL end_tag)
+process_heading_start(FILE* output, UBYTE heading_level)
 {
-    print_output(output, "<%sstrong>", end_tag ? "/" : "");
+    print_output(output, "<h%d>", heading_level);
     return 0;
 }
 
 int
-process_italic(FILE* output, BOOL end_tag)
+process_heading(uint8_t* token, FILE* output, UBYTE heading_level)
 {
-    print_output(output, "<%sem>", end_tag ? "/" : "");
+    if (!token || u8_strlen(token) < 1)
+        warning(1, (uint8_t*)"Empty heading");
+
+    print_output(output, "%s</h%d>", 
+            token ? (char*)token : "", heading_level);
+
     return 0;
 }
 
 int
-process_code(FILE* output, BOOL end_tag)
+process_git_log(FILE* output)
 {
-    print_output(output, "<%scode>", end_tag ? "/" : "");
-    return 0;
-}
-
-int
-process_blockquote(FILE* output, BOOL end_tag)
-{
-    print_output(output, "<%sblockquote>", end_tag ? "/" : "");
-    return 0;
-}
-
-int
-process_kbd(FILE* output, BOOL end_tag)
-{
-    print_output(output, "<%skbd>", end_tag ? "/" : "");
-    return 0;
-}
-
-int
-process_table_start(FILE* output)
-{
-    print_output(output, "<table>\n");
-    return 0;
-}
+    if (!input_filename)
+        return warning(1, (uint8_t*)"Cannot use 'git-log' in stdin");
 
-int 
-process_table_header_start(FILE* output)
-{
-    print_output(output, "<thead>\n<tr><th>");
-    return 0;
-}
+    include_volatile = TRUE;
 
-int
-process_table_header_cell(FILE* output)
-{
-    print_output(output, "</th><th>");
-    return 0;
-}
+    char* basename = NULL;
+    size_t basename_size = strlen(input_filename)+1;
+    CALLOC(basename, char, basename_size)
+    char* slash = strrchr(input_filename, '/');
+    pid_t result = 0;
 
-int 
-process_table_header_end(FILE* output)
-{
-    print_output(output, "</th></tr>\n</thead>\n");
-    return 0;
-}
+    if (slash)
+        strncpy(basename, slash+1, basename_size-1);
+    else
+        strncpy(basename, input_filename, basename_size-1);
 
-int
-process_table_body_start(FILE* output, BOOL start_row)
-{
-    print_output(output, "<tbody>\n");
-    if (start_row)
-        print_output(output, "<tr><td>");
-    return 0;
-}
+    uint8_t* pipe_args[] = { (uint8_t*)basename, NULL };
 
-int
-process_table_body_row_start(FILE* output)
-{
-    print_output(output, "<tr><td>");
-    return 0;
-}
+    print_output(output, "<div id=\"git-log\">\nPrevious commit:\n");
+    result = print_command(CMD_GIT_LOG, 
+            (const uint8_t**)CMD_GIT_LOG_ARGS,
+            (const uint8_t**)pipe_args, output, FALSE);
 
-int
-process_table_body_cell(FILE* output)
-{
-    print_output(output, "</td><td>");
-    return 0;
-}
+    print_output(output, "</div><!--git-log-->\n");
 
-int
-process_table_body_row_end(FILE* output)
-{
-    print_output(output, "</td></tr>\n");
-    return 0;
-}
+    free(basename);
 
-int
-process_table_end(FILE* output)
-{
-    print_output(output, "</tbody>\n</table>\n");
-    return 0;
+    return result ? warning(result, (uint8_t*)"git-log: Cannot run git") : 0;
 }
 
-BOOL
-url_is_local(char* url)
-{
-    return !(startswith(url, "http://")
-        || startswith(url, "https://")
-        || startswith(url, "ftp://")
-        || startswith(url, "ftps://")
-        || startswith(url, "mailto://"));
-}
+#define PRINTIF(format, arg) { \
+    if ((ALL(csv_state, ST_CS_COND_NONEMPTY) \
+                && *csv_register[conditional_index-1]) \
+             || (ALL(csv_state, ST_CS_COND_EMPTY) \
+                && !*csv_register[conditional_index-1]) \
+             || !ANY(csv_state, ST_CS_COND_EMPTY | ST_CS_COND_NONEMPTY)) \
+    { print_html(output, format, arg); } }
 
 int
-get_realpath(char** realpath, char* relativeto, char* path)
+print_csv_row(FILE* output, uint8_t** csv_header, uint8_t** csv_register)
 {
-    uint8_t* command = NULL;
-    FILE* cmd_output = NULL;
-
-    CALLOC(command, uint8_t, BUFSIZE)
-    strncpy(*realpath, ".", BUFSIZE-1);
-    u8_snprintf(command, BUFSIZE-1, "realpath --relative-to=%s %s", 
-            relativeto, path);
+    uint8_t* pcsv_template  = csv_template.text;
+    UBYTE csv_state         = ST_CS_NONE;
+    UBYTE num               = 0;
+    UBYTE conditional_index = 0;
 
-    cmd_output = popen((char*)command, "r");
-    if (cmd_output)
+    while (pcsv_template && *pcsv_template)
     {
-        uint8_t* cmd_output_line = NULL;
-        CALLOC(cmd_output_line, uint8_t, BUFSIZE)
-        while (!feof(cmd_output))
+        if (csv_state & ST_CS_ESCAPE)
         {
-            if (!fgets((char*)cmd_output_line, BUFSIZE, cmd_output))
-                continue;
-
-            char* eol = strchr((char*)cmd_output_line, '\n');
-            if (eol)
-                *eol = 0;
-
-            strncpy(*realpath, (char*)cmd_output_line, BUFSIZE-1);
+            PRINTIF("%c", *pcsv_template)
+            csv_state &= ~ST_CS_ESCAPE;
+            pcsv_template++;
+            continue;
         }
-        pclose(cmd_output);
-        free(cmd_output_line);
-    }
-    else
-        warning(1, (uint8_t*)"get_realpath: Cannot popen");
-
-    free(command);
-
-    return 0;
-}
-
-int
-process_inline_link(uint8_t* link_text, uint8_t* link_macro_body, 
-        uint8_t* link_url, FILE* output)
-{
-    print_output(output, "<a href=\"%s\">%s%s</a>", 
-            link_url ? (char*)link_url : "", 
-            link_macro_body ? (char*)link_macro_body : "",
-            link_text);
-
-    return 0;
-}
-
-int
-process_link(uint8_t* link_text, uint8_t* link_macro_body, uint8_t* link_id, 
-        FILE* output)
-{
-    uint8_t* url = get_value(links, links_count, link_id, NULL);
-    return process_inline_link(link_text, link_macro_body,
-            url, output);
-}
-
-int
-process_inline_image(uint8_t* image_text, uint8_t* image_url, FILE* output,
-        BOOL add_link, BOOL add_figcaption)
-{
-    if (add_figcaption)
-        print_output(output, "<figure>\n");
-
-    if (add_link)
-        print_output(output, "<a href=\"%s\" title=\"%s\" class=\"image\""
-                " target=\"_blank\">",
-                image_url ? (char*)image_url : "", 
-                image_text);
-
-    print_output(output, "<img src=\"%s\" alt=\"%s\" />",
-            image_url ? (char*)image_url : "", 
-            image_text);
-
-    if (add_link)
-        print_output(output, "</a>");
-
-    if (add_figcaption)
-        print_output(output, "<figcaption>%s</figcaption>\n</figure>\n",
-                image_text);
-    return 0;
-}
-
-int
-process_image(uint8_t* image_text, uint8_t* image_id, FILE* output, 
-        BOOL add_link, BOOL add_figcaption)
-{
-    uint8_t* url = get_value(links, links_count, image_id, NULL);
-    return process_inline_image(image_text, url, output, add_link,
-            add_figcaption);
-}
 
-int
-process_line_start(uint8_t* line, BOOL first_line_in_doc,
-        BOOL previous_line_blank, BOOL read_yaml_macros_and_links,  
-        BOOL list_para, FILE* output, uint8_t** token, uint8_t** ptoken)
-{
-    if ((first_line_in_doc || previous_line_blank)
-            && !(ANY(state, ST_BLOCKQUOTE | ST_PRE)))
-    {
-        if (!list_para)
+        switch (*pcsv_template)
         {
-            if (state & ST_LIST)
+        case '\\':
+            csv_state |= ST_CS_ESCAPE;
+            pcsv_template++;
+            break;
+        case '$':
+            if (csv_state & ST_CS_REGISTER)
             {
-                state &= ~ST_LIST;
-                if (!read_yaml_macros_and_links)
-                {
-                    process_list_item_end(output);
-                    process_list_end(output);
-                }
+                PRINTIF("%c", '$')
+                csv_state &= ~ST_CS_REGISTER;
             }
-
-            if (state & ST_NUMLIST)
+            else
+                csv_state |= ST_CS_REGISTER;
+            pcsv_template++;
+            break;
+        case '#':
+            if (csv_state & ST_CS_HEADER)
             {
-                state &= ~ST_NUMLIST;
-                if (!read_yaml_macros_and_links)
-                {
-                    process_list_item_end(output);
-                    process_numlist_end(output);
-                }
+                error(1, (uint8_t*)"csv: Invalid header register mark");
+                csv_state &= ~(ST_CS_REGISTER | ST_CS_HEADER);
             }
-
-            if (state & ST_FOOTNOTE_TEXT)
+            else if (csv_state & ST_CS_REGISTER)
             {
-                if (!read_yaml_macros_and_links && (state & ST_PARA_OPEN))
-                    print_output(output, "</p>\n");
-                state &= ~(ST_FOOTNOTE_TEXT | ST_PARA_OPEN);
+                csv_state &= ~ST_CS_REGISTER;
+                csv_state |= ST_CS_HEADER;
             }
-        }
-        if (!ANY(state, ST_TABLE | ST_TABLE_HEADER | ST_TABLE_LINE))
-        {
-            if (!read_yaml_macros_and_links)
-                print_output(output, "<p>");
-            state |= ST_PARA_OPEN;
-        }
-    }
-    return 0;
-}
-
-int
-process_text_token(uint8_t* line, BOOL first_line_in_doc,
-        BOOL previous_line_blank,
-        BOOL processed_start_of_line,
-        BOOL read_yaml_macros_and_links, BOOL list_para,
-        FILE* output, uint8_t** token,
-        uint8_t** ptoken, size_t* token_size,
-        BOOL add_enclosing_paragraph)
-{
-    if (!(state & ST_YAML))
-    {
-        if (add_enclosing_paragraph && !processed_start_of_line)
-            process_line_start(line, first_line_in_doc, previous_line_blank,
-                    read_yaml_macros_and_links, list_para, output, token, ptoken);
-        **ptoken = 0;
-        if (**token && !read_yaml_macros_and_links 
-                && !(state & ST_MACRO_BODY))
-            print_output(output, "%s", *token);
-    }
-    RESET_TOKEN(*token, *ptoken, *token_size)
-    return 0;
-}
-
-int
-process_inline_footnote(uint8_t* token, BOOL read_yaml_macros_and_links, 
-        FILE* output)
-{
-    current_inline_footnote++;
-
-    if (read_yaml_macros_and_links)
-    {
-        size_t token_len = u8_strlen(token);
-
-        inline_footnote_count++;
-        if (inline_footnote_count == 1 && footnote_count > 0)
-            warning(1, (u_int8_t*)"Both inline and regular footnotes present");
-        else if (inline_footnote_count > 1)
-            REALLOC(inline_footnotes, uint8_t*, sizeof(uint8_t*) * inline_footnote_count)
-        CALLOC(inline_footnotes[inline_footnote_count-1], uint8_t, token_len+1)
-
-        u8_strncpy(inline_footnotes[inline_footnote_count-1], token, token_len);
-        *(inline_footnotes[inline_footnote_count-1] + token_len) = 0;
+            else
+                PRINTIF("%c", '#')
+            pcsv_template++;
+            break;
+        case '?':
+            if (csv_state & ST_CS_COND)
+            {
+                error(1, (uint8_t*)"csv: Invalid conditional mark");
+                csv_state &= ~ST_CS_COND;
+            }
+            else if (csv_state & ST_CS_REGISTER)
+            {
+                csv_state &= ~ST_CS_REGISTER;
+                csv_state |= ST_CS_COND;
+            }
+            else
+                PRINTIF("%c", '?')
+            pcsv_template++;
+            break;
+        case '!':
+            if (ALL(csv_state, ST_CS_COND | ST_CS_COND_NONEMPTY))
+            {
+                csv_state &= ~(ST_CS_COND | ST_CS_COND_NONEMPTY);
+                csv_state |= ST_CS_COND_EMPTY;
+            }
+            else if (csv_state & ST_CS_COND)
+            {
+                error(1, (uint8_t*)"Empty conditional before/without nonempty"
+                        " conditional");
+                csv_state &= ~(ST_CS_COND | ST_CS_COND_EMPTY);
+            }
+            else
+                PRINTIF("%c", '!')
+            pcsv_template++;
+            break;
+        case '/':
+            if (ALL(csv_state, ST_CS_COND | ST_CS_COND_EMPTY))
+                csv_state &= ~(ST_CS_COND | ST_CS_COND_EMPTY);
+            else if (ALL(csv_state, ST_CS_COND))
+                csv_state &= ~(ST_CS_COND | ST_CS_COND_NONEMPTY);
+            else
+                PRINTIF("%c", '/')
+            pcsv_template++;
+            break;
+        case '1': case '2': case '3': case '4': case '5': 
+        case '6': case '7': case '8': case '9':
+            if (csv_state & ST_CS_COND)
+            {
+                conditional_index = *pcsv_template - '0';
+                csv_state &= ~ST_CS_COND;
+                csv_state |= ST_CS_COND_NONEMPTY;
+            }
+            else if (csv_state & ST_CS_HEADER)
+            {
+                num = *pcsv_template - '0';
+                PRINTIF("%s", csv_header[num-1])
+                csv_state &= ~ST_CS_HEADER;
+            }
+            else if (csv_state & ST_CS_REGISTER)
+            {
+                num = *pcsv_template - '0';
+                PRINTIF("%s", csv_register[num-1])
+                csv_state &= ~ST_CS_REGISTER;
+            }
+            else
+                PRINTIF("%c", *pcsv_template)
+            pcsv_template++;
+            break;
+        default:
+            if (csv_state & ST_CS_HEADER)
+            {
+                error(1, (uint8_t*)"csv: Invalid header register mark");
+                csv_state &= ~ST_CS_HEADER;
+            }
+            else if (csv_state & ST_CS_REGISTER)
+            {
+                error(1, (uint8_t*)"csv: Invalid register mark");
+                csv_state &= ~ST_CS_REGISTER;
+            }
+            else
+                PRINTIF("%c", *pcsv_template)
+            pcsv_template++;
+        }
     }
-    else
-        print_output(output, "<a href=\"#inline-footnote-%d\" id=\"inline-footnote-text-%d\">"
-                "<sup>%d</sup></a>", 
-                current_inline_footnote, current_inline_footnote, 
-                current_inline_footnote);
-
     return 0;
 }
 
 int
-process_footnote(uint8_t* token, BOOL footnote_definition, BOOL footnote_output,
-        FILE* output)
+read_csv(FILE* output, const char* filename, csv_callback_t callback)
 {
-    current_footnote++;
+    if (!callback)
+        exit(error(EINVAL, (uint8_t*)"read_csv: Invalid callback argument"));
 
-    if (footnote_definition)
+    FILE* csv                                 = NULL;
+    size_t csv_lineno                         = 0;
+    uint8_t* bufline                          = NULL;
+    uint8_t* pbufline                         = NULL;
+    uint8_t* token                            = NULL;
+    uint8_t* ptoken                           = NULL;
+    size_t token_size                         = 0;
+    UBYTE csv_state                           = ST_CS_NONE;
+    uint8_t* csv_header[MAX_CSV_REGISTERS];
+    UBYTE current_header                      = 0;
+    uint8_t* csv_register[MAX_CSV_REGISTERS];
+    UBYTE current_register                    = 0;
+    uint8_t* csv_delimiter                    = get_value(vars, vars_count,
+            (uint8_t*)"csv-delimiter", NULL);
+
+    record_include_dep('f', (uint8_t*)filename, hash_file(filename));
+
+    if (!(csv = fopen(filename, "rt")))
+        exit(error(ENOENT, (uint8_t*)"csv: No such file: %s", filename));
+
+    CALLOC(bufline, uint8_t, BUFSIZE)
+    token_size = BUFSIZE;
+    CALLOC(token, uint8_t, token_size)
+    for (UBYTE i = 0; i < MAX_CSV_REGISTERS; i++)
+        CALLOC(csv_header[i], uint8_t, BUFSIZE)
+    for (UBYTE i = 0; i < MAX_CSV_REGISTERS; i++)
+        CALLOC(csv_register[i], uint8_t, BUFSIZE)
+
+    while (!feof(csv) && (!csv_iter || csv_lineno <= csv_iter))
     {
-        footnote_count++;
-        if (footnote_count == 1 && inline_footnote_count > 0)
-            warning(1, (u_int8_t*)"Both inline and regular footnotes present");
-        else if (footnote_count > 1)
+        uint8_t* eol = NULL;
+        if (!fgets((char*)bufline, BUFSIZE, csv))
+            break;
+        eol = u8_strchr(bufline, (ucs4_t)'\n');
+        if (eol)
+            *eol = 0;
+
+        pbufline = bufline;
+        RESET_TOKEN(token, ptoken, token_size)
+        current_register = 0;
+        while (*pbufline)
+        {
+            switch (*pbufline)
+            {
+            case '"':
+                if (csv_state & ST_CS_QUOTE)
+                    csv_state &= ~ST_CS_QUOTE;
+                else
+                    csv_state |= ST_CS_QUOTE;
+                pbufline++;
+                break;
+            case ';':
+            case ',':
+                if (csv_state & ST_CS_QUOTE)
+                    CHECKCOPY(token, ptoken, token_size, pbufline)
+                else
+                {
+                    *ptoken = 0;
+                    if (csv_lineno > 0)
+                    {
+                        if (current_register < MAX_CSV_REGISTERS)
+                            u8_strncpy(csv_register[current_register++], token,
+                                    BUFSIZE-1);
+                    }
+                    else
+                    {
+                        if (current_header < MAX_CSV_REGISTERS)
+                            u8_strncpy(csv_header[current_header++], token, 
+                                    BUFSIZE-1);
+                    }
+                    RESET_TOKEN(token, ptoken, token_size)
+                    pbufline++;
+                }
+                break;
+            default:
+                if (csv_state & ST_CS_QUOTE)
+                    CHECKCOPY(token, ptoken, token_size, pbufline)
+                else
+                {
+                    if (csv_delimiter && *pbufline == *csv_delimiter)
+                    {
+                        *ptoken = 0;
+                        if (csv_lineno > 0)
+                        {
+                            if (current_register < MAX_CSV_REGISTERS)
+                                u8_strncpy(csv_register[current_register++], token,
+                                        BUFSIZE-1);
+                        }
+                        else
+                        {
+                            if (current_header < MAX_CSV_REGISTERS)
+                                u8_strncpy(csv_header[current_header++], token, 
+                                        BUFSIZE-1);
+                        }
+                        RESET_TOKEN(token, ptoken, token_size)
+                        pbufline++;
+                    }
+                    else
+                        CHECKCOPY(token, ptoken, token_size, pbufline)
+                }
+            }
+        }
+        *ptoken = 0;
+        if (csv_lineno > 0)
         {
-            REALLOC(footnotes, KeyValue, footnote_count * sizeof(KeyValue))
-            pfootnotes = footnotes + footnote_count - 1;
+            if (current_register < MAX_CSV_REGISTERS)
+                u8_strncpy(csv_register[current_register++], token, 
+                        BUFSIZE-1);
         }
-        CALLOC(pfootnotes->key, uint8_t, KEYSIZE)
-        u8_strncpy(pfootnotes->key, token, KEYSIZE-1);
-        pfootnotes->value = NULL;
-        pfootnotes->value_size = 0;
+        else
+        {
+            if (current_header < MAX_CSV_REGISTERS)
+                u8_strncpy(csv_header[current_header++], token, BUFSIZE-1);
+        }
+        RESET_TOKEN(token, ptoken, token_size)
+
+        if (csv_lineno > 0 && pbufline != bufline)
+            (*callback)(output, csv_header, csv_register);
+
+        for (UBYTE i = 0; i < MAX_CSV_REGISTERS; i++)
+            *csv_register[i] = 0;
+        csv_lineno++;
     }
-    
-    if (footnote_output)
-        print_output(output, "<a href=\"#footnote-%d\" id=\"footnote-text-%d\">"
-                "<sup>%d</sup></a>", 
-                current_footnote, current_footnote, current_footnote);
+    fclose(csv);
+    for (UBYTE i = MAX_CSV_REGISTERS; i > 0; i--)
+        free(csv_register[i-1]);
+    for (UBYTE i = MAX_CSV_REGISTERS; i > 0; i--)
+        free(csv_header[i-1]);
+    free(token);
+    free(bufline);
 
     return 0;
 }
 
 int
-process_horizontal_rule(FILE* output)
+process_csv(uint8_t* arg_token, ParsedDoc* doc, 
+        BOOL read_yaml_macros_and_links, BOOL end_tag)
 {
-    /* Temporarily break paragraph as hr is para-level */
-    if (state & ST_PARA_OPEN)
-        print_output(output, "</p>\n");
-    print_output(output, "<hr />\n");
-    if (state & ST_PARA_OPEN)
-        print_output(output, "<p>\n");
-    return 0;
-}
+    if (end_tag)
+    {
+        state &= ~ST_CSV_BODY;
+        add_node(doc, NODE_CSV_END, 
+                read_yaml_macros_and_links ? 0 : NODE_FLAG_RENDER);
+    }
+    else
+    {
+        if (state & ST_CSV_BODY)
+            exit(error(1, (uint8_t*)"Can't nest csv directives"));
 
-int
-process_formula(FILE* output, const uint8_t* token, BOOL display_formula)
-{
-    int result           = 0;
-    const uint8_t* pipe_args[] = { token, NULL};
+        state |= ST_CSV_BODY;
 
-    result = print_command(CMD_KATEX, 
-            display_formula 
-                ? (const uint8_t**)CMD_KATEX_DISPLAY_ARGS 
-                : (const uint8_t**)CMD_KATEX_INLINE_ARGS,
-            (const uint8_t**)pipe_args, output, TRUE);
+        if (read_yaml_macros_and_links)
+        {
+            add_node(doc, NODE_CSV_START, 0);
+            return 0;
+        }
 
-    if (result)
-        print_output(output, "%s$%s$%s", 
-                display_formula ? "$" : "",
-                token,
-                display_formula ? "$" : "");
+        long iter = 0;
+        char* filename = NULL;
+        uint8_t* saveptr = NULL;
+        uint8_t* args = u8_strtok(arg_token, (uint8_t*)" ", &saveptr);
+        args = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
+        if (!args)
+            exit(error(EINVAL, (uint8_t*)"csv: Arguments required"));
+        size_t args_len = u8_strlen(args);
+        if (*args != '"' || *(args + args_len - 1) != '"')
+            exit(error(EINVAL, (uint8_t*)"csv: First argument must be a string"));
+        CALLOC(filename, char, BUFSIZE)
+        uint8_t* args_base = u8_strdup(args+1);
+        *(args_base + u8_strlen(args_base) - 1) = 0;
+        snprintf(filename, BUFSIZE, "%s/%s.csv", input_dirname, (char*)args_base);
+        free(args_base);
+        args = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
+        if (args)
+        {
+            errno = 0;
+            iter = strtol((char*)args, NULL, 10);
+            if (errno)
+                exit(error(errno, (uint8_t*)"csv: Invalid argument '%s'", args));
+        }
 
-    return result;
+        add_text_node(doc, NODE_CSV_START, 0, (uint8_t*)filename)->number 
+            = iter;
+        free(filename);
+    }
+
+    return 0;
 }
 
 int
-begin_html_and_head(FILE* output)
+init_links_and_footnotes()
 {
-    uint8_t* lang        = get_value(vars, vars_count, (uint8_t*)"lang", NULL);
-    uint8_t* site_name   = get_value(vars, vars_count, (uint8_t*)"site-name", NULL);
-    uint8_t* site_desc   = get_value(vars, vars_count, (uint8_t*)"site-desc", NULL);
-    uint8_t* canonical   = get_value(vars, vars_count, (uint8_t*)"canonical", NULL);
-    uint8_t* favicon_url = get_value(vars, vars_count, (uint8_t*)"favicon-url", NULL);
-    uint8_t* meta        = get_value(vars, vars_count, (uint8_t*)"meta", NULL);
-
-    uint8_t* feed        = get_value(vars, vars_count, (uint8_t*)"feed", NULL);
-    uint8_t* feed_desc   = get_value(vars, vars_count, (uint8_t*)"feed-desc", NULL);
-
-    print_output(output, "<!DOCTYPE html>\n"
-            "<html lang=\"%s\">\n"
-            "<head>\n"
-            "<title>%s</title>\n"
-            "<meta charset=\"utf-8\" />\n",
-            lang ? (char*)lang : "en",
-            site_name ? (char*)site_name : "");
-
-    char* favicon = NULL;
-    CALLOC(favicon, char, BUFSIZE)
-    snprintf(favicon, BUFSIZE-1, "%s/favicon.ico", basedir);
-    if (!access(favicon, R_OK))
-        print_output(output, "<link rel=\"shortcut icon\" type=\"image/x-icon\""
-                " href=\"%s\" />\n", 
-                favicon_url ? (char*)favicon_url : "/favicon.ico");
-    free(favicon);
-   
-    if (meta)
-    {
-        char* filename = NULL;
-        CALLOC(filename, char, BUFSIZE)
-        snprintf(filename, BUFSIZE, "%s/%s", input_dirname, (char*)meta);
-        read_csv(output, filename, &print_meta_var);
-        free(filename);
-    }
+    free(links);
+    CALLOC(links, KeyValue, 1)
+    links->key = NULL;
+    links->value = NULL;
+    links->value_size = 0;
+    links_count = 0;
 
-    if (canonical && *canonical)
-        print_output(output, "<link rel=\"canonical\" href=\"%s\" />\n",
-                (char*)canonical);
+    free(footnotes);
+    CALLOC(footnotes, KeyValue, 1)
+    footnotes->key = NULL;
+    footnotes->value = NULL;
+    footnotes->value_size = 0;
+    footnote_count = 0;
+    current_footnote = 0;
 
-    if (feed && *feed && feed_desc && *feed_desc)
-        print_output(output, "<link rel=\"alternate\""
-                " type=\"application/rss+xml\" href=\"%s\" title=\"%s\" />\n",
-                (char*)feed, (char*)feed_desc);
+    free(inline_footnotes);
+    CALLOC(inline_footnotes, uint8_t*, 1)
+    *inline_footnotes = NULL;
+    inline_footnote_count = 0;
+    current_inline_footnote = 0;
 
-    if (site_desc && *site_desc)
-        print_output(output, "<meta name=\"description\" content=\"%s\" />\n",
-                (char*)site_desc);
+    /* Spilled footnotes belong to the streamed document */
+    footnote_spill = inline_footnote_spill = NULL;
+    footnotes_spilled = inline_footnotes_spilled = 0;
 
-    print_output(output, "<meta name=\"viewport\" content=\"width=device-width,"
-            " initial-scale=1\" />\n<meta name=\"generator\" content=\"slweb\" />\n");
     return 0;
 }
 
 int
-add_css(FILE* output)
+write_include_defs(FILE* output, UBYTE kind, KeyValue* list, size_t first, 
+        size_t list_count)
 {
-    KeyValue* pvars = vars;
-    while (pvars < vars + vars_count)
+    KeyValue* plist = list + first;
+    while (plist < list + list_count)
     {
-        if (!u8_strcmp(pvars->key, (uint8_t*)"stylesheet"))
-            print_output(output, "<link rel=\"stylesheet\" href=\"%s\" />\n",
-                    pvars->value);
-        pvars++;
+        size_t value_len = plist->value ? u8_strlen(plist->value) : 0;
+        fprintf(output, "%c %lu %lu %d\n%s", kind, 
+                (ULONG)u8_strlen(plist->key), (ULONG)value_len, 
+                plist->value ? 1 : 0, (char*)plist->key);
+        fputc(0, output);
+        fwrite(plist->value ? plist->value : (uint8_t*)"", 1, value_len, 
+                output);
+        fputc(0, output);
+        plist++;
     }
     return 0;
 }
 
 int
-end_head_start_body(FILE* output)
+write_include_entry(FILE* output, IncludeJob* job, uint8_t* fragment, 
+        size_t fragment_len)
 {
-    print_output(output, "</head>\n<body>\n");
+    uint8_t* body      = NULL;
+    size_t body_len    = 0;
+    FILE* body_output  = open_memstream((char**)&body, &body_len);
+    IncludeDep* pdep   = include_deps;
+
+    if (!body_output)
+        exit(error(errno, (uint8_t*)"include: Cannot open memory stream"));
+
+    fprintf(body_output, "F %lu\n", (ULONG)fragment_len);
+    fwrite(fragment, 1, fragment_len, body_output);
+    fputc(0, body_output);
+
+    if (include_volatile)
+        fprintf(body_output, "X\n");
+
+    while (pdep < include_deps + include_deps_count)
+    {
+        fprintf(body_output, "D %c %d %016llx %lu\n%s", pdep->kind, 
+                pdep->seen ? 1 : 0, (unsigned long long)pdep->hash,
+                (ULONG)u8_strlen(pdep->key), (char*)pdep->key);
+        fputc(0, body_output);
+        pdep++;
+    }
+
+    write_include_defs(body_output, 'V', vars, include_vars_base, vars_count);
+    write_include_defs(body_output, 'M', macros, include_macros_base, 
+            macros_count);
+    write_include_defs(body_output, 'L', links, 0, links_count);
+    fclose(body_output);
+
+    fprintf(output, "E %016llx %lu %016llx %lu\n%s\n", 
+            (unsigned long long)job->content_hash, (ULONG)body_len, 
+            (unsigned long long)hash_buffer(body, body_len),
+            (ULONG)strlen(job->filename), job->filename);
+    fwrite(body, 1, body_len, output);
+    free(body);
 
     return 0;
 }
 
+uint64_t
+read_include_field(uint8_t** pdata, int base)
+{
+    char* end = NULL;
+    uint64_t value = 0;
+
+    while (**pdata == ' ')
+        (*pdata)++;
+    value = strtoull((char*)*pdata, &end, base);
+    *pdata = (uint8_t*)end;
+    return value;
+}
+
 int
-begin_article(FILE* output, const BOOL add_article_header, 
-        const uint8_t* author, const uint8_t* title, 
-        const uint8_t* header_text, const char* title_heading_level, 
-        uint8_t* date, const BOOL ext_in_permalink, const char* permalink_url)
+free_include_entry(IncludeCacheEntry* entry)
 {
-    if (author || date || header_text || title)
-        print_output(output, "<header>\n");
+    if (!entry)
+        return 1;
+    free(entry->filename);
+    free(entry->data);
+    free(entry->deps);
+    free(entry->def_vars);
+    free(entry->def_macros);
+    free(entry->def_links);
+    free(entry);
+    return 0;
+}
 
-    if (title)
-        print_output(output, "<h%s>%s</h%s>\n", 
-                title_heading_level ? title_heading_level : "2", 
-                (char*)title, 
-                title_heading_level ? title_heading_level : "2");
+IncludeCacheEntry*
+parse_include_entry(uint8_t* data, size_t data_len, size_t* consumed)
+{
+    IncludeCacheEntry* entry = NULL;
+    uint8_t* pdata           = data;
+    uint8_t* filename        = NULL;
+    uint8_t* body_end        = NULL;
+    uint64_t content_hash    = 0;
+    uint64_t body_hash       = 0;
+    size_t body_len          = 0;
+    size_t filename_len      = 0;
+    BOOL malformed           = FALSE;
+
+    if (data_len < 2 || *pdata++ != 'E')
+        return NULL;
 
-    if (header_text)
-        print_output(output, "<p>%s</p>\n", (char*)header_text);
+    content_hash = read_include_field(&pdata, 16);
+    body_len = read_include_field(&pdata, 10);
+    body_hash = read_include_field(&pdata, 16);
+    filename_len = read_include_field(&pdata, 10);
+    if (*pdata++ != '\n' || pdata + filename_len + 1 + body_len > data + data_len)
+        return NULL;
 
-    if (author)
-        print_output(output, "<address>%s</address>\n", author);
+    filename = pdata;
+    pdata += filename_len;
+    if (*pdata++ != '\n' || hash_buffer(pdata, body_len) != body_hash)
+        return NULL;
+    *consumed = pdata + body_len - data;
+
+    CALLOC(entry, IncludeCacheEntry, 1)
+    CALLOC(entry->filename, char, filename_len+1)
+    memcpy(entry->filename, filename, filename_len);
+    entry->content_hash = content_hash;
+    entry->data_len = body_len;
+    CALLOC(entry->data, uint8_t, body_len+1)
+    memcpy(entry->data, pdata, body_len);
+
+    pdata = entry->data;
+    body_end = entry->data + body_len;
+    while (!malformed && pdata < body_end)
+    {
+        UBYTE kind = *pdata++;
+        size_t key_len = 0;
+        size_t value_len = 0;
+        BOOL has_value = FALSE;
+        KeyValue** defs = NULL;
+        size_t* defs_count = NULL;
+        IncludeDep* pdep = NULL;
+
+        switch (kind)
+        {
+        case 'F':
+            entry->fragment_len = read_include_field(&pdata, 10);
+            if (*pdata++ != '\n' || pdata + entry->fragment_len >= body_end)
+            {
+                malformed = TRUE;
+                break;
+            }
+            entry->fragment = pdata;
+            pdata += entry->fragment_len + 1;
+            break;
 
-    if (date && input_filename)
+        case 'X':
+            entry->is_volatile = TRUE;
+            pdata++;
+            break;
+
+        case 'D':
+            entry->deps_count++;
+            REALLOCARRAY(entry->deps, IncludeDep, entry->deps_count)
+            pdep = entry->deps + entry->deps_count - 1;
+            pdep->kind = *(pdata+1);
+            pdata += 2;
+            pdep->seen = read_include_field(&pdata, 10) ? TRUE : FALSE;
+            pdep->hash = read_include_field(&pdata, 16);
+            key_len = read_include_field(&pdata, 10);
+            if (*pdata++ != '\n' || pdata + key_len >= body_end)
+            {
+                malformed = TRUE;
+                break;
+            }
+            pdep->key = pdata;
+            pdata += key_len + 1;
+            break;
+
+        case 'V':
+        case 'M':
+        case 'L':
+            defs = kind == 'V' ? &entry->def_vars 
+                : kind == 'M' ? &entry->def_macros 
+                : &entry->def_links;
+            defs_count = kind == 'V' ? &entry->def_vars_count 
+                : kind == 'M' ? &entry->def_macros_count 
+                : &entry->def_links_count;
+            key_len = read_include_field(&pdata, 10);
+            value_len = read_include_field(&pdata, 10);
+            has_value = read_include_field(&pdata, 10) ? TRUE : FALSE;
+            if (*pdata++ != '\n' || pdata + key_len + value_len + 1 >= body_end)
+            {
+                malformed = TRUE;
+                break;
+            }
+            (*defs_count)++;
+            REALLOCARRAY(*defs, KeyValue, *defs_count)
+            (*defs + *defs_count - 1)->key = pdata;
+            pdata += key_len + 1;
+            (*defs + *defs_count - 1)->value = has_value ? pdata : NULL;
+            (*defs + *defs_count - 1)->value_size = has_value ? value_len+1 : 0;
+            (*defs + *defs_count - 1)->seen = FALSE;
+            (*defs + *defs_count - 1)->kept = FALSE;
+            pdata += value_len + 1;
+            break;
+
+        default:
+            malformed = TRUE;
+        }
+    }
+
+    if (malformed || !entry->fragment)
     {
-        char* link = strip_ext(input_filename);
-        uint8_t* samedir_permalink = get_value(vars, vars_count, 
-                (uint8_t*)"samedir-permalink", NULL);
-        char* real_link = NULL;
-        uint8_t* permalink_macro = get_value(macros, macros_count,
-                (uint8_t*)"permalink", NULL);
-        CALLOC(real_link, char, BUFSIZE)
+        free_include_entry(entry);
+        return NULL;
+    }
 
-        if (ext_in_permalink)
-            strncat(link, timestamp_output_ext, BUFSIZE-strlen(link)-1);
+    return entry;
+}
 
-        if (permalink_url)
-            process_timestamp(output, permalink_url, permalink_macro, date);
-        else if (samedir_permalink && !u8_strcmp(samedir_permalink, (uint8_t*)"1"))
+BOOL
+include_entry_valid(IncludeCacheEntry* entry)
+{
+    IncludeDep* pdep = entry->deps;
+    KeyValue* kv = NULL;
+
+    while (pdep < entry->deps + entry->deps_count)
+    {
+        switch (pdep->kind)
         {
-            get_realpath(&real_link, input_dirname, link);
-            process_timestamp(output, real_link, permalink_macro, date);
+        case 'v':
+            kv = find_keyvalue(vars, vars_count, pdep->key);
+            if ((kv ? hash_value(kv->value) : 0) != pdep->hash)
+                return FALSE;
+            break;
+        case 'm':
+            /* Includes don't see macros kept from other includes */
+            kv = find_keyvalue(macros, macros_count, pdep->key);
+            if (kv && kv->kept)
+                kv = NULL;
+            if ((kv ? hash_value(kv->value) : 0) != pdep->hash
+                    || (kv ? kv->seen : FALSE) != pdep->seen)
+                return FALSE;
+            break;
+        case 'f':
+            if (hash_file((char*)pdep->key) != pdep->hash)
+                return FALSE;
+            break;
+        default:
+            return FALSE;
         }
-        else
-            process_timestamp(output, link, permalink_macro, date);
-
-        free(real_link);
-        free(link);
+        pdep++;
     }
+    return TRUE;
+}
 
-    if (author || date || header_text || title)
-        print_output(output, "</header>\n");
+int
+record_include_entry_deps(IncludeCacheEntry* entry)
+{
+    IncludeDep* pdep = entry->deps;
+
+    if (!include_recording)
+        return 0;
 
+    /* A nested include makes the enclosing one depend on the same things */
+    while (pdep < entry->deps + entry->deps_count)
+    {
+        record_include_dep(pdep->kind, pdep->key, pdep->hash);
+        pdep++;
+    }
+    if (entry->is_volatile)
+        include_volatile = TRUE;
     return 0;
 }
 
+char*
+get_include_cache_filename(IncludeJob* job)
+{
+    char* cache_filename = NULL;
+    uint64_t key = hash_buffer((uint8_t*)job->filename, strlen(job->filename))
+        ^ job->content_hash;
+
+    CALLOC(cache_filename, char, strlen(include_cache_dir) + KEYSIZE)
+    sprintf(cache_filename, "%s/%016llx.inc", include_cache_dir, 
+            (unsigned long long)key);
+    return cache_filename;
+}
+
 int
-end_footnotes(FILE* output, BOOL add_footnote_div)
+add_include_entry(IncludeCacheEntry* entry)
 {
-    size_t footnote = 0;
+    include_cache_count++;
+    REALLOCARRAY(include_cache, IncludeCacheEntry*, include_cache_count)
+    *(include_cache + include_cache_count - 1) = entry;
+    return 0;
+}
 
-    if (state & ST_PARA_OPEN)
+IncludeCacheEntry*
+find_include_entry(IncludeJob* job)
+{
+    IncludeCacheEntry** pentry = include_cache;
+    IncludeCacheEntry* found   = NULL;
+    char* cache_filename       = NULL;
+    char* cache_dirname        = NULL;
+    uint8_t* data              = NULL;
+    uint8_t* pdata             = NULL;
+    size_t data_size           = 0;
+    size_t magic_len           = 0;
+    FILE* input                = NULL;
+    char magic[KEYSIZE];
+
+    while (pentry < include_cache + include_cache_count)
     {
-        print_output(output, "</p>\n");
-        state &= ~ST_PARA_OPEN;
+        if (!(*pentry)->is_volatile
+                && (*pentry)->content_hash == job->content_hash
+                && !strcmp((*pentry)->filename, job->filename)
+                && include_entry_valid(*pentry))
+            return *pentry;
+        pentry++;
     }
 
-    if (add_footnote_div)
-        print_output(output, "<div class=\"footnotes\">\n");
+    if (!include_cache_dir)
+        return NULL;
 
-    process_horizontal_rule(output);
+    cache_filename = get_include_cache_filename(job);
+    if (access(cache_filename, R_OK) 
+            || read_file_into_buffer(&data, &data_size, cache_filename,
+                &cache_dirname, &input))
+    {
+        free(cache_filename);
+        return NULL;
+    }
 
-    for (footnote = 0; footnote < inline_footnote_count; footnote++)
-        print_output(output, "<p id=\"inline-footnote-%d\">"
-                "<a href=\"#inline-footnote-text-%d\">%d.</a> %s</p>\n",
-                footnote+1, footnote+1, footnote+1,
-                (char*)inline_footnotes[footnote]);
+    snprintf(magic, KEYSIZE, "%s %d\n", INCLUDE_CACHE_MAGIC, 
+            INCLUDE_CACHE_VERSION);
+    magic_len = strlen(magic);
+    if (data_size-1 < magic_len || memcmp(data, magic, magic_len))
+        unlink(cache_filename);
+    else
+    {
+        pdata = data + magic_len;
+        while (pdata < data + data_size - 1)
+        {
+            size_t consumed = 0;
+            IncludeCacheEntry* entry = parse_include_entry(pdata, 
+                    data + data_size - 1 - pdata, &consumed);
+            if (!entry)
+                break;
+            pdata += consumed;
 
-    KeyValue* pfootnote = footnotes;
-    footnote = 0;
-    while (pfootnote && footnote < footnote_count)
+            if (entry->content_hash != job->content_hash
+                    || strcmp(entry->filename, job->filename))
+            {
+                free_include_entry(entry);
+                continue;
+            }
+            add_include_entry(entry);
+            if (!found && include_entry_valid(entry))
+                found = entry;
+        }
+    }
+
+    free(cache_dirname);
+    free(cache_filename);
+    free(data);
+    return found;
+}
+
+int
+store_include_entry(IncludeJob* job, IncludeCacheEntry* entry, 
+        uint8_t* serialized, size_t serialized_len)
+{
+    char* cache_filename = NULL;
+    struct stat fs;
+    int fd = -1;
+
+    add_include_entry(entry);
+
+    if (!include_cache_dir)
+        return 0;
+
+    cache_filename = get_include_cache_filename(job);
+    fd = open(cache_filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
     {
-        print_output(output, "<p id=\"footnote-%d\">"
-                "<a href=\"#footnote-text-%d\">%d.</a> %s</p>\n",
-                footnote+1, footnote+1, footnote+1,
-                (char*)pfootnote->value);
-        pfootnote++;
-        footnote++;
+        warning(1, (uint8_t*)"include: Cannot write cache file '%s'", 
+                cache_filename);
+        free(cache_filename);
+        return 1;
     }
 
-    if (add_footnote_div)
-        print_output(output, "</div><!--footnotes-->\n");
+    if (!fstat(fd, &fs) && fs.st_size == 0)
+        dprintf(fd, "%s %d\n", INCLUDE_CACHE_MAGIC, INCLUDE_CACHE_VERSION);
+    /* A single append keeps concurrent builds from interleaving entries */
+    if (write(fd, serialized, serialized_len) != (ssize_t)serialized_len)
+        warning(1, (uint8_t*)"include: Cannot write cache file '%s'", 
+                cache_filename);
 
+    close(fd);
+    free(cache_filename);
     return 0;
 }
 
 int
-end_body_and_html(FILE* output)
+drop_kept_macros()
 {
-    print_output(output, "</body>\n</html>\n");
+    KeyValue* pmacro = macros;
+    KeyValue* pkept  = macros;
+
+    /* Macros kept from an include belong to the including file alone */
+    while (pmacro < macros + macros_count)
+    {
+        if (pmacro->kept)
+            free(pmacro->key);
+        else
+            *pkept++ = *pmacro;
+        pmacro++;
+    }
+    macros_count = pkept - macros;
     return 0;
 }
 
 int
-slweb_parse(uint8_t* buffer, FILE* output, BOOL body_only, 
-        BOOL read_yaml_macros_and_links)
+render_include(FILE* output, void* arg)
 {
-    uint8_t* title                     = NULL;
-    uint8_t* title_heading_level       = NULL;
-    uint8_t* header_text               = NULL;
-    uint8_t* author                    = NULL;
-    uint8_t* date                      = NULL;
-    uint8_t* permalink_url             = NULL;
-    uint8_t* ext_in_permalink          = NULL;
-    uint8_t* var_add_article_header    = NULL;
-    uint8_t* var_add_image_links       = NULL;
-    uint8_t* var_add_figcaption        = NULL;
-    uint8_t* var_add_footnote_div      = NULL;
-    uint8_t* pbuffer                   = NULL;
-    uint8_t* line                      = NULL;
-    uint8_t* pline                     = NULL;
-    size_t line_len                    = 0;
-    uint8_t* token                     = NULL;
-    uint8_t* ptoken                    = NULL;
-    size_t token_size                  = 0;
-    uint8_t* link_text                 = NULL;
-    size_t link_size                   = 0;
-    uint8_t* link_macro                = NULL;
-    UBYTE heading_level                = 0;
-    BOOL end_tag                       = FALSE;
-    BOOL first_line_in_doc             = TRUE;
-    BOOL skip_change_first_line_in_doc = FALSE;
-    BOOL skip_eol                      = FALSE;
-    BOOL keep_token                    = FALSE;
-    BOOL previous_line_blank           = FALSE;
-    BOOL processed_start_of_line       = FALSE;
-    BOOL add_image_links               = TRUE;
-    BOOL add_figcaption                = TRUE;
-    BOOL add_footnote_div              = FALSE;
-    BOOL list_para                     = FALSE;
-    BOOL footnote_at_line_start        = FALSE;
-    size_t pline_len                   = 0;
+    IncludeJob* job       = (IncludeJob*)arg;
+    uint8_t* fragment     = NULL;
+    size_t fragment_len   = 0;
+    FILE* fragment_output = NULL;
+    int result            = 0;
+
+    set_basedir(job->basedir, &basedir, &basedir_size);
+    input_filename = job->filename;
+    free(input_dirname);
+    input_dirname = strdup(job->dirname);
+
+    init_links_and_footnotes();
+    drop_kept_macros();
+    state = ST_NONE;
 
-    if (!buffer)
-        exit(error(1, (uint8_t*)"Empty buffer"));
+    /* Track what the include reads from its parent's definitions */
+    free(include_deps);
+    include_deps = NULL;
+    include_deps_count = 0;
+    include_vars_base = vars_count;
+    include_macros_base = macros_count;
+    include_recording = TRUE;
+    include_volatile = FALSE;
+    if (site_defs_filename)
+        record_include_dep('f', (uint8_t*)site_defs_filename, site_defs_hash);
+
+    fragment_output = open_memstream((char**)&fragment, &fragment_len);
+    if (!fragment_output)
+        exit(error(errno, (uint8_t*)"include: Cannot open memory stream"));
 
-    if (!vars)
-        exit(error(EINVAL, (uint8_t*)"Invalid argument (vars)"));
+    /* First pass: read YAML, macros and links */
+    result = slweb_parse(job->buffer, fragment_output, TRUE, TRUE);
 
-    if (!links)
-        exit(error(EINVAL, (uint8_t*)"Invalid argument (links)"));
+    if (!result)
+    {
+        state = ST_NONE;
+        current_footnote = 0;
+        current_inline_footnote = 0;
 
-    if (!macros)
-        exit(error(EINVAL, (uint8_t*)"Invalid argument (macros)"));
+        /* Second pass: parse and output */
+        result = slweb_parse(job->buffer, fragment_output, TRUE, FALSE);
+    }
+    fclose(fragment_output);
 
-    title                  = get_value(vars, vars_count, (uint8_t*)"title", NULL);
-    title_heading_level    = get_value(vars, vars_count,
-            (uint8_t*)"title-heading-level", NULL);
-    header_text            = get_value(vars, vars_count, (uint8_t*)"header-text", NULL);
-    author                 = get_value(vars, vars_count, (uint8_t*)"author", NULL);
-    date                   = get_value(vars, vars_count, (uint8_t*)"date", NULL);
-    permalink_url          = get_value(vars, vars_count, (uint8_t*)"permalink-url", NULL);
-    ext_in_permalink       = get_value(vars, vars_count, (uint8_t*)"ext-in-permalink", NULL);
-    var_add_article_header = get_value(vars, vars_count, (uint8_t*)"add-article-header", NULL);
-    var_add_image_links    = get_value(vars, vars_count, (uint8_t*)"add-image-links", NULL);
-    add_image_links        = !(var_add_image_links && *var_add_image_links == '0');
-    var_add_figcaption     = get_value(vars, vars_count, (uint8_t*)"add-figcaption", NULL);
-    add_figcaption         = !(var_add_figcaption && *var_add_figcaption == '0');
-    var_add_footnote_div   = get_value(vars, vars_count, (uint8_t*)"add-footnote-div", NULL);
-    add_footnote_div       = var_add_footnote_div && *var_add_footnote_div == '1';
-
-    CALLOC(line, uint8_t, BUFSIZE)
-    token_size = BUFSIZE;
-    CALLOC(token, uint8_t, BUFSIZE)
-    CALLOC(link_macro, uint8_t, BUFSIZE)
+    if (!result)
+        write_include_entry(output, job, fragment, fragment_len);
 
-    pbuffer = buffer;
-    pvars = vars;
-    plinks = links;
-    pmacros = macros;
-    pfootnotes = footnotes;
-    lineno = 0;
+    free(fragment);
+    return result;
+}
 
-    if (!read_yaml_macros_and_links && !body_only)
+BOOL
+keeps_macros(const uint8_t* buffer)
+{
+    const uint8_t* pbuffer = buffer;
+    const uint8_t* eol     = NULL;
+    size_t key_len         = strlen("keep-macros");
+
+    /* Variables can only be set in the front matter */
+    if (u8_strncmp(pbuffer, (uint8_t*)"---", 3) 
+            || !(eol = u8_strchr(pbuffer, (ucs4_t)'\n')))
+        return FALSE;
+
+    pbuffer = eol + 1;
+    while ((eol = u8_strchr(pbuffer, (ucs4_t)'\n')) 
+            && u8_strncmp(pbuffer, (uint8_t*)"---", 3))
     {
-        begin_html_and_head(output);
-        add_css(output);
-        end_head_start_body(output);
+        if (!u8_strncmp(pbuffer, (uint8_t*)"keep-macros", key_len)
+                && *(pbuffer + key_len) == ':')
+        {
+            pbuffer += key_len + 1;
+            while (*pbuffer == ' ' || *pbuffer == '\t')
+                pbuffer++;
+            return *pbuffer != '0';
+        }
+        pbuffer = eol + 1;
     }
+    return FALSE;
+}
 
-    begin_article(output, 
-            var_add_article_header && *var_add_article_header == '1',
-            author, title, header_text, (char*)title_heading_level, date, 
-            ext_in_permalink && *ext_in_permalink != '0', 
-            (char*)permalink_url);
+IncludeCacheEntry*
+get_include_entry(uint8_t* token, BOOL keeping_macros)
+{
+    uint8_t* ptoken           = u8_strchr(token, (ucs4_t)' ');
+    char* include_filename    = NULL;
+    char* pinclude_filename   = NULL;
+    IncludeJob job;
+    IncludeCacheEntry* entry  = NULL;
+    FILE* input               = NULL;
+    size_t buffer_size        = 0;
+    uint8_t* serialized       = NULL;
+    size_t serialized_len     = 0;
+    size_t consumed           = 0;
+    
+    if (!ptoken)
+        exit(error(1, (uint8_t*)"Directive 'include' requires"
+                " an argument"));
+
+    CALLOC(include_filename, char, BUFSIZE)
+    pinclude_filename = include_filename;
+    ptoken++;
+    while (ptoken && *ptoken)
+        if (*ptoken != '"')
+            *pinclude_filename++ = *ptoken++;
+        else 
+            ptoken++;
 
-    RESET_TOKEN(token, ptoken, token_size)
+    memset(&job, 0, sizeof(job));
+    job.basedir = !strcmp(basedir, ".") ? input_dirname : basedir;
+    CALLOC(job.filename, char, BUFSIZE)
+    snprintf(job.filename, BUFSIZE, "%s/%s.slw", job.basedir, include_filename);
+    free(include_filename);
 
-    do
+    if (read_file_into_buffer(&job.buffer, &buffer_size, job.filename, 
+                &job.dirname, &input))
     {
-        uint8_t* eol = u8_strchr(pbuffer, (ucs4_t)'\n');
-        if (!eol)
-            break;
+        free(job.filename);
+        return NULL;
+    }
 
-        pline = line;
-        while (pbuffer != eol)
-            *pline++ = *pbuffer++;
-        pbuffer++;
-        *pline = 0;
-        pline = line;
-        line_len = u8_strlen(line);
+    /* Only includes keeping their macros are needed while reading 
+     * definitions */
+    if (keeping_macros && !keeps_macros(job.buffer))
+    {
+        free(job.buffer);
+        free(job.dirname);
+        free(job.filename);
+        return NULL;
+    }
 
-        lineno++;
-        colno = 1;
-        processed_start_of_line = FALSE;
-        skip_eol = FALSE;
-        /*list_item = FALSE;*/
-        list_para = FALSE;
+    job.content_hash = hash_buffer(job.buffer, buffer_size-1);
+    record_include_dep('f', (uint8_t*)job.filename, job.content_hash | 1);
 
-        while (pline && *pline)
+    /* Replay an earlier rendering of the same file in the same context */
+    entry = find_include_entry(&job);
+    if (!entry)
+    {
+        if (!capture_child_output(&render_include, &job, &serialized,
+                    &serialized_len)
+                && (entry = parse_include_entry(serialized, serialized_len,
+                        &consumed)))
         {
-            switch (*pline)
-            {
-            case '-':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_MACRO_BODY | ST_PRE | ST_YAML_VAL))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                }
-                else if (colno == 1 
-                        && u8_strlen(pline) > 2
-                        && startswith((char*)pline, "---"))
-                {
-                    skip_eol = TRUE;
+            if (!entry->is_volatile)
+                store_include_entry(&job, entry, serialized, consumed);
+        }
+        else
+            warning(1, (uint8_t*)"include: Cannot process '%s'", job.filename);
+        free(serialized);
+    }
 
-                    if (!(state & ST_YAML) && lineno > 1
-                            && !read_yaml_macros_and_links)
-                        process_horizontal_rule(output);
-                    else
-                    {
-                        if (lineno == 1)
-                            state |= ST_YAML;
-                        else
-                            state &= ~ST_YAML;
+    if (entry)
+        record_include_entry_deps(entry);
 
-                        skip_change_first_line_in_doc = TRUE;
-                    }
-                    pline = NULL;
-                }
-                else if (colno == 1 
-                        && u8_strlen(pline) > 1
-                        && *(pline+1) == ' ')
-                {
-                    if (state & ST_NUMLIST)
-                    {
-                        state &= ~ST_NUMLIST;
-                        if (!read_yaml_macros_and_links)
-                        {
-                            process_list_item_end(output);
-                            process_numlist_end(output);
-                        }
-                    }
-                    if (!read_yaml_macros_and_links)
-                    {
-                        if (!(state & ST_LIST))
-                            process_list_start(output);
-                        else
-                            process_list_item_end(output);
-                        process_list_item_start(output);
-                    }
+    free(job.buffer);
+    free(job.dirname);
+    free(job.filename);
 
-                    processed_start_of_line = TRUE;
-                    skip_eol = FALSE;
+    return entry;
+}
 
-                    state |= ST_LIST;
+int
+process_include(uint8_t* token, FILE* output)
+{
+    IncludeCacheEntry* entry = NULL;
 
-                    pline += 2;
-                    colno += 2;
-                }
-                else
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                }
-                break;
+    if (!input_filename)
+        return warning(1, (uint8_t*)"Cannot use 'include' in stdin");
 
-            case ':':
-                if (state & ST_YAML
-                        && !(ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                                | ST_HEADING | ST_IMAGE | ST_MACRO_BODY 
-                                | ST_PRE | ST_TAG | ST_YAML_VAL))
-                        && read_yaml_macros_and_links)
-                {
-                    *ptoken = 0;
+    if (!(entry = get_include_entry(token, FALSE)))
+        return 1;
 
-                    vars_count++;
+    write_output(output, entry->fragment, entry->fragment_len);
+    if (entry->is_volatile)
+        free_include_entry(entry);
 
-                    if (vars_count > 1)
-                    {
-                        REALLOCARRAY(vars, KeyValue, vars_count)
-                        pvars = vars + vars_count - 1;
-                    }
-                    CALLOC(pvars->key, uint8_t, KEYSIZE)
-                    u8_strncpy(pvars->key, token, KEYSIZE-1);
-                    pvars->value = NULL;
-                    pvars->value_size = 0;
+    return 0;
+}
 
-                    state |= ST_YAML_VAL;
-                    RESET_TOKEN(token, ptoken, token_size)
-                    pline++;
-                    colno++;
+int
+keep_include_macros(uint8_t* token)
+{
+    IncludeCacheEntry* entry = NULL;
+    KeyValue* pdef           = NULL;
+    KeyValue* pmacro         = NULL;
 
-                    while (pline && (*pline == ' ' || *pline == '\t'))
-                    {
-                        pline++;
-                        colno++;
-                    }
-                }
-                else {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                }
-                break;
+    if (!input_filename)
+        return 0;
 
-            case '`':
-                if (ANY(state, ST_DISPLAY_FORMULA | ST_FORMULA | ST_IMAGE 
-                            | ST_MACRO_BODY))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+    if (!(entry = get_include_entry(token, TRUE)))
+        return 0;
 
-                if (colno == 1 
-                        && u8_strlen(pline) > 2
-                        && startswith((char*)pline, "```"))
-                {
-                    state ^= ST_PRE;
-                    
-                    if (!read_yaml_macros_and_links)
-                    {
-                        if (state & ST_PRE)
-                            print_output(output, "<pre>");
-                        else
-                            print_output(output, "</pre>");
-                    }
+    /* The bodies stay in the cache entry and are shared, not copied */
+    for (pdef = entry->def_macros; 
+            pdef < entry->def_macros + entry->def_macros_count; pdef++)
+    {
+        if (find_keyvalue(macros, macros_count, pdef->key))
+            continue;
 
-                    /* Skip the rest of the line (language) */
-                    pline = NULL;
-                }
-                else if (!ANY(state, ST_PRE | ST_TAG | ST_YAML))
-                {
-                    /* Handle ` within footnotes, headings and link text specially */
-                    if (ANY(state, ST_INLINE_FOOTNOTE | ST_HEADING 
-                                | ST_FOOTNOTE_TEXT | ST_LINK))
-                    {
-                        uint8_t* tag = state & ST_CODE
-                                ? (uint8_t*)"</code>"
-                                : (uint8_t*)"<code>";
-                        size_t tag_len = u8_strlen(tag);
-                        size_t token_len = 0;
+        macros_count++;
+        if (macros_count > 1)
+            REALLOCARRAY(macros, KeyValue, macros_count)
+        pmacro = macros + macros_count - 1;
+        CALLOC(pmacro->key, uint8_t, KEYSIZE)
+        u8_strncpy(pmacro->key, pdef->key, KEYSIZE-1);
+        pmacro->value = pdef->value;
+        pmacro->value_size = pdef->value_size;
+        pmacro->seen = TRUE;
+        pmacro->kept = TRUE;
+        macros_kept = TRUE;
+    }
 
-                        *ptoken = 0;
-                        token_len = u8_strlen(token);
+    /* Never reused, but kept alive for the macros which point into it */
+    if (entry->is_volatile)
+        add_include_entry(entry);
 
-                        if (token_len + tag_len < BUFSIZE)
-                        {
-                            u8_strncat(token, tag, BUFSIZE-token_len-1);
-                            ptoken += tag_len;
-                        }
-                    }
-                    else
-                    {
-                        /* Output existing text up to ` */
-                        process_text_token(line, first_line_in_doc,
-                                previous_line_blank,
-                                processed_start_of_line,
-                                read_yaml_macros_and_links,
-                                list_para, output, &token, &ptoken, 
-                                &token_size, TRUE);
-                        processed_start_of_line = TRUE;
+    return 0;
+}
 
-                        if (!read_yaml_macros_and_links 
-                                && !(ANY(state, ST_PRE | ST_HEADING)))
-                            process_code(output, state & ST_CODE);
-                    }
+int
+process_list_start(FILE* output)
+{
+    print_html(output, "<ul>");
+    return 0;
+}
 
-                    state ^= ST_CODE;
+int
+process_list_item_start(ParsedDoc* doc)
+{
+    add_node(doc, NODE_LIST_ITEM_START, 0);
+    state |= ST_PARA_OPEN;
+    return 0;
+}
 
-                    pline++;
-                    colno++;
-                }
-                else
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                }
-                break;
+int
+process_list_item_end(ParsedDoc* doc)
+{
+    add_node(doc, NODE_LIST_ITEM_END, 
+            state & ST_PARA_OPEN ? NODE_FLAG_PARA_OPEN : 0);
+    state &= ~ST_PARA_OPEN;
+    return 0;
+}
 
-            case '#':
-                if (colno == 1
-                        && !(ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                                | ST_MACRO_BODY | ST_PRE | ST_YAML)))
-                {
-                    if (state & ST_LIST)
-                    {
-                        state &= ~ST_LIST;
-                        if (!read_yaml_macros_and_links)
-                        {
-                            process_list_item_end(output);
-                            process_list_end(output);
-                        }
-                    }
+int
+print_list_item_start(FILE* output)
+{
+    print_html(output, "\n<li><p>");
+    return 0;
+}
 
-                    if (state & ST_NUMLIST)
-                    {
-                        state &= ~ST_NUMLIST;
-                        if (!read_yaml_macros_and_links)
-                        {
-                            process_list_item_end(output);
-                            process_numlist_end(output);
-                        }
-                    }
+int
+print_list_item_end(FILE* output, BOOL para_open)
+{
+    if (para_open)
+        print_html(output, "</p>");
+    print_html(output, "</li>");
+    return 0;
+}
 
-                    state |= ST_HEADING;
-                    heading_level = 1;
-                    pline++;
-                    colno++;
-                }
-                else if (state & ST_HEADING && *(pline-1) == '#')
-                {
-                    if (heading_level < MAX_HEADING_LEVEL)
-                        heading_level++;
-                    pline++;
-                    colno++;
-                }
-                else 
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                }
-                break;
+int
+process_list_end(FILE* output)
+{
+    print_html(output, "</ul>\n");
+    return 0;
+}
 
-            case '_':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_HTML_TAG | ST_IMAGE | ST_LINK_SECOND_ARG 
-                            | ST_MACRO_BODY | ST_PRE | ST_TAG | ST_YAML))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+int
+process_numlist_start(FILE* output)
+{
+    print_html(output, "<ol>");
+    return 0;
+}
 
-                if (u8_strlen(pline) > 1 && *(pline+1) == '_')
-                {
-                    /* Handle __ within footnotes, headings and link text specially */
-                    if (ANY(state, ST_INLINE_FOOTNOTE | ST_HEADING 
-                                | ST_FOOTNOTE_TEXT | ST_LINK))
-                    {
-                        uint8_t* tag = state & ST_BOLD
-                                ? (uint8_t*)"</strong>"
-                                : (uint8_t*)"<strong>";
-                        size_t tag_len = u8_strlen(tag);
-                        size_t token_len = 0;
+int
+process_numlist_end(FILE* output)
+{
+    print_html(output, "</ol>\n");
+    return 0;
+}
 
-                        *ptoken = 0;
-                        token_len = u8_strlen(token);
+int
+filter_subdirs(const struct dirent* node)
+{
+    if (!node || !strcmp(node->d_name, ".") || !strcmp(node->d_name, ".."))
+        return 0;
 
-                        if (token_len + tag_len < BUFSIZE)
-                        {
-                            u8_strncat(token, tag, BUFSIZE-token_len-1);
-                            ptoken += tag_len;
-                        }
-                    }
-                    else
-                    {
-                        /* Output existing text up to __ */
-                        process_text_token(line, first_line_in_doc,
-                                previous_line_blank,
-                                processed_start_of_line,
-                                read_yaml_macros_and_links,
-                                list_para, output, &token, &ptoken, 
-                                &token_size, TRUE);
-                        processed_start_of_line = TRUE;
+    struct stat st;
+    char* nodename = NULL;
+    
+    CALLOC(nodename, char, BUFSIZE)
+    snprintf(nodename, BUFSIZE, "%s/%s", incdir, node->d_name);
+    
+    if (lstat(nodename, &st) < 0 || !S_ISDIR(st.st_mode))
+    {
+        free(nodename);
+        return 0;
+    }
 
-                        if (!read_yaml_macros_and_links 
-                                && !(ANY(state, ST_PRE | ST_CODE | ST_HEADING)))
-                            process_bold(output, state & ST_BOLD);
-                    }
+    free(nodename);
 
-                    state ^= ST_BOLD;
-                    pline += 2;
-                    colno += 2;
-                }
-                else
-                {
-                    /* Handle _ within footnotes, headings and link text specially */
-                    if (ANY(state, ST_INLINE_FOOTNOTE | ST_HEADING 
-                                | ST_FOOTNOTE_TEXT | ST_LINK))
-                    {
-                        uint8_t* tag = state & ST_ITALIC
-                                ? (uint8_t*)"</em>"
-                                : (uint8_t*)"<em>";
-                        size_t tag_len = u8_strlen(tag);
-                        size_t token_len = 0;
+    return 1;
+}
 
-                        *ptoken = 0;
-                        token_len = u8_strlen(token);
+int
+filter_slw(const struct dirent* node)
+{
+    if (!node || !strcmp(node->d_name, ".") || !strcmp(node->d_name, ".."))
+        return 0;
 
-                        if (token_len + tag_len < BUFSIZE)
-                        {
-                            u8_strncat(token, tag, BUFSIZE-token_len-1);
-                            ptoken += tag_len;
-                        }
-                    }
-                    else
-                    {
-                        /* Output existing text up to _ */
-                        process_text_token(line, first_line_in_doc,
-                                previous_line_blank,
-                                processed_start_of_line,
-                                read_yaml_macros_and_links,
-                                list_para, output, &token, &ptoken, 
-                                &token_size, TRUE);
-                        processed_start_of_line = TRUE;
+    size_t node_len = strlen(node->d_name);
+    size_t slw_len  = strlen(".slw");
 
-                        if (!read_yaml_macros_and_links 
-                                && !(ANY(state, ST_PRE | ST_CODE | ST_HEADING)))
-                            process_italic(output, state & ST_ITALIC);
-                    }
+    if (slw_len >= node_len)
+        return 0;
+    return !strcmp(node->d_name + strlen(node->d_name) - slw_len, ".slw");
+}
 
-                    state ^= ST_ITALIC;
-                    pline++;
-                    colno++;
-                }
-                break;
+int 
+reverse_alphacompare(const struct dirent** a, const struct dirent** b)
+{
+    if (!a || !b)
+        return 0;
 
-            case '*':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_HTML_TAG | ST_IMAGE | ST_MACRO_BODY | ST_PRE 
-                            | ST_YAML))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+    return -1 * strcmp((*a)->d_name, (*b)->d_name); 
+}
 
-                pline_len = u8_strlen(pline);
-                if (colno == 1
-                        && pline_len > 1 && *(pline+1) == '[')
-                {
-                    process_line_start(line, first_line_in_doc,
-                            previous_line_blank, read_yaml_macros_and_links, 
-                            list_para, output, &token, &ptoken);
+/* Renders a page listed by incdir, body only */
+int
+render_incdir_page(FILE* output, uint8_t* buffer)
+{
+    int result = 0;
 
-                    /* Ignore abbreviations (for now) */
-                    pline = NULL;
-                }
-                else if (colno == 1
-                        && pline_len > 2 && startswith((char*)pline, "***"))
-                {
-                    skip_eol = TRUE;
-                    if (!read_yaml_macros_and_links)
-                        process_horizontal_rule(output);
-                    pline = NULL;
-                }
-                else if (pline_len > 1 && *(pline+1) == '*')
-                {
-                    /* Handle ** within footnotes, headings and link text specially */
-                    if (ANY(state, ST_INLINE_FOOTNOTE | ST_HEADING 
-                                | ST_FOOTNOTE_TEXT | ST_LINK))
-                    {
-                        uint8_t* tag = state & ST_BOLD
-                                ? (uint8_t*)"</strong>"
-                                : (uint8_t*)"<strong>";
-                        size_t tag_len = u8_strlen(tag);
-                        size_t token_len = 0;
+    set_basedir(input_dirname, &basedir, &basedir_size);
 
-                        *ptoken = 0;
-                        token_len = u8_strlen(token);
+    init_links_and_footnotes();
+    drop_kept_macros();
+    state = ST_NONE;
 
-                        if (token_len + tag_len < BUFSIZE)
-                        {
-                            u8_strncat(token, tag, BUFSIZE-token_len-1);
-                            ptoken += tag_len;
-                        }
-                    }
-                    else
-                    {
-                        /* Output existing text up to * */
-                        process_text_token(line, first_line_in_doc,
-                                previous_line_blank,
-                                processed_start_of_line,
-                                read_yaml_macros_and_links,
-                                list_para, output, &token, &ptoken, 
-                                &token_size, TRUE);
-                        processed_start_of_line = TRUE;
+    /* First pass: read YAML, macros and links */
+    result = slweb_parse(buffer, output, TRUE, TRUE);
 
-                        if (!read_yaml_macros_and_links 
-                                && !(ANY(state, ST_PRE | ST_CODE | ST_HEADING)))
-                            process_bold(output, state & ST_BOLD);
-                    }
+    if (!result)
+    {
+        state = ST_NONE;
+        current_footnote = 0;
+        current_inline_footnote = 0;
 
-                    state ^= ST_BOLD;
-                    pline += 2;
-                    colno += 2;
-                }
-                else
-                {
-                    /* Handle * within footnotes, headings and link text specially */
-                    if (ANY(state, ST_INLINE_FOOTNOTE | ST_HEADING 
-                                | ST_FOOTNOTE_TEXT | ST_LINK))
- 
-                    {
-                        uint8_t* tag = state & ST_ITALIC
-                                ? (uint8_t*)"</em>"
-                                : (uint8_t*)"<em>";
-                        size_t tag_len = u8_strlen(tag);
-                        size_t token_len = 0;
+        /* Second pass: parse and output */
+        result = slweb_parse(buffer, output, TRUE, FALSE);
+    }
 
-                        *ptoken = 0;
-                        token_len = u8_strlen(token);
+    fflush(output);
+    return result;
+}
 
-                        if (token_len + tag_len < BUFSIZE)
-                        {
-                            u8_strncat(token, tag, BUFSIZE-token_len-1);
-                            ptoken += tag_len;
-                        }
-                    }
-                    else
-                    {
-                        /* Output existing text up to * */
-                        process_text_token(line, first_line_in_doc,
-                                previous_line_blank,
-                                processed_start_of_line,
-                                read_yaml_macros_and_links,
-                                list_para, output, &token, &ptoken, 
-                                &token_size, TRUE);
-                        processed_start_of_line = TRUE;
+int
+render_incdir_entry(FILE* output, void* arg)
+{
+    FILE* input        = NULL;
+    uint8_t* buffer    = NULL;
+    size_t buffer_size = 0;
+    int result         = 0;
 
-                        if (!read_yaml_macros_and_links 
-                                && !(ANY(state, ST_PRE | ST_CODE | ST_HEADING)))
-                            process_italic(output, state & ST_ITALIC);
-                    }
+    input_filename = (char*)arg;
+    read_file_into_buffer(&buffer, &buffer_size, input_filename, 
+            &input_dirname, &input);
 
-                    state ^= ST_ITALIC;
-                    pline++;
-                    colno++;
-                }
-                break;
+    result = render_incdir_page(output, buffer);
 
-            case ' ':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_IMAGE | ST_MACRO_BODY | ST_PRE | ST_YAML_VAL))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+    free(buffer);
+    return result;
+}
 
-                if ((state & ST_HEADING) && !(state & ST_HEADING_TEXT))
-                {
-                    if (!read_yaml_macros_and_links)
-                        process_heading_start(output, heading_level);
-                    state |= ST_HEADING_TEXT;
-                    pline++;
-                    colno++;
-                    break;
-                }
+/* Renders the front matter and the first paragraph; the rest isn't read */
+int
+render_incdir_summary(FILE* output, void* arg)
+{
+    FILE* input      = NULL;
+    StrBuf summary   = { NULL, 0, 0 };
+    char* line       = NULL;
+    size_t line_size = 0;
+    ssize_t line_len = 0;
+    BOOL in_yaml     = FALSE;
+    BOOL in_para     = FALSE;
+    int result       = 0;
+
+    input_filename = (char*)arg;
+    if ((result = open_input(input_filename, &input_dirname, &input)))
+        return result;
 
-                if (colno == 1
-                        && u8_strlen(pline) > 1
-                        && startswith((char*)pline, "    "))
-                {
-                    list_para = TRUE;
-                    process_text_token(line, first_line_in_doc,
-                            previous_line_blank,
-                            processed_start_of_line,
-                            read_yaml_macros_and_links,
-                            list_para, output, &token, &ptoken, 
-                            &token_size, TRUE);
-                    processed_start_of_line = TRUE;
-                    pline += 4;
-                    colno += 4;
-                    break;
-                }
+    while ((line_len = getline(&line, &line_size, input)) > 0)
+    {
+        BOOL blank = strspn(line, " \t\r\n") == (size_t)line_len;
 
-                if (u8_strlen(pline) == 2
-                        && *(pline+1) == ' ')
-                {
-                    *ptoken = 0;
-                    u8_strncat(ptoken, (uint8_t*)"<br />", 
-                            BUFSIZE-u8_strlen(token)-1);
-                    ptoken += strlen("<br />");
-                    pline++;
-                    colno++;
-                }
-                else if (state & ST_LINK_MACRO)
-                {
-                    *ptoken = 0;
-                    u8_strncpy(link_macro, token, BUFSIZE-1);
-                    *(link_macro + u8_strlen(token)) = 0;
-                    RESET_TOKEN(token, ptoken, token_size)
-                    state &= ~ST_LINK_MACRO;
-                }
-                else if (!(state & ST_HEADING
-                        && *(pline-1) == '#'))
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                colno++;
-                break;
+        if (startswith(line, "---") && (!summary.len || in_yaml))
+            in_yaml = !in_yaml;
+        else if (!in_yaml && blank && in_para)
+            break;
+        else if (!in_yaml && !blank)
+            in_para = TRUE;
+        strbuf_append(&summary, (uint8_t*)line, line_len);
+    }
+    free(line);
+    fclose(input);
 
-            case '{':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_HTML_TAG | ST_PRE | ST_YAML | ST_YAML_VAL))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+    strbuf_reserve(&summary, 0);
+    result = render_incdir_page(output, summary.text);
 
-                if (state & ST_MACRO_BODY)
-                {
-                    *ptoken = 0;
-                    size_t token_len = u8_strlen(token);
+    free_strbuf(&summary);
+    return result;
+}
 
-                    skip_eol = TRUE;
-                    if (read_yaml_macros_and_links)
-                    {
-                        if (pmacros->value)
-                        {
-                            size_t value_len = u8_strlen(pmacros->value);
+char*
+publish_asset(const uint8_t* data, size_t len, const char* ext);
 
-                            if (pmacros->value_size < value_len + token_len + 1)
-                            {
-                                pmacros->value_size += token_len;
-                                REALLOC(pmacros->value, uint8_t, pmacros->value_size)
-                            }
-                            u8_strncat(pmacros->value, token, pmacros->value_size-1);
-                        }
-                        else
-                        {
-                            pmacros->value_size = token_len+1;
-                            CALLOC(pmacros->value, uint8_t, pmacros->value_size)
-                            u8_strncpy(pmacros->value, token, pmacros->value_size-1);
-                        }
-                    }
-                }
-                else
-                {
-                    /* Output existing text up to { */
-                    process_text_token(line, first_line_in_doc,
-                            previous_line_blank, processed_start_of_line,
-                            read_yaml_macros_and_links, list_para, output,
-                            &token, &ptoken, &token_size, FALSE);
-                    processed_start_of_line = TRUE;
-                }
+/* 
+ * Publishes the whole body of a page as an asset, to be fetched when its 
+ * <details> is opened, and returns its URL. It is rendered as an include, so 
+ * that with --include-cache it is rendered again only when the page or 
+ * anything it depends on changes.
+ */
+char*
+write_incdir_fragment(char* entry_filename)
+{
+    IncludeJob job;
+    IncludeCacheEntry* entry = NULL;
+    FILE* input              = NULL;
+    size_t buffer_size       = 0;
+    uint8_t* serialized      = NULL;
+    size_t serialized_len    = 0;
+    size_t consumed          = 0;
+    char* url                = NULL;
+
+    memset(&job, 0, sizeof(job));
+    job.filename = entry_filename;
+    if (read_file_into_buffer(&job.buffer, &buffer_size, job.filename, 
+                &job.dirname, &input))
+        return NULL;
 
-                state |= ST_TAG;
-                RESET_TOKEN(token, ptoken, token_size)
+    /* Unlike an include of the same file, relative to its own directory */
+    job.basedir = job.dirname;
+    job.content_hash = hash_buffer(job.buffer, buffer_size-1)
+        ^ hash_buffer((uint8_t*)job.basedir, strlen(job.basedir));
 
-                pline++;
-                colno++;
-                break;
+    entry = find_include_entry(&job);
+    if (!entry)
+    {
+        if (!capture_child_output(&render_include, &job, &serialized,
+                    &serialized_len)
+                && (entry = parse_include_entry(serialized, serialized_len,
+                        &consumed)))
+        {
+            if (!entry->is_volatile)
+                store_include_entry(&job, entry, serialized, consumed);
+        }
+        else
+            warning(1, (uint8_t*)"incdir: Cannot render '%s'", 
+                    entry_filename);
+        free(serialized);
+    }
 
-            case '/':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_IMAGE | ST_PRE | ST_HEADING | ST_YAML_VAL))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+    if (entry)
+        url = publish_asset(entry->fragment, entry->fragment_len, "html");
+    if (entry && entry->is_volatile)
+        free_include_entry(entry);
 
-                if ((state & ST_TAG) && pline-1 && *(pline-1) == '{')
-                {
-                    end_tag = TRUE;
-                    pline++;
-                }
-                else
-                    CHECKCOPY(token, ptoken, token_size, pline)
+    free(job.buffer);
+    free(job.dirname);
+    return url;
+}
 
-                colno++;
-                break;
+int
+print_incdir_summary(char* entry_filename, FILE* output)
+{
+    uint8_t* summary        = NULL;
+    size_t summary_len      = 0;
+    char* url               = NULL;
+
+    capture_child_output(&render_incdir_summary, entry_filename, 
+            &summary, &summary_len);
+    print_output(output, "<div class=\"incdir-summary\">\n");
+    write_output(output, summary, summary_len);
+
+    url = write_incdir_fragment(entry_filename);
+    if (url)
+        print_output(output, "<details data-fragment=\"%s\">\n"
+                "<summary>%s</summary>\n<div></div>\n</details>\n", 
+                url, INCDIR_MORE);
+    print_output(output, "</div>\n");
+
+    free(url);
+    free(summary);
+    return 0;
+}
 
-            case '}':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_IMAGE | ST_PRE | ST_YAML | ST_YAML_VAL))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+int
+process_incdir_subdir(const char* subdirname, FILE* output, BOOL details_open,
+        uint8_t* macro_body, BOOL lazy)
+{
+    print_output(output, "<li>\n<details%s>\n<summary>", 
+            details_open ? " open" : "");
+    if (macro_body)
+        print_html(output, "%s", macro_body);
+    print_output(output, "%s</summary>\n<div>\n", subdirname);
 
-                if (state & ST_TAG)
-                {
-                    state &= ~ST_TAG;
-                    *ptoken = 0;
+    struct dirent** namelist;
+    struct dirent** pnamelist;
+    long names_total;
+    long names_output;
+    char* abs_subdirname = NULL;
 
-                    process_tag(token, output, read_yaml_macros_and_links,
-                            &skip_eol, end_tag);
+    CALLOC(abs_subdirname, char, BUFSIZE)
+    snprintf(abs_subdirname, BUFSIZE, "%s/%s", incdir, subdirname);
 
-                    RESET_TOKEN(token, ptoken, token_size)
-                    end_tag = FALSE;
-                }
+    if ((names_total = scandir(abs_subdirname, &namelist, &filter_slw, 
+                &reverse_alphacompare)) < 0)
+    {
+        perror("scandir");
+        exit(error(errno, (uint8_t*)"incdir_subdir: scandir error"));
+    }
 
-                pline++;
-                colno++;
-                break;
+    pnamelist = namelist;
+    names_output = 0;
+    while (names_output < names_total && pnamelist && *pnamelist)
+    {
+        char* entry_filename  = NULL;
+        uint8_t* entry_output = NULL;
+        size_t entry_len      = 0;
 
-            case '|':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_HTML_TAG | ST_IMAGE | ST_PRE | ST_TAG 
-                            | ST_YAML))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+        CALLOC(entry_filename, char, BUFSIZE)
+        snprintf(entry_filename, BUFSIZE, "%s/%s", abs_subdirname, 
+                (*pnamelist)->d_name);
 
-                if (u8_strlen(pline) > 1 && *(pline+1) == '|')
-                {
-                    /* Handle || within footnotes, headings and link text specially */
-                    if (ANY(state, ST_INLINE_FOOTNOTE | ST_HEADING 
-                                | ST_FOOTNOTE_TEXT | ST_LINK))
-                    {
-                        uint8_t* tag = state & ST_KBD
-                                ? (uint8_t*)"</kbd>"
-                                : (uint8_t*)"<kbd>";
-                        size_t tag_len = u8_strlen(tag);
-                        size_t token_len = 0;
+        if (lazy)
+            print_incdir_summary(entry_filename, output);
+        else
+        {
+            capture_child_output(&render_incdir_entry, entry_filename, 
+                    &entry_output, &entry_len);
+            write_output(output, entry_output, entry_len);
+        }
 
-                        *ptoken = 0;
-                        token_len = u8_strlen(token);
+        free(entry_output);
+        free(entry_filename);
+        pnamelist++;
+        names_output++;
+    }
 
-                        if (token_len + tag_len < BUFSIZE)
-                        {
-                            u8_strncat(token, tag, BUFSIZE-token_len-1);
-                            ptoken += tag_len;
-                        }
-                    }
-                    else
-                    {
-                        /* Output existing text up to || */
-                        process_text_token(line, first_line_in_doc,
-                                previous_line_blank,
-                                processed_start_of_line,
-                                read_yaml_macros_and_links,
-                                list_para, output, &token, &ptoken, 
-                                &token_size, TRUE);
-                        processed_start_of_line = TRUE;
+    free(abs_subdirname);
 
-                        if (!read_yaml_macros_and_links 
-                                && !(ANY(state, ST_PRE | ST_CODE | ST_HEADING)))
-                        {
-                            state ^= ST_KBD;
-                            process_kbd(output, !(state & ST_KBD));
-                        }
-                    }
+    print_output(output, "</div>\n</details>\n</li>\n");
+    return 0;
+}
 
-                    pline += 2;
-                    colno += 2;
-                }
-                /* Partial tables (for templating) */
-                else if (!(state & ST_PRE) && colno == 1 && u8_strlen(pline) > 1 
-                        && *(pline+1) == '@')
-                {
-                    skip_eol = TRUE;
+int
+process_incdir(uint8_t* token, FILE* output)
+{
+    /* Directory listings change without any include changing */
+    include_volatile = TRUE;
 
-                    pline += 2;
-                    colno += 2;
+    uint8_t* saveptr                        = NULL;
+    /* skipping the first token (incdir) */
+    uint8_t* arg                            = u8_strtok(token, (uint8_t*)" ", &saveptr);
+    size_t arg_len                          = 0;
+    long num                                = 5;
+    uint8_t* macro_body                     = NULL;
+    struct dirent** namelist;
+    struct dirent** pnamelist;
+    long names_output;
+    BOOL details_open                       = TRUE;
+    uint8_t* var_lazy                       = get_value(vars, vars_count, 
+            (uint8_t*)"incdir-lazy", NULL);
+    BOOL lazy                               = var_lazy && *var_lazy == '1';
 
-                    switch (*pline)
-                    {
-                    case '\\':
-                        if (!read_yaml_macros_and_links)
-                        {
-                            process_table_start(output);
-                            process_table_header_start(output);
-                        }
-                        pline = NULL;
-                        break;
+    if (lazy && !assets_dir)
+    {
+        warning(1, (uint8_t*)"incdir-lazy: Needs --assets to publish"
+                " fragments, rendering whole files instead");
+        lazy = FALSE;
+    }
 
-                    case '#':
-                        state |= ST_TABLE_HEADER;
-                        pline++;
-                        colno++;
-                        break;
+    arg = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
+    if (!arg)
+        exit(error(1, (uint8_t*)"incdir: Arguments required"));
 
-                    case '-':
-                        state &= ~ST_TABLE_HEADER;
-                        if (!read_yaml_macros_and_links)
-                            process_table_body_start(output, FALSE);
-                        pline = NULL;
-                        break;
+    arg_len = u8_strlen(arg);
 
-                    case ' ':
-                        state |= ST_TABLE;
-                        if (!read_yaml_macros_and_links)
-                            process_table_body_row_start(output);
-                        break;
+    if (*arg != '"' || *(arg + arg_len - 1) != '"')
+        exit(error(1, (uint8_t*)"incdir: First argument not string"));
 
-                    case '/':
-                        state &= ~ST_TABLE;
-                        process_table_end(output);
-                        pline = NULL;
-                        break;
+    incdir = strdup((char*)(arg+1));
+    *(incdir + strlen(incdir) - 1) = 0;
 
-                    default:
-                        warning(1, (uint8_t*)"Invalid partial table line");
-                        CHECKCOPY(token, ptoken, token_size, pline)
-                        colno++;
-                    }
-                }
-                else if (!(state & ST_PRE) && colno == 1)
-                {
-                    skip_eol = TRUE;
+    arg = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
+    if (!arg)
+        exit(error(1, (uint8_t*)"incdir: Second argument required"));
 
-                    if (state & ST_TABLE_HEADER)
-                    {
-                        state &= ~ST_TABLE_HEADER;
-                        state |= ST_TABLE_LINE;
-                        pline = NULL;
-                        break;
-                    }
-                    
-                    if (state & ST_TABLE_LINE)
-                    {
-                        state &= ~ST_TABLE_LINE;
-                        state |= ST_TABLE;
-                        if (!read_yaml_macros_and_links)
-                            process_table_body_start(output, TRUE);
-                    }
-                    else if (state & ST_TABLE)
-                    {
-                        if (!read_yaml_macros_and_links)
-                            process_table_body_row_start(output);
-                    }
-                    else
-                    {
-                        state |= ST_TABLE_HEADER;
-                        if (!read_yaml_macros_and_links)
-                        {
-                            process_table_start(output);
-                            process_table_header_start(output);
-                        }
-                    }
+    if (*arg == '=')
+        macro_body = get_value(macros, macros_count, arg+1, NULL);
+    else
+    {
+        uint8_t* parg = arg;
+        while (parg && *parg)
+        {
+            if (*parg < '0' || *parg > '9')
+                exit(error(1, (uint8_t*)"incdir: Non-numeric argument"));
+            parg++;
+        }
+        errno = 0;
+        num = strtol((char*)arg, NULL, 10);
+        if (errno)
+            exit(error(errno, (uint8_t*)"incdir: Invalid parameter 'num'"));
+        arg = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
+        if (arg)
+        {
+            if (*arg != '=')
+                exit(error(1, (uint8_t*)"incdir: Third argument not macro"));
+            macro_body = get_value(macros, macros_count, arg+1, NULL);
+        }
+    }
 
-                    pline++;
-                    colno++;
-                }
-                else if (state & ST_TABLE_HEADER)
-                {
-                    *ptoken = 0;
-                    if (!read_yaml_macros_and_links)
-                    {
-                        print_output(output, "%s", token);
-                        if (u8_strlen(pline) > 1)
-                            process_table_header_cell(output);
-                        else
-                            process_table_header_end(output);
-                    }
-                    RESET_TOKEN(token, ptoken, token_size)
-                    pline++;
-                    colno++;
-                }
-                else if (state & ST_TABLE)
-                {
-                    *ptoken = 0;
-                    if (!read_yaml_macros_and_links)
-                    {
-                        print_output(output, "%s", token);
-                        if (u8_strlen(pline) > 1)
-                            process_table_body_cell(output);
-                        else
-                            process_table_body_row_end(output);
-                    }
-                    RESET_TOKEN(token, ptoken, token_size)
-                    pline++;
-                    colno++;
-                }
-                else
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                }
-                break;
+    print_output(output, "<ul class=\"incdir\">\n");
 
-            case '<':
-                if (read_yaml_macros_and_links
-                        || ANY(state, ST_DISPLAY_FORMULA | ST_FORMULA 
-                                | ST_IMAGE))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+    if (scandir(incdir, &namelist, &filter_subdirs,
+            &reverse_alphacompare) < 0)
+    {
+        perror("scandir");
+        exit(error(errno, (uint8_t*)"incdir: scandir '%s' error", incdir));
+    }
 
-                if (ANY(state, ST_CODE | ST_KBD | ST_PRE))
+    pnamelist = namelist;
+    names_output = 0;
+    while (names_output < num && pnamelist && *pnamelist)
+    {
+        process_incdir_subdir((*pnamelist)->d_name, output, details_open,
+                macro_body, lazy);
+        details_open = FALSE;
+        pnamelist++;
+        names_output++;
+    }
+    free(namelist);
+    free(incdir);
+
+    print_output(output, "</ul>\n");
+    if (lazy)
+        print_output(output, "<script>%s</script>\n", INCDIR_LAZY_SCRIPT);
+
+    return 0;
+}
+
+int
+process_timestamp(FILE* output, const char* link, uint8_t* permalink_macro,
+        uint8_t* date)
+{
+    uint8_t* day = NULL;
+    uint8_t* month = NULL;
+    uint8_t* year = NULL;
+    uint8_t* formatted_date = NULL;
+    uint8_t* ptr = NULL;
+    const char* ptimestamp_format = NULL;
+    char* in_filename = NULL;
+    char* in_line = NULL;
+
+    CALLOC(formatted_date, uint8_t, DATEBUFSIZE)
+    ptr = NULL;
+    year = u8_strtok(date, (uint8_t*)"-", &ptr);
+    if (year)
+    {
+        month = u8_strtok(NULL, (uint8_t*)"-", &ptr);
+        if (month)
+        {
+            day = u8_strtok(NULL, (uint8_t*)"T", &ptr);
+            if (day)
+            {
+                ptimestamp_format = timestamp_format;
+                while (*ptimestamp_format)
                 {
-                    size_t lt_len = u8_strlen((uint8_t*)"&lt;");
-                    *ptoken = 0;
-                    u8_strncat(token, (uint8_t*)"&lt;", 
-                            BUFSIZE-(ptoken-token)-1);
-                    ptoken += lt_len;
-                    pline++;
-                    colno++;
-                    break;
+                    if (*ptimestamp_format == 'd' 
+                            || *ptimestamp_format == 'D')
+                        u8_strncat(formatted_date, day, 
+                                DATEBUFSIZE-u8_strlen(formatted_date-1));
+                    else if (*ptimestamp_format == 'm' 
+                            || *ptimestamp_format == 'M')
+                        u8_strncat(formatted_date, month, 
+                                DATEBUFSIZE-u8_strlen(formatted_date-1));
+                    else if (*ptimestamp_format == 'y' 
+                            || *ptimestamp_format == 'Y')
+                        u8_strncat(formatted_date, year, 
+                                DATEBUFSIZE-u8_strlen(formatted_date-1));
+                    else
+                        *(formatted_date + u8_strlen(formatted_date)) 
+                            = *ptimestamp_format;
+
+                    ptimestamp_format++;
                 }
+                print_output(output, "<a href=\"%s\""
+                        " class=\"timestamp\">%s%s</a>\n",
+                        link,
+                        permalink_macro ? (char*)permalink_macro : "",
+                        formatted_date);
+            }
+        }
+    }
 
-                state |= ST_HTML_TAG;
-                CHECKCOPY(token, ptoken, token_size, pline)
-                colno++;
-                break;
+    free(formatted_date);
+    free(in_line);
+    free(in_filename);
 
-            case '>':
-                if (state & ST_HTML_TAG)
-                    state &= ~ST_HTML_TAG;
+    return 0;
+}
 
-                if (ANY(state, ST_DISPLAY_FORMULA | ST_FORMULA | ST_IMAGE 
-                            | ST_MACRO_BODY))
+int
+end_macro_body(BOOL read_yaml_macros_and_links)
+{
+    /* Joined even when empty, so that {=m}{/=m} defines m as "" */
+    if (read_yaml_macros_and_links && (state & ST_MACRO_BODY))
+        pmacros->value = rope_join(&macro_rope, &pmacros->value_size);
+    state &= ~ST_MACRO_BODY;
+    return 0;
+}
+
+int
+end_footnote_text(BOOL read_yaml_macros_and_links)
+{
+    if (read_yaml_macros_and_links && (state & ST_FOOTNOTE_TEXT) 
+            && footnote_text.text)
+        pfootnotes->value = strbuf_detach(&footnote_text, 
+                &pfootnotes->value_size);
+    state &= ~ST_FOOTNOTE_TEXT;
+    return 0;
+}
+
+/* Whether {/=name} follows in the document being parsed */
+BOOL
+macro_end_follows(const uint8_t* name)
+{
+    char end_tag[KEYSIZE + 5];
+
+    snprintf(end_tag, sizeof(end_tag), "{/=%s}", (const char*)name);
+    return (parse_rest_of_line 
+                && strstr((const char*)parse_rest_of_line, end_tag))
+        || (parse_rest_of_buffer 
+                && strstr((const char*)parse_rest_of_buffer, end_tag));
+}
+
+int
+process_macro(uint8_t* token, ParsedDoc* doc, BOOL read_yaml_macros_and_links, 
+        BOOL end_tag)
+{
+    if (!end_tag)
+    {
+        if (state & ST_MACRO_BODY)
+            exit(error(1, (uint8_t*)"Macro undefined or nested"));
+
+        BOOL seen = FALSE;
+        uint8_t* macro_body = NULL;
+
+        /* A page can define a macro the site defines too; site macros are
+         * only used for names the page doesn't define */
+        if (!read_yaml_macros_and_links
+                || find_keyvalue(macros, macros_count, token+1)
+                || !find_site_keyvalue(macros, token+1)
+                || !macro_end_follows(token+1))
+            macro_body = get_value(macros, macros_count, token+1,
+                    read_yaml_macros_and_links ? NULL : &seen);
+
+        if (macro_body)
+        {
+            if (!read_yaml_macros_and_links)
+            {
+                KeyValue* macro = find_keyvalue(macros, macros_count, token+1);
+                size_t index = macro - macros;
+
+                if (!macro)
+                    add_node(doc, NODE_MACRO, NODE_FLAG_SITE)->number 
+                        = find_keyvalue(site_macros, site_macros_count, 
+                                token+1) - site_macros;
+                else if (seen)
+                    add_node(doc, NODE_MACRO, 0)->number = index;
+                else
                 {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
+                    add_node(doc, NODE_MACRO_DEFINITION, 0)->number = index;
+                    state |= ST_MACRO_BODY;
                 }
+            }
+        }
+        else
+        {
+            if (read_yaml_macros_and_links)
+            {
+                macros_count++;
 
-                if (!read_yaml_macros_and_links
-                        && !ANY(state, ST_CODE | ST_HEADING | ST_PRE)
-                        && colno == 1)
+                if (macros_count > 1)
                 {
-                    if (!read_yaml_macros_and_links 
-                            && !(state & ST_BLOCKQUOTE))
-                        process_blockquote(output, FALSE);
+                    REALLOC(macros, KeyValue, macros_count * sizeof(KeyValue))
+                    pmacros = macros + macros_count - 1;
+                }
+                CALLOC(pmacros->key, uint8_t, KEYSIZE)
+                pmacros->seen = FALSE;
+                u8_strncpy(pmacros->key, token+1, KEYSIZE-1);
+                pmacros->value = NULL;
+                pmacros->value_size = 0;
+                pmacros->kept = FALSE;
+            }
+            state |= ST_MACRO_BODY;
+        }
+    }
+    else
+        end_macro_body(read_yaml_macros_and_links);
+
+    return 0;
+}
+
+int
+directive_git_log(uint8_t* token, ParsedDoc* doc, 
+        BOOL read_yaml_macros_and_links, BOOL* skip_eol, BOOL end_tag)
+{
+    if (!read_yaml_macros_and_links)
+        add_node(doc, NODE_GIT_LOG, 0);
+    return 0;
+}
+
+int
+directive_made_by(uint8_t* token, ParsedDoc* doc, 
+        BOOL read_yaml_macros_and_links, BOOL* skip_eol, BOOL end_tag)
+{
+    if (!read_yaml_macros_and_links)
+        add_node(doc, NODE_MADE_BY, 0);
+    return 0;
+}
+
+int
+directive_csv(uint8_t* token, ParsedDoc* doc, 
+        BOOL read_yaml_macros_and_links, BOOL* skip_eol, BOOL end_tag)
+{
+    return process_csv(token, doc, read_yaml_macros_and_links, end_tag);
+}
+
+int
+directive_csv_table(uint8_t* token, ParsedDoc* doc, 
+        BOOL read_yaml_macros_and_links, BOOL* skip_eol, BOOL end_tag)
+{
+    if (!read_yaml_macros_and_links && !end_tag)
+        add_text_node(doc, NODE_CSV_TABLE, 0, token);
+    *skip_eol = TRUE;
+    return 0;
+}
+
+int
+directive_include(uint8_t* token, ParsedDoc* doc, 
+        BOOL read_yaml_macros_and_links, BOOL* skip_eol, BOOL end_tag)
+{
+    if (read_yaml_macros_and_links)
+        keep_include_macros(token);
+    else
+        add_text_node(doc, NODE_INCLUDE, 0, token);
+    *skip_eol = TRUE;
+    return 0;
+}
+
+int
+directive_incdir(uint8_t* token, ParsedDoc* doc, 
+        BOOL read_yaml_macros_and_links, BOOL* skip_eol, BOOL end_tag)
+{
+    if (!read_yaml_macros_and_links)
+        add_text_node(doc, NODE_INCDIR, 0, token);
+    *skip_eol = TRUE;
+    return 0;
+}
+
+/* Indexed by DIRECTIVE_HASH, which must differ for every name here */
+static const Directive builtin_directives[DIRECTIVE_SLOTS] = {
+    [DIRECTIVE_HASH('g', 'g', 7)] = { "git-log",   directive_git_log },
+    [DIRECTIVE_HASH('m', 'y', 7)] = { "made-by",   directive_made_by },
+    [DIRECTIVE_HASH('c', 'v', 3)] = { "csv",       directive_csv },
+    [DIRECTIVE_HASH('c', 'e', 9)] = { "csv-table", directive_csv_table },
+    [DIRECTIVE_HASH('i', 'e', 7)] = { "include",   directive_include },
+    [DIRECTIVE_HASH('i', 'r', 6)] = { "incdir",    directive_incdir },
+};
+
+/* The directive named by the first len bytes of name, if any */
+const Directive*
+find_directive(const uint8_t* name, size_t len)
+{
+    const Directive* directive = NULL;
+
+    if (!len)
+        return NULL;
+
+    directive = &builtin_directives[DIRECTIVE_HASH(*name, name[len-1], len)];
+    if (directive->name && !strncmp(directive->name, (char*)name, len)
+            && !directive->name[len])
+        return directive;
+
+    for (size_t i = 0; i < registered_directives_count; i++)
+    {
+        directive = &registered_directives[i];
+        if (!strncmp(directive->name, (char*)name, len) 
+                && !directive->name[len])
+            return directive;
+    }
+    return NULL;
+}
+
+/* Adds a directive to those process_tag knows, besides the built-in ones */
+int
+register_directive(const char* name, directive_handler_t handler)
+{
+    if (!name || !*name || strchr("=/.#", *name) || strchr(name, ' '))
+        return warning(1, (uint8_t*)"Invalid directive name '%s'",
+                name ? name : "");
+
+    if (find_directive((uint8_t*)name, strlen(name)))
+        return warning(1, (uint8_t*)"Directive '%s' already defined", name);
+
+    registered_directives_count++;
+    REALLOCARRAY(registered_directives, Directive, 
+            registered_directives_count)
+    registered_directives[registered_directives_count-1].name = strdup(name);
+    registered_directives[registered_directives_count-1].handler = handler;
+
+    return 0;
+}
+
+int
+process_tag(uint8_t* token, ParsedDoc* doc, BOOL read_yaml_macros_and_links, 
+        BOOL* skip_eol, BOOL end_tag)
+{
+    if (!token || u8_strlen(token) < 1)
+        return warning(1, (uint8_t*)"%s:%ld:%ld: Empty tag name",
+                input_filename, lineno, colno);
+
+    /* Directives are known by their first word */
+    const Directive* directive = find_directive(token, 
+            strcspn((char*)token, " "));
+
+    if (directive)
+        directive->handler(token, doc, read_yaml_macros_and_links, skip_eol,
+                end_tag);
+    else if (*token == '=')   /* {=macro} */
+    {
+        process_macro(token, doc, read_yaml_macros_and_links, end_tag);
+        *skip_eol = TRUE;
+    }
+    else if (!read_yaml_macros_and_links)   /* general tags */
+        add_text_node(doc, NODE_TAG, end_tag ? NODE_FLAG_END : 0, token);
+
+    return 0;
+}
+
+int
+print_tag(FILE* output, const uint8_t* token, BOOL end_tag)
+{
+    print_output(output, "<");
+    if (end_tag)
+        print_output(output, "/");
+
+    if (*token == '.' || *token == '#')
+    {
+        print_output(output, "div");
+    }
+
+    while (*token && *token != '#' && *token != '.')
+        print_output(output, "%c", *token++);
+
+    if (!end_tag)
+    {
+        if (*token == '#')
+        {
+            token++;
+            print_output(output, " id=\"");
+            while (*token && *token != '.')
+                print_output(output, "%c", *token++);
+            print_output(output, "\"");
+            if (*token == '.')
+            {
+                token++;
+                print_output(output, " class=\"");
+                while (*token)
+                    print_output(output, "%c", *token++);
+                print_output(output, "\"");
+            }
+        }
+        else if (*token == '.')
+        {
+            token++;
+            print_output(output, " class=\"");
+            while (*token && *token != '#')
+                print_output(output, "%c", *token++);
+            print_output(output, "\"");
+            if (*token == '#')
+            {
+                token++;
+                print_output(output, " id=\"");
+                while (*token)
+                    print_output(output, "%c", *token++);
+                print_output(output, "\"");
+            }
+        }
+    }
+    print_output(output, ">");
+
+    return 0;
+}
+
+int
+print_made_by(FILE* output)
+{
+    print_output(output, "<div id=\"made-by\">\n"
+            "Generated by <a href=\"%s\" target=\"_blank\">"
+            "slweb</a>\n"
+            "© %s Strahinya Radich.\n"
+            "</div><!--made-by-->\n",
+            MADEBY_URL,
+            COPYRIGHTYEAR);
+    return 0;
+}
+
+int
+process_bold(FILE* output, BOOL end_tag)
+{
+    print_output(output, "<%sstrong>", end_tag ? "/" : "");
+    return 0;
+}
+
+int
+process_italic(FILE* output, BOOL end_tag)
+{
+    print_output(output, "<%sem>", end_tag ? "/" : "");
+    return 0;
+}
+
+const Language*
+find_language(const uint8_t* name)
+{
+    const Language* language = languages;
+    size_t name_len          = name ? u8_strlen(name) : 0;
+
+    if (!name_len)
+        return NULL;
+
+    for (; language->names; language++)
+    {
+        const char* pnames = language->names;
+
+        while (*pnames)
+        {
+            size_t len = strcspn(pnames, " ");
+
+            if (len == name_len && !strncasecmp(pnames, (char*)name, len))
+                return language;
+            pnames += len;
+            while (*pnames == ' ')
+                pnames++;
+        }
+    }
+    return NULL;
+}
+
+/* The name under which the language is known in class names */
+int
+print_language_class(FILE* output, const Language* language)
+{
+    print_output(output, "<pre class=\"language-%.*s\">", 
+            (int)strcspn(language->names, " "), language->names);
+    return 0;
+}
+
+BOOL
+is_code_word_char(uint8_t c, BOOL css)
+{
+    return isalnum(c) || c == '_' || c >= 0x80 || (css && c == '-');
+}
+
+size_t
+match_code(const uint8_t* pcode, const uint8_t* end, const char* text)
+{
+    size_t len = text ? strlen(text) : 0;
+
+    if (!len || (size_t)(end - pcode) < len || memcmp(pcode, text, len))
+        return 0;
+    return len;
+}
+
+BOOL
+is_keyword(const char** keywords, const uint8_t* word, size_t len)
+{
+    const char** pkeyword = keywords;
+
+    while (pkeyword && *pkeyword)
+    {
+        if (**pkeyword == *word && !strncmp(*pkeyword, (char*)word, len)
+                && !(*pkeyword)[len])
+            return TRUE;
+        pkeyword++;
+    }
+    return FALSE;
+}
+
+int
+append_highlighted(StrBuf* out, HighlightClass hl_class, const uint8_t* text,
+        size_t len)
+{
+    if (hl_class != HL_NONE)
+    {
+        strbuf_append(out, (uint8_t*)"<span class=\"", 13);
+        strbuf_append(out, (uint8_t*)highlight_classes[hl_class], 
+                strlen(highlight_classes[hl_class]));
+        strbuf_append(out, (uint8_t*)"\">", 2);
+    }
+    strbuf_append(out, text, len);
+    if (hl_class != HL_NONE)
+        strbuf_append(out, (uint8_t*)"</span>", 7);
+    return 0;
+}
+
+/* Just past the end marker, or the end of the line if stop_at_eol */
+const uint8_t*
+find_code_end(const uint8_t* pcode, const uint8_t* end, const char* marker,
+        BOOL stop_at_eol)
+{
+    const uint8_t* found = NULL;
+    const uint8_t* eol   = stop_at_eol ? memchr(pcode, '\n', end - pcode) 
+        : NULL;
+
+    if (marker)
+        found = memmem(pcode, (eol ? eol : end) - pcode, marker, 
+                strlen(marker));
+    if (found)
+        return found + strlen(marker);
+    return eol ? eol : end;
+}
+
+const uint8_t*
+find_string_end(const uint8_t* pcode, const uint8_t* end, uint8_t quote,
+        BOOL escapes, BOOL multiline)
+{
+    const uint8_t* pstring = pcode + 1;
+
+    while (pstring < end)
+    {
+        if (*pstring == '\\' && escapes && pstring + 1 < end)
+            pstring += 2;
+        else if (*pstring == quote)
+            return pstring + 1;
+        else if (*pstring == '\n' && !multiline)
+            return pstring;
+        else
+            pstring++;
+    }
+    return end;
+}
+
+/*
+ * Puts spans around the tokens of code already escaped for <pre>, in one
+ * pass with the language's table deciding what starts a token; the text
+ * itself is copied unchanged, and &lt; is never split
+ */
+int
+highlight_code(const Language* language, const uint8_t* code, size_t len,
+        StrBuf* out)
+{
+    const uint8_t* pcode  = code;
+    const uint8_t* end    = code + len;
+    const uint8_t* token  = NULL;
+    const uint8_t* plain  = code;
+    BOOL css              = language->flags & LANG_CSS ? TRUE : FALSE;
+    BOOL line_start       = TRUE;
+    BOOL in_tag           = FALSE;
+    BOOL at_rule          = FALSE;
+    size_t depth          = 0;
+    size_t rule_blocks    = 0;
+    size_t match          = 0;
+
+    strbuf_reserve(out, len + len / 2);
+
+    while (pcode < end)
+    {
+        uint8_t c = *pcode;
+        HighlightClass hl_class = HL_NONE;
+        BOOL word_before = pcode > code 
+            && is_code_word_char(*(pcode-1), css);
+
+        token = pcode;
+
+        if (c == '\n')
+        {
+            pcode++;
+            line_start = TRUE;
+            continue;
+        }
+
+        if (language->flags & LANG_DIFF)
+        {
+            /* Only ever at the start of a line */
+            if (c == '@' || match_code(pcode, end, "+++ ") 
+                    || match_code(pcode, end, "--- ")
+                    || match_code(pcode, end, "diff ")
+                    || match_code(pcode, end, "index "))
+                hl_class = HL_META;
+            else if (c == '+')
+                hl_class = HL_ADDED;
+            else if (c == '-')
+                hl_class = HL_REMOVED;
+            pcode = find_code_end(pcode, end, NULL, TRUE);
+        }
+        else if (language->flags & LANG_MARKUP)
+        {
+            if (!in_tag && match_code(pcode, end, "&lt;!--"))
+            {
+                hl_class = HL_COMMENT;
+                pcode = find_code_end(pcode, end, "-->", FALSE);
+            }
+            else if (!in_tag && (match = match_code(pcode, end, "&lt;")))
+            {
+                hl_class = HL_TAG;
+                pcode += match;
+                if (pcode < end && strchr("/!?", *pcode))
+                    pcode++;
+                while (pcode < end && (is_code_word_char(*pcode, TRUE) 
+                            || *pcode == ':' || *pcode == '.'))
+                    pcode++;
+                in_tag = TRUE;
+            }
+            else if (in_tag && (c == '>' || match_code(pcode, end, "/>")))
+            {
+                hl_class = HL_TAG;
+                pcode += c == '>' ? 1 : 2;
+                in_tag = FALSE;
+            }
+            else if (in_tag && (c == '"' || c == '\''))
+            {
+                hl_class = HL_STRING;
+                pcode = find_string_end(pcode, end, c, FALSE, TRUE);
+            }
+            else if (in_tag && is_code_word_char(c, TRUE))
+            {
+                hl_class = HL_ATTR;
+                while (pcode < end && (is_code_word_char(*pcode, TRUE) 
+                            || *pcode == ':'))
+                    pcode++;
+            }
+            else
+                pcode++;
+        }
+        else if (line_start && c == '#' 
+                && language->flags & LANG_PREPROCESSOR)
+        {
+            hl_class = HL_META;
+            pcode = find_code_end(pcode, end, NULL, TRUE);
+        }
+        else if ((match = match_code(pcode, end, language->block_comment)))
+        {
+            hl_class = HL_COMMENT;
+            pcode = find_code_end(pcode + match, end, 
+                    language->block_comment_end, FALSE);
+        }
+        else if (match_code(pcode, end, language->line_comment)
+                && !(c == '#' && pcode > code 
+                    && (word_before || strchr("${", *(pcode-1)))))
+        {
+            hl_class = HL_COMMENT;
+            pcode = find_code_end(pcode, end, NULL, TRUE);
+        }
+        else if (language->flags & LANG_TRIPLE_QUOTES
+                && ((match = match_code(pcode, end, "\"\"\"")) 
+                    || (match = match_code(pcode, end, "'''"))))
+        {
+            hl_class = HL_STRING;
+            pcode = find_code_end(pcode + match, end, 
+                    c == '"' ? "\"\"\"" : "'''", FALSE);
+        }
+        else if (language->quotes && strchr(language->quotes, c))
+        {
+            BOOL shell = language->flags & LANG_VARIABLES ? TRUE : FALSE;
+
+            hl_class = HL_STRING;
+            pcode = find_string_end(pcode, end, c, !(shell && c == '\''),
+                    shell || c == '`');
+        }
+        else if (match_code(pcode, end, "&lt;"))
+            pcode += 4;
+        else if (c == '$' && language->flags & LANG_VARIABLES 
+                && pcode + 1 < end)
+        {
+            hl_class = HL_VARIABLE;
+            pcode++;
+            if (*pcode == '{')
+                pcode = find_code_end(pcode, end, "}", TRUE);
+            else if (is_code_word_char(*pcode, FALSE))
+                while (pcode < end && is_code_word_char(*pcode, FALSE))
+                    pcode++;
+            else if (strchr("@#?$!*-", *pcode))
+                pcode++;
+            else
+                hl_class = HL_NONE;
+        }
+        else if (css && c == '@')
+        {
+            hl_class = HL_KEYWORD;
+            pcode++;
+            while (pcode < end && is_code_word_char(*pcode, TRUE))
+                pcode++;
+            at_rule = TRUE;
+        }
+        else if (css && depth == rule_blocks 
+                && (c == '.' || c == '#' || c == ':') 
+                && pcode + 1 < end && is_code_word_char(*(pcode+1), TRUE))
+        {
+            hl_class = HL_TAG;
+            pcode++;
+            while (pcode < end && is_code_word_char(*pcode, TRUE))
+                pcode++;
+        }
+        else if ((isdigit(c) || (c == '.' && pcode + 1 < end 
+                        && isdigit(*(pcode+1)))
+                    || (css && depth > rule_blocks && c == '#')) 
+                && !word_before)
+        {
+            hl_class = HL_NUMBER;
+            pcode++;
+            while (pcode < end && (is_code_word_char(*pcode, FALSE) 
+                        || *pcode == '.' || (css && *pcode == '%')))
+                pcode++;
+        }
+        else if (is_code_word_char(c, css))
+        {
+            const uint8_t* next = NULL;
+
+            while (pcode < end && is_code_word_char(*pcode, css))
+                pcode++;
+
+            if (css)
+            {
+                /* A property name is followed by a colon, on the line */
+                next = pcode;
+                while (next < end && (*next == ' ' || *next == '\t'))
+                    next++;
+                if (depth == rule_blocks)
+                    hl_class = HL_TAG;
+                else if (next < end && *next == ':')
+                    hl_class = HL_ATTR;
+            }
+            else if (is_keyword(language->keywords, token, pcode - token))
+                hl_class = HL_KEYWORD;
+        }
+        else
+        {
+            /* Blocks of at-rules such as @media hold rules, not
+             * declarations */
+            if (css && c == '{')
+            {
+                if (at_rule && depth == rule_blocks)
+                    rule_blocks++;
+                depth++;
+                at_rule = FALSE;
+            }
+            else if (css && c == '}' && depth)
+            {
+                if (depth == rule_blocks)
+                    rule_blocks--;
+                depth--;
+            }
+            else if (css && c == ';')
+                at_rule = FALSE;
+            pcode++;
+        }
+
+        if (c != ' ' && c != '\t')
+            line_start = FALSE;
+
+        /* Unhighlighted text is copied in runs */
+        if (hl_class != HL_NONE)
+        {
+            strbuf_append(out, plain, token - plain);
+            append_highlighted(out, hl_class, token, pcode - token);
+            plain = pcode;
+        }
+    }
+    strbuf_append(out, plain, pcode - plain);
+
+    return 0;
+}
+
+/* The language of a fenced block, unless highlighting is turned off */
+const Language*
+get_code_language(const uint8_t* name)
+{
+    uint8_t* var_syntax_highlight = get_value(vars, vars_count, 
+            (uint8_t*)"syntax-highlight", NULL);
+
+    if (var_syntax_highlight && *var_syntax_highlight == '0')
+        return NULL;
+    return find_language(name);
+}
+
+int
+print_highlighted(FILE* output, const Language* language, StrBuf* code)
+{
+    StrBuf highlighted;
+
+    if (!code->len)
+        return 0;
+
+    memset(&highlighted, 0, sizeof(StrBuf));
+    highlight_code(language, code->text, code->len, &highlighted);
+    print_output(output, "%s", highlighted.text);
+    free_strbuf(&highlighted);
+    code->len = 0;
+    return 0;
+}
+
+int
+process_code(FILE* output, BOOL end_tag)
+{
+    print_output(output, "<%scode>", end_tag ? "/" : "");
+    return 0;
+}
+
+int
+process_blockquote(FILE* output, BOOL end_tag)
+{
+    print_output(output, "<%sblockquote>", end_tag ? "/" : "");
+    return 0;
+}
+
+int
+process_kbd(FILE* output, BOOL end_tag)
+{
+    print_output(output, "<%skbd>", end_tag ? "/" : "");
+    return 0;
+}
+
+int
+process_table_start(FILE* output)
+{
+    print_output(output, "<table>\n");
+    return 0;
+}
+
+int 
+process_table_header_start(FILE* output)
+{
+    print_output(output, "<thead>\n<tr><th>");
+    return 0;
+}
+
+int
+process_table_header_cell(FILE* output)
+{
+    print_output(output, "</th><th>");
+    return 0;
+}
+
+int 
+process_table_header_end(FILE* output)
+{
+    print_output(output, "</th></tr>\n</thead>\n");
+    return 0;
+}
+
+int
+process_table_body_start(FILE* output, BOOL start_row)
+{
+    print_output(output, "<tbody>\n");
+    if (start_row)
+        print_output(output, "<tr><td>");
+    return 0;
+}
+
+int
+process_table_body_row_start(FILE* output)
+{
+    print_output(output, "<tr><td>");
+    return 0;
+}
+
+int
+process_table_body_cell(FILE* output)
+{
+    print_output(output, "</td><td>");
+    return 0;
+}
+
+int
+process_table_body_row_end(FILE* output)
+{
+    print_output(output, "</td></tr>\n");
+    return 0;
+}
+
+int
+process_table_end(FILE* output)
+{
+    print_output(output, "</tbody>\n</table>\n");
+    return 0;
+}
+
+int
+csv_table_flush(CsvTable* table)
+{
+    if (table->chunk_len)
+        print_output(table->output, "%.*s", (int)table->chunk_len,
+                table->chunk);
+    table->chunk_len = 0;
+    return 0;
+}
+
+int
+csv_table_append(CsvTable* table, int c)
+{
+    const char* entity = NULL;
+
+    if (!table->selected)
+        return 0;
+
+    if (table->chunk_len + 8 > CSV_TABLE_CHUNK_SIZE)
+        csv_table_flush(table);
+
+    switch (c)
+    {
+    case '&':
+        entity = "&amp;";
+        break;
+    case '<':
+        entity = "&lt;";
+        break;
+    case '>':
+        entity = "&gt;";
+        break;
+    case '"':
+        entity = "&quot;";
+        break;
+    default:
+        table->chunk[table->chunk_len++] = c;
+        return 0;
+    }
+    memcpy(table->chunk + table->chunk_len, entity, strlen(entity));
+    table->chunk_len += strlen(entity);
+    return 0;
+}
+
+/* Opens a cell, and the row and the table body when needed */
+int
+csv_table_start_cell(CsvTable* table)
+{
+    csv_table_flush(table);
+    if (!table->row)
+    {
+        if (table->cells)
+            process_table_header_cell(table->output);
+        else
+            process_table_header_start(table->output);
+    }
+    else if (table->cells)
+        process_table_body_cell(table->output);
+    else
+    {
+        if (!table->body_started)
+            process_table_body_start(table->output, FALSE);
+        table->body_started = TRUE;
+        process_table_body_row_start(table->output);
+    }
+    table->cells++;
+    return 0;
+}
+
+int
+csv_table_start_field(CsvTable* table)
+{
+    table->column++;
+    if (table->columns)
+    {
+        while (table->next_selected < table->columns_count
+                && table->columns[table->next_selected] < table->column)
+            table->next_selected++;
+        table->selected = table->next_selected < table->columns_count
+            && table->columns[table->next_selected] == table->column;
+    }
+    else
+        table->selected = TRUE;
+
+    if (table->selected)
+        csv_table_start_cell(table);
+    return 0;
+}
+
+int
+csv_table_end_row(CsvTable* table)
+{
+    /* Short rows are padded to the width of the header */
+    while (table->row && table->cells < table->header_cells)
+        csv_table_start_cell(table);
+
+    csv_table_flush(table);
+    if (!table->row)
+    {
+        const size_t* pcolumn = NULL;
+
+        /* Fields of later rows past the header's are still output */
+        for (pcolumn = table->columns; 
+                pcolumn < table->columns + table->columns_count; pcolumn++)
+            if (*pcolumn > table->column)
+                warning(1, (uint8_t*)"csv-table: No column %zu in the"
+                        " header", *pcolumn);
+
+        table->header_cells = table->cells;
+        if (table->cells)
+            process_table_header_end(table->output);
+    }
+    else if (table->cells)
+        process_table_body_row_end(table->output);
+
+    table->row++;
+    table->column = 0;
+    table->next_selected = 0;
+    table->cells = 0;
+    table->selected = FALSE;
+    return 0;
+}
+
+int
+compare_columns(const void* a, const void* b)
+{
+    size_t column_a = *(const size_t*)a;
+    size_t column_b = *(const size_t*)b;
+
+    return column_a < column_b ? -1 : column_a > column_b;
+}
+
+/*
+ * {csv-table "csvfile" rows columns}: the header of csvfile.csv and up to
+ * rows of its lines as a table, with only the comma-separated column
+ * numbers in columns if given; read and output a character at a time
+ */
+int
+process_csv_table(uint8_t* token, FILE* output)
+{
+    uint8_t* saveptr       = NULL;
+    /* skipping the first token (csv-table) */
+    uint8_t* arg           = u8_strtok(token, (uint8_t*)" ", &saveptr);
+    size_t arg_len         = 0;
+    long rows              = 0;
+    size_t* columns        = NULL;
+    char* filename         = NULL;
+    FILE* csv              = NULL;
+    uint8_t* csv_delimiter = get_value(vars, vars_count, 
+            (uint8_t*)"csv-delimiter", NULL);
+    BOOL quoted            = FALSE;
+    BOOL row_open          = FALSE;
+    int c                  = 0;
+    CsvTable table;
+
+    memset(&table, 0, sizeof(CsvTable));
+    table.output = output;
+
+    arg = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
+    if (!arg)
+        exit(error(EINVAL, (uint8_t*)"csv-table: Arguments required"));
+
+    arg_len = u8_strlen(arg);
+    if (arg_len < 2 || *arg != '"' || *(arg + arg_len - 1) != '"')
+        exit(error(EINVAL, (uint8_t*)"csv-table: First argument must be"
+                    " a string"));
+    *(arg + arg_len - 1) = 0;
+    CALLOC(filename, char, (input_dirname ? strlen(input_dirname) : 1) 
+            + arg_len + 6)
+    sprintf(filename, "%s/%s.csv", input_dirname ? input_dirname : ".", 
+            (char*)arg+1);
+
+    arg = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
+    if (arg)
+    {
+        char* end = NULL;
+
+        errno = 0;
+        rows = strtol((char*)arg, &end, 10);
+        if (errno || *end || rows < 0)
+            exit(error(EINVAL, (uint8_t*)"csv-table: Invalid row limit '%s'",
+                        arg));
+        arg = u8_strtok(NULL, (uint8_t*)" ", &saveptr);
+    }
+
+    if (arg)
+    {
+        char* parg = (char*)arg;
+
+        CALLOC(columns, size_t, u8_strlen(arg) / 2 + 1)
+        while (*parg)
+        {
+            char* end = NULL;
+            long column = 0;
+
+            errno = 0;
+            column = strtol(parg, &end, 10);
+            if (errno || end == parg || column < 1 || (*end && *end != ','))
+                exit(error(EINVAL, (uint8_t*)"csv-table: Invalid column"
+                            " list '%s'", arg));
+            columns[table.columns_count++] = column;
+            parg = *end ? end + 1 : end;
+        }
+        qsort(columns, table.columns_count, sizeof(size_t), 
+                &compare_columns);
+        table.columns = columns;
+    }
+
+    record_include_dep('f', (uint8_t*)filename, hash_file(filename));
+
+    if (!(csv = fopen(filename, "rt")))
+        exit(error(ENOENT, (uint8_t*)"csv-table: No such file: %s", 
+                    filename));
+
+    process_table_start(output);
+    while ((c = getc(csv)) != EOF && (!rows || table.row <= (size_t)rows))
+    {
+        if (c == '\r' && !quoted)
+            continue;
+
+        if (c == '\n' && !quoted)
+        {
+            /* Blank lines are skipped */
+            if (row_open)
+                csv_table_end_row(&table);
+            row_open = FALSE;
+            continue;
+        }
+
+        if (!row_open)
+        {
+            row_open = TRUE;
+            csv_table_start_field(&table);
+        }
+
+        if (c == '"')
+        {
+            int next = getc(csv);
+
+            /* "" within quotes is a quotation mark */
+            if (quoted && next == '"')
+                csv_table_append(&table, c);
+            else
+            {
+                quoted = !quoted;
+                if (next != EOF)
+                    ungetc(next, csv);
+            }
+        }
+        else if (!quoted && (c == ';' || c == ','
+                    || (csv_delimiter && c == *csv_delimiter)))
+            csv_table_start_field(&table);
+        else
+            csv_table_append(&table, c);
+    }
+    if (row_open && (!rows || table.row <= (size_t)rows))
+        csv_table_end_row(&table);
+    fclose(csv);
+
+    /* Even with no rows, or none of the columns, the table is complete */
+    if (!table.body_started)
+        process_table_body_start(output, FALSE);
+    process_table_end(output);
+
+    free(columns);
+    free(filename);
+    return 0;
+}
+
+BOOL
+url_is_local(char* url)
+{
+    return !(startswith(url, "http://")
+        || startswith(url, "https://")
+        || startswith(url, "ftp://")
+        || startswith(url, "ftps://")
+        || startswith(url, "mailto://"));
+}
+
+int
+get_realpath(char** realpath, char* relativeto, char* path)
+{
+    CommandJob job;
+    char* relative_arg   = NULL;
+    const char* args[]   = { "realpath", NULL, path, NULL };
+    uint8_t* line        = NULL;
+    uint8_t* eol         = NULL;
+
+    strncpy(*realpath, ".", BUFSIZE-1);
+    CALLOC(relative_arg, char, strlen(relativeto) + 15)
+    sprintf(relative_arg, "--relative-to=%s", relativeto);
+    *(args + 1) = relative_arg;
+
+    init_command_job(&job, "realpath", args);
+    run_command_jobs(&job, 1, 1);
+    if (job.spawn_error)
+        warning(job.spawn_error, (uint8_t*)"get_realpath: Cannot run"
+                " realpath");
+
+    /* The last line printed is the path */
+    line = job.output.text;
+    while (line && *line)
+    {
+        eol = (uint8_t*)strchr((char*)line, '\n');
+        if (eol)
+            *eol = 0;
+        strncpy(*realpath, (char*)line, BUFSIZE-1);
+        line = eol ? eol + 1 : NULL;
+    }
+
+    free_command_job(&job);
+    free(relative_arg);
+
+    return 0;
+}
+
+int
+process_inline_link(uint8_t* link_text, uint8_t* link_macro_body, 
+        uint8_t* link_url, FILE* output)
+{
+    print_output(output, "<a href=\"%s\">%s%s</a>", 
+            link_url ? (char*)link_url : "", 
+            link_macro_body ? (char*)link_macro_body : "",
+            link_text);
+
+    return 0;
+}
+
+int
+process_link(ParsedDoc* doc, uint8_t* link_text, uint8_t* link_macro_body,
+        uint8_t* link_url)
+{
+    Span text   = add_span(doc, link_text);
+    Span url    = add_span(doc, link_url);
+    Span prefix = add_span(doc, link_macro_body);
+    Node* node  = add_node(doc, NODE_LINK, 0);
+
+    node->text = text;
+    node->arg = url;
+    node->prefix = prefix;
+    return 0;
+}
+
+int
+process_inline_image(uint8_t* image_text, uint8_t* image_url, FILE* output,
+        BOOL add_link, BOOL add_figcaption)
+{
+    if (add_figcaption)
+        print_output(output, "<figure>\n");
+
+    if (add_link)
+        print_output(output, "<a href=\"%s\" title=\"%s\" class=\"image\""
+                " target=\"_blank\">",
+                image_url ? (char*)image_url : "", 
+                image_text);
+
+    print_output(output, "<img src=\"%s\" alt=\"%s\" />",
+            image_url ? (char*)image_url : "", 
+            image_text);
+
+    if (add_link)
+        print_output(output, "</a>");
+
+    if (add_figcaption)
+        print_output(output, "<figcaption>%s</figcaption>\n</figure>\n",
+                image_text);
+    return 0;
+}
+
+int
+process_image(ParsedDoc* doc, uint8_t* image_text, uint8_t* image_url,
+        BOOL add_link, BOOL add_figcaption)
+{
+    Span text  = add_span(doc, image_text);
+    Span url   = add_span(doc, image_url);
+    Node* node = add_node(doc, NODE_IMAGE, 
+            (add_link ? NODE_FLAG_LINK : 0)
+            | (add_figcaption ? NODE_FLAG_FIGCAPTION : 0));
+
+    node->text = text;
+    node->arg = url;
+    return 0;
+}
+
+int
+process_line_start(uint8_t* line, BOOL first_line_in_doc,
+        BOOL previous_line_blank, BOOL read_yaml_macros_and_links,  
+        BOOL list_para, ParsedDoc* doc, uint8_t** token, uint8_t** ptoken)
+{
+    if ((first_line_in_doc || previous_line_blank)
+            && !(ANY(state, ST_BLOCKQUOTE | ST_PRE)))
+    {
+        if (!list_para)
+        {
+            if (state & ST_LIST)
+            {
+                state &= ~ST_LIST;
+                if (!read_yaml_macros_and_links)
+                {
+                    process_list_item_end(doc);
+                    add_node(doc, NODE_LIST_END, 0);
+                }
+            }
+
+            if (state & ST_NUMLIST)
+            {
+                state &= ~ST_NUMLIST;
+                if (!read_yaml_macros_and_links)
+                {
+                    process_list_item_end(doc);
+                    add_node(doc, NODE_NUMLIST_END, 0);
+                }
+            }
+
+            if (state & ST_FOOTNOTE_TEXT)
+            {
+                if (!read_yaml_macros_and_links && (state & ST_PARA_OPEN))
+                    add_node(doc, NODE_PARA_BREAK, 0);
+                end_footnote_text(read_yaml_macros_and_links);
+                state &= ~ST_PARA_OPEN;
+            }
+        }
+        if (!ANY(state, ST_TABLE | ST_TABLE_HEADER | ST_TABLE_LINE))
+        {
+            if (!read_yaml_macros_and_links)
+                add_node(doc, NODE_PARA_START, 0);
+            state |= ST_PARA_OPEN;
+        }
+    }
+    return 0;
+}
+
+int
+process_text_token(uint8_t* line, BOOL first_line_in_doc,
+        BOOL previous_line_blank,
+        BOOL processed_start_of_line,
+        BOOL read_yaml_macros_and_links, BOOL list_para,
+        ParsedDoc* doc, uint8_t** token,
+        uint8_t** ptoken, size_t* token_size,
+        BOOL add_enclosing_paragraph)
+{
+    if (!(state & ST_YAML))
+    {
+        if (add_enclosing_paragraph && !processed_start_of_line)
+            process_line_start(line, first_line_in_doc, previous_line_blank,
+                    read_yaml_macros_and_links, list_para, doc, token, ptoken);
+        **ptoken = 0;
+        if (**token && !read_yaml_macros_and_links 
+                && !(state & ST_MACRO_BODY))
+            add_text_node(doc, NODE_TEXT, 0, *token);
+    }
+    RESET_TOKEN(*token, *ptoken, *token_size)
+    return 0;
+}
+
+int
+process_inline_footnote(uint8_t* token, BOOL read_yaml_macros_and_links, 
+        ParsedDoc* doc)
+{
+    current_inline_footnote++;
+
+    if (read_yaml_macros_and_links)
+    {
+        size_t token_len = u8_strlen(token);
+        size_t unspilled = 0;
+
+        inline_footnote_count++;
+        unspilled = inline_footnote_count - inline_footnotes_spilled;
+        if (inline_footnote_count == 1 && footnote_count > 0)
+            warning(1, (u_int8_t*)"Both inline and regular footnotes present");
+        else if (unspilled > 1)
+            REALLOC(inline_footnotes, uint8_t*, sizeof(uint8_t*) * unspilled)
+        CALLOC(inline_footnotes[unspilled-1], uint8_t, token_len+1)
+
+        u8_strncpy(inline_footnotes[unspilled-1], token, token_len);
+        *(inline_footnotes[unspilled-1] + token_len) = 0;
+    }
+    else
+        add_node(doc, NODE_INLINE_FOOTNOTE_REF, 0)->number 
+            = current_inline_footnote;
+
+    return 0;
+}
+
+int
+print_footnote_ref(FILE* output, BOOL inline_footnote, size_t footnote)
+{
+    const char* prefix = inline_footnote ? "inline-" : "";
+
+    print_output(output, "<a href=\"#%sfootnote-%d\" id=\"%sfootnote-text-%d\">"
+            "<sup>%d</sup></a>", 
+            prefix, footnote, prefix, footnote, footnote);
+    return 0;
+}
+
+int
+process_footnote(uint8_t* token, BOOL footnote_definition, BOOL footnote_output,
+        ParsedDoc* doc)
+{
+    current_footnote++;
+
+    if (footnote_definition)
+    {
+        size_t unspilled = 0;
+
+        footnote_count++;
+        unspilled = footnote_count - footnotes_spilled;
+        if (footnote_count == 1 && inline_footnote_count > 0)
+            warning(1, (u_int8_t*)"Both inline and regular footnotes present");
+        else if (unspilled > 1)
+        {
+            REALLOC(footnotes, KeyValue, unspilled * sizeof(KeyValue))
+            pfootnotes = footnotes + unspilled - 1;
+        }
+        else
+            pfootnotes = footnotes;
+        CALLOC(pfootnotes->key, uint8_t, KEYSIZE)
+        u8_strncpy(pfootnotes->key, token, KEYSIZE-1);
+        pfootnotes->value = NULL;
+        pfootnotes->value_size = 0;
+        pfootnotes->kept = FALSE;
+    }
+    
+    if (footnote_output)
+        add_node(doc, NODE_FOOTNOTE_REF, 0)->number = current_footnote;
+
+    return 0;
+}
+
+int
+process_horizontal_rule(ParsedDoc* doc)
+{
+    add_node(doc, NODE_HORIZONTAL_RULE, 
+            state & ST_PARA_OPEN ? NODE_FLAG_PARA_OPEN : 0);
+    return 0;
+}
+
+int
+print_horizontal_rule(FILE* output, BOOL para_open)
+{
+    /* Temporarily break paragraph as hr is para-level */
+    if (para_open)
+        print_output(output, "</p>\n");
+    print_output(output, "<hr />\n");
+    if (para_open)
+        print_output(output, "<p>\n");
+    return 0;
+}
+
+int
+math_append(StrBuf* out, const char* text)
+{
+    return strbuf_append(out, (const uint8_t*)text, strlen(text));
+}
+
+/* <tag attributes>text</tag>, with text already escaped */
+int
+math_append_token(StrBuf* out, const char* tag, const char* attributes,
+        const char* text)
+{
+    math_append(out, "<");
+    math_append(out, tag);
+    if (attributes)
+    {
+        math_append(out, " ");
+        math_append(out, attributes);
+    }
+    math_append(out, ">");
+    math_append(out, text);
+    math_append(out, "</");
+    math_append(out, tag);
+    math_append(out, ">");
+    return 0;
+}
+
+/* Spaces become no-break spaces, which aren't trimmed from <mtext> */
+int
+math_append_escaped(StrBuf* out, const uint8_t* text, size_t len,
+        BOOL keep_spaces)
+{
+    const uint8_t* ptext = text;
+    const uint8_t* run   = text;
+
+    while (ptext < text + len)
+    {
+        const char* entity = NULL;
+
+        switch (*ptext)
+        {
+        case '<':
+            entity = "&lt;";
+            break;
+        case '>':
+            entity = "&gt;";
+            break;
+        case '&':
+            entity = "&amp;";
+            break;
+        case '"':
+            entity = "&quot;";
+            break;
+        case ' ':
+            entity = keep_spaces ? "&#xA0;" : NULL;
+            break;
+        }
+        if (entity)
+        {
+            strbuf_append(out, run, ptext - run);
+            math_append(out, entity);
+            run = ptext + 1;
+        }
+        ptext++;
+    }
+    strbuf_append(out, run, ptext - run);
+    return 0;
+}
+
+/* A letter or digit, in the font set by \mathbf and the like */
+int
+math_append_alphanumeric(StrBuf* out, uint8_t c, const char* variant)
+{
+    const MathFont* font = math_fonts;
+    const char* tag      = isdigit(c) ? "mn" : "mi";
+    char text[8]         = { c, 0 };
+    ucs4_t code_point    = 0;
+    size_t hole          = 0;
+    int len              = 0;
+
+    if (!variant)
+        return math_append_token(out, tag, NULL, text);
+    if (!strcmp(variant, "normal"))
+        return math_append_token(out, tag, 
+                isdigit(c) ? NULL : "mathvariant=\"normal\"", text);
+
+    while (font->variant && strcmp(font->variant, variant))
+        font++;
+    if (isupper(c) && font->upper)
+        code_point = font->upper + c - 'A';
+    else if (islower(c) && font->lower)
+        code_point = font->lower + c - 'a';
+    else if (isdigit(c) && font->digit)
+        code_point = font->digit + c - '0';
+    for (hole = 0; math_font_holes[hole].variant; hole++)
+        if (!strcmp(math_font_holes[hole].variant, variant)
+                && math_font_holes[hole].letter == c)
+            code_point = math_font_holes[hole].code_point;
+
+    if (code_point && (len = u8_uctomb((uint8_t*)text, code_point, 
+                    sizeof(text) - 1)) > 0)
+        text[len] = 0;
+    return math_append_token(out, tag, NULL, text);
+}
+
+BOOL
+math_at_command(const uint8_t* tex, const char* name)
+{
+    size_t len = strlen(name);
+
+    return *tex == '\\' && !strncmp((char*)tex + 1, name, len)
+        && !(isalpha(*name) && isalpha(*(tex + 1 + len)));
+}
+
+int
+math_skip_space(MathState* state)
+{
+    while (isspace(*state->tex))
+        state->tex++;
+    return 0;
+}
+
+/* Reads the name of the command at \ into name, returning its length */
+size_t
+math_read_command(MathState* state, char* name)
+{
+    const uint8_t* pname = state->tex + 1;
+    size_t len           = 0;
+
+    if (isalpha(*pname))
+        while (isalpha(*(pname + len)))
+            len++;
+    else if (*pname)
+        len = 1;
+    if (!len || len >= MATH_COMMAND_MAX)
+        return 0;
+
+    memcpy(name, pname, len);
+    *(name + len) = 0;
+    state->tex = pname + len;
+    return len;
+}
+
+const MathSymbol*
+find_math_symbol(const char* name)
+{
+    const MathSymbol* symbol = math_symbols;
+
+    while (symbol->name && strcmp(symbol->name, name))
+        symbol++;
+    return symbol->name ? symbol : NULL;
+}
+
+/* The text of {...}, which may not hold commands or formulas */
+const uint8_t*
+math_read_braced(MathState* state, size_t* len)
+{
+    const uint8_t* start = NULL;
+    size_t depth         = 0;
+
+    math_skip_space(state);
+    if (*state->tex != '{')
+        return NULL;
+
+    start = ++state->tex;
+    while (*state->tex && (*state->tex != '}' || depth))
+    {
+        if (*state->tex == '\\' || *state->tex == '$')
+            return NULL;
+        if (*state->tex == '{')
+            depth++;
+        else if (*state->tex == '}')
+            depth--;
+        state->tex++;
+    }
+    if (!*state->tex)
+        return NULL;
+
+    *len = state->tex++ - start;
+    return start;
+}
+
+/* The text of a delimiter after \left, \right or \big; "" for . */
+const char*
+math_read_delimiter(MathState* state)
+{
+    static const char* delimiters[] = { "(", ")", "[", "]", "|", "/", NULL };
+    const char** pdelimiter   = delimiters;
+    const MathSymbol* symbol  = NULL;
+    char name[MATH_COMMAND_MAX];
+
+    math_skip_space(state);
+    if (*state->tex == '.')
+    {
+        state->tex++;
+        return "";
+    }
+    if (*state->tex == '\\')
+    {
+        if (!math_read_command(state, name) 
+                || !(symbol = find_math_symbol(name))
+                || (symbol->kind != MATH_FENCE 
+                    && symbol->kind != MATH_OPERATOR))
+            return NULL;
+        return symbol->text;
+    }
+    while (*pdelimiter && **pdelimiter != *state->tex)
+        pdelimiter++;
+    if (*pdelimiter)
+        state->tex++;
+    return *pdelimiter;
+}
+
+int
+math_parse_list(MathState* state, StrBuf* out, uint8_t close);
+
+int
+math_parse_atom(MathState* state, StrBuf* out, BOOL* limits, 
+        const char** after);
+
+int
+math_parse_group(MathState* state, StrBuf* out)
+{
+    int result = 0;
+
+    state->tex++;
+    math_append(out, "<mrow>");
+    if (!(result = math_parse_list(state, out, '}')) && *state->tex != '}')
+        return 1;
+    state->tex++;
+    math_append(out, "</mrow>");
+    return result;
+}
+
+/* The argument of a command or script: a group, a digit or another atom */
+int
+math_parse_argument(MathState* state, StrBuf* out)
+{
+    BOOL limits       = FALSE;
+    const char* after = NULL;
+    int result        = 0;
+
+    math_skip_space(state);
+    if (isdigit(*state->tex))
+        return math_append_alphanumeric(out, *state->tex++, state->variant);
+    if (!*state->tex || strchr("}^_&'", *state->tex))
+        return 1;
+    result = math_parse_atom(state, out, &limits, &after);
+    if (!result && after)
+        math_append(out, after);
+    return result;
+}
+
+int
+math_parse_left(MathState* state, StrBuf* out)
+{
+    const char* open  = math_read_delimiter(state);
+    const char* close = NULL;
+    int result        = 0;
+
+    if (!open)
+        return 1;
+
+    math_append(out, "<mrow>");
+    if (*open)
+        math_append_token(out, "mo", "fence=\"true\" form=\"prefix\"", open);
+    result = math_parse_list(state, out, 0);
+    if (!result && math_at_command(state->tex, "right"))
+    {
+        state->tex += strlen("\\right");
+        close = math_read_delimiter(state);
+    }
+    if (!close)
+        return 1;
+    if (*close)
+        math_append_token(out, "mo", "fence=\"true\" form=\"postfix\"", 
+                close);
+    math_append(out, "</mrow>");
+    return result;
+}
+
+/* Rows separated by \\ of cells separated by &, until \end */
+int
+math_parse_environment(MathState* state, StrBuf* out)
+{
+    const MathEnvironment* environment = math_environments;
+    const uint8_t* name                = NULL;
+    const uint8_t* end_name            = NULL;
+    size_t len                         = 0;
+    size_t end_len                     = 0;
+    BOOL display                       = state->display;
+    int result                         = 0;
+
+    if (!(name = math_read_braced(state, &len)))
+        return 1;
+    while (environment->name && (strlen(environment->name) != len 
+                || strncmp(environment->name, (char*)name, len)))
+        environment++;
+    if (!environment->name)
+        return 1;
+
+    math_append(out, "<mrow>");
+    if (environment->open)
+        math_append_token(out, "mo", "fence=\"true\" form=\"prefix\"", 
+                environment->open);
+    math_append(out, "<mtable");
+    if (environment->columnalign)
+    {
+        math_append(out, " columnalign=\"");
+        math_append(out, environment->columnalign);
+        math_append(out, "\"");
+    }
+    math_append(out, ">");
+
+    state->display = FALSE;
+    while (!result)
+    {
+        math_append(out, "<mtr><mtd>");
+        while (!(result = math_parse_list(state, out, 0))
+                && *state->tex == '&')
+        {
+            state->tex++;
+            math_append(out, "</mtd><mtd>");
+        }
+        math_append(out, "</mtd></mtr>");
+        if (result)
+            break;
+
+        if (math_at_command(state->tex, "\\"))
+        {
+            state->tex += 2;
+            math_skip_space(state);
+            if (*state->tex == '[')
+                result = 1;
+        }
+        else if (!math_at_command(state->tex, "end"))
+            result = 1;
+        if (math_at_command(state->tex, "end"))
+            break;
+    }
+    state->display = display;
+    if (result)
+        return result;
+
+    state->tex += strlen("\\end");
+    if (!(end_name = math_read_braced(state, &end_len)) || end_len != len
+            || strncmp((char*)end_name, (char*)name, len))
+        return 1;
+
+    math_append(out, "</mtable>");
+    if (environment->close)
+        math_append_token(out, "mo", "fence=\"true\" form=\"postfix\"", 
+                environment->close);
+    math_append(out, "</mrow>");
+    return 0;
+}
+
+int
+math_parse_command(MathState* state, StrBuf* out, BOOL* limits,
+        const char** after)
+{
+    const MathSymbol* symbol = NULL;
+    const char* variant      = state->variant;
+    const char* delimiter    = NULL;
+    const uint8_t* text      = NULL;
+    StrBuf first;
+    StrBuf second;
+    char name[MATH_COMMAND_MAX];
+    char attributes[SMALL_ARGSIZE];
+    size_t len               = 0;
+    int result               = 0;
+
+    if (!math_read_command(state, name) || !(symbol = find_math_symbol(name)))
+        return 1;
+
+    memset(&first, 0, sizeof(StrBuf));
+    memset(&second, 0, sizeof(StrBuf));
+
+    switch (symbol->kind)
+    {
+    case MATH_IDENTIFIER:
+        math_append_token(out, "mi", NULL, symbol->text);
+        break;
+    case MATH_UPRIGHT:
+        math_append_token(out, "mi", "mathvariant=\"normal\"", symbol->text);
+        break;
+    case MATH_OPERATOR:
+        math_append_token(out, "mo", NULL, symbol->text);
+        break;
+    case MATH_FENCE:
+        math_append_token(out, "mo", "stretchy=\"false\"", symbol->text);
+        break;
+    case MATH_LARGE_OPERATOR:
+        *limits = state->display;
+        math_append_token(out, "mo", NULL, symbol->text);
+        break;
+    case MATH_INTEGRAL:
+        math_append_token(out, "mo", NULL, symbol->text);
+        break;
+    case MATH_FUNCTION:
+    case MATH_LIMIT_FUNCTION:
+        *limits = symbol->kind == MATH_LIMIT_FUNCTION && state->display;
+        *after = "<mo>&#x2061;</mo>";
+        math_append_token(out, "mi", NULL, symbol->text);
+        break;
+    case MATH_SPACE:
+        math_append(out, "<mspace width=\"");
+        math_append(out, symbol->text);
+        math_append(out, "\"/>");
+        break;
+    case MATH_ACCENT:
+    case MATH_WIDE_ACCENT:
+    case MATH_UNDER_ACCENT:
+        if ((result = math_parse_argument(state, &first)))
+            break;
+        math_append(out, symbol->kind == MATH_UNDER_ACCENT 
+                ? "<munder accentunder=\"true\">" : "<mover accent=\"true\">");
+        strbuf_append(out, first.text, first.len);
+        math_append_token(out, "mo", symbol->kind == MATH_ACCENT 
+                ? "stretchy=\"false\"" : "stretchy=\"true\"", symbol->text);
+        math_append(out, symbol->kind == MATH_UNDER_ACCENT 
+                ? "</munder>" : "</mover>");
+        break;
+    case MATH_FONT:
+        state->variant = symbol->text;
+        result = math_parse_argument(state, out);
+        state->variant = variant;
+        break;
+    case MATH_TEXT:
+        if (!(text = math_read_braced(state, &len)))
+            return 1;
+        math_append(out, "<mtext>");
+        math_append_escaped(out, text, len, TRUE);
+        math_append(out, "</mtext>");
+        break;
+    case MATH_BIG:
+        if (!(delimiter = math_read_delimiter(state)) || !*delimiter)
+            return 1;
+        snprintf(attributes, sizeof(attributes), 
+                "minsize=\"%s\" maxsize=\"%s\"", symbol->text, symbol->text);
+        math_append_token(out, "mo", attributes, delimiter);
+        break;
+    case MATH_FRACTION:
+    case MATH_BINOMIAL:
+        if ((result = math_parse_argument(state, &first))
+                || (result = math_parse_argument(state, &second)))
+            break;
+        if (symbol->text)
+        {
+            math_append(out, "<mstyle displaystyle=\"");
+            math_append(out, symbol->text);
+            math_append(out, "\">");
+        }
+        if (symbol->kind == MATH_BINOMIAL)
+            math_append(out, "<mrow><mo>(</mo><mfrac linethickness=\"0\">");
+        else
+            math_append(out, "<mfrac>");
+        strbuf_append(out, first.text, first.len);
+        strbuf_append(out, second.text, second.len);
+        math_append(out, symbol->kind == MATH_BINOMIAL 
+                ? "</mfrac><mo>)</mo></mrow>" : "</mfrac>");
+        if (symbol->text)
+            math_append(out, "</mstyle>");
+        break;
+    case MATH_ROOT:
+        math_skip_space(state);
+        if (*state->tex == '[')
+        {
+            state->tex++;
+            math_append(&second, "<mrow>");
+            if ((result = math_parse_list(state, &second, ']'))
+                    || *state->tex != ']')
+            {
+                result = 1;
+                break;
+            }
+            math_append(&second, "</mrow>");
+            state->tex++;
+        }
+        if ((result = math_parse_argument(state, &first)))
+            break;
+        math_append(out, second.len ? "<mroot>" : "<msqrt>");
+        strbuf_append(out, first.text, first.len);
+        if (second.len)
+            strbuf_append(out, second.text, second.len);
+        math_append(out, second.len ? "</mroot>" : "</msqrt>");
+        break;
+    case MATH_OVERSET:
+        if ((result = math_parse_argument(state, &first))
+                || (result = math_parse_argument(state, &second)))
+            break;
+        math_append(out, "<");
+        math_append(out, symbol->text);
+        math_append(out, ">");
+        strbuf_append(out, second.text, second.len);
+        strbuf_append(out, first.text, first.len);
+        math_append(out, "</");
+        math_append(out, symbol->text);
+        math_append(out, ">");
+        break;
+    case MATH_LEFT:
+        result = math_parse_left(state, out);
+        break;
+    case MATH_BEGIN:
+        result = math_parse_environment(state, out);
+        break;
+    case MATH_OPERATOR_NAME:
+        if (!(text = math_read_braced(state, &len)) || !len)
+            return 1;
+        *after = "<mo>&#x2061;</mo>";
+        math_append(out, "<mi>");
+        math_append_escaped(out, text, len, FALSE);
+        math_append(out, "</mi>");
+        break;
+    case MATH_BMOD:
+        math_append_token(out, "mo", 
+                "lspace=\"0.2222em\" rspace=\"0.2222em\"", "mod");
+        break;
+    case MATH_PMOD:
+        if ((result = math_parse_argument(state, &first)))
+            break;
+        math_append(out, "<mrow><mspace width=\"1em\"/>"
+                "<mo stretchy=\"false\">(</mo><mi>mod</mi>"
+                "<mspace width=\"0.3333em\"/>");
+        strbuf_append(out, first.text, first.len);
+        math_append(out, "<mo stretchy=\"false\">)</mo></mrow>");
+        break;
+    default:
+        /* \displaystyle and \limits only where handled by the caller */
+        result = 1;
+        break;
+    }
+
+    free_strbuf(&first);
+    free_strbuf(&second);
+    return result;
+}
+
+int
+math_parse_atom(MathState* state, StrBuf* out, BOOL* limits, 
+        const char** after)
+{
+    const uint8_t* start = state->tex;
+    uint8_t c            = *state->tex;
+    ucs4_t uc            = 0;
+    int len              = 0;
+
+    if (c == '{')
+        return math_parse_group(state, out);
+    if (c == '\\')
+        return math_parse_command(state, out, limits, after);
+    if (isalpha(c))
+        return math_append_alphanumeric(out, *state->tex++, state->variant);
+
+    if (isdigit(c) || (c == '.' && isdigit(*(state->tex + 1))))
+    {
+        while (isdigit(*state->tex) || (*state->tex == '.' 
+                    && isdigit(*(state->tex + 1))))
+            state->tex++;
+        if (state->variant && strcmp(state->variant, "normal"))
+        {
+            for (; start < state->tex; start++)
+                if (*start == '.')
+                    math_append(out, "<mn>.</mn>");
+                else
+                    math_append_alphanumeric(out, *start, state->variant);
+            return 0;
+        }
+        math_append(out, "<mn>");
+        strbuf_append(out, start, state->tex - start);
+        math_append(out, "</mn>");
+        return 0;
+    }
+
+    state->tex++;
+    switch (c)
+    {
+    case '-':
+        return math_append_token(out, "mo", NULL, "−");
+    case '*':
+        return math_append_token(out, "mo", NULL, "∗");
+    case '<':
+        return math_append_token(out, "mo", NULL, "&lt;");
+    case '>':
+        return math_append_token(out, "mo", NULL, "&gt;");
+    case '(':
+    case ')':
+    case '[':
+    case ']':
+    case '|':
+        return math_append_token(out, "mo", "stretchy=\"false\"", 
+                c == '(' ? "(" : c == ')' ? ")" : c == '[' ? "[" 
+                : c == ']' ? "]" : "|");
+    case '~':
+        return math_append(out, "<mtext>&#xA0;</mtext>");
+    case '+':
+    case '=':
+    case ',':
+    case ';':
+    case ':':
+    case '!':
+    case '?':
+    case '/':
+    case '.':
+        math_append(out, "<mo>");
+        strbuf_append(out, start, 1);
+        return math_append(out, "</mo>");
+    }
+
+    /* Letters and symbols typed as they are */
+    if (c >= 0x80 && (len = u8_strmbtouc(&uc, start)) > 0)
+    {
+        state->tex = start + len;
+        math_append(out, "<mi>");
+        strbuf_append(out, start, len);
+        return math_append(out, "</mi>");
+    }
+    return 1;
+}
+
+/* An atom with its subscript, superscript and primes, if any */
+int
+math_parse_scripted(MathState* state, StrBuf* out)
+{
+    StrBuf base;
+    StrBuf sub;
+    StrBuf sup;
+    const char* tag   = NULL;
+    const char* after = NULL;
+    BOOL limits       = FALSE;
+    BOOL has_sub      = FALSE;
+    BOOL has_sup      = FALSE;
+    size_t primes     = 0;
+    int result        = 0;
+
+    memset(&base, 0, sizeof(StrBuf));
+    memset(&sub, 0, sizeof(StrBuf));
+    memset(&sup, 0, sizeof(StrBuf));
+
+    if (*state->tex == '^' || *state->tex == '_')
+        math_append(&base, "<mrow></mrow>");
+    else
+        result = math_parse_atom(state, &base, &limits, &after);
+
+    while (!result)
+    {
+        math_skip_space(state);
+        if (math_at_command(state->tex, "limits"))
+        {
+            state->tex += strlen("\\limits");
+            limits = TRUE;
+        }
+        else if (math_at_command(state->tex, "nolimits"))
+        {
+            state->tex += strlen("\\nolimits");
+            limits = FALSE;
+        }
+        else if (*state->tex == '\'' && !has_sup)
+        {
+            state->tex++;
+            math_append(&sup, "<mo>′</mo>");
+            primes++;
+        }
+        else if (*state->tex == '^' && !has_sup)
+        {
+            state->tex++;
+            has_sup = TRUE;
+            result = math_parse_argument(state, &sup);
+        }
+        else if (*state->tex == '_' && !has_sub)
+        {
+            state->tex++;
+            has_sub = TRUE;
+            result = math_parse_argument(state, &sub);
+        }
+        else if (*state->tex == '\'' || *state->tex == '^' 
+                || *state->tex == '_')
+            result = 1;
+        else
+            break;
+    }
+
+    if (!result)
+    {
+        if (has_sub && (has_sup || primes))
+            tag = limits ? "munderover" : "msubsup";
+        else if (has_sub)
+            tag = limits ? "munder" : "msub";
+        else if (has_sup || primes)
+            tag = limits ? "mover" : "msup";
+
+        if (tag)
+        {
+            math_append(out, "<");
+            math_append(out, tag);
+            math_append(out, ">");
+        }
+        strbuf_append(out, base.text, base.len);
+        if (sub.len)
+            strbuf_append(out, sub.text, sub.len);
+        if (primes + has_sup > 1)
+            math_append(out, "<mrow>");
+        if (sup.len)
+            strbuf_append(out, sup.text, sup.len);
+        if (primes + has_sup > 1)
+            math_append(out, "</mrow>");
+        if (tag)
+        {
+            math_append(out, "</");
+            math_append(out, tag);
+            math_append(out, ">");
+        }
+        if (after)
+            math_append(out, after);
+    }
+
+    free_strbuf(&base);
+    free_strbuf(&sub);
+    free_strbuf(&sup);
+    return result;
+}
+
+/*
+ * Atoms until the end of the formula, a closing brace or bracket, & or \\
+ * of a table, \right or \end, which the caller checks
+ */
+int
+math_parse_list(MathState* state, StrBuf* out, uint8_t close)
+{
+    const MathSymbol* symbol = NULL;
+    MathState peek;
+    const char* variant      = state->variant;
+    BOOL display             = state->display;
+    size_t styles            = 0;
+    int result               = 0;
+    char name[MATH_COMMAND_MAX];
+
+    if (++state->depth > MATH_DEPTH_MAX)
+        return 1;
+
+    while (!result)
+    {
+        math_skip_space(state);
+        if (!*state->tex || *state->tex == '&' 
+                || (close && *state->tex == close)
+                || math_at_command(state->tex, "\\")
+                || math_at_command(state->tex, "right")
+                || math_at_command(state->tex, "end"))
+            break;
+        if (*state->tex == '}')
+        {
+            result = 1;
+            break;
+        }
+
+        /* \displaystyle, \textstyle and \rm apply to the rest of the list */
+        peek = *state;
+        symbol = NULL;
+        if (*state->tex == '\\' && math_read_command(&peek, name))
+            symbol = find_math_symbol(name);
+        if (symbol && symbol->kind == MATH_FONT_SWITCH)
+        {
+            *state = peek;
+            state->variant = symbol->text;
+            continue;
+        }
+        if (symbol && symbol->kind == MATH_STYLE)
+        {
+            *state = peek;
+            state->display = !strcmp(symbol->text, "true");
+            math_append(out, "<mstyle displaystyle=\"");
+            math_append(out, symbol->text);
+            math_append(out, "\">");
+            styles++;
+            continue;
+        }
+
+        result = math_parse_scripted(state, out);
+    }
+
+    while (styles--)
+        math_append(out, "</mstyle>");
+    state->variant = variant;
+    state->display = display;
+    state->depth--;
+    return result;
+}
+
+/*
+ * Converts a formula written in the common subset of TeX to MathML,
+ * returning nonzero for anything outside of it, to be left to katex
+ */
+int
+render_formula_mathml(const uint8_t* tex, BOOL display, StrBuf* out)
+{
+    MathState state;
+    StrBuf mathml;
+    int result = 0;
+
+    memset(&state, 0, sizeof(MathState));
+    memset(&mathml, 0, sizeof(StrBuf));
+    state.tex = tex;
+    state.display = display;
+
+    result = math_parse_list(&state, &mathml, 0);
+    if (!result && *state.tex)
+        result = 1;
+    if (!result)
+    {
+        math_append(out, display 
+                ? "<math xmlns=\"http://www.w3.org/1998/Math/MathML\""
+                    " display=\"block\">"
+                : "<math xmlns=\"http://www.w3.org/1998/Math/MathML\">");
+        math_append(out, "<semantics><mrow>");
+        if (mathml.len)
+            strbuf_append(out, mathml.text, mathml.len);
+        math_append(out, "</mrow><annotation encoding=\"application/x-tex\">");
+        math_append_escaped(out, tex, u8_strlen(tex), FALSE);
+        math_append(out, "</annotation></semantics></math>");
+    }
+
+    free_strbuf(&mathml);
+    return result;
+}
+
+long
+count_jobs()
+{
+    long jobs = parse_jobs ? parse_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+
+    return jobs > 1 ? jobs : 1;
+}
+
+Formula*
+find_formula(const uint8_t* text, BOOL display)
+{
+    Formula* formula = formulas;
+
+    while (formula < formulas + formulas_count)
+    {
+        if (formula->display == display && !u8_strcmp(formula->text, text))
+            return formula;
+        formula++;
+    }
+    return NULL;
+}
+
+int
+add_formula(const uint8_t* text, BOOL display)
+{
+    Formula* formula = NULL;
+
+    if (find_formula(text, display))
+        return 0;
+
+    formulas_count++;
+    REALLOCARRAY(formulas, Formula, formulas_count)
+    formula = formulas + formulas_count - 1;
+    memset(formula, 0, sizeof(Formula));
+    formula->text = u8_strdup(text);
+    CHECKEXITNOMEM(formula->text)
+    formula->display = display;
+    return 0;
+}
+
+int
+free_formulas()
+{
+    Formula* formula = formulas;
+
+    while (formula < formulas + formulas_count)
+    {
+        free(formula->text);
+        free_strbuf(&formula->html);
+        formula++;
+    }
+    free(formulas);
+    formulas = NULL;
+    formulas_count = 0;
+    return 0;
+}
+
+/* Runs the renderer on every formula found by the first pass, several at a
+ * time, so that a page waits for the slowest formula rather than for all */
+int
+render_formulas()
+{
+    CommandJob* jobs  = NULL;
+    size_t* pending   = NULL;
+    size_t jobs_count = 0;
+    size_t formula    = 0;
+
+    if (!formulas_count)
+        return 0;
+
+    CALLOC(jobs, CommandJob, formulas_count)
+    CALLOC(pending, size_t, formulas_count)
+    for (formula = 0; formula < formulas_count; formula++)
+    {
+        CommandJob* job = jobs + jobs_count;
+        Formula* pformula = formulas + formula;
+
+        if (!use_katex && !render_formula_mathml(pformula->text, 
+                    pformula->display, &pformula->html))
+        {
+            pformula->rendered = TRUE;
+            formulas_native++;
+            continue;
+        }
+
+        init_command_job(job, CMD_KATEX, pformula->display 
+                ? CMD_KATEX_DISPLAY_ARGS : CMD_KATEX_INLINE_ARGS);
+        strbuf_append(&job->input, pformula->text, 
+                u8_strlen(pformula->text));
+        strbuf_append(&job->input, (uint8_t*)"\n", 1);
+        pending[jobs_count++] = formula;
+    }
+
+    if (jobs_count)
+        run_command_jobs(jobs, jobs_count, count_jobs());
+
+    for (formula = 0; formula < jobs_count; formula++)
+    {
+        CommandJob* job = jobs + formula;
+        Formula* pformula = formulas + pending[formula];
+
+        strip_command_newlines(&job->output);
+        pformula->html = job->output;
+        pformula->result = job->status;
+        pformula->rendered = TRUE;
+        memset(&job->output, 0, sizeof(StrBuf));
+        free_command_job(job);
+    }
+    formulas_katex += jobs_count;
+
+    free(pending);
+    free(jobs);
+    return 0;
+}
+
+int
+process_formula(FILE* output, const uint8_t* token, BOOL display_formula)
+{
+    int result           = 0;
+    const uint8_t* pipe_args[] = { token, NULL};
+    Formula* formula     = find_formula(token, display_formula);
+    StrBuf mathml;
+
+    memset(&mathml, 0, sizeof(StrBuf));
+    if (formula && formula->rendered)
+    {
+        if (formula->html.len)
+            print_output(output, "%s", formula->html.text);
+        result = formula->result;
+    }
+    else if (!use_katex 
+            && !render_formula_mathml(token, display_formula, &mathml))
+    {
+        print_output(output, "%s", mathml.text);
+        formulas_native++;
+    }
+    else
+    {
+        result = print_command(CMD_KATEX, 
+                display_formula 
+                    ? (const uint8_t**)CMD_KATEX_DISPLAY_ARGS 
+                    : (const uint8_t**)CMD_KATEX_INLINE_ARGS,
+                (const uint8_t**)pipe_args, output, TRUE);
+        formulas_katex++;
+    }
+    free_strbuf(&mathml);
+
+    if (result)
+        print_output(output, "%s$%s$%s", 
+                display_formula ? "$" : "",
+                token,
+                display_formula ? "$" : "");
+
+    return result;
+}
+
+const char*
+plugin_get_var(const char* name)
+{
+    return (const char*)get_value(vars, vars_count, (uint8_t*)name, NULL);
+}
+
+const char*
+plugin_get_macro(const char* name)
+{
+    return (const char*)get_value(macros, macros_count, (uint8_t*)name, NULL);
+}
+
+int
+plugin_write(SlwebSink* sink, const char* text, size_t len)
+{
+    if (!sink || !text)
+        return 1;
+
+    if (sink->buffer)
+    {
+        if (len)
+            strbuf_append(sink->buffer, (const uint8_t*)text, len);
+    }
+    else
+        print_output(sink->output, "%.*s", (int)len, text);
+    return 0;
+}
+
+const PluginDirective*
+find_plugin_directive(const uint8_t* name, size_t len)
+{
+    for (size_t i = 0; i < plugin_directives_count; i++)
+        if (!strncmp(plugin_directives[i].name, (char*)name, len)
+                && !plugin_directives[i].name[len])
+            return plugin_directives + i;
+    return NULL;
+}
+
+PluginCall*
+find_plugin_call(const uint8_t* text)
+{
+    PluginCall* call = plugin_calls;
+
+    while (call < plugin_calls + plugin_calls_count)
+    {
+        if (!u8_strcmp(call->text, text))
+            return call;
+        call++;
+    }
+    return NULL;
+}
+
+int
+free_plugin_calls()
+{
+    PluginCall* call = plugin_calls;
+
+    while (call < plugin_calls + plugin_calls_count)
+    {
+        free(call->text);
+        free_strbuf(&call->html);
+        call++;
+    }
+    free(plugin_calls);
+    plugin_calls = NULL;
+    plugin_calls_count = 0;
+    return 0;
+}
+
+/* Parsing only records plugin directives; they are run when output */
+int
+directive_plugin(uint8_t* token, ParsedDoc* doc, 
+        BOOL read_yaml_macros_and_links, BOOL* skip_eol, BOOL end_tag)
+{
+    const PluginDirective* directive = find_plugin_directive(token, 
+            strcspn((char*)token, " "));
+
+    if (end_tag || !directive)
+        return 0;
+
+    if (!read_yaml_macros_and_links)
+        add_text_node(doc, NODE_PLUGIN, 0, token);
+    else if (directive->flags & SLWEB_DIRECTIVE_THREADED 
+            && !find_plugin_call(token))
+    {
+        PluginCall* call = NULL;
+
+        plugin_calls_count++;
+        REALLOCARRAY(plugin_calls, PluginCall, plugin_calls_count)
+        call = plugin_calls + plugin_calls_count - 1;
+        memset(call, 0, sizeof(PluginCall));
+        call->text = u8_strdup(token);
+        CHECKEXITNOMEM(call->text)
+        call->directive = directive - plugin_directives;
+    }
+    return 0;
+}
+
+int
+plugin_register_directive(const char* name, SlwebDirective function,
+        int flags, void* data)
+{
+    PluginDirective* directive = NULL;
+
+    if (!plugins_loading)
+        return warning(1, (uint8_t*)"%s: Directives can only be registered"
+                " when the plugin is loaded", name ? name : "");
+
+    if (!function || register_directive(name, directive_plugin))
+        return 1;
+
+    plugin_directives_count++;
+    REALLOCARRAY(plugin_directives, PluginDirective, plugin_directives_count)
+    directive = plugin_directives + plugin_directives_count - 1;
+    directive->name = strdup(name);
+    CHECKEXITNOMEM(directive->name)
+    directive->function = function;
+    directive->flags = flags;
+    directive->data = data;
+
+    /* Pages parsed without the plugin must not be taken from the cache */
+    plugin_directives_hash = plugin_directives_hash * 31 
+        + hash_buffer((uint8_t*)name, strlen(name));
+    return 0;
+}
+
+static const SlwebHost plugin_host = {
+    SLWEB_PLUGIN_VERSION,
+    plugin_get_var,
+    plugin_get_macro,
+    plugin_write,
+    plugin_register_directive
+};
+
+int
+load_plugin(const char* filename)
+{
+    void* library = NULL;
+    int (*init)(const SlwebHost* host);
+    int result = 0;
+
+    /* A name without a slash would be searched for, not taken as a path */
+    if (!strchr(filename, '/'))
+    {
+        char* path = NULL;
+
+        CALLOC(path, char, strlen(filename) + 3)
+        sprintf(path, "./%s", filename);
+        library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+        free(path);
+    }
+    else
+        library = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+
+    if (!library)
+        return error(1, (uint8_t*)"--plugin: %s", dlerror());
+
+    *(void**)&init = dlsym(library, "slweb_plugin_init");
+    if (!init)
+        return error(1, (uint8_t*)"--plugin: '%s' has no slweb_plugin_init",
+                filename);
+
+    plugins_loading = TRUE;
+    result = init(&plugin_host);
+    plugins_loading = FALSE;
+
+    if (result)
+        return error(result, (uint8_t*)"--plugin: '%s' failed to initialize",
+                filename);
+    return 0;
+}
+
+/* Splits the directive in place into its name and arguments */
+char**
+split_plugin_args(char* text, int* argc)
+{
+    char** argv = NULL;
+    char* ptext = text;
+
+    CALLOC(argv, char*, strlen(text) / 2 + 2)
+    *argc = 0;
+    while (*ptext)
+    {
+        while (*ptext == ' ')
+            ptext++;
+        if (!*ptext)
+            break;
+
+        if (*ptext == '"')
+        {
+            argv[(*argc)++] = ++ptext;
+            while (*ptext && *ptext != '"')
+                ptext++;
+        }
+        else
+        {
+            argv[(*argc)++] = ptext;
+            while (*ptext && *ptext != ' ')
+                ptext++;
+        }
+        if (*ptext)
+            *ptext++ = 0;
+    }
+    argv[*argc] = NULL;
+    return argv;
+}
+
+int
+run_plugin_directive(const PluginDirective* directive, const uint8_t* text,
+        SlwebSink* sink)
+{
+    char* args = strdup((const char*)text);
+    char** argv = NULL;
+    int argc = 0;
+    int result = 0;
+
+    CHECKEXITNOMEM(args)
+    argv = split_plugin_args(args, &argc);
+    result = directive->function(&plugin_host, sink, argc, argv, 
+            directive->data);
+    free(argv);
+    free(args);
+    return result;
+}
+
+void*
+plugin_thread(void* arg)
+{
+    PluginPool* pool = arg;
+
+    for (;;)
+    {
+        PluginCall* call = NULL;
+        SlwebSink sink = { NULL, NULL };
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next < plugin_calls_count)
+            call = plugin_calls + pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (!call)
+            break;
+
+        sink.buffer = &call->html;
+        call->result = run_plugin_directive(
+                plugin_directives + call->directive, call->text, &sink);
+        call->rendered = TRUE;
+    }
+    return NULL;
+}
+
+/* Runs the threaded plugin directives found by the first pass, up to
+ * --jobs at a time */
+int
+render_plugin_calls()
+{
+    PluginPool pool;
+    pthread_t* threads   = NULL;
+    size_t threads_count = count_jobs();
+    size_t thread        = 0;
+    BOOL recording       = include_recording;
+
+    if (!plugin_calls_count)
+        return 0;
+
+    /* Lookups would record dependencies from several threads at once; a
+     * page served by --serve, the only one recording here, needs only its
+     * files */
+    include_recording = FALSE;
+
+    if (threads_count > plugin_calls_count)
+        threads_count = plugin_calls_count;
+
+    memset(&pool, 0, sizeof(PluginPool));
+    pthread_mutex_init(&pool.lock, NULL);
+    CALLOC(threads, pthread_t, threads_count)
+    for (thread = 0; thread < threads_count; thread++)
+        if (pthread_create(threads + thread, NULL, plugin_thread, &pool))
+            break;
+
+    /* With no thread at all, they are run as they are output */
+    threads_count = thread;
+    for (thread = 0; thread < threads_count; thread++)
+        pthread_join(threads[thread], NULL);
+
+    pthread_mutex_destroy(&pool.lock);
+    free(threads);
+    include_recording = recording;
+    return 0;
+}
+
+int
+process_plugin_directive(FILE* output, const uint8_t* text)
+{
+    const PluginDirective* directive = find_plugin_directive(text,
+            strcspn((char*)text, " "));
+    PluginCall* call = NULL;
+    SlwebSink sink = { output, NULL };
+    int result = 0;
+
+    if (!directive)
+        return warning(1, (uint8_t*)"%s: Plugin directive not loaded", text);
+
+    if (directive->flags & SLWEB_DIRECTIVE_THREADED)
+        call = find_plugin_call(text);
+
+    if (call && call->rendered)
+    {
+        plugin_write(&sink, (const char*)call->html.text, call->html.len);
+        result = call->result;
+    }
+    else
+        result = run_plugin_directive(directive, text, &sink);
+
+    if (result)
+        warning(1, (uint8_t*)"%s: Plugin directive failed", directive->name);
+    return result;
+}
+
+const uint8_t*
+skip_css_string(const uint8_t* pcss, const uint8_t* end)
+{
+    uint8_t quote = *pcss++;
+
+    while (pcss < end && *pcss != quote)
+    {
+        if (*pcss == '\\' && pcss + 1 < end)
+            pcss++;
+        pcss++;
+    }
+    return pcss < end ? pcss + 1 : end;
+}
+
+/* 
+ * A colon followed by ; or } before any { separates a property from its
+ * value; others, as in "a :hover", are part of a selector
+ */
+BOOL
+is_css_declaration_colon(const uint8_t* pcss, const uint8_t* end)
+{
+    while (pcss < end && *pcss != '{' && *pcss != ';' && *pcss != '}')
+        pcss = *pcss == '"' || *pcss == '\'' ? skip_css_string(pcss, end) 
+            : pcss + 1;
+    return pcss == end || *pcss != '{';
+}
+
+/* Removes comments, and whitespace which doesn't separate anything */
+int
+minify_css(const uint8_t* css, size_t len, StrBuf* out)
+{
+    const uint8_t* pcss = css;
+    BOOL space          = FALSE;
+
+    while (pcss < css + len)
+    {
+        uint8_t c = *pcss;
+
+        if (c == '/' && pcss + 1 < css + len && *(pcss+1) == '*')
+        {
+            const char* end = strstr((const char*)pcss + 2, "*/");
+            pcss = end ? (const uint8_t*)end + 2 : css + len;
+            space = TRUE;
+            continue;
+        }
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f')
+        {
+            space = TRUE;
+            pcss++;
+            continue;
+        }
+
+        if (space && out->len && !strchr("{};,>:", *(out->text + out->len - 1))
+                && !strchr("{};,>", c)
+                && !(c == ':' && is_css_declaration_colon(pcss + 1, css + len)))
+            strbuf_append(out, (uint8_t*)" ", 1);
+        space = FALSE;
+
+        if (c == '}' && out->len && *(out->text + out->len - 1) == ';')
+            out->len--;
+
+        if (c == '"' || c == '\'')
+        {
+            const uint8_t* start = pcss++;
+            while (pcss < css + len && *pcss != c && *pcss != '\n')
+            {
+                if (*pcss == '\\' && pcss + 1 < css + len)
+                    pcss++;
+                pcss++;
+            }
+            if (pcss < css + len && *pcss == c)
+                pcss++;
+            strbuf_append(out, start, pcss - start);
+            continue;
+        }
+
+        strbuf_append(out, pcss++, 1);
+    }
+    return 0;
+}
+
+/* The URL of the directory a file is in, if it is under basedir */
+char*
+get_dirname_url(const char* filename)
+{
+    char* path      = realpath(filename, NULL);
+    char* base      = realpath(basedir, NULL);
+    char* url       = NULL;
+    size_t base_len = base && strcmp(base, "/") ? strlen(base) : 0;
+
+    if (path && base && !strncmp(path, base, base_len) 
+            && *(path + base_len) == '/')
+    {
+        *(strrchr(path, '/') + 1) = 0;
+        url = strdup(path + base_len);
+        CHECKEXITNOMEM(url)
+    }
+
+    free(path);
+    free(base);
+    return url;
+}
+
+/* Returns the end of the URL at pcss, inside url() or after @import */
+const uint8_t*
+find_css_url_end(const uint8_t** pcss, const uint8_t* end)
+{
+    const uint8_t* url_end = NULL;
+
+    if (*pcss < end && (**pcss == '"' || **pcss == '\''))
+    {
+        url_end = skip_css_string(*pcss, end);
+        (*pcss)++;
+        return url_end > *pcss && *(url_end - 1) == *(*pcss - 1) 
+            ? url_end - 1 : url_end;
+    }
+
+    url_end = *pcss;
+    while (url_end < end && *url_end != ')' && *url_end != ' ')
+        url_end++;
+    return url_end;
+}
+
+/* Relative URLs have no scheme and don't start with '/' or '#' */
+BOOL
+is_relative_css_url(const uint8_t* url, const uint8_t* end)
+{
+    const uint8_t* purl = url;
+
+    if (url == end || *url == '/' || *url == '#')
+        return FALSE;
+    while (purl < end && (isalnum(*purl) || *purl == '+' || *purl == '-' 
+                || *purl == '.'))
+        purl++;
+    return purl < end && *purl == ':' ? FALSE : TRUE;
+}
+
+/*
+ * Appends minified css, making its relative URLs absolute, as an asset is
+ * served from elsewhere than the file it was made from. Returns nonzero if
+ * there are such URLs but the file isn't under basedir.
+ */
+int
+rewrite_css_urls(const uint8_t* css, size_t len, const char* filename, 
+        StrBuf* out)
+{
+    const uint8_t* end    = css + len;
+    const uint8_t* pcss   = css;
+    const uint8_t* copied = css;
+    char* dir_url         = NULL;
+
+    while (pcss < end)
+    {
+        const uint8_t* url     = NULL;
+        const uint8_t* url_end = NULL;
+
+        if (*pcss == '"' || *pcss == '\'')
+        {
+            pcss = skip_css_string(pcss, end);
+            continue;
+        }
+
+        if (pcss > css && is_code_word_char(*(pcss - 1), TRUE))
+            url = NULL;
+        else if (end - pcss > 4 && !strncasecmp((char*)pcss, "url(", 4))
+            url = pcss + 4;
+        else if (end - pcss > 7 && !strncasecmp((char*)pcss, "@import", 7))
+            url = pcss + 7;
+
+        if (!url)
+        {
+            pcss++;
+            continue;
+        }
+
+        while (url < end && *url == ' ')
+            url++;
+        /* @import url(...) is taken as url(...) */
+        if (*pcss == '@' && url < end && *url != '"' && *url != '\'')
+        {
+            pcss = url;
+            continue;
+        }
+
+        pcss = url;
+        url_end = find_css_url_end(&url, end);
+        if (is_relative_css_url(url, url_end))
+        {
+            if (!dir_url && !(dir_url = get_dirname_url(filename)))
+                return 1;
+            strbuf_append(out, copied, url - copied);
+            strbuf_append(out, (uint8_t*)dir_url, strlen(dir_url));
+            copied = url;
+        }
+        /* Past the closing quote, if any */
+        pcss = url > pcss && url_end < end ? url_end + 1 : url_end;
+    }
+
+    strbuf_append(out, copied, end - copied);
+    free(dir_url);
+    return 0;
+}
+
+/*
+ * Moves the @charset and @import rules at the start of minified css to
+ * imports, as they are ignored after other rules, and the rest to rules. Only
+ * an @charset which can still come first is kept.
+ */
+int
+split_css_imports(const uint8_t* css, size_t len, StrBuf* imports, 
+        StrBuf* rules)
+{
+    const uint8_t* end  = css + len;
+    const uint8_t* pcss = css;
+
+    while (pcss < end && *pcss == '@')
+    {
+        const uint8_t* rule = pcss;
+        BOOL charset        = end - pcss > 8 
+            && !strncasecmp((char*)pcss, "@charset", 8);
+        int depth           = 0;
+
+        if (!charset && !(end - pcss > 7 
+                    && !strncasecmp((char*)pcss, "@import", 7)))
+            break;
+
+        while (pcss < end && (depth || *pcss != ';'))
+        {
+            if (*pcss == '"' || *pcss == '\'')
+            {
+                pcss = skip_css_string(pcss, end);
+                continue;
+            }
+            if (*pcss == '(')
+                depth++;
+            else if (*pcss == ')' && depth)
+                depth--;
+            pcss++;
+        }
+        if (pcss < end)
+            pcss++;
+
+        if (!charset || (!imports->len && !rules->len))
+            strbuf_append(imports, rule, pcss - rule);
+    }
+
+    strbuf_append(rules, pcss, end - pcss);
+    return 0;
+}
+
+int
+read_asset(const char* filename, StrBuf* buf)
+{
+    FILE* file   = fopen(filename, "r");
+    size_t nread = 0;
+
+    if (!file)
+        return 1;
+
+    do
+    {
+        strbuf_reserve(buf, BUFSIZE);
+        nread = fread(buf->text + buf->len, 1, BUFSIZE, file);
+        buf->len += nread;
+    }
+    while (nread == BUFSIZE);
+    *(buf->text + buf->len) = 0;
+
+    nread = ferror(file);
+    fclose(file);
+    return nread ? 1 : 0;
+}
+
+/* Identifies a file as it is now, by its name and modification time */
+int
+append_file_key(StrBuf* key, const char* filename)
+{
+    struct stat st;
+    char line[KEYSIZE];
+
+    if (stat(filename, &st) < 0)
+        return 1;
+    snprintf(line, KEYSIZE, "%lld.%09ld ", (long long)st.st_mtim.tv_sec,
+            st.st_mtim.tv_nsec);
+    strbuf_append(key, (uint8_t*)line, strlen(line));
+    strbuf_append(key, (uint8_t*)filename, strlen(filename) + 1);
+    return 0;
+}
+
+/* 
+ * Writes an asset named by the hash of its contents and returns its URL, or
+ * NULL if it can't be written. An asset which already exists has the same
+ * contents, so it isn't written again.
+ */
+char*
+publish_asset(const uint8_t* data, size_t len, const char* ext)
+{
+    char* url           = NULL;
+    char* filename      = NULL;
+    char* temp_filename = NULL;
+    char line[KEYSIZE];
+    int fd              = -1;
+
+    CALLOC(url, char, strlen(assets_dir) + KEYSIZE)
+    sprintf(url, "/%s/%016llx.%s", assets_dir, 
+            (unsigned long long)hash_buffer(data, len), ext);
+    CALLOC(filename, char, strlen(basedir) + strlen(url) + 1)
+    sprintf(filename, "%s%s", basedir, url);
+
+    if (!access(filename, F_OK))
+    {
+        free(filename);
+        return url;
+    }
+
+    CALLOC(temp_filename, char, strlen(filename) + KEYSIZE)
+    sprintf(temp_filename, "%s.%ld", filename, (long)getpid());
+    fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || send_all(fd, data, len) || close(fd) < 0)
+    {
+        warning(1, (uint8_t*)"--assets: Cannot write '%s'", filename);
+        unlink(temp_filename);
+        free(temp_filename);
+        free(filename);
+        free(url);
+        return NULL;
+    }
+
+    /* Linked rather than renamed, so that of several processes publishing
+     * the same asset only one adds it to the header map */
+    if (!link(temp_filename, filename))
+    {
+        sprintf(temp_filename, "%s/%s/%s", basedir, assets_dir, 
+                ASSETS_HEADER_MAP);
+        snprintf(line, KEYSIZE, "%s \"%s\";\n", url, ASSETS_CACHE_HEADER);
+        fd = open(temp_filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0 || send_all(fd, (uint8_t*)line, strlen(line)))
+            warning(1, (uint8_t*)"--assets: Cannot write '%s'", 
+                    temp_filename);
+        if (fd >= 0)
+            close(fd);
+        sprintf(temp_filename, "%s.%ld", filename, (long)getpid());
+    }
+    else if (errno != EEXIST)
+        warning(1, (uint8_t*)"--assets: Cannot write '%s'", filename);
+    unlink(temp_filename);
+
+    free(temp_filename);
+    free(filename);
+    return url;
+}
+
+/*
+ * Returns the URL of the asset made by joining the files, minified and with
+ * relative URLs made absolute if they are stylesheets, or NULL if they can't
+ * be read. Each asset is made once per run, unless one of the files changes.
+ */
+char*
+get_asset_url(char** filenames, size_t filenames_count, const char* ext)
+{
+    StrBuf key          = { NULL, 0, 0 };
+    StrBuf contents     = { NULL, 0, 0 };
+    StrBuf minified     = { NULL, 0, 0 };
+    StrBuf rules        = { NULL, 0, 0 };
+    StrBuf asset        = { NULL, 0, 0 };
+    AssetEntry* pentry  = NULL;
+    char* url           = NULL;
+    char** pfilename    = NULL;
+    size_t size         = 0;
+
+    for (pfilename = filenames; pfilename < filenames + filenames_count; 
+            pfilename++)
+        if (append_file_key(&key, *pfilename))
+        {
+            warning(1, (uint8_t*)"--assets: Cannot read '%s'", *pfilename);
+            free_strbuf(&key);
+            return NULL;
+        }
+
+    for (pentry = assets; pentry < assets + assets_count; pentry++)
+        if (pentry->key_len == key.len 
+                && !memcmp(pentry->key, key.text, key.len))
+        {
+            free_strbuf(&key);
+            return pentry->url;
+        }
+
+    for (pfilename = filenames; pfilename < filenames + filenames_count; 
+            pfilename++)
+    {
+        contents.len = 0;
+        if (read_asset(*pfilename, &contents))
+        {
+            warning(1, (uint8_t*)"--assets: Cannot read '%s'", *pfilename);
+            break;
+        }
+        if (!strcmp(ext, "css"))
+        {
+            minified.len = 0;
+            minify_css(contents.text, contents.len, &minified);
+            contents.len = 0;
+            if (rewrite_css_urls(minified.text, minified.len, *pfilename,
+                        &contents))
+            {
+                warning(1, (uint8_t*)"--assets: '%s' has relative URLs and"
+                        " isn't under the base directory, not bundled",
+                        *pfilename);
+                break;
+            }
+            /* The imports of all the sheets go before all of their rules */
+            split_css_imports(contents.text, contents.len, &asset, &rules);
+            strbuf_append(&rules, (uint8_t*)"\n", 1);
+        }
+        else
+            strbuf_append(&asset, contents.text, contents.len);
+    }
+    if (rules.len)
+        strbuf_append(&asset, rules.text, rules.len);
+
+    if (pfilename == filenames + filenames_count 
+            && (url = publish_asset(asset.text, asset.len, ext)))
+    {
+        assets_count++;
+        REALLOCARRAY(assets, AssetEntry, assets_count)
+        pentry = assets + assets_count - 1;
+        pentry->key_len = key.len;
+        pentry->key = (char*)strbuf_detach(&key, &size);
+        pentry->url = url;
+    }
+
+    free_strbuf(&key);
+    free_strbuf(&contents);
+    free_strbuf(&minified);
+    free_strbuf(&rules);
+    free_strbuf(&asset);
+    return url;
+}
+
+/* The file a local URL refers to, if it can be made an asset */
+char*
+get_local_asset_filename(const uint8_t* href)
+{
+    char* filename    = NULL;
+    const char* dir   = NULL;
+
+    if (strstr((char*)href, "://") || startswith((char*)href, "//")
+            || startswith((char*)href, "data:") || strchr((char*)href, '?')
+            || strchr((char*)href, '#'))
+        return NULL;
+
+    dir = *href == '/' ? basedir : input_dirname ? input_dirname : ".";
+    CALLOC(filename, char, strlen(dir) + u8_strlen(href) + 2)
+    sprintf(filename, *href == '/' ? "%s%s" : "%s/%s", dir, (char*)href);
+    return filename;
+}
+
+int
+print_stylesheets(FILE* output, uint8_t** hrefs, char** filenames, 
+        size_t* count)
+{
+    char* url = NULL;
+
+    if (!*count)
+        return 0;
+
+    url = get_asset_url(filenames, *count, "css");
+    if (url)
+        print_output(output, "<link rel=\"stylesheet\" href=\"%s\" />\n", 
+                url);
+
+    for (size_t index = 0; index < *count; index++)
+    {
+        if (!url)
+            print_output(output, "<link rel=\"stylesheet\" href=\"%s\" />\n",
+                    *(hrefs + index));
+        free(*(filenames + index));
+    }
+    *count = 0;
+    return 0;
+}
+
+/* Returns the end of what starts at pcss and is closed by close */
+const uint8_t*
+find_css_close(const uint8_t* pcss, const uint8_t* end, uint8_t close)
+{
+    uint8_t open = close == '}' ? '{' : close == ')' ? '(' : '[';
+    int depth    = 1;
+
+    while (pcss < end)
+    {
+        if (*pcss == '"' || *pcss == '\'')
+        {
+            pcss = skip_css_string(pcss, end);
+            continue;
+        }
+        if (*pcss == open)
+            depth++;
+        else if (*pcss == close && !--depth)
+            return pcss;
+        pcss++;
+    }
+    return end;
+}
+
+/* Splits minified CSS into rules, looking into @media and @supports */
+int
+parse_css(const uint8_t* css, const uint8_t* end, Stylesheet* sheet, 
+        uint8_t* media)
+{
+    const uint8_t* pcss = css;
+
+    while (pcss < end)
+    {
+        const uint8_t* start     = pcss;
+        const uint8_t* block_end = NULL;
+        CssRule* rule            = NULL;
+
+        while (pcss < end && *pcss != '{' && *pcss != ';' && *pcss != '}')
+        {
+            if (*pcss == '"' || *pcss == '\'')
+                pcss = skip_css_string(pcss, end);
+            else
+                pcss++;
+        }
+
+        /* Statements such as @import are left to the linked stylesheet */
+        if (pcss == end || *pcss != '{')
+        {
+            pcss++;
+            continue;
+        }
+
+        block_end = find_css_close(pcss + 1, end, '}');
+        if (!media && (startswith((char*)start, "@media")
+                    || startswith((char*)start, "@supports")))
+        {
+            uint8_t* nested = (uint8_t*)strndup((char*)start, pcss - start);
+            CHECKEXITNOMEM(nested)
+            parse_css(pcss + 1, block_end, sheet, nested);
+        }
+        else
+        {
+            sheet->rules_count++;
+            REALLOCARRAY(sheet->rules, CssRule, sheet->rules_count)
+            rule = sheet->rules + sheet->rules_count - 1;
+            rule->media = media;
+            rule->selector = (uint8_t*)strndup((char*)start, pcss - start);
+            rule->body = (uint8_t*)strndup((char*)pcss + 1, 
+                    block_end - pcss - 1);
+            CHECKEXITNOMEM(rule->selector)
+            CHECKEXITNOMEM(rule->body)
+            rule->always = *start == '@';
+        }
+        pcss = block_end + 1;
+    }
+    return 0;
+}
+
+Stylesheet*
+get_stylesheet(const char* filename)
+{
+    StrBuf key          = { NULL, 0, 0 };
+    StrBuf css          = { NULL, 0, 0 };
+    StrBuf minified     = { NULL, 0, 0 };
+    Stylesheet** psheet = NULL;
+    Stylesheet* sheet   = NULL;
+    size_t size         = 0;
+
+    if (append_file_key(&key, filename))
+    {
+        warning(1, (uint8_t*)"--inline-css: Cannot read '%s'", filename);
+        return NULL;
+    }
+
+    for (psheet = stylesheets; psheet < stylesheets + stylesheets_count; 
+            psheet++)
+        if (!strcmp((*psheet)->key, (char*)key.text))
+        {
+            free_strbuf(&key);
+            return *psheet;
+        }
+
+    if (read_asset(filename, &css))
+    {
+        warning(1, (uint8_t*)"--inline-css: Cannot read '%s'", filename);
+        free_strbuf(&key);
+        free_strbuf(&css);
+        return NULL;
+    }
+
+    minify_css(css.text, css.len, &minified);
+    strbuf_reserve(&minified, 0);
+
+    CALLOC(sheet, Stylesheet, 1)
+    sheet->key = (char*)strbuf_detach(&key, &size);
+    sheet->len = minified.len;
+    sheet->text = strbuf_detach(&minified, &size);
+    parse_css(sheet->text, sheet->text + sheet->len, sheet, NULL);
+
+    stylesheets_count++;
+    REALLOCARRAY(stylesheets, Stylesheet*, stylesheets_count)
+    *(stylesheets + stylesheets_count - 1) = sheet;
+
+    free_strbuf(&css);
+    return sheet;
+}
+
+/* Names are kept as "\nname\n", so that each can be found with memmem */
+BOOL
+has_page_name(const StrBuf* names, const uint8_t* name, size_t len)
+{
+    uint8_t pattern[KEYSIZE];
+
+    if (len + 2 > KEYSIZE)
+        return FALSE;
+    *pattern = '\n';
+    memcpy(pattern + 1, name, len);
+    *(pattern + len + 1) = '\n';
+    return memmem(names->text, names->len, pattern, len + 2) ? TRUE : FALSE;
+}
+
+int
+add_page_name(StrBuf* names, const uint8_t* name, size_t len)
+{
+    if (!len || has_page_name(names, name, len))
+        return 0;
+    strbuf_append(names, name, len);
+    strbuf_append(names, (uint8_t*)"\n", 1);
+    return 0;
+}
+
+/* Adds words separated by whitespace, each with the prefix, if any */
+int
+add_page_words(StrBuf* names, const uint8_t* words, const uint8_t* end, 
+        uint8_t prefix)
+{
+    uint8_t name[KEYSIZE];
+    const uint8_t* pwords = words;
+
+    while (pwords < end)
+    {
+        const uint8_t* start = pwords;
+        while (pwords < end && !isspace(*pwords))
+            pwords++;
+        if (pwords > start && pwords - start < KEYSIZE - 1)
+        {
+            size_t len = 0;
+            if (prefix)
+                *(name + len++) = prefix;
+            memcpy(name + len, start, pwords - start);
+            add_page_name(names, name, len + (pwords - start));
+        }
+        while (pwords < end && isspace(*pwords))
+            pwords++;
+    }
+    return 0;
+}
+
+/* Element names, ids and classes in HTML written as is into the document */
+int
+add_html_names(StrBuf* names, const uint8_t* html)
+{
+    const uint8_t* phtml = html;
+
+    while ((phtml = (uint8_t*)strchr((char*)phtml, '<')))
+    {
+        const uint8_t* start = ++phtml;
+        uint8_t name[KEYSIZE];
+        size_t len = 0;
+
+        while (isalnum(*phtml) || *phtml == '-')
+        {
+            if (len < KEYSIZE - 1)
+                *(name + len++) = tolower(*phtml);
+            phtml++;
+        }
+        if (phtml == start || !isalpha(*start))
+            continue;
+        add_page_name(names, name, len);
+
+        while (*phtml && *phtml != '>')
+        {
+            BOOL is_class = startswith((char*)phtml, "class=");
+            BOOL is_id    = startswith((char*)phtml, "id=");
+            uint8_t quote = 0;
+
+            if (!(is_class || is_id) || !isspace(*(phtml-1)))
+            {
+                phtml++;
+                continue;
+            }
+            phtml += is_class ? strlen("class=") : strlen("id=");
+            if (*phtml == '"' || *phtml == '\'')
+                quote = *phtml++;
+            start = phtml;
+            while (*phtml && (quote ? *phtml != quote 
+                        : !isspace(*phtml) && *phtml != '>'))
+                phtml++;
+            add_page_words(names, start, phtml, is_class ? '.' : '#');
+            if (quote && *phtml)
+                phtml++;
+        }
+    }
+    return 0;
+}
+
+/* What a page prints, read from its nodes before the head is printed */
+int
+get_page_names(const ParsedDoc* doc, StrBuf* names)
+{
+    const Node* node = NULL;
+    const Language* language = NULL;
+    HighlightClass hl_class = HL_NONE;
+    uint8_t name[KEYSIZE];
+
+    strbuf_append(names, (uint8_t*)"\n", 1);
+    for (node = doc->nodes; node < doc->nodes + doc->nodes_count; node++)
+    {
+        const uint8_t* text = span_text(doc, node->text);
+        const uint8_t* ptext = text;
+        const uint8_t* elements = (uint8_t*)node_elements[node->type];
+
+        if (elements)
+            add_page_words(names, elements, elements + u8_strlen(elements), 0);
+
+        switch (node->type)
+        {
+        case NODE_HEADING_START:
+            snprintf((char*)name, KEYSIZE, "h%d", node->number);
+            add_page_name(names, name, u8_strlen(name));
+            break;
+        case NODE_TAG:
+            /* As printed by print_tag */
+            while (*ptext && *ptext != '#' && *ptext != '.')
+                ptext++;
+            if (ptext == text)
+                add_page_name(names, (uint8_t*)"div", 3);
+            else
+                add_page_name(names, text, ptext - text);
+            while (*ptext)
+            {
+                uint8_t prefix = *ptext++;
+                text = ptext;
+                while (*ptext && *ptext != (prefix == '#' ? '.' : '#'))
+                    ptext++;
+                add_page_words(names, text, ptext, prefix);
+            }
+            break;
+        case NODE_TEXT:
+            add_html_names(names, text);
+            break;
+        case NODE_PRE:
+            if (node->text.len && (language = get_code_language(text)))
+            {
+                add_page_name(names, (uint8_t*)"span", 4);
+                for (hl_class = HL_KEYWORD; hl_class < HL_END; hl_class++)
+                    add_page_words(names, 
+                            (uint8_t*)highlight_classes[hl_class],
+                            (uint8_t*)highlight_classes[hl_class] 
+                            + strlen(highlight_classes[hl_class]), '.');
+                snprintf((char*)name, KEYSIZE, ".language-%.*s", 
+                        (int)strcspn(language->names, " "), language->names);
+                add_page_name(names, name, u8_strlen(name));
+            }
+            break;
+        case NODE_MACRO:
+            if ((node->flags & NODE_FLAG_SITE ? site_macros 
+                        : macros)[node->number].value)
+                add_html_names(names, (node->flags & NODE_FLAG_SITE 
+                            ? site_macros : macros)[node->number].value);
+            break;
+        default:
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Whether all element names, ids and classes in the selector are printed */
+BOOL
+selector_matches(const uint8_t* selector, const uint8_t* end, 
+        const StrBuf* names)
+{
+    const uint8_t* pselector = selector;
+    uint8_t name[KEYSIZE];
+
+    while (pselector < end)
+    {
+        uint8_t prefix = 0;
+        size_t len     = 0;
+
+        if (*pselector == '(' || *pselector == '[')
+        {
+            pselector = find_css_close(pselector + 1, end, 
+                    *pselector == '(' ? ')' : ']') + 1;
+            continue;
+        }
+        if (*pselector == '"' || *pselector == '\'')
+        {
+            pselector = skip_css_string(pselector, end);
+            continue;
+        }
+        if (*pselector == ':')
+        {
+            /* Pseudo-classes and pseudo-elements don't narrow it down */
+            while (pselector < end && *pselector == ':')
+                pselector++;
+            while (pselector < end && (isalnum(*pselector) 
+                        || *pselector == '-' || *pselector == '_'))
+                pselector++;
+            continue;
+        }
+        if (*pselector == '.' || *pselector == '#')
+            prefix = *pselector++;
+        else if (!isalpha(*pselector) && *pselector != '_' 
+                && *pselector < 0x80)
+        {
+            pselector++;
+            continue;
+        }
+
+        if (prefix)
+            *(name + len++) = prefix;
+        while (pselector < end && (isalnum(*pselector) || *pselector == '-'
+                    || *pselector == '_' || *pselector >= 0x80 
+                    || *pselector == '\\'))
+        {
+            if (*pselector == '\\' && pselector + 1 < end)
+                pselector++;
+            if (len < KEYSIZE - 1)
+                *(name + len++) = prefix ? *pselector : tolower(*pselector);
+            pselector++;
+        }
+        if (!has_page_name(names, name, len))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Whether any of the comma-separated selectors matches */
+BOOL
+rule_matches(const CssRule* rule, const StrBuf* names)
+{
+    const uint8_t* pselector = rule->selector;
+    const uint8_t* end       = rule->selector + u8_strlen(rule->selector);
+
+    if (rule->always)
+        return TRUE;
+
+    while (pselector < end)
+    {
+        const uint8_t* start = pselector;
+        while (pselector < end && *pselector != ',')
+        {
+            if (*pselector == '(' || *pselector == '[')
+                pselector = find_css_close(pselector + 1, end, 
+                        *pselector == '(' ? ')' : ']');
+            else if (*pselector == '"' || *pselector == '\'')
+            {
+                pselector = skip_css_string(pselector, end);
+                continue;
+            }
+            if (pselector < end)
+                pselector++;
+        }
+        if (selector_matches(start, pselector, names))
+            return TRUE;
+        pselector++;
+    }
+    return FALSE;
+}
+
+/* 
+ * Inlines the stylesheet if it's small, and otherwise only the rules which
+ * apply to what the page prints, loading the whole of it afterwards
+ */
+int
+print_inline_stylesheet(FILE* output, const Stylesheet* sheet, 
+        const uint8_t* href, const StrBuf* names)
+{
+    const CssRule* prule = NULL;
+    const uint8_t* media = NULL;
+
+    if (sheet->len <= inline_css_limit)
+    {
+        print_output(output, "<style>%s</style>\n", sheet->text);
+        return 0;
+    }
+
+    print_output(output, "<style>");
+    for (prule = sheet->rules; prule < sheet->rules + sheet->rules_count; 
+            prule++)
+    {
+        if (!rule_matches(prule, names))
+            continue;
+        if (prule->media != media)
+        {
+            if (media)
+                print_output(output, "}");
+            if (prule->media)
+                print_output(output, "%s{", prule->media);
+            media = prule->media;
+        }
+        print_output(output, "%s{%s}", prule->selector, prule->body);
+    }
+    if (media)
+        print_output(output, "}");
+    print_output(output, "</style>\n");
+
+    print_output(output, "<link rel=\"stylesheet\" href=\"%s\""
+            " media=\"print\" onload=\"this.media='all'\" />\n"
+            "<noscript><link rel=\"stylesheet\" href=\"%s\" /></noscript>\n",
+            href, href);
+    return 0;
+}
+
+int
+begin_html_and_head(FILE* output)
+{
+    uint8_t* lang        = get_value(vars, vars_count, (uint8_t*)"lang", NULL);
+    uint8_t* site_name   = get_value(vars, vars_count, (uint8_t*)"site-name", NULL);
+    uint8_t* site_desc   = get_value(vars, vars_count, (uint8_t*)"site-desc", NULL);
+    uint8_t* canonical   = get_value(vars, vars_count, (uint8_t*)"canonical", NULL);
+    uint8_t* favicon_url = get_value(vars, vars_count, (uint8_t*)"favicon-url", NULL);
+    uint8_t* meta        = get_value(vars, vars_count, (uint8_t*)"meta", NULL);
+
+    uint8_t* feed        = get_value(vars, vars_count, (uint8_t*)"feed", NULL);
+    uint8_t* feed_desc   = get_value(vars, vars_count, (uint8_t*)"feed-desc", NULL);
+
+    print_output(output, "<!DOCTYPE html>\n"
+            "<html lang=\"%s\">\n"
+            "<head>\n"
+            "<title>%s</title>\n"
+            "<meta charset=\"utf-8\" />\n",
+            lang ? (char*)lang : "en",
+            site_name ? (char*)site_name : "");
+
+    char* favicon = NULL;
+    CALLOC(favicon, char, BUFSIZE)
+    snprintf(favicon, BUFSIZE-1, "%s/favicon.ico", basedir);
+    if (!access(favicon, R_OK))
+    {
+        const char* ext = favicon_url 
+            ? strrchr((char*)favicon_url, '.') : NULL;
+        char* url       = NULL;
+
+        /* A favicon-url naming a local file is published like the default */
+        if (assets_dir && favicon_url)
+        {
+            free(favicon);
+            favicon = get_local_asset_filename(favicon_url);
+        }
+        if (assets_dir && favicon && !access(favicon, R_OK))
+            url = get_asset_url(&favicon, 1, ext && !strchr(ext, '/') 
+                    ? ext + 1 : "ico");
+        print_output(output, "<link rel=\"shortcut icon\" type=\"image/x-icon\""
+                " href=\"%s\" />\n", url ? url : favicon_url 
+                ? (char*)favicon_url : "/favicon.ico");
+    }
+    free(favicon);
+   
+    if (meta)
+    {
+        char* filename = NULL;
+        CALLOC(filename, char, BUFSIZE)
+        snprintf(filename, BUFSIZE, "%s/%s", input_dirname, (char*)meta);
+        read_csv(output, filename, &print_meta_var);
+        free(filename);
+    }
+
+    if (canonical && *canonical)
+        print_output(output, "<link rel=\"canonical\" href=\"%s\" />\n",
+                (char*)canonical);
+
+    if (feed && *feed && feed_desc && *feed_desc)
+        print_output(output, "<link rel=\"alternate\""
+                " type=\"application/rss+xml\" href=\"%s\" title=\"%s\" />\n",
+                (char*)feed, (char*)feed_desc);
+
+    if (site_desc && *site_desc)
+        print_output(output, "<meta name=\"description\" content=\"%s\" />\n",
+                (char*)site_desc);
+
+    print_output(output, "<meta name=\"viewport\" content=\"width=device-width,"
+            " initial-scale=1\" />\n<meta name=\"generator\" content=\"slweb\" />\n");
+    return 0;
+}
+
+int
+add_css(FILE* output, const ParsedDoc* doc)
+{
+    KeyValue* list = vars;
+    size_t list_count = vars_count;
+    KeyValue* pvars = NULL;
+    uint8_t** hrefs = NULL;
+    char** filenames = NULL;
+    size_t bundled = 0;
+    StrBuf names = { NULL, 0, 0 };
+
+    /* Site stylesheets are used only by pages which don't have their own */
+    if (!find_keyvalue(vars, vars_count, (uint8_t*)"stylesheet"))
+    {
+        list = site_vars;
+        list_count = site_vars_count;
+    }
+
+    /* With --assets, each run of local stylesheets becomes one bundle;
+     * --inline-css puts them in the page instead */
+    CALLOC(hrefs, uint8_t*, list_count + 1)
+    CALLOC(filenames, char*, list_count + 1)
+
+    pvars = list;
+    while (pvars < list + list_count)
+    {
+        if (!u8_strcmp(pvars->key, (uint8_t*)"stylesheet"))
+        {
+            char* filename = (assets_dir || inline_css) && pvars->value 
+                ? get_local_asset_filename(pvars->value) : NULL;
+            Stylesheet* sheet = filename && inline_css 
+                ? get_stylesheet(filename) : NULL;
+
+            if (sheet)
+            {
+                char* url = NULL;
+
+                print_stylesheets(output, hrefs, filenames, &bundled);
+                if (!names.len)
+                    get_page_names(doc, &names);
+                if (assets_dir && sheet->len > inline_css_limit)
+                    url = get_asset_url(&filename, 1, "css");
+                print_inline_stylesheet(output, sheet, 
+                        url ? (uint8_t*)url : pvars->value, &names);
+                free(filename);
+            }
+            else if (filename && assets_dir)
+            {
+                *(hrefs + bundled) = pvars->value;
+                *(filenames + bundled) = filename;
+                bundled++;
+            }
+            else
+            {
+                free(filename);
+                print_stylesheets(output, hrefs, filenames, &bundled);
+                print_output(output, "<link rel=\"stylesheet\" href=\"%s\" />\n",
+                        pvars->value);
+            }
+        }
+        pvars++;
+    }
+    print_stylesheets(output, hrefs, filenames, &bundled);
+
+    free(hrefs);
+    free(filenames);
+    free_strbuf(&names);
+    return 0;
+}
+
+int
+end_head_start_body(FILE* output)
+{
+    print_output(output, "</head>\n<body>\n");
+
+    return 0;
+}
+
+int
+begin_article(FILE* output, const BOOL add_article_header, 
+        const uint8_t* author, const uint8_t* title, 
+        const uint8_t* header_text, const char* title_heading_level, 
+        uint8_t* date, const BOOL ext_in_permalink, const char* permalink_url,
+        const uint8_t* samedir_permalink, uint8_t* permalink_macro)
+{
+    if (author || date || header_text || title)
+        print_output(output, "<header>\n");
+
+    if (title)
+        print_output(output, "<h%s>%s</h%s>\n", 
+                title_heading_level ? title_heading_level : "2", 
+                (char*)title, 
+                title_heading_level ? title_heading_level : "2");
+
+    if (header_text)
+        print_output(output, "<p>%s</p>\n", (char*)header_text);
+
+    if (author)
+        print_output(output, "<address>%s</address>\n", author);
+
+    if (date && input_filename)
+    {
+        char* link = strip_ext(input_filename);
+        char* real_link = NULL;
+        CALLOC(real_link, char, BUFSIZE)
+
+        if (ext_in_permalink)
+            strncat(link, timestamp_output_ext, BUFSIZE-strlen(link)-1);
+
+        if (permalink_url)
+            process_timestamp(output, permalink_url, permalink_macro, date);
+        else if (samedir_permalink && !u8_strcmp(samedir_permalink, (uint8_t*)"1"))
+        {
+            get_realpath(&real_link, input_dirname, link);
+            process_timestamp(output, real_link, permalink_macro, date);
+        }
+        else
+            process_timestamp(output, link, permalink_macro, date);
+
+        free(real_link);
+        free(link);
+    }
+
+    if (author || date || header_text || title)
+        print_output(output, "</header>\n");
+
+    return 0;
+}
+
+int
+print_article_header(FILE* output, size_t vars_limit, size_t macros_limit)
+{
+    uint8_t* title                  = get_value(vars, vars_limit, 
+            (uint8_t*)"title", NULL);
+    uint8_t* title_heading_level    = get_value(vars, vars_limit,
+            (uint8_t*)"title-heading-level", NULL);
+    uint8_t* header_text            = get_value(vars, vars_limit, 
+            (uint8_t*)"header-text", NULL);
+    uint8_t* author                 = get_value(vars, vars_limit, 
+            (uint8_t*)"author", NULL);
+    uint8_t* date                   = get_value(vars, vars_limit, 
+            (uint8_t*)"date", NULL);
+    uint8_t* permalink_url          = get_value(vars, vars_limit, 
+            (uint8_t*)"permalink-url", NULL);
+    uint8_t* ext_in_permalink       = get_value(vars, vars_limit, 
+            (uint8_t*)"ext-in-permalink", NULL);
+    uint8_t* var_add_article_header = get_value(vars, vars_limit, 
+            (uint8_t*)"add-article-header", NULL);
+    uint8_t* samedir_permalink      = get_value(vars, vars_limit, 
+            (uint8_t*)"samedir-permalink", NULL);
+    uint8_t* permalink_macro        = get_value(macros, macros_limit,
+            (uint8_t*)"permalink", NULL);
+
+    return begin_article(output, 
+            var_add_article_header && *var_add_article_header == '1',
+            author, title, header_text, (char*)title_heading_level, date, 
+            ext_in_permalink && *ext_in_permalink != '0', 
+            (char*)permalink_url, samedir_permalink, permalink_macro);
+}
+
+int
+print_footnote(FILE* output, BOOL inline_footnote, size_t footnote, 
+        uint8_t* text)
+{
+    const char* prefix = inline_footnote ? "inline-" : "";
+
+    print_output(output, "<p id=\"%sfootnote-%d\">"
+            "<a href=\"#%sfootnote-text-%d\">%d.</a> %s</p>\n",
+            prefix, footnote, prefix, footnote, footnote, (char*)text);
+    return 0;
+}
+
+int
+spill_footnotes()
+{
+    ULONG saved_state = state;
+    size_t unspilled  = footnote_count - footnotes_spilled;
+    size_t footnote   = 0;
+
+    if (!footnote_spill || !inline_footnote_spill)
+        return 0;
+
+    /* Printed as they will be output, so that nothing is parsed twice */
+    state &= ~ST_CSV_BODY;
+
+    for (footnote = 0; footnote < inline_footnote_count 
+            - inline_footnotes_spilled; footnote++)
+    {
+        print_footnote(inline_footnote_spill, TRUE, 
+                inline_footnotes_spilled + footnote + 1, 
+                inline_footnotes[footnote]);
+        free(inline_footnotes[footnote]);
+    }
+    inline_footnotes_spilled = inline_footnote_count;
+
+    /* The last footnote may still be reading its text */
+    if (unspilled && (saved_state & ST_FOOTNOTE_TEXT))
+        unspilled--;
+
+    for (footnote = 0; footnote < unspilled; footnote++)
+    {
+        print_footnote(footnote_spill, FALSE, footnotes_spilled + footnote + 1,
+                footnotes[footnote].value);
+        free(footnotes[footnote].key);
+        free(footnotes[footnote].value);
+    }
+    if (unspilled < footnote_count - footnotes_spilled)
+        footnotes[0] = footnotes[unspilled];
+    footnotes_spilled += unspilled;
+    pfootnotes = footnotes;
+
+    state = saved_state;
+    return 0;
+}
+
+int
+print_spilled_footnotes(FILE* output, FILE* spill)
+{
+    uint8_t buf[BUFSIZE];
+    size_t nread = 0;
+
+    if (!spill)
+        return 0;
+
+    rewind(spill);
+    while ((nread = fread(buf, 1, BUFSIZE-1, spill)) > 0)
+    {
+        buf[nread] = 0;
+        print_output(output, "%s", buf);
+    }
+    return 0;
+}
+
+int
+end_footnotes(FILE* output, BOOL add_footnote_div, BOOL para_open)
+{
+    size_t footnote = 0;
+
+    if (para_open)
+        print_output(output, "</p>\n");
+
+    if (add_footnote_div)
+        print_output(output, "<div class=\"footnotes\">\n");
+
+    print_horizontal_rule(output, FALSE);
+
+    print_spilled_footnotes(output, inline_footnote_spill);
+    for (footnote = inline_footnotes_spilled; 
+            footnote < inline_footnote_count; footnote++)
+        print_footnote(output, TRUE, footnote+1,
+                inline_footnotes[footnote - inline_footnotes_spilled]);
+
+    print_spilled_footnotes(output, footnote_spill);
+    KeyValue* pfootnote = footnotes;
+    footnote = footnotes_spilled;
+    while (pfootnote && footnote < footnote_count)
+    {
+        print_footnote(output, FALSE, footnote+1, pfootnote->value);
+        pfootnote++;
+        footnote++;
+    }
+
+    if (add_footnote_div)
+        print_output(output, "</div><!--footnotes-->\n");
+
+    return 0;
+}
+
+int
+end_body_and_html(FILE* output)
+{
+    print_output(output, "</body>\n</html>\n");
+    return 0;
+}
+
+int
+read_parse_flags(BOOL* add_image_links, BOOL* add_figcaption, 
+        BOOL* add_footnote_div)
+{
+    uint8_t* var_add_image_links  = get_value(vars, vars_count, 
+            (uint8_t*)"add-image-links", NULL);
+    uint8_t* var_add_figcaption   = get_value(vars, vars_count, 
+            (uint8_t*)"add-figcaption", NULL);
+    uint8_t* var_add_footnote_div = get_value(vars, vars_count, 
+            (uint8_t*)"add-footnote-div", NULL);
+
+    *add_image_links  = !(var_add_image_links && *var_add_image_links == '0');
+    *add_figcaption   = !(var_add_figcaption && *var_add_figcaption == '0');
+    *add_footnote_div = var_add_footnote_div && *var_add_footnote_div == '1';
+    return 0;
+}
+
+int
+parse_document(uint8_t* buffer, ParsedDoc* doc, BOOL body_only, 
+        BOOL read_yaml_macros_and_links, ParseChunk* chunk)
+{
+    uint8_t* pbuffer                   = NULL;
+    uint8_t* line                      = NULL;
+    uint8_t* line_end                  = NULL;
+    uint8_t* pline                     = NULL;
+    size_t line_len                    = 0;
+    size_t line_size                   = BUFSIZE;
+    uint8_t* token                     = NULL;
+    uint8_t* ptoken                    = NULL;
+    size_t token_size                  = 0;
+    uint8_t* link_text                 = NULL;
+    size_t link_size                   = 0;
+    uint8_t* link_macro                = NULL;
+    UBYTE heading_level                = 0;
+    BOOL end_tag                       = FALSE;
+    BOOL first_line_in_doc             = TRUE;
+    BOOL skip_change_first_line_in_doc = FALSE;
+    BOOL skip_eol                      = FALSE;
+    BOOL keep_token                    = FALSE;
+    BOOL previous_line_blank           = FALSE;
+    BOOL processed_start_of_line       = FALSE;
+    BOOL add_image_links               = TRUE;
+    BOOL add_figcaption                = TRUE;
+    BOOL add_footnote_div              = FALSE;
+    BOOL list_para                     = FALSE;
+    BOOL footnote_at_line_start        = FALSE;
+    size_t pline_len                   = 0;
+
+    if (!buffer)
+        exit(error(1, (uint8_t*)"Empty buffer"));
+
+    if (!vars)
+        exit(error(EINVAL, (uint8_t*)"Invalid argument (vars)"));
+
+    if (!links)
+        exit(error(EINVAL, (uint8_t*)"Invalid argument (links)"));
+
+    if (!macros)
+        exit(error(EINVAL, (uint8_t*)"Invalid argument (macros)"));
+
+    CALLOC(line, uint8_t, line_size)
+    pbuffer = buffer;
+    doc->continued = chunk && chunk->continued;
+
+    if (doc->continued)
+    {
+        /* Pick up the line state where the previous chunk left it */
+        lineno                        = chunk->lineno;
+        token                         = chunk->token;
+        ptoken                        = chunk->ptoken;
+        token_size                    = chunk->token_size;
+        link_text                     = chunk->link_text;
+        link_size                     = chunk->link_size;
+        link_macro                    = chunk->link_macro;
+        heading_level                 = chunk->heading_level;
+        end_tag                       = chunk->end_tag;
+        first_line_in_doc             = chunk->first_line_in_doc;
+        skip_change_first_line_in_doc = chunk->skip_change_first_line_in_doc;
+        keep_token                    = chunk->keep_token;
+        previous_line_blank           = chunk->previous_line_blank;
+        add_image_links               = chunk->add_image_links;
+        add_figcaption                = chunk->add_figcaption;
+        add_footnote_div              = chunk->add_footnote_div;
+        footnote_at_line_start        = chunk->footnote_at_line_start;
+    }
+    else
+    {
+        read_parse_flags(&add_image_links, &add_figcaption, 
+                &add_footnote_div);
+
+        token_size = BUFSIZE;
+        CALLOC(token, uint8_t, BUFSIZE)
+        CALLOC(link_macro, uint8_t, BUFSIZE)
+
+        pvars = vars;
+        plinks = links;
+        pmacros = macros;
+        pfootnotes = footnotes;
+        lineno = 0;
+
+        if (!read_yaml_macros_and_links && !body_only)
+            add_node(doc, NODE_HEAD, 0);
+
+        /* The header uses only what was defined before this pass */
+        Node* header = add_node(doc, NODE_ARTICLE_HEADER, 
+                read_yaml_macros_and_links ? 0 : NODE_FLAG_SITE);
+        header->number = vars_count;
+        header->count = macros_count;
+
+        RESET_TOKEN(token, ptoken, token_size)
+    }
+
+    do
+    {
+        uint8_t* eol = u8_strchr(pbuffer, (ucs4_t)'\n');
+        if (!eol)
+            break;
+
+        if ((size_t)(eol - pbuffer) + 1 > line_size)
+        {
+            while ((size_t)(eol - pbuffer) + 1 > line_size)
+                line_size *= 2;
+            REALLOC(line, uint8_t, line_size)
+        }
+
+        memcpy(line, pbuffer, eol - pbuffer);
+        *(line + (eol - pbuffer)) = 0;
+        pbuffer = eol + 1;
+        pline = line;
+        line_len = u8_strlen(line);
+        line_end = line + line_len;
+
+        lineno++;
+        colno = 1;
+        processed_start_of_line = FALSE;
+        skip_eol = FALSE;
+        /*list_item = FALSE;*/
+        list_para = FALSE;
+
+        while (pline && *pline)
+        {
+            switch (*pline)
+            {
+            case '-':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_MACRO_BODY | ST_PRE | ST_YAML_VAL))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                }
+                else if (colno == 1 
+                        && line_end - pline > 2
+                        && startswith((char*)pline, "---"))
+                {
+                    skip_eol = TRUE;
+
+                    if (!(state & ST_YAML) && lineno > 1
+                            && !read_yaml_macros_and_links)
+                        process_horizontal_rule(doc);
+                    else
+                    {
+                        if (lineno == 1)
+                            state |= ST_YAML;
+                        else
+                            state &= ~ST_YAML;
+
+                        skip_change_first_line_in_doc = TRUE;
+                    }
+                    pline = NULL;
+                }
+                else if (colno == 1 
+                        && line_end - pline > 1
+                        && *(pline+1) == ' ')
+                {
+                    if (state & ST_NUMLIST)
+                    {
+                        state &= ~ST_NUMLIST;
+                        if (!read_yaml_macros_and_links)
+                        {
+                            process_list_item_end(doc);
+                            add_node(doc, NODE_NUMLIST_END, 0);
+                        }
+                    }
+                    if (!read_yaml_macros_and_links)
+                    {
+                        if (!(state & ST_LIST))
+                            add_node(doc, NODE_LIST_START, 0);
+                        else
+                            process_list_item_end(doc);
+                        process_list_item_start(doc);
+                    }
+
+                    processed_start_of_line = TRUE;
+                    skip_eol = FALSE;
+
+                    state |= ST_LIST;
+
+                    pline += 2;
+                    colno += 2;
+                }
+                else
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                }
+                break;
+
+            case ':':
+                if (state & ST_YAML
+                        && !(ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                                | ST_HEADING | ST_IMAGE | ST_MACRO_BODY 
+                                | ST_PRE | ST_TAG | ST_YAML_VAL))
+                        && read_yaml_macros_and_links)
+                {
+                    *ptoken = 0;
+
+                    vars_count++;
+
+                    if (vars_count > 1)
+                    {
+                        REALLOCARRAY(vars, KeyValue, vars_count)
+                        pvars = vars + vars_count - 1;
+                    }
+                    CALLOC(pvars->key, uint8_t, KEYSIZE)
+                    u8_strncpy(pvars->key, token, KEYSIZE-1);
+                    pvars->value = NULL;
+                    pvars->value_size = 0;
+                    pvars->kept = FALSE;
+
+                    state |= ST_YAML_VAL;
+                    RESET_TOKEN(token, ptoken, token_size)
+                    pline++;
+                    colno++;
+
+                    while (pline && (*pline == ' ' || *pline == '\t'))
+                    {
+                        pline++;
+                        colno++;
+                    }
+                }
+                else {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                }
+                break;
+
+            case '`':
+                if (ANY(state, ST_DISPLAY_FORMULA | ST_FORMULA | ST_IMAGE 
+                            | ST_MACRO_BODY))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (colno == 1 
+                        && line_end - pline > 2
+                        && startswith((char*)pline, "```"))
+                {
+                    state ^= ST_PRE;
+                    
+                    if (!read_yaml_macros_and_links && (state & ST_PRE))
+                    {
+                        /* The language, for highlighting */
+                        uint8_t* language = pline + 3;
+                        uint8_t* planguage = NULL;
+
+                        while (*language == ' ' || *language == '\t')
+                            language++;
+                        planguage = language;
+                        while (*planguage && *planguage != ' ' 
+                                && *planguage != '\t')
+                            planguage++;
+                        *planguage = 0;
+                        add_text_node(doc, NODE_PRE, 0, language);
+                    }
+                    else if (!read_yaml_macros_and_links)
+                        add_node(doc, NODE_PRE, NODE_FLAG_END);
+
+                    /* Skip the rest of the line */
+                    pline = NULL;
+                }
+                else if (!ANY(state, ST_PRE | ST_TAG | ST_YAML))
+                {
+                    /* Handle ` within footnotes, headings and link text specially */
+                    if (ANY(state, ST_INLINE_FOOTNOTE | ST_HEADING 
+                                | ST_FOOTNOTE_TEXT | ST_LINK))
+                    {
+                        uint8_t* tag = state & ST_CODE
+                                ? (uint8_t*)"</code>"
+                                : (uint8_t*)"<code>";
+
+                        CHECKAPPEND(token, ptoken, token_size, tag)
+                    }
+                    else
+                    {
+                        /* Output existing text up to ` */
+                        process_text_token(line, first_line_in_doc,
+                                previous_line_blank,
+                                processed_start_of_line,
+                                read_yaml_macros_and_links,
+                                list_para, doc, &token, &ptoken, 
+                                &token_size, TRUE);
+                        processed_start_of_line = TRUE;
+
+                        if (!read_yaml_macros_and_links 
+                                && !(ANY(state, ST_PRE | ST_HEADING)))
+                            add_node(doc, NODE_CODE, 
+                                    state & ST_CODE ? NODE_FLAG_END : 0);
+                    }
+
+                    state ^= ST_CODE;
+
+                    pline++;
+                    colno++;
+                }
+                else
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                }
+                break;
+
+            case '#':
+                if (colno == 1
+                        && !(ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                                | ST_MACRO_BODY | ST_PRE | ST_YAML)))
+                {
+                    if (state & ST_LIST)
+                    {
+                        state &= ~ST_LIST;
+                        if (!read_yaml_macros_and_links)
+                        {
+                            process_list_item_end(doc);
+                            add_node(doc, NODE_LIST_END, 0);
+                        }
+                    }
+
+                    if (state & ST_NUMLIST)
+                    {
+                        state &= ~ST_NUMLIST;
+                        if (!read_yaml_macros_and_links)
+                        {
+                            process_list_item_end(doc);
+                            add_node(doc, NODE_NUMLIST_END, 0);
+                        }
+                    }
+
+                    state |= ST_HEADING;
+                    heading_level = 1;
+                    pline++;
+                    colno++;
+                }
+                else if (state & ST_HEADING && *(pline-1) == '#')
+                {
+                    if (heading_level < MAX_HEADING_LEVEL)
+                        heading_level++;
+                    pline++;
+                    colno++;
+                }
+                else 
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                }
+                break;
+
+            case '_':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_HTML_TAG | ST_IMAGE | ST_LINK_SECOND_ARG 
+                            | ST_MACRO_BODY | ST_PRE | ST_TAG | ST_YAML))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (line_end - pline > 1 && *(pline+1) == '_')
+                {
+                    /* Handle __ within footnotes, headings and link text specially */
+                    if (ANY(state, ST_INLINE_FOOTNOTE | ST_HEADING 
+                                | ST_FOOTNOTE_TEXT | ST_LINK))
+                    {
+                        uint8_t* tag = state & ST_BOLD
+                                ? (uint8_t*)"</strong>"
+                                : (uint8_t*)"<strong>";
+
+                        CHECKAPPEND(token, ptoken, token_size, tag)
+                    }
+                    else
+                    {
+                        /* Output existing text up to __ */
+                        process_text_token(line, first_line_in_doc,
+                                previous_line_blank,
+                                processed_start_of_line,
+                                read_yaml_macros_and_links,
+                                list_para, doc, &token, &ptoken, 
+                                &token_size, TRUE);
+                        processed_start_of_line = TRUE;
+
+                        if (!read_yaml_macros_and_links 
+                                && !(ANY(state, ST_PRE | ST_CODE | ST_HEADING)))
+                            add_node(doc, NODE_BOLD, 
+                                    state & ST_BOLD ? NODE_FLAG_END : 0);
+                    }
+
+                    state ^= ST_BOLD;
+                    pline += 2;
+                    colno += 2;
+                }
+                else
+                {
+                    /* Handle _ within footnotes, headings and link text specially */
+                    if (ANY(state, ST_INLINE_FOOTNOTE | ST_HEADING 
+                                | ST_FOOTNOTE_TEXT | ST_LINK))
+                    {
+                        uint8_t* tag = state & ST_ITALIC
+                                ? (uint8_t*)"</em>"
+                                : (uint8_t*)"<em>";
+
+                        CHECKAPPEND(token, ptoken, token_size, tag)
+                    }
+                    else
+                    {
+                        /* Output existing text up to _ */
+                        process_text_token(line, first_line_in_doc,
+                                previous_line_blank,
+                                processed_start_of_line,
+                                read_yaml_macros_and_links,
+                                list_para, doc, &token, &ptoken, 
+                                &token_size, TRUE);
+                        processed_start_of_line = TRUE;
+
+                        if (!read_yaml_macros_and_links 
+                                && !(ANY(state, ST_PRE | ST_CODE | ST_HEADING)))
+                            add_node(doc, NODE_ITALIC, 
+                                    state & ST_ITALIC ? NODE_FLAG_END : 0);
+                    }
+
+                    state ^= ST_ITALIC;
+                    pline++;
+                    colno++;
+                }
+                break;
+
+            case '*':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_HTML_TAG | ST_IMAGE | ST_MACRO_BODY | ST_PRE 
+                            | ST_YAML))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                pline_len = line_end - pline;
+                if (colno == 1
+                        && pline_len > 1 && *(pline+1) == '[')
+                {
+                    process_line_start(line, first_line_in_doc,
+                            previous_line_blank, read_yaml_macros_and_links, 
+                            list_para, doc, &token, &ptoken);
+
+                    /* Ignore abbreviations (for now) */
+                    pline = NULL;
+                }
+                else if (colno == 1
+                        && pline_len > 2 && startswith((char*)pline, "***"))
+                {
+                    skip_eol = TRUE;
+                    if (!read_yaml_macros_and_links)
+                        process_horizontal_rule(doc);
+                    pline = NULL;
+                }
+                else if (pline_len > 1 && *(pline+1) == '*')
+                {
+                    /* Handle ** within footnotes, headings and link text specially */
+                    if (ANY(state, ST_INLINE_FOOTNOTE | ST_HEADING 
+                                | ST_FOOTNOTE_TEXT | ST_LINK))
+                    {
+                        uint8_t* tag = state & ST_BOLD
+                                ? (uint8_t*)"</strong>"
+                                : (uint8_t*)"<strong>";
+
+                        CHECKAPPEND(token, ptoken, token_size, tag)
+                    }
+                    else
+                    {
+                        /* Output existing text up to * */
+                        process_text_token(line, first_line_in_doc,
+                                previous_line_blank,
+                                processed_start_of_line,
+                                read_yaml_macros_and_links,
+                                list_para, doc, &token, &ptoken, 
+                                &token_size, TRUE);
+                        processed_start_of_line = TRUE;
+
+                        if (!read_yaml_macros_and_links 
+                                && !(ANY(state, ST_PRE | ST_CODE | ST_HEADING)))
+                            add_node(doc, NODE_BOLD, 
+                                    state & ST_BOLD ? NODE_FLAG_END : 0);
+                    }
+
+                    state ^= ST_BOLD;
+                    pline += 2;
+                    colno += 2;
+                }
+                else
+                {
+                    /* Handle * within footnotes, headings and link text specially */
+                    if (ANY(state, ST_INLINE_FOOTNOTE | ST_HEADING 
+                                | ST_FOOTNOTE_TEXT | ST_LINK))
+ 
+                    {
+                        uint8_t* tag = state & ST_ITALIC
+                                ? (uint8_t*)"</em>"
+                                : (uint8_t*)"<em>";
+
+                        CHECKAPPEND(token, ptoken, token_size, tag)
+                    }
+                    else
+                    {
+                        /* Output existing text up to * */
+                        process_text_token(line, first_line_in_doc,
+                                previous_line_blank,
+                                processed_start_of_line,
+                                read_yaml_macros_and_links,
+                                list_para, doc, &token, &ptoken, 
+                                &token_size, TRUE);
+                        processed_start_of_line = TRUE;
+
+                        if (!read_yaml_macros_and_links 
+                                && !(ANY(state, ST_PRE | ST_CODE | ST_HEADING)))
+                            add_node(doc, NODE_ITALIC, 
+                                    state & ST_ITALIC ? NODE_FLAG_END : 0);
+                    }
+
+                    state ^= ST_ITALIC;
+                    pline++;
+                    colno++;
+                }
+                break;
+
+            case ' ':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_IMAGE | ST_MACRO_BODY | ST_PRE | ST_YAML_VAL))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if ((state & ST_HEADING) && !(state & ST_HEADING_TEXT))
+                {
+                    if (!read_yaml_macros_and_links)
+                        add_node(doc, NODE_HEADING_START, 0)->number 
+                            = heading_level;
+                    state |= ST_HEADING_TEXT;
+                    pline++;
+                    colno++;
+                    break;
+                }
+
+                if (colno == 1
+                        && line_end - pline > 1
+                        && startswith((char*)pline, "    "))
+                {
+                    list_para = TRUE;
+                    process_text_token(line, first_line_in_doc,
+                            previous_line_blank,
+                            processed_start_of_line,
+                            read_yaml_macros_and_links,
+                            list_para, doc, &token, &ptoken, 
+                            &token_size, TRUE);
+                    processed_start_of_line = TRUE;
+                    pline += 4;
+                    colno += 4;
+                    break;
+                }
+
+                if (line_end - pline == 2
+                        && *(pline+1) == ' ')
+                {
+                    CHECKAPPEND(token, ptoken, token_size, (uint8_t*)"<br />")
+                    pline++;
+                    colno++;
+                }
+                else if (state & ST_LINK_MACRO)
+                {
+                    *ptoken = 0;
+                    REALLOC(link_macro, uint8_t, ptoken - token + 1)
+                    memcpy(link_macro, token, ptoken - token + 1);
+                    RESET_TOKEN(token, ptoken, token_size)
+                    state &= ~ST_LINK_MACRO;
+                }
+                else if (!(state & ST_HEADING
+                        && *(pline-1) == '#'))
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                colno++;
+                break;
+
+            case '{':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_HTML_TAG | ST_PRE | ST_YAML | ST_YAML_VAL))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (state & ST_MACRO_BODY)
+                {
+                    *ptoken = 0;
+                    size_t token_len = ptoken - token;
+
+                    skip_eol = TRUE;
+                    if (read_yaml_macros_and_links)
+                        rope_append(&macro_rope, token, token_len);
+                }
+                else
+                {
+                    /* Output existing text up to { */
+                    process_text_token(line, first_line_in_doc,
+                            previous_line_blank, processed_start_of_line,
+                            read_yaml_macros_and_links, list_para, doc,
+                            &token, &ptoken, &token_size, FALSE);
+                    processed_start_of_line = TRUE;
+                }
+
+                state |= ST_TAG;
+                RESET_TOKEN(token, ptoken, token_size)
+
+                pline++;
+                colno++;
+                break;
+
+            case '/':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_IMAGE | ST_PRE | ST_HEADING | ST_YAML_VAL))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if ((state & ST_TAG) && pline-1 && *(pline-1) == '{')
+                {
+                    end_tag = TRUE;
+                    pline++;
+                }
+                else
+                    CHECKCOPY(token, ptoken, token_size, pline)
+
+                colno++;
+                break;
+
+            case '}':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_IMAGE | ST_PRE | ST_YAML | ST_YAML_VAL))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (state & ST_TAG)
+                {
+                    state &= ~ST_TAG;
+                    *ptoken = 0;
+
+                    parse_rest_of_line = pline + 1;
+                    parse_rest_of_buffer = pbuffer;
+                    process_tag(token, doc, read_yaml_macros_and_links,
+                            &skip_eol, end_tag);
+
+                    RESET_TOKEN(token, ptoken, token_size)
+                    end_tag = FALSE;
+                }
+
+                pline++;
+                colno++;
+                break;
+
+            case '|':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_HTML_TAG | ST_IMAGE | ST_PRE | ST_TAG 
+                            | ST_YAML))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (line_end - pline > 1 && *(pline+1) == '|')
+                {
+                    /* Handle || within footnotes, headings and link text specially */
+                    if (ANY(state, ST_INLINE_FOOTNOTE | ST_HEADING 
+                                | ST_FOOTNOTE_TEXT | ST_LINK))
+                    {
+                        uint8_t* tag = state & ST_KBD
+                                ? (uint8_t*)"</kbd>"
+                                : (uint8_t*)"<kbd>";
+
+                        CHECKAPPEND(token, ptoken, token_size, tag)
+                    }
+                    else
+                    {
+                        /* Output existing text up to || */
+                        process_text_token(line, first_line_in_doc,
+                                previous_line_blank,
+                                processed_start_of_line,
+                                read_yaml_macros_and_links,
+                                list_para, doc, &token, &ptoken, 
+                                &token_size, TRUE);
+                        processed_start_of_line = TRUE;
+
+                        if (!read_yaml_macros_and_links 
+                                && !(ANY(state, ST_PRE | ST_CODE | ST_HEADING)))
+                        {
+                            state ^= ST_KBD;
+                            add_node(doc, NODE_KBD, 
+                                    state & ST_KBD ? 0 : NODE_FLAG_END);
+                        }
+                    }
+
+                    pline += 2;
+                    colno += 2;
+                }
+                /* Partial tables (for templating) */
+                else if (!(state & ST_PRE) && colno == 1 && line_end - pline > 1 
+                        && *(pline+1) == '@')
+                {
+                    skip_eol = TRUE;
+
+                    pline += 2;
+                    colno += 2;
+
+                    switch (*pline)
+                    {
+                    case '\\':
+                        if (!read_yaml_macros_and_links)
+                        {
+                            add_node(doc, NODE_TABLE_START, 0);
+                            add_node(doc, NODE_TABLE_HEADER_START, 0);
+                        }
+                        pline = NULL;
+                        break;
+
+                    case '#':
+                        state |= ST_TABLE_HEADER;
+                        pline++;
+                        colno++;
+                        break;
+
+                    case '-':
+                        state &= ~ST_TABLE_HEADER;
+                        if (!read_yaml_macros_and_links)
+                            add_node(doc, NODE_TABLE_BODY_START, 0);
+                        pline = NULL;
+                        break;
+
+                    case ' ':
+                        state |= ST_TABLE;
+                        if (!read_yaml_macros_and_links)
+                            add_node(doc, NODE_TABLE_BODY_ROW_START, 0);
+                        break;
+
+                    case '/':
+                        state &= ~ST_TABLE;
+                        add_node(doc, NODE_TABLE_END, 0);
+                        pline = NULL;
+                        break;
+
+                    default:
+                        warning(1, (uint8_t*)"Invalid partial table line");
+                        CHECKCOPY(token, ptoken, token_size, pline)
+                        colno++;
+                    }
+                }
+                else if (!(state & ST_PRE) && colno == 1)
+                {
+                    skip_eol = TRUE;
+
+                    if (state & ST_TABLE_HEADER)
+                    {
+                        state &= ~ST_TABLE_HEADER;
+                        state |= ST_TABLE_LINE;
+                        pline = NULL;
+                        break;
+                    }
+                    
+                    if (state & ST_TABLE_LINE)
+                    {
+                        state &= ~ST_TABLE_LINE;
+                        state |= ST_TABLE;
+                        if (!read_yaml_macros_and_links)
+                            add_node(doc, NODE_TABLE_BODY_START, 
+                                    NODE_FLAG_START_ROW);
+                    }
+                    else if (state & ST_TABLE)
+                    {
+                        if (!read_yaml_macros_and_links)
+                            add_node(doc, NODE_TABLE_BODY_ROW_START, 0);
+                    }
+                    else
+                    {
+                        state |= ST_TABLE_HEADER;
+                        if (!read_yaml_macros_and_links)
+                        {
+                            add_node(doc, NODE_TABLE_START, 0);
+                            add_node(doc, NODE_TABLE_HEADER_START, 0);
+                        }
+                    }
+
+                    pline++;
+                    colno++;
+                }
+                else if (state & ST_TABLE_HEADER)
+                {
+                    *ptoken = 0;
+                    if (!read_yaml_macros_and_links)
+                    {
+                        add_text_node(doc, NODE_TEXT, 0, token);
+                        if (line_end - pline > 1)
+                            add_node(doc, NODE_TABLE_HEADER_CELL, 0);
+                        else
+                            add_node(doc, NODE_TABLE_HEADER_END, 0);
+                    }
+                    RESET_TOKEN(token, ptoken, token_size)
+                    pline++;
+                    colno++;
+                }
+                else if (state & ST_TABLE)
+                {
+                    *ptoken = 0;
+                    if (!read_yaml_macros_and_links)
+                    {
+                        add_text_node(doc, NODE_TEXT, 0, token);
+                        if (line_end - pline > 1)
+                            add_node(doc, NODE_TABLE_BODY_CELL, 0);
+                        else
+                            add_node(doc, NODE_TABLE_BODY_ROW_END, 0);
+                    }
+                    RESET_TOKEN(token, ptoken, token_size)
+                    pline++;
+                    colno++;
+                }
+                else
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                }
+                break;
+
+            case '<':
+                if (read_yaml_macros_and_links
+                        || ANY(state, ST_DISPLAY_FORMULA | ST_FORMULA 
+                                | ST_IMAGE))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (ANY(state, ST_CODE | ST_KBD | ST_PRE))
+                {
+                    CHECKAPPEND(token, ptoken, token_size, (uint8_t*)"&lt;")
+                    pline++;
+                    colno++;
+                    break;
+                }
+
+                state |= ST_HTML_TAG;
+                CHECKCOPY(token, ptoken, token_size, pline)
+                colno++;
+                break;
+
+            case '>':
+                if (state & ST_HTML_TAG)
+                    state &= ~ST_HTML_TAG;
+
+                if (ANY(state, ST_DISPLAY_FORMULA | ST_FORMULA | ST_IMAGE 
+                            | ST_MACRO_BODY))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (!read_yaml_macros_and_links
+                        && !ANY(state, ST_CODE | ST_HEADING | ST_PRE)
+                        && colno == 1)
+                {
+                    if (!read_yaml_macros_and_links 
+                            && !(state & ST_BLOCKQUOTE))
+                        add_node(doc, NODE_BLOCKQUOTE, 0);
+
+                    state |= ST_BLOCKQUOTE;
+
+                    pline++;
+                    colno++;
+                }
+                else 
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                }
+                break;
+
+            case '!':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_FOOTNOTE_TEXT | ST_HEADING | ST_IMAGE
+                            | ST_INLINE_FOOTNOTE | ST_LINK | ST_MACRO_BODY 
+                            | ST_PRE))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (line_end - pline > 1 && *(pline+1) == '[')
+                {
+                    /* Output existing text up to ! */
+                    *ptoken = 0;
+                    process_text_token(line, first_line_in_doc,
+                            previous_line_blank, processed_start_of_line,
+                            read_yaml_macros_and_links, list_para, doc,
+                            &token, &ptoken, &token_size, FALSE);
+                    processed_start_of_line = TRUE;
+
+                    RESET_TOKEN(token, ptoken, token_size)
+
+                    state |= ST_IMAGE;
+                    keep_token = TRUE;
+                    pline += 2;
+                    colno += 2;
+                }
+                else 
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                }
+
+                break;
+
+            case '=':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_MACRO_BODY | ST_PRE | ST_TAG))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (colno != 1 && *(pline-1) == '[')
+                {
+                    state |= ST_LINK_MACRO;
+                    pline++;
+                    colno++;
+                }
+                else 
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                }
+                break;
+
+            case '[':
+                pline_len = line_end - pline;
+
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_HEADING | ST_IMAGE | ST_MACRO_BODY | ST_PRE))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (state & ST_FOOTNOTE_TEXT)
+                {
+                    if (!read_yaml_macros_and_links && (state & ST_PARA_OPEN))
+                        add_node(doc, NODE_PARA_BREAK, 0);
+                    end_footnote_text(read_yaml_macros_and_links);
+                    state &= ~ST_PARA_OPEN;
+                }
+
+                if (pline_len > 1 && *(pline+1) == '^')
+                {
+                    footnote_at_line_start = colno == 1;
+                    if (*token)
+                    {
+                        /* Output existing text up to [^ */
+                        *ptoken = 0;
+                        process_text_token(line, first_line_in_doc,
+                                previous_line_blank, processed_start_of_line,
+                                read_yaml_macros_and_links, list_para, doc,
+                                &token, &ptoken, &token_size, TRUE);
+                    }
+                    processed_start_of_line = TRUE;
+
+                    RESET_TOKEN(token, ptoken, token_size)
+                    state |= ST_FOOTNOTE;
+                    pline += 2;
+                    colno += 2;
+                    break;
+                }
+
+                if (*token)
+                {
+                    /* Output existing text up to [ */
+                    *ptoken = 0;
+                    process_text_token(line, first_line_in_doc,
+                            previous_line_blank,
+                            processed_start_of_line,
+                            read_yaml_macros_and_links,
+                            list_para, doc, &token, &ptoken, &token_size, 
+                            TRUE);
+                }
+                processed_start_of_line = TRUE;
+
+                RESET_TOKEN(token, ptoken, token_size)
+                state |= ST_LINK;
+                keep_token = TRUE;
+                *link_macro = 0;
+                pline++;
+                colno++;
+                break;
+
+            case '(':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_FOOTNOTE_TEXT | ST_HEADING
+                            | ST_INLINE_FOOTNOTE | ST_MACRO_BODY | ST_PRE))
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                else if (state & ST_LINK)
+                {
+                    uint8_t* tag = (uint8_t*)"<span>";
+
+                    CHECKAPPEND(token, ptoken, token_size, tag)
+
+                    state |= ST_LINK_SPAN;
+                    pline++;
+                }
+                else
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                colno++;
+                break;
+
+            case ')':
+                if (ANY(state, ST_DISPLAY_FORMULA | ST_FORMULA))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (state & ST_LINK_SPAN)
+                {
+                    if (line_end - pline > 1
+                            && *(pline+1) == ']')
+                    {
+                        uint8_t* tag = (uint8_t*)"</span>";
+
+                        CHECKAPPEND(token, ptoken, token_size, tag)
+                        state &= ~ST_LINK_SPAN;
+                    }
+                    pline++;
+                }
+                else if (ANY(state, ST_LINK_SECOND_ARG | ST_IMAGE_SECOND_ARG))
+                {
+                    *ptoken = 0;
+                    if (!read_yaml_macros_and_links)
+                    {
+                        if (state & ST_LINK_SECOND_ARG)
+                            process_link(doc, link_text, 
+                                    get_value(macros, macros_count, 
+                                        link_macro, NULL), 
+                                    token);
+                        else
+                            process_image(doc, link_text, token, 
+                                    add_image_links, add_figcaption);
+                    }
+                    RESET_TOKEN(token, ptoken, token_size)
+                    state &= ~(ST_LINK | ST_LINK_SECOND_ARG 
+                            | ST_IMAGE | ST_IMAGE_SECOND_ARG);
+                    pline++;
+                }
+                else
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                colno++;
+                break;
+
+            case ']':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_HEADING | ST_MACRO_BODY | ST_PRE))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                *ptoken = 0;
+                if (state & ST_INLINE_FOOTNOTE)
+                {
+                    process_inline_footnote(token, read_yaml_macros_and_links,
+                            doc);
+
+                    keep_token = FALSE;
+                    RESET_TOKEN(token, ptoken, token_size)
+                    state &= ~ST_INLINE_FOOTNOTE;
+                    pline++;
+                    colno++;
+                }
+                else if (state & ST_FOOTNOTE)
+                {
+                    BOOL footnote_definition = (line_end - pline > 1)
+                            && (*(pline+1) == ':') && footnote_at_line_start;
+
+                    process_footnote(token, 
+                            footnote_definition && read_yaml_macros_and_links,
+                            !footnote_definition && !read_yaml_macros_and_links,
+                            doc);
+
+                    RESET_TOKEN(token, ptoken, token_size)
+                    state &= ~ST_FOOTNOTE;
+                    footnote_at_line_start = FALSE;
+                    if (footnote_definition)
+                    {
+                        state |= ST_FOOTNOTE_TEXT;
+                        pline++;
+                        colno++;
+                    }
+                    pline++;
+                    colno++;
+                }
+                else if (state & ST_LINK_SECOND_ARG)
+                {
+                    if (!read_yaml_macros_and_links)
+                        process_link(doc, link_text, 
+                                get_value(macros, macros_count, 
+                                    link_macro, NULL), 
+                                get_value(links, links_count, token, NULL));
+                    RESET_TOKEN(token, ptoken, token_size)
+                    state &= ~(ST_LINK | ST_LINK_SECOND_ARG);
+                    pline++;
+                    colno++;
+                }
+                else if (state & ST_IMAGE_SECOND_ARG)
+                {
+                    if (!read_yaml_macros_and_links)
+                        process_image(doc, link_text, 
+                                get_value(links, links_count, token, NULL),
+                                add_image_links, add_figcaption);
+                    RESET_TOKEN(token, ptoken, token_size)
+                    state &= ~(ST_IMAGE | ST_IMAGE_SECOND_ARG);
+                    pline++;
+                    colno++;
+                }
+                else if (line_end - pline > 1)
+                {
+                    size_t token_len = 0;
+                    switch (*(pline+1))
+                    {
+                        case ':':
+                            links_count++;
+
+                            if (links_count > 1)
+                            {
+                                REALLOCARRAY(links, KeyValue, links_count)
+                                plinks = links + links_count - 1;
+                            }
+                            CALLOC(plinks->key, uint8_t, KEYSIZE)
+                            u8_strncpy(plinks->key, token, KEYSIZE-1);
+                            plinks->value = NULL;
+                            plinks->value_size = 0;
+                            plinks->kept = FALSE;
+                            pline += 2;
+                            colno += 2;
+                            while (pline && (*pline == ' ' || *pline == '\t'))
+                            {
+                                pline++;
+                                colno++;
+                            }
+                            RESET_TOKEN(token, ptoken, token_size)
+                            keep_token = FALSE;
+                            state |= ST_LINK_SECOND_ARG;
+                            break;
+
+                        case '[':
+                        case '(':
+                            token_len = ptoken - token;
+                            if (link_text)
+                            {
+                                if (token_len + 1 > link_size)
+                                {
+                                    link_size = token_len+1;
+                                    REALLOC(link_text, uint8_t, link_size)
+                                }
+                            }
+                            else
+                            {
+                                link_size = token_len+1;
+                                CALLOC(link_text, uint8_t, link_size)
+                            }
+                            u8_strncpy(link_text, token, link_size-1);
+                            *(link_text + token_len) = 0;
+                            pline += 2;
+                            colno += 2;
+                            RESET_TOKEN(token, ptoken, token_size)
+                            keep_token = FALSE;
+                            if (state & ST_LINK)
+                                state |= ST_LINK_SECOND_ARG;
+                            else
+                                state |= ST_IMAGE_SECOND_ARG;
+                            break;
+                        default:
+                            CHECKCOPY(token, ptoken, token_size, pline)
+                            colno++;
+                            state &= ~(ST_LINK | ST_IMAGE);
+                            break;
+                    }
+                }
+                else
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                }
+                break;
+
+            case '^':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_FOOTNOTE_TEXT | ST_IMAGE | ST_INLINE_FOOTNOTE 
+                            | ST_PRE | ST_YAML))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (line_end - pline > 1 && *(pline+1) == '[')
+                {
+                    /* Output existing text up to ^[ */
+                    *ptoken = 0;
+                    process_text_token(line, first_line_in_doc,
+                            previous_line_blank, processed_start_of_line,
+                            read_yaml_macros_and_links, list_para, doc,
+                            &token, &ptoken, &token_size, TRUE);
+                    processed_start_of_line = TRUE;
+
+                    RESET_TOKEN(token, ptoken, token_size)
+                    state |= ST_INLINE_FOOTNOTE;
+                    keep_token = TRUE;
+                    pline += 2;
+                    colno += 2;
+                    break;
+                }
+
+                CHECKCOPY(token, ptoken, token_size, pline)
+                colno++;
+                break;
+
+            case '\\':
+                *ptoken = 0;
+                if (ANY(state, ST_DISPLAY_FORMULA | ST_FORMULA 
+                            | ST_HTML_TAG | ST_IMAGE | ST_LINK 
+                            | ST_MACRO_BODY))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (line_end - pline > 1)
+                {
+                    pline++;
+                    colno++;
+
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                }
+                else
+                {
+                    pline = NULL;
+                    break;
+                }
+
+                colno++;
+                break;
+
+            case '$':
+                if (ANY(state, ST_CODE | ST_CSV_BODY | ST_IMAGE | ST_PRE 
+                            | ST_YAML))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                    break;
+                }
+
+                if (line_end - pline > 1
+                        && *(pline+1) == '$')
+                {
+                    if (state & ST_FORMULA)
+                        exit(error(1, (uint8_t*)"Display formula within an"
+                                    " open formula"));
+
+                    if (!(state & ST_DISPLAY_FORMULA))
+                    {
+                        /* Output existing text up to $$ */
+                        process_text_token(line, first_line_in_doc,
+                                previous_line_blank,
+                                processed_start_of_line,
+                                read_yaml_macros_and_links,
+                                list_para, doc, &token, &ptoken, &token_size, 
+                                TRUE);
+                    }
+                    processed_start_of_line = TRUE;
+
+                    state ^= ST_DISPLAY_FORMULA;
+
+                    if (state & ST_DISPLAY_FORMULA)
+                        keep_token = TRUE;
+                    else
+                    {
+                        *ptoken = 0;
+
+                        if (read_yaml_macros_and_links)
+                            add_formula(token, TRUE);
+                        else
+                            add_text_node(doc, NODE_FORMULA, NODE_FLAG_DISPLAY,
+                                    token);
+
+                        keep_token = FALSE;
+                        RESET_TOKEN(token, ptoken, token_size)
+                    }
+
+                    pline += 2;
+                    colno += 2;
+                }
+                else
+                {
+                    if (state & ST_DISPLAY_FORMULA)
+                        exit(error(1, (uint8_t*)"Formula within an open"
+                                    " display formula"));
+
+                    if (!(state & ST_FORMULA))
+                    {
+                        /* Output existing text up to $ */
+                        process_text_token(line, first_line_in_doc,
+                                previous_line_blank,
+                                processed_start_of_line,
+                                read_yaml_macros_and_links,
+                                list_para, doc, &token, &ptoken, &token_size, 
+                                TRUE);
+                    }
+                    processed_start_of_line = TRUE;
+
+                    state ^= ST_FORMULA;
+
+                    if (state & ST_FORMULA)
+                        keep_token = TRUE;
+                    else
+                    {
+                        *ptoken = 0;
+
+                        if (read_yaml_macros_and_links)
+                            add_formula(token, FALSE);
+                        else
+                            add_text_node(doc, NODE_FORMULA, 0, token);
+
+                        keep_token = FALSE;
+                        RESET_TOKEN(token, ptoken, token_size)
+                    }
+
+                    pline++;
+                    colno++;
+                }
+                break;
+
+            case '1': case '2': case '3': case '4': case '5':
+            case '6': case '7': case '8': case '9': case '0':
+                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA
+                            | ST_MACRO_BODY | ST_PRE | ST_YAML_VAL))
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                }
+                else if (colno == 1
+                        && line_end - pline > 1
+                        && (*(pline+1) == '.' || *(pline+1) == ')'))
+                {
+                    if (state & ST_LIST)
+                    {
+                        state &= ~ST_LIST;
+                        if (!read_yaml_macros_and_links)
+                        {
+                            process_list_item_end(doc);
+                            add_node(doc, NODE_LIST_END, 0);
+                        }
+                    }
+                    if (!read_yaml_macros_and_links)
+                    {
+                        if (!(state & ST_NUMLIST))
+                            add_node(doc, NODE_NUMLIST_START, 0);
+                        else
+                            process_list_item_end(doc);
+                        process_list_item_start(doc);
+                    }
+
+                    processed_start_of_line = TRUE;
+                    skip_eol = FALSE;
+
+                    state |= ST_NUMLIST;
+
+                    pline += 2;
+                    colno += 2;
+                }
+                else
+                {
+                    CHECKCOPY(token, ptoken, token_size, pline)
+                    colno++;
+                }
+                break;
+
+            default:
+                CHECKCOPY(token, ptoken, token_size, pline)
+                colno++;
+            }
+        }
+
+        *ptoken = 0;
+
+        if (*token && read_yaml_macros_and_links
+                && (state & ST_YAML_VAL))
+        {
+            *ptoken = 0;
+            pvars->value_size = u8_strlen(token)+1;
+            CALLOC(pvars->value, uint8_t, pvars->value_size)
+            u8_strncpy(pvars->value, token, pvars->value_size-1);
+        }
+        else if (keep_token)
+            CHECKAPPEND(token, ptoken, token_size, 
+                    ANY(state, ST_IMAGE | ST_LINK)
+                    ? (uint8_t*)" " : (uint8_t*)"\n")
+        else
+        {
+            if (*token)
+            {
+                *ptoken = 0;
+                size_t token_len = ptoken - token;
+                if (state & ST_MACRO_BODY)
+                {
+                    skip_eol = TRUE;
+                    if (read_yaml_macros_and_links)
+                    {
+                        rope_append(&macro_rope, token, token_len);
+                        rope_append(&macro_rope, (uint8_t*)"\n", 1);
+                    }
+                }
+                else if (state & ST_FOOTNOTE_TEXT)
+                {
+                    skip_eol = TRUE;
+                    if (read_yaml_macros_and_links)
+                    {
+                        strbuf_append(&footnote_text, token, token_len);
+                        strbuf_append(&footnote_text, (uint8_t*)"\n", 1);
+                    }
+                }
+                else if (state & ST_LINK_SECOND_ARG)
+                {
+                    if (read_yaml_macros_and_links)
+                    {
+                        plinks->value_size = u8_strlen(token)+1;
+                        CALLOC(plinks->value, uint8_t, plinks->value_size)
+                        u8_strncpy(plinks->value, token, plinks->value_size-1);
+                    }
+                }
+                else if (state & ST_HEADING)
+                {
+                    state &= ~(ST_HEADING | ST_HEADING_TEXT);
+                    if (!read_yaml_macros_and_links)
+                        add_text_node(doc, NODE_HEADING_END, 0, token)->number
+                            = heading_level;
+                    first_line_in_doc = FALSE;
+                    RESET_TOKEN(token, ptoken, token_size)
+                    heading_level = 0;
+                }
+                else if (!ANY(state, ST_DISPLAY_FORMULA | ST_FORMULA 
+                                | ST_IMAGE | ST_LINK))
+                    process_text_token(line, first_line_in_doc,
+                            previous_line_blank,
+                            processed_start_of_line,
+                            read_yaml_macros_and_links,
+                            list_para, doc, &token, &ptoken, &token_size, 
+                            TRUE);
+            }
+
+            if (!ANY(state, ST_PRE | ST_IMAGE_SECOND_ARG | ST_LINK_SECOND_ARG)
+                        && (!*pbuffer || *pbuffer == '\n'))
+            {
+                if (state & ST_PARA_OPEN)
+                {
+                    if (!read_yaml_macros_and_links)
+                        add_node(doc, NODE_PARA_END, 0);
+                    if (state & ST_LIST)
+                        skip_eol = TRUE;
+                    state &= ~ST_PARA_OPEN;
+                }
+
+                if (!*pbuffer && (state & ST_LIST))
+                {
+                    if (!read_yaml_macros_and_links)
+                    {
+                        process_list_item_end(doc);
+                        add_node(doc, NODE_LIST_END, 0);
+                    }
+                    state &= ~ST_LIST;
+                }
+
+                if (!*pbuffer && (state & ST_NUMLIST))
+                {
+                    if (!read_yaml_macros_and_links)
+                    {
+                        process_list_item_end(doc);
+                        add_node(doc, NODE_NUMLIST_END, 0);
+                    }
+                    state &= ~ST_NUMLIST;
+                }
+
+                if (!*pbuffer && (state & ST_FOOTNOTE_TEXT))
+                {
+                    *ptoken = 0;
+                    skip_eol = TRUE;
+                    if (read_yaml_macros_and_links)
+                        strbuf_append(&footnote_text, token, ptoken - token);
+                    end_footnote_text(read_yaml_macros_and_links);
+                }
+            }
+
+            if (state & ST_BLOCKQUOTE 
+                    && (!*pbuffer || *pbuffer != '>'))
+            {
+                state &= ~ST_BLOCKQUOTE;
+                add_node(doc, NODE_BLOCKQUOTE, NODE_FLAG_END);
+            }
+
+            if (ANY(state, ST_TABLE_HEADER | ST_TABLE_LINE) 
+                    && (!line_len || !*pbuffer))
+            {
+                if (!read_yaml_macros_and_links)
+                {
+                    warning(1, (uint8_t*)"Malformed table");
+                    add_node(doc, NODE_TABLE_END, 0);
+                }
+                state &= ~(ST_TABLE_HEADER | ST_TABLE_LINE);
+            }
+
+            if ((state & ST_TABLE) && (!line_len || !*pbuffer))
+            {
+                if (!read_yaml_macros_and_links)
+                    add_node(doc, NODE_TABLE_END, 0);
+                state &= ~ST_TABLE;
+            }
+
+            previous_line_blank = FALSE;
+        }
+
+        if (!skip_eol && !keep_token && !read_yaml_macros_and_links 
+                && !ANY(state, ST_YAML | ST_YAML_VAL | ST_LINK_SECOND_ARG))
+                add_node(doc, NODE_NEWLINE, 0);
+
+        if (!keep_token)
+            RESET_TOKEN(token, ptoken, token_size)
+
+        if (!skip_change_first_line_in_doc
+                && !(state & ST_YAML))
+            first_line_in_doc = FALSE;
+
+        skip_change_first_line_in_doc = FALSE; 
+        if (line_len == 0)
+            previous_line_blank = TRUE;
+
+        /* Lasts until the end of line */
+        state &= ~(ST_YAML_VAL | ST_IMAGE_SECOND_ARG | ST_LINK_SECOND_ARG);
+    }
+    while (pbuffer && *pbuffer && (!chunk || pbuffer < chunk->end));
+
+    if (chunk && !chunk->last)
+    {
+        chunk->continued                     = TRUE;
+        chunk->lineno                        = lineno;
+        chunk->token                         = token;
+        chunk->ptoken                        = ptoken;
+        chunk->token_size                    = token_size;
+        chunk->link_text                     = link_text;
+        chunk->link_size                     = link_size;
+        chunk->link_macro                    = link_macro;
+        chunk->heading_level                 = heading_level;
+        chunk->end_tag                       = end_tag;
+        chunk->first_line_in_doc             = first_line_in_doc;
+        chunk->skip_change_first_line_in_doc = skip_change_first_line_in_doc;
+        chunk->keep_token                    = keep_token;
+        chunk->previous_line_blank           = previous_line_blank;
+        chunk->add_image_links               = add_image_links;
+        chunk->add_figcaption                = add_figcaption;
+        chunk->add_footnote_div              = add_footnote_div;
+        chunk->footnote_at_line_start        = footnote_at_line_start;
+        free(line);
+        return 0;
+    }
+
+    /* A macro body or footnote left open runs to the end of the document */
+    if (read_yaml_macros_and_links && (state & ST_MACRO_BODY))
+        pmacros->value = rope_join(&macro_rope, &pmacros->value_size);
+    if (read_yaml_macros_and_links && footnote_text.text)
+        pfootnotes->value = strbuf_detach(&footnote_text, 
+                &pfootnotes->value_size);
+
+    if (!read_yaml_macros_and_links 
+            && (footnote_count > 0 || inline_footnote_count > 0))
+    {
+        add_node(doc, NODE_FOOTNOTES, 
+                (state & ST_PARA_OPEN ? NODE_FLAG_PARA_OPEN : 0)
+                | (add_footnote_div ? NODE_FLAG_FOOTNOTE_DIV : 0));
+        state &= ~ST_PARA_OPEN;
+    }
+
+    if (!read_yaml_macros_and_links && !body_only)
+        add_node(doc, NODE_END_HTML, 0);
+
+    if (link_text)
+        free(link_text);
+
+    free(link_macro);
+    free(token);
+    free(line);
+
+    return 0;
+}
+
+int
+emit_html(const ParsedDoc* doc, FILE* output)
+{
+    const Node* node     = NULL;
+    ULONG saved_state    = state;
+    size_t saved_lineno  = lineno;
+    uint8_t* directive   = NULL;
+
+    /* Replay the points at which macros of this document were defined */
+    for (node = doc->nodes; node < doc->nodes + doc->nodes_count; node++)
+        if (node->type == NODE_MACRO_DEFINITION)
+            (macros + node->number)->seen = FALSE;
+
+    /* A chunk of a streamed document may go on with a CSV template */
+    if (doc->continued && csv_body_emitting)
+        state |= ST_CSV_BODY;
+    else
+        state &= ~ST_CSV_BODY;
+
+    /* ...or with highlighted code, which is kept until the block ends */
+    if (!doc->continued)
+    {
+        code_language = NULL;
+        code_text.len = 0;
+    }
+
+    for (node = doc->nodes; node < doc->nodes + doc->nodes_count; node++)
+    {
+        uint8_t* text = span_text(doc, node->text);
+        BOOL end_tag = node->flags & NODE_FLAG_END ? TRUE : FALSE;
+
+        lineno = node->lineno;
+
+        if (code_language && node->type != NODE_TEXT 
+                && node->type != NODE_NEWLINE && node->type != NODE_PRE)
+            print_highlighted(output, code_language, &code_text);
+
+        switch (node->type)
+        {
+        case NODE_HEAD:
+            begin_html_and_head(output);
+            add_css(output, doc);
+            end_head_start_body(output);
+            break;
+        case NODE_ARTICLE_HEADER:
+            site_defs_hidden = !(node->flags & NODE_FLAG_SITE);
+            print_article_header(output, node->number, node->count);
+            site_defs_hidden = FALSE;
+            break;
+        case NODE_TEXT:
+            if (code_language)
+                strbuf_append(&code_text, text, u8_strlen(text));
+            else
+                print_output(output, "%s", text);
+            break;
+        case NODE_NEWLINE:
+            if (code_language)
+                strbuf_append(&code_text, (uint8_t*)"\n", 1);
+            else
+                print_output(output, "\n");
+            break;
+        case NODE_PARA_START:
+            print_output(output, "<p>");
+            break;
+        case NODE_PARA_END:
+            print_output(output, "</p>");
+            break;
+        case NODE_PARA_BREAK:
+            print_output(output, "</p>\n");
+            break;
+        case NODE_HEADING_START:
+            process_heading_start(output, node->number);
+            break;
+        case NODE_HEADING_END:
+            process_heading(text, output, node->number);
+            break;
+        case NODE_LIST_START:
+            process_list_start(output);
+            break;
+        case NODE_LIST_END:
+            process_list_end(output);
+            break;
+        case NODE_NUMLIST_START:
+            process_numlist_start(output);
+            break;
+        case NODE_NUMLIST_END:
+            process_numlist_end(output);
+            break;
+        case NODE_LIST_ITEM_START:
+            print_list_item_start(output);
+            break;
+        case NODE_LIST_ITEM_END:
+            print_list_item_end(output, 
+                    node->flags & NODE_FLAG_PARA_OPEN ? TRUE : FALSE);
+            break;
+        case NODE_BOLD:
+            process_bold(output, end_tag);
+            break;
+        case NODE_ITALIC:
+            process_italic(output, end_tag);
+            break;
+        case NODE_CODE:
+            process_code(output, end_tag);
+            break;
+        case NODE_KBD:
+            process_kbd(output, end_tag);
+            break;
+        case NODE_BLOCKQUOTE:
+            process_blockquote(output, end_tag);
+            break;
+        case NODE_PRE:
+            if (end_tag && code_language)
+            {
+                print_highlighted(output, code_language, &code_text);
+                code_language = NULL;
+            }
+            if (!end_tag && node->text.len 
+                    && (code_language = get_code_language(text)))
+                print_language_class(output, code_language);
+            else
+                print_output(output, end_tag ? "</pre>" : "<pre>");
+            break;
+        case NODE_HORIZONTAL_RULE:
+            print_horizontal_rule(output, 
+                    node->flags & NODE_FLAG_PARA_OPEN ? TRUE : FALSE);
+            break;
+        case NODE_TABLE_START:
+            process_table_start(output);
+            break;
+        case NODE_TABLE_HEADER_START:
+            process_table_header_start(output);
+            break;
+        case NODE_TABLE_HEADER_CELL:
+            process_table_header_cell(output);
+            break;
+        case NODE_TABLE_HEADER_END:
+            process_table_header_end(output);
+            break;
+        case NODE_TABLE_BODY_START:
+            process_table_body_start(output, 
+                    node->flags & NODE_FLAG_START_ROW ? TRUE : FALSE);
+            break;
+        case NODE_TABLE_BODY_ROW_START:
+            process_table_body_row_start(output);
+            break;
+        case NODE_TABLE_BODY_CELL:
+            process_table_body_cell(output);
+            break;
+        case NODE_TABLE_BODY_ROW_END:
+            process_table_body_row_end(output);
+            break;
+        case NODE_TABLE_END:
+            process_table_end(output);
+            break;
+        case NODE_LINK:
+            process_inline_link(text, span_text(doc, node->prefix), 
+                    span_text(doc, node->arg), output);
+            break;
+        case NODE_IMAGE:
+            process_inline_image(text, span_text(doc, node->arg), output,
+                    node->flags & NODE_FLAG_LINK ? TRUE : FALSE,
+                    node->flags & NODE_FLAG_FIGCAPTION ? TRUE : FALSE);
+            break;
+        case NODE_FOOTNOTE_REF:
+            print_footnote_ref(output, FALSE, node->number);
+            break;
+        case NODE_INLINE_FOOTNOTE_REF:
+            print_footnote_ref(output, TRUE, node->number);
+            break;
+        case NODE_FORMULA:
+            process_formula(output, text, 
+                    node->flags & NODE_FLAG_DISPLAY ? TRUE : FALSE);
+            break;
+        case NODE_TAG:
+            print_tag(output, text, end_tag);
+            break;
+        case NODE_MACRO:
+            print_output(output, "%s", (node->flags & NODE_FLAG_SITE 
+                        ? site_macros : macros)[node->number].value);
+            break;
+        case NODE_MACRO_DEFINITION:
+            (macros + node->number)->seen = TRUE;
+            break;
+        case NODE_CSV_START:
+            state |= ST_CSV_BODY;
+            if (node->text.len)
+            {
+                if (!csv_filename)
+                    CALLOC(csv_filename, char, BUFSIZE)
+                strncpy(csv_filename, (char*)text, BUFSIZE-1);
+                csv_iter = node->number;
+            }
+            break;
+        case NODE_CSV_END:
+            state &= ~ST_CSV_BODY;
+            if (node->flags & NODE_FLAG_RENDER)
+            {
+                read_csv(output, csv_filename, &print_csv_row);
+
+                free(csv_filename);
+                csv_filename = NULL;
+                free_strbuf(&csv_template);
+            }
+            break;
+        case NODE_INCLUDE:
+        case NODE_INCDIR:
+        case NODE_CSV_TABLE:
+            /* Directive handlers tokenize their argument in place */
+            directive = u8_strdup(text);
+            CHECKEXITNOMEM(directive)
+            if (node->type == NODE_INCLUDE)
+                process_include(directive, output);
+            else if (node->type == NODE_INCDIR)
+                process_incdir(directive, output);
+            else
+                process_csv_table(directive, output);
+            free(directive);
+            break;
+        case NODE_GIT_LOG:
+            process_git_log(output);
+            break;
+        case NODE_MADE_BY:
+            print_made_by(output);
+            break;
+        case NODE_PLUGIN:
+            process_plugin_directive(output, text);
+            break;
+        case NODE_FOOTNOTES:
+            end_footnotes(output, 
+                    node->flags & NODE_FLAG_FOOTNOTE_DIV ? TRUE : FALSE,
+                    node->flags & NODE_FLAG_PARA_OPEN ? TRUE : FALSE);
+            break;
+        case NODE_END_HTML:
+            end_body_and_html(output);
+            break;
+        default:
+            exit(error(EINVAL, (uint8_t*)"emit_html: Invalid node type %d",
+                        node->type));
+        }
+    }
+
+    csv_body_emitting = state & ST_CSV_BODY ? TRUE : FALSE;
+    state = saved_state;
+    lineno = saved_lineno;
+    return 0;
+}
+
+double
+elapsed_ms(const struct timespec* start, const struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000.0 
+        + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+int
+parse_timed(uint8_t* buffer, ParsedDoc* doc, BOOL body_only, 
+        BOOL read_yaml_macros_and_links, ParseChunk* chunk)
+{
+    struct timespec start;
+    struct timespec parsed;
+    int result = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    result = parse_document(buffer, doc, body_only, 
+            read_yaml_macros_and_links, chunk);
+    clock_gettime(CLOCK_MONOTONIC, &parsed);
+
+    timings[read_yaml_macros_and_links ? TIMING_DEFINITIONS : TIMING_PARSE] 
+        += elapsed_ms(&start, &parsed);
+    return result;
+}
+
+int
+emit_timed(const ParsedDoc* doc, FILE* output)
+{
+    struct timespec start;
+    struct timespec emitted;
+    int result = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    result = emit_html(doc, output);
+    clock_gettime(CLOCK_MONOTONIC, &emitted);
+
+    timings[TIMING_EMIT] += elapsed_ms(&start, &emitted);
+    return result;
+}
+
+int
+slweb_parse(uint8_t* buffer, FILE* output, BOOL body_only, 
+        BOOL read_yaml_macros_and_links)
+{
+    ParsedDoc doc;
+    int result = 0;
+
+    init_parsed_doc(&doc);
+    result = parse_timed(buffer, &doc, body_only, read_yaml_macros_and_links,
+            NULL);
+    if (!result)
+        result = emit_timed(&doc, output);
+    free_parsed_doc(&doc);
+    return result;
+}
+
+int
+init_document()
+{
+    CALLOC(vars, KeyValue, 1)
+    vars->key = NULL;
+    vars->value = NULL;
+    vars->value_size = 0;
+    vars_count = 0;
+
+    CALLOC(macros, KeyValue, 1)
+    macros->key = NULL;
+    macros->value = NULL;
+    macros->value_size = 0;
+    macros_count = 0;
+
+    links = NULL;
+    footnotes = NULL;
+    inline_footnotes = NULL;
+    init_links_and_footnotes();
+
+    state = ST_NONE;
+
+    return 0;
+}
+
+int
+free_document()
+{
+    if (input_dirname)
+        free(input_dirname);
+    input_dirname = NULL;
+    if (inline_footnotes)
+        free(inline_footnotes);
+    inline_footnotes = NULL;
+    free_keyvalue(&footnotes, footnote_count - footnotes_spilled);
+    free_keyvalue(&links, links_count);
+    free_keyvalue(&macros, macros_count);
+    free_keyvalue(&vars, vars_count);
+    free_formulas();
+    free_plugin_calls();
+    free(footnotes);
+    free(links);
+    free(macros);
+    free(vars);
+    footnotes = links = macros = vars = NULL;
+    footnote_count = links_count = macros_count = vars_count = 0;
+    footnotes_spilled = inline_footnotes_spilled = 0;
+    return 0;
+}
+
+KeyValue*
+freeze_defs(KeyValue* list, size_t list_count)
+{
+    KeyValue* frozen = NULL;
+    KeyValue* plist  = list;
+    KeyValue* pfrozen = NULL;
+    uint8_t* pdata   = NULL;
+    size_t size      = sizeof(KeyValue) * list_count;
+
+    if (!list_count)
+        return NULL;
+
+    while (plist < list + list_count)
+    {
+        size += u8_strlen(plist->key) + 1;
+        size += plist->value ? u8_strlen(plist->value) + 1 : 0;
+        plist++;
+    }
+
+    /* One read-only mapping, shared as is by every forked worker */
+    frozen = mmap(NULL, size, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (frozen == MAP_FAILED)
+        exit(error(ENOMEM, (uint8_t*)"Memory allocation failed"
+                    " (out of memory?)"));
+
+    pdata = (uint8_t*)(frozen + list_count);
+    for (plist = list, pfrozen = frozen; plist < list + list_count; 
+            plist++, pfrozen++)
+    {
+        size_t key_len = u8_strlen(plist->key);
+
+        memcpy(pdata, plist->key, key_len + 1);
+        pfrozen->key = pdata;
+        pdata += key_len + 1;
+        pfrozen->value = NULL;
+        pfrozen->value_size = 0;
+        if (plist->value)
+        {
+            pfrozen->value_size = u8_strlen(plist->value) + 1;
+            memcpy(pdata, plist->value, pfrozen->value_size);
+            pfrozen->value = pdata;
+            pdata += pfrozen->value_size;
+        }
+        pfrozen->seen = TRUE;
+        pfrozen->kept = TRUE;
+    }
+
+    mprotect(frozen, size, PROT_READ);
+    return frozen;
+}
+
+int
+load_site_defs(char* filename)
+{
+    char* page_filename = input_filename;
+    FILE* input         = NULL;
+    uint8_t* buffer     = NULL;
+    size_t buffer_size  = 0;
+    ParsedDoc doc;
+
+    input_filename = filename;
+    if (read_file_into_buffer(&buffer, &buffer_size, filename, 
+                &input_dirname, &input))
+        return 1;
+
+    /* Only the definitions pass is needed */
+    init_document();
+    init_parsed_doc(&doc);
+    parse_document(buffer, &doc, TRUE, TRUE, NULL);
+    free_parsed_doc(&doc);
+
+    site_vars = freeze_defs(vars, vars_count);
+    site_vars_count = vars_count;
+    site_macros = freeze_defs(macros, macros_count);
+    site_macros_count = macros_count;
+    site_links = freeze_defs(links, links_count);
+    site_links_count = links_count;
+    site_defs_filename = filename;
+    site_defs_hash = hash_file(filename);
+
+    free_document();
+    free(buffer);
+    input_filename = page_filename;
+    return 0;
+}
+
+uint64_t
+get_doc_source_hash(const uint8_t* buffer, BOOL body_only)
+{
+    const char* dirname = input_dirname ? input_dirname : "";
+
+    /* Besides the source, parsing depends only on where CSV files are looked
+     * up, on the site definitions, on the directives of plugins and on 
+     * whether <head> is wanted */
+    return hash_words(buffer, u8_strlen(buffer))
+        ^ (hash_buffer((uint8_t*)dirname, strlen(dirname)) << 1)
+        ^ (site_defs_hash << 2)
+        ^ (plugin_directives_hash << 3)
+        ^ (body_only ? 1 : 0);
+}
+
+char*
+get_doc_cache_filename()
+{
+    char* cache_filename = NULL;
+    char* path           = realpath(input_filename, NULL);
+    uint64_t key         = 0;
+
+    /* Pages with the same name in different directories must not collide */
+    key = path ? hash_buffer((uint8_t*)path, strlen(path))
+        : hash_buffer((uint8_t*)input_filename, strlen(input_filename));
+    free(path);
+
+    CALLOC(cache_filename, char, strlen(doc_cache_dir) + KEYSIZE)
+    sprintf(cache_filename, "%s/%016llx.doc", doc_cache_dir, 
+            (unsigned long long)key);
+    return cache_filename;
+}
+
+DocDef*
+get_doc_defs(ParsedDoc* strings, KeyValue* list, size_t list_count)
+{
+    DocDef* defs  = NULL;
+    DocDef* pdef  = NULL;
+    KeyValue* plist = list;
+
+    CALLOC(defs, DocDef, list_count + 1)
+    pdef = defs;
+    while (plist < list + list_count)
+    {
+        pdef->key = add_span(strings, plist->key);
+        pdef->value = add_span(strings, plist->value);
+        pdef->flags = (plist->value ? DOC_DEF_VALUE : 0)
+            | (plist->seen ? DOC_DEF_SEEN : 0);
+        pdef++;
+        plist++;
+    }
+    return defs;
+}
+
+int
+store_doc_cache(const ParsedDoc* defs_doc, ULONG defs_state, 
+        const ParsedDoc* doc, uint64_t source_hash)
+{
+    DocCacheHeader header;
+    ParsedDoc strings;
+    const void* data[DOC_SECTION_COUNT];
+    size_t counts[DOC_SECTION_COUNT];
+    DocDef* defs[4];
+    Span* inline_spans   = NULL;
+    uint8_t* image       = NULL;
+    size_t image_len     = sizeof(header);
+    char* cache_filename = NULL;
+    char* temp_filename  = NULL;
+    int fd               = -1;
+    int section          = 0;
+    size_t footnote      = 0;
+
+    init_parsed_doc(&strings);
+    defs[0] = get_doc_defs(&strings, vars, vars_count);
+    defs[1] = get_doc_defs(&strings, macros, macros_count);
+    defs[2] = get_doc_defs(&strings, links, links_count);
+    defs[3] = get_doc_defs(&strings, footnotes, footnote_count);
+    CALLOC(inline_spans, Span, inline_footnote_count + 1)
+    for (footnote = 0; footnote < inline_footnote_count; footnote++)
+        inline_spans[footnote] = add_span(&strings, inline_footnotes[footnote]);
+
+    data[DOC_SECTION_DEFS_NODES] = defs_doc->nodes;
+    counts[DOC_SECTION_DEFS_NODES] = defs_doc->nodes_count;
+    data[DOC_SECTION_DEFS_POOL] = defs_doc->pool;
+    counts[DOC_SECTION_DEFS_POOL] = defs_doc->pool_len;
+    data[DOC_SECTION_NODES] = doc->nodes;
+    counts[DOC_SECTION_NODES] = doc->nodes_count;
+    data[DOC_SECTION_POOL] = doc->pool;
+    counts[DOC_SECTION_POOL] = doc->pool_len;
+    data[DOC_SECTION_VARS] = defs[0];
+    counts[DOC_SECTION_VARS] = vars_count;
+    data[DOC_SECTION_MACROS] = defs[1];
+    counts[DOC_SECTION_MACROS] = macros_count;
+    data[DOC_SECTION_LINKS] = defs[2];
+    counts[DOC_SECTION_LINKS] = links_count;
+    data[DOC_SECTION_FOOTNOTES] = defs[3];
+    counts[DOC_SECTION_FOOTNOTES] = footnote_count;
+    data[DOC_SECTION_INLINE_FOOTNOTES] = inline_spans;
+    counts[DOC_SECTION_INLINE_FOOTNOTES] = inline_footnote_count;
+    data[DOC_SECTION_STRINGS] = strings.pool;
+    counts[DOC_SECTION_STRINGS] = strings.pool_len;
+
+    memset(&header, 0, sizeof(header));
+    for (section = 0; section < DOC_SECTION_COUNT; section++)
+    {
+        image_len = (image_len + 7) & ~(size_t)7;
+        header.sections[section].offset = image_len;
+        header.sections[section].count = counts[section];
+        image_len += counts[section] * doc_section_sizes[section];
+    }
+
+    CALLOC(image, uint8_t, image_len)
+    for (section = 0; section < DOC_SECTION_COUNT; section++)
+        memcpy(image + header.sections[section].offset, data[section],
+                counts[section] * doc_section_sizes[section]);
+
+    memcpy(header.magic, DOC_CACHE_MAGIC, sizeof(header.magic));
+    header.version = DOC_CACHE_VERSION;
+    header.byte_order = DOC_CACHE_BYTE_ORDER;
+    header.header_size = sizeof(header);
+    header.node_size = sizeof(Node);
+    header.source_hash = source_hash;
+    header.body_hash = hash_words(image + sizeof(header), 
+            image_len - sizeof(header));
+    header.file_len = image_len;
+    header.defs_state = defs_state;
+    header.state = state;
+    header.current_footnote = current_footnote;
+    header.current_inline_footnote = current_inline_footnote;
+    memcpy(image, &header, sizeof(header));
+
+    /* Written aside and renamed, so that readers never map a partial file */
+    cache_filename = get_doc_cache_filename();
+    CALLOC(temp_filename, char, strlen(cache_filename) + KEYSIZE)
+    sprintf(temp_filename, "%s.%ld", cache_filename, (long)getpid());
+    fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, image, image_len) != (ssize_t)image_len
+            || close(fd) < 0 || rename(temp_filename, cache_filename) < 0)
+    {
+        warning(1, (uint8_t*)"Cannot write document cache file '%s'",
+                cache_filename);
+        unlink(temp_filename);
+    }
+
+    free(temp_filename);
+    free(cache_filename);
+    free(image);
+    free(inline_spans);
+    for (section = 0; section < 4; section++)
+        free(defs[section]);
+    free_parsed_doc(&strings);
+    return 0;
+}
+
+BOOL
+doc_span_valid(const uint8_t* pool, size_t pool_len, Span span)
+{
+    return (uint64_t)span.offset + span.len < pool_len
+        && !pool[span.offset + span.len];
+}
+
+BOOL
+doc_cache_valid(const uint8_t* map, size_t map_len, uint64_t source_hash)
+{
+    const DocCacheHeader* header = (const DocCacheHeader*)map;
+    const DocSection* sections   = header->sections;
+    const uint8_t* strings       = NULL;
+    size_t strings_len           = 0;
+    int section                  = 0;
+
+    if (memcmp(header->magic, DOC_CACHE_MAGIC, sizeof(header->magic))
+            || header->version != DOC_CACHE_VERSION
+            || header->byte_order != DOC_CACHE_BYTE_ORDER
+            || header->header_size != sizeof(DocCacheHeader)
+            || header->node_size != sizeof(Node)
+            || header->source_hash != source_hash
+            || header->file_len != map_len)
+        return FALSE;
+
+    for (section = 0; section < DOC_SECTION_COUNT; section++)
+        if (sections[section].offset % 8
+                || sections[section].offset < sizeof(DocCacheHeader)
+                || sections[section].offset > map_len
+                || sections[section].count > (map_len 
+                    - sections[section].offset) / doc_section_sizes[section])
+            return FALSE;
+
+    if (hash_words(map + sizeof(DocCacheHeader), 
+                map_len - sizeof(DocCacheHeader)) != header->body_hash)
+        return FALSE;
+
+    /* Everything the emitter follows must stay within the file */
+    for (section = DOC_SECTION_DEFS_NODES; section <= DOC_SECTION_NODES; 
+            section += 2)
+    {
+        const Node* node = (const Node*)(map + sections[section].offset);
+        const Node* end  = node + sections[section].count;
+        const uint8_t* pool = map + sections[section+1].offset;
+        size_t pool_len     = sections[section+1].count;
+
+        for (; node < end; node++)
+            if (node->type > NODE_END_HTML
+                    || ((node->type == NODE_MACRO 
+                            || node->type == NODE_MACRO_DEFINITION)
+                        && node->number >= (node->flags & NODE_FLAG_SITE 
+                            ? site_macros_count 
+                            : sections[DOC_SECTION_MACROS].count))
+                    || !doc_span_valid(pool, pool_len, node->text)
+                    || !doc_span_valid(pool, pool_len, node->arg)
+                    || !doc_span_valid(pool, pool_len, node->prefix))
+                return FALSE;
+    }
+
+    strings = map + sections[DOC_SECTION_STRINGS].offset;
+    strings_len = sections[DOC_SECTION_STRINGS].count;
+    for (section = DOC_SECTION_VARS; section <= DOC_SECTION_FOOTNOTES; 
+            section++)
+    {
+        const DocDef* def = (const DocDef*)(map + sections[section].offset);
+        const DocDef* end = def + sections[section].count;
+
+        for (; def < end; def++)
+            if (!doc_span_valid(strings, strings_len, def->key)
+                    || !doc_span_valid(strings, strings_len, def->value))
+                return FALSE;
+    }
+
+    const Span* span = (const Span*)(map 
+            + sections[DOC_SECTION_INLINE_FOOTNOTES].offset);
+    const Span* end = span + sections[DOC_SECTION_INLINE_FOOTNOTES].count;
+    for (; span < end; span++)
+        if (!doc_span_valid(strings, strings_len, *span))
+            return FALSE;
+
+    return TRUE;
+}
+
+uint8_t*
+map_doc_cache(uint64_t source_hash, size_t* map_len)
+{
+    char* cache_filename = get_doc_cache_filename();
+    uint8_t* map         = NULL;
+    struct stat fs;
+    int fd               = open(cache_filename, O_RDONLY);
+
+    free(cache_filename);
+    if (fd < 0)
+        return NULL;
+
+    if (!fstat(fd, &fs) && fs.st_size >= (off_t)sizeof(DocCacheHeader))
+    {
+        map = mmap(NULL, fs.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+    }
+    close(fd);
+
+    if (map && !doc_cache_valid(map, fs.st_size, source_hash))
+    {
+        munmap(map, fs.st_size);
+        map = NULL;
+    }
+
+    *map_len = map ? fs.st_size : 0;
+    return map;
+}
+
+int
+load_doc_defs(KeyValue** list, size_t* list_count, const uint8_t* map,
+        DocSectionType section)
+{
+    const DocCacheHeader* header = (const DocCacheHeader*)map;
+    const uint8_t* strings = map 
+        + header->sections[DOC_SECTION_STRINGS].offset;
+    const DocDef* def = (const DocDef*)(map 
+            + header->sections[section].offset);
+    KeyValue* plist = NULL;
+
+    *list_count = header->sections[section].count;
+    if (*list_count > 1)
+        REALLOCARRAY(*list, KeyValue, *list_count)
+
+    plist = *list;
+    while (plist < *list + *list_count)
+    {
+        plist->key = (uint8_t*)strings + def->key.offset;
+        plist->value = def->flags & DOC_DEF_VALUE 
+            ? (uint8_t*)strings + def->value.offset : NULL;
+        plist->value_size = plist->value ? def->value.len + 1 : 0;
+        plist->seen = def->flags & DOC_DEF_SEEN ? TRUE : FALSE;
+        plist->kept = FALSE;
+        plist++;
+        def++;
+    }
+    return 0;
+}
+
+int
+forget_doc_defs(KeyValue* list, size_t list_count, const uint8_t* map)
+{
+    const DocCacheHeader* header = (const DocCacheHeader*)map;
+    KeyValue* plist = list;
+
+    /* Includes may have added their own, which are freed as usual */
+    while (plist < list + list_count)
+    {
+        if (plist->key >= map && plist->key < map + header->file_len)
+            plist->key = NULL;
+        if (plist->value >= map && plist->value < map + header->file_len)
+            plist->value = NULL;
+        plist++;
+    }
+    return 0;
+}
+
+int
+get_mapped_doc(ParsedDoc* doc, const uint8_t* map, DocSectionType nodes)
+{
+    const DocCacheHeader* header = (const DocCacheHeader*)map;
+
+    doc->nodes = (Node*)(map + header->sections[nodes].offset);
+    doc->nodes_count = doc->nodes_size = header->sections[nodes].count;
+    doc->pool = (uint8_t*)(map + header->sections[nodes+1].offset);
+    doc->pool_len = doc->pool_size = header->sections[nodes+1].count;
+    doc->continued = FALSE;
+    return 0;
+}
+
+int
+render_mapped_doc(const uint8_t* map, FILE* output)
+{
+    const DocCacheHeader* header = (const DocCacheHeader*)map;
+    const uint8_t* strings = map 
+        + header->sections[DOC_SECTION_STRINGS].offset;
+    const Span* span = (const Span*)(map 
+            + header->sections[DOC_SECTION_INLINE_FOOTNOTES].offset);
+    ParsedDoc defs_doc;
+    ParsedDoc doc;
+    size_t footnote = 0;
+    int result = 0;
+
+    /* Keys, values and inline footnotes point into the map, which is
+     * unmapped as soon as the document has been emitted */
+    load_doc_defs(&vars, &vars_count, map, DOC_SECTION_VARS);
+    load_doc_defs(&macros, &macros_count, map, DOC_SECTION_MACROS);
+    load_doc_defs(&links, &links_count, map, DOC_SECTION_LINKS);
+    load_doc_defs(&footnotes, &footnote_count, map, DOC_SECTION_FOOTNOTES);
+
+    inline_footnote_count = header->sections[DOC_SECTION_INLINE_FOOTNOTES].count;
+    if (inline_footnote_count > 1)
+        REALLOCARRAY(inline_footnotes, uint8_t*, inline_footnote_count)
+    for (footnote = 0; footnote < inline_footnote_count; footnote++, span++)
+        inline_footnotes[footnote] = (uint8_t*)strings + span->offset;
+
+    get_mapped_doc(&defs_doc, map, DOC_SECTION_DEFS_NODES);
+    get_mapped_doc(&doc, map, DOC_SECTION_NODES);
+
+    state = header->defs_state;
+    result = emit_timed(&defs_doc, output);
+
+    if (!result)
+    {
+        state = header->state;
+        current_footnote = header->current_footnote;
+        current_inline_footnote = header->current_inline_footnote;
+        result = emit_timed(&doc, output);
+    }
+
+    forget_doc_defs(vars, vars_count, map);
+    forget_doc_defs(macros, macros_count, map);
+    forget_doc_defs(links, links_count, map);
+    forget_doc_defs(footnotes, footnote_count, map);
+    return result;
+}
+
+void*
+gzip_thread(void* arg)
+{
+    GzipJob* job = (GzipJob*)arg;
+    uint8_t in[GZIP_CHUNK_SIZE];
+    uint8_t out[GZIP_CHUNK_SIZE];
+    z_stream stream;
+    ssize_t nread = 0;
+    int flush     = Z_NO_FLUSH;
+
+    memset(&stream, 0, sizeof(z_stream));
+
+    /* 16 more window bits ask for a gzip header and trailer */
+    if (deflateInit2(&stream, job->level, Z_DEFLATED, 15 + 16, 8, 
+                Z_DEFAULT_STRATEGY) != Z_OK)
+        job->result = error(1, (uint8_t*)"gzip: Cannot initialize");
+
+    /* Read to the end even after an error, so that printing never blocks */
+    do
+    {
+        nread = read(job->input, in, GZIP_CHUNK_SIZE);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread < 0)
+        {
+            job->result = error(errno, (uint8_t*)"gzip: Cannot read output");
+            nread = 0;
+        }
+        flush = nread ? Z_NO_FLUSH : Z_FINISH;
+
+        if (job->result)
+            continue;
+
+        if (job->html >= 0 && send_all(job->html, in, nread))
+            job->result = error(errno, (uint8_t*)"Cannot write output");
+
+        stream.next_in = in;
+        stream.avail_in = nread;
+        do
+        {
+            stream.next_out = out;
+            stream.avail_out = GZIP_CHUNK_SIZE;
+            deflate(&stream, flush);
+            if (!job->result && send_all(job->gz, out, 
+                        GZIP_CHUNK_SIZE - stream.avail_out))
+                job->result = error(errno, (uint8_t*)"gzip: Cannot write"
+                        " output");
+        }
+        while (stream.avail_out == 0);
+    }
+    while (flush != Z_FINISH);
+
+    deflateEnd(&stream);
+    close(job->input);
+    return NULL;
+}
+
+FILE*
+start_gzip(GzipJob* job, int html, int gz)
+{
+    int output_pipe_fds[2];
+    FILE* output = NULL;
+
+    if (pipe(output_pipe_fds) < 0)
+        exit(error(errno, (uint8_t*)"Cannot create pipe"));
+    fcntl(output_pipe_fds[PIPE_READ_INDEX], F_SETFD, FD_CLOEXEC);
+    fcntl(output_pipe_fds[PIPE_WRITE_INDEX], F_SETFD, FD_CLOEXEC);
+
+    job->input = output_pipe_fds[PIPE_READ_INDEX];
+    job->html = html;
+    job->gz = gz;
+    job->level = gzip_level;
+    job->result = 0;
+
+    output = fdopen(output_pipe_fds[PIPE_WRITE_INDEX], "w");
+    if (!output)
+        exit(error(errno, (uint8_t*)"Cannot fdopen"));
+
+    /* Compression overlaps with rendering the rest of the page */
+    if (pthread_create(&job->thread, NULL, gzip_thread, job))
+        exit(error(1, (uint8_t*)"gzip: Cannot start thread"));
+
+    return output;
+}
+
+FILE*
+open_gzip_page(GzipJob* job, const char* html_filename)
+{
+    char* gz_filename = NULL;
+    int html          = -1;
+    int gz            = -1;
+
+    CALLOC(gz_filename, char, strlen(html_filename) + 4)
+    sprintf(gz_filename, "%s.gz", html_filename);
+
+    html = open(html_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (html >= 0)
+        gz = open(gz_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    free(gz_filename);
+
+    if (gz < 0)
+    {
+        if (html >= 0)
+            close(html);
+        return NULL;
+    }
+    return start_gzip(job, html, gz);
+}
+
+int
+finish_gzip(GzipJob* job, FILE* output)
+{
+    fclose(output);
+    pthread_join(job->thread, NULL);
+    return job->result;
+}
+
+int
+print_timings(BOOL use_doc_cache, BOOL cached)
+{
+    if (show_timings)
+    {
+        fprintf(stderr, "%s: %s: definitions %.3f ms, parse %.3f ms,",
+                PROGRAMNAME, input_filename ? input_filename : "(stdin)",
+                timings[TIMING_DEFINITIONS], timings[TIMING_PARSE]);
+        if (use_doc_cache)
+            fprintf(stderr, " load %.3f ms%s,", timings[TIMING_LOAD],
+                    cached ? " (cached)" : "");
+        fprintf(stderr, " emit %.3f ms", timings[TIMING_EMIT]);
+        if (formulas_native || formulas_katex)
+            fprintf(stderr, ", formulas %zu (%zu with katex)",
+                    formulas_native + formulas_katex, formulas_katex);
+        fprintf(stderr, "\n");
+    }
+    memset(timings, 0, sizeof(timings));
+    formulas_native = 0;
+    formulas_katex = 0;
+    return 0;
+}
+
+int
+find_blocks(uint8_t* buffer, size_t buffer_len, FILE* output, BOOL body_only,
+        size_t block_size, BlockStart** blocks, size_t* blocks_count)
+{
+    ParsedDoc doc;
+    ParseChunk chunk;
+    BlockStart* block   = NULL;
+    uint8_t* buffer_end = buffer + buffer_len;
+    uint8_t* start      = buffer;
+    uint8_t* end        = NULL;
+    int result          = 0;
+
+    memset(&chunk, 0, sizeof(ParseChunk));
+    CALLOC(*blocks, BlockStart, 1)
+    (*blocks)->start = buffer;
+    *blocks_count = 1;
+
+    while (!result && !chunk.last)
+    {
+        /* Parsed up to the first blank line past the block size */
+        end = NULL;
+        if ((size_t)(buffer_end - start) > block_size)
+            end = memmem(start + block_size - 1, 
+                    buffer_end - start - block_size + 1, "\n\n", 2);
+        if (end && end + 2 < buffer_end)
+            end += 2;
+        else
+        {
+            end = buffer_end;
+            chunk.last = TRUE;
+        }
+        chunk.end = end;
+
+        init_parsed_doc(&doc);
+        result = parse_timed(start, &doc, body_only, TRUE, &chunk);
+        if (!result)
+            result = emit_timed(&doc, output);
+        free_parsed_doc(&doc);
+        start = end;
+
+        /* Nothing open across the blank line: a block can start here */
+        if (!chunk.last && state == ST_NONE && !chunk.keep_token 
+                && chunk.previous_line_blank)
+        {
+            (*blocks_count)++;
+            REALLOCARRAY(*blocks, BlockStart, *blocks_count)
+            block = *blocks + *blocks_count - 1;
+            block->start = start;
+            block->chunk = chunk;
+            block->state = state;
+            block->current_footnote = current_footnote;
+            block->current_inline_footnote = current_inline_footnote;
+            block->macros_count = macros_count;
+        }
+    }
+
+    return result;
+}
+
+int
+render_block(uint8_t* buffer_end, BlockStart* blocks, size_t blocks_count, 
+        size_t block_index, BOOL body_only, FILE* output)
+{
+    ParsedDoc doc;
+    ParseChunk chunk;
+    BlockStart* block = blocks + block_index;
+    BlockStart* next  = block_index + 1 < blocks_count ? block + 1 : NULL;
+    BOOL* seen        = NULL;
+    size_t macro      = 0;
+    int result        = 0;
+
+    chunk = block->chunk;
+    if (chunk.continued)
+    {
+        /* Only the line state carries over from the first pass */
+        chunk.token_size = BUFSIZE;
+        CALLOC(chunk.token, uint8_t, chunk.token_size)
+        chunk.ptoken = chunk.token;
+        chunk.link_text = NULL;
+        chunk.link_size = 0;
+        CALLOC(chunk.link_macro, uint8_t, BUFSIZE)
+        read_parse_flags(&chunk.add_image_links, &chunk.add_figcaption,
+                &chunk.add_footnote_div);
+    }
+    chunk.end = next ? next->start : buffer_end;
+    chunk.last = next ? FALSE : TRUE;
+
+    state = block->state;
+    current_footnote = block->current_footnote;
+    current_inline_footnote = block->current_inline_footnote;
+
+    /* Macros defined in earlier blocks are used, not defined, in this one */
+    CALLOC(seen, BOOL, macros_count + 1)
+    for (macro = 0; macro < macros_count; macro++)
+    {
+        if (macro < block->macros_count)
+            (macros + macro)->seen = TRUE;
+        *(seen + macro) = (macros + macro)->seen 
+            || (next && macro < next->macros_count);
+    }
+
+    init_parsed_doc(&doc);
+    result = parse_document(block->start, &doc, body_only, FALSE, &chunk);
+
+    /* The next block was started from where the first pass left off, which
+     * holds only if this pass ends up in the same place */
+    if (!result && next 
+            && (state != next->state
+                || current_footnote != next->current_footnote
+                || current_inline_footnote != next->current_inline_footnote
+                || chunk.lineno != next->chunk.lineno
+                || chunk.first_line_in_doc != next->chunk.first_line_in_doc
+                || chunk.keep_token || !chunk.previous_line_blank))
+        result = BLOCK_MISMATCH;
+    for (macro = 0; !result && next && macro < macros_count; macro++)
+        if ((macros + macro)->seen != *(seen + macro))
+            result = BLOCK_MISMATCH;
+
+    if (!result)
+        result = emit_html(&doc, output);
+
+    free_parsed_doc(&doc);
+    free(seen);
+    return result;
+}
+
+int
+render_blocks(uint8_t* buffer_end, BlockStart* blocks, size_t blocks_count, 
+        size_t jobs, BOOL body_only, FILE* output, BOOL* mismatch)
+{
+    FILE** block_outputs = NULL;
+    pid_t* pids          = NULL;
+    uint8_t* copy        = NULL;
+    size_t started       = 0;
+    size_t running       = 0;
+    size_t block_index   = 0;
+    size_t nread         = 0;
+    int pstatus          = 0;
+    int result           = 0;
+
+    *mismatch = FALSE;
+    CALLOC(block_outputs, FILE*, blocks_count)
+    CALLOC(pids, pid_t, blocks_count)
+
+    while (running || (started < blocks_count && !result && !*mismatch))
+    {
+        if (running < jobs && started < blocks_count && !result && !*mismatch)
+        {
+            if (!(*(block_outputs + started) = tmpfile()))
+                exit(error(errno, (uint8_t*)"Cannot create temporary file"));
+
+            /* Don't let the child flush our pending output a second time */
+            fflush(NULL);
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                output_minify = NULL;
+                exit(render_block(buffer_end, blocks, blocks_count, started,
+                            body_only, *(block_outputs + started)));
+            }
+            else if (pid < 0)
+                exit(error(errno, (uint8_t*)"Fork failed"));
+
+            *(pids + started++) = pid;
+            running++;
+            continue;
+        }
+
+        pid_t pid = waitpid(-1, &pstatus, 0);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            exit(error(errno, (uint8_t*)"Cannot wait for child"));
+        }
+
+        for (block_index = 0; block_index < started; block_index++)
+            if (*(pids + block_index) == pid)
+                break;
+        if (block_index == started)
+            continue;
+        running--;
+
+        if (!WIFEXITED(pstatus))
+            result = 1;
+        else if (WEXITSTATUS(pstatus) == BLOCK_MISMATCH)
+            *mismatch = TRUE;
+        else if (WEXITSTATUS(pstatus) && !result)
+            result = WEXITSTATUS(pstatus);
+    }
+
+    /* Concatenated in document order once all blocks are done */
+    CALLOC(copy, uint8_t, BUFSIZE)
+    for (block_index = 0; block_index < started; block_index++)
+    {
+        FILE* block_output = *(block_outputs + block_index);
+
+        rewind(block_output);
+        while (!result && !*mismatch 
+                && (nread = fread(copy, 1, BUFSIZE, block_output)) > 0)
+            if (write_output(output, copy, nread))
+                result = error(errno, (uint8_t*)"Cannot write output");
+        fclose(block_output);
+    }
+
+    free(copy);
+    free(pids);
+    free(block_outputs);
+    return result;
+}
+
+int
+render_buffer(uint8_t* buffer, FILE* output, BOOL body_only)
+{
+    ParsedDoc defs_doc;
+    ParsedDoc doc;
+    ULONG defs_state     = ST_NONE;
+    uint64_t source_hash = 0;
+    uint8_t* map         = NULL;
+    size_t map_len       = 0;
+    BOOL use_doc_cache   = doc_cache_dir && input_filename;
+    BlockStart* blocks   = NULL;
+    size_t blocks_count  = 0;
+    size_t buffer_len    = 0;
+    size_t block_size    = 0;
+    long jobs            = count_jobs();
+    BOOL mismatch        = FALSE;
+    struct timespec start;
+    struct timespec loaded;
+    Minify minify;
+    int result           = 0;
+
+    init_document();
+    macros_kept = FALSE;
+
+    if (minify_output)
+        start_minify(&minify);
+
+    if (use_doc_cache)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        source_hash = get_doc_source_hash(buffer, body_only);
+        map = map_doc_cache(source_hash, &map_len);
+        clock_gettime(CLOCK_MONOTONIC, &loaded);
+        timings[TIMING_LOAD] += elapsed_ms(&start, &loaded);
+    }
+
+    if (map)
+    {
+        /* Unchanged since it was cached: emit without parsing */
+        result = render_mapped_doc(map, output);
+        munmap(map, map_len);
+    }
+    else
+    {
+        init_parsed_doc(&defs_doc);
+        init_parsed_doc(&doc);
+
+        /* Inlined styles and cached documents need the whole document */
+        if (!use_doc_cache && !inline_css)
+            buffer_len = u8_strlen(buffer);
+
+        /* First pass: read YAML, macros and links */
+        if (jobs > 1 && buffer_len >= BLOCK_PARALLEL_MIN)
+        {
+            block_size = buffer_len / (jobs * BLOCKS_PER_JOB);
+            if (block_size < BLOCK_SIZE_MIN)
+                block_size = BLOCK_SIZE_MIN;
+            result = find_blocks(buffer, buffer_len, output, body_only, 
+                    block_size, &blocks, &blocks_count);
+        }
+        else
+        {
+            result = parse_timed(buffer, &defs_doc, body_only, TRUE, NULL);
+            defs_state = state;
+            if (!result)
+                result = emit_timed(&defs_doc, output);
+        }
+
+        if (!result && (formulas_count || plugin_calls_count))
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            render_formulas();
+            render_plugin_calls();
+            clock_gettime(CLOCK_MONOTONIC, &loaded);
+            timings[TIMING_EMIT] += elapsed_ms(&start, &loaded);
+        }
+
+        /* Second pass a block at a time, each in its own process; counted
+         * as parsing, which is where most of the time goes */
+        if (!result && blocks_count > 1)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            result = render_blocks(buffer + buffer_len, blocks, blocks_count,
+                    jobs, body_only, output, &mismatch);
+            clock_gettime(CLOCK_MONOTONIC, &loaded);
+            timings[TIMING_PARSE] += elapsed_ms(&start, &loaded);
+        }
+
+        /* Sequential when the blocks turned out not to be independent */
+        if (!result && (blocks_count < 2 || mismatch))
+        {
+            state = ST_NONE;
+            current_footnote = 0;
+            current_inline_footnote = 0;
+
+            /* Second pass: parse and output */
+            result = parse_timed(buffer, &doc, body_only, FALSE, NULL);
+
+            /* Stored before emission changes which macros were seen; kept
+             * macros depend on includes, which are not tracked here */
+            if (!result && use_doc_cache && !macros_kept)
+                store_doc_cache(&defs_doc, defs_state, &doc, source_hash);
+            if (!result)
+                result = emit_timed(&doc, output);
+        }
+
+        free_parsed_doc(&defs_doc);
+        free_parsed_doc(&doc);
+        free(blocks);
+    }
+
+    if (minify_output)
+        finish_minify(&minify, output);
+    print_timings(use_doc_cache, map ? TRUE : FALSE);
+    return result;
+}
+
+int
+stream_pass(FILE* input, FILE* output, FILE* spool, BOOL body_only, 
+        BOOL read_yaml_macros_and_links)
+{
+    ParsedDoc doc;
+    ParseChunk chunk;
+    uint8_t* window    = NULL;
+    uint8_t* end       = NULL;
+    size_t window_size = STREAM_WINDOW_SIZE;
+    size_t window_len  = 0;
+    ssize_t nread      = 0;
+    int result         = 0;
+
+    memset(&chunk, 0, sizeof(ParseChunk));
+    CALLOC(window, uint8_t, window_size + 1)
+
+    while (!result && !chunk.last)
+    {
+        /* Grown only for a line longer than the window */
+        if (window_len == window_size)
+        {
+            window_size *= 2;
+            REALLOC(window, uint8_t, window_size + 1)
+        }
+
+        /* Unbuffered, as forked children would otherwise move the shared
+         * file offset back to where their copy of the buffer ends */
+        nread = read(fileno(input), window + window_len, 
+                window_size - window_len);
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            exit(error(errno, (uint8_t*)"Cannot read input"));
+        }
+        if (spool && nread 
+                && fwrite(window + window_len, 1, nread, spool) != (size_t)nread)
+            exit(error(errno, (uint8_t*)"Cannot write temporary file"));
+        window_len += nread;
+        *(window + window_len) = 0;
+        chunk.last = nread ? FALSE : TRUE;
+
+        /* Parse whole lines only, leaving the start of the next line to 
+         * look ahead at */
+        end = window + window_len;
+        if (!chunk.last)
+        {
+            end--;
+            while (end > window && *(end-1) != '\n')
+                end--;
+            if (end == window)
+                continue;
+        }
+        chunk.end = end;
+
+        init_parsed_doc(&doc);
+        result = parse_timed(window, &doc, body_only, 
+                read_yaml_macros_and_links, &chunk);
+        if (!result)
+            result = emit_timed(&doc, output);
+        free_parsed_doc(&doc);
+
+        if (read_yaml_macros_and_links)
+            spill_footnotes();
+
+        window_len -= end - window;
+        memmove(window, end, window_len + 1);
+    }
+
+    free(window);
+    return result;
+}
+
+int
+render_stream(FILE* input, FILE* output, BOOL body_only)
+{
+    FILE* spool = NULL;
+    Minify minify;
+    int result  = 0;
+
+    init_document();
+    macros_kept = FALSE;
+
+    if (minify_output)
+        start_minify(&minify);
+
+    footnote_spill = tmpfile();
+    inline_footnote_spill = tmpfile();
+    if (!footnote_spill || !inline_footnote_spill)
+        exit(error(errno, (uint8_t*)"Cannot create temporary file"));
+
+    /* A pipe can be read only once, so the first pass keeps a copy */
+    if (fseek(input, 0, SEEK_SET) < 0 && !(spool = tmpfile()))
+        exit(error(errno, (uint8_t*)"Cannot create temporary file"));
+
+    /* First pass: read YAML, macros and links */
+    result = stream_pass(input, output, spool, body_only, TRUE);
+    if (!result)
+    {
+        render_formulas();
+        render_plugin_calls();
+    }
+
+    if (!result)
+    {
+        if (spool)
+            input = spool;
+        rewind(input);
+
+        state = ST_NONE;
+        current_footnote = 0;
+        current_inline_footnote = 0;
+
+        /* Second pass: parse and output */
+        result = stream_pass(input, output, NULL, body_only, FALSE);
+    }
+
+    if (spool)
+        fclose(spool);
+    fclose(footnote_spill);
+    fclose(inline_footnote_spill);
+    footnote_spill = inline_footnote_spill = NULL;
+
+    if (minify_output)
+        finish_minify(&minify, output);
+    print_timings(FALSE, FALSE);
+    return result;
+}
+
+int
+render_files(char** filenames, size_t filenames_count, BOOL body_only)
+{
+    char** pfilename = filenames;
+    int result       = 0;
+
+    /* One process for all pages, so included files are parsed only once */
+    while (pfilename < filenames + filenames_count)
+    {
+        FILE* input         = NULL;
+        FILE* output        = NULL;
+        GzipJob gzip;
+        uint8_t* buffer     = NULL;
+        size_t buffer_size  = 0;
+        char* html_filename = NULL;
+        char* dot           = NULL;
+        char* slash         = NULL;
+        int page_result     = 0;
+
+        input_filename = *pfilename++;
+        CALLOC(html_filename, char, strlen(input_filename) + 6)
+        strcpy(html_filename, input_filename);
+        dot = strrchr(html_filename, '.');
+        slash = strrchr(html_filename, '/');
+        if (dot && (!slash || dot > slash) && !strcmp(dot, ".slw"))
+            *dot = 0;
+        strcat(html_filename, ".html");
+
+        if (stream_input 
+                ? open_input(input_filename, &input_dirname, &input)
+                : read_file_into_buffer(&buffer, &buffer_size, input_filename,
+                    &input_dirname, &input))
+        {
+            free(html_filename);
+            result = 1;
+            continue;
+        }
+
+        if (use_gzip)
+            output = open_gzip_page(&gzip, html_filename);
+        else
+            output = fopen(html_filename, "w");
+
+        if (!output)
+        {
+            result = error(errno, (uint8_t*)"Cannot open '%s' for writing",
+                    html_filename);
+            if (stream_input)
+                fclose(input);
+            free(html_filename);
+            free_document();
+            free(buffer);
+            continue;
+        }
+
+        if (stream_input)
+        {
+            page_result = render_stream(input, output, body_only);
+            fclose(input);
+        }
+        else
+            page_result = render_buffer(buffer, output, body_only);
+        if (page_result)
+            result = page_result;
+
+        if (use_gzip)
+        {
+            page_result = finish_gzip(&gzip, output);
+            close(gzip.html);
+            close(gzip.gz);
+            if (page_result)
+                result = page_result;
+        }
+        else
+            fclose(output);
+        free(html_filename);
+        free_document();
+        free(buffer);
+    }
+
+    input_filename = NULL;
+    return result;
+}
+
+int
+print_xml_escaped(FILE* output, const uint8_t* text)
+{
+    const uint8_t* ptext = text;
+
+    while (ptext && *ptext)
+    {
+        switch (*ptext)
+        {
+        case '&':
+            fputs("&amp;", output);
+            break;
+        case '<':
+            fputs("&lt;", output);
+            break;
+        case '>':
+            fputs("&gt;", output);
+            break;
+        case '"':
+            fputs("&quot;", output);
+            break;
+        default:
+            putc(*ptext, output);
+        }
+        ptext++;
+    }
+    return 0;
+}
+
+/*
+ * Reads the front matter of a page into vars, with the YAML handling of
+ * parse_document, but only as far as its closing "---": the rest of the file
+ * is never read
+ */
+int
+load_front_matter(FILE* input)
+{
+    StrBuf block     = { NULL, 0, 0 };
+    ParsedDoc doc;
+    char* line       = NULL;
+    size_t line_size = 0;
+    ssize_t line_len = 0;
+    int result       = 0;
+
+    init_document();
+
+    while ((line_len = getline(&line, &line_size, input)) > 0)
+    {
+        if (!block.len && !startswith(line, "---"))
+            break;
+        strbuf_append(&block, (uint8_t*)line, line_len);
+        if (block.len > (size_t)line_len && startswith(line, "---"))
+            break;
+    }
+    free(line);
+
+    if (block.len)
+    {
+        init_parsed_doc(&doc);
+        result = parse_document(block.text, &doc, TRUE, TRUE, NULL);
+        free_parsed_doc(&doc);
+    }
+    state = ST_NONE;
+
+    free_strbuf(&block);
+    return result;
+}
+
+uint8_t*
+dup_value(const uint8_t* value)
+{
+    uint8_t* copy = NULL;
+
+    if (!value)
+        return NULL;
+    copy = u8_strdup(value);
+    CHECKEXITNOMEM(copy)
+    return copy;
+}
+
+/* Values of the page itself, which --defs doesn't provide */
+uint8_t*
+dup_page_value(const char* key)
+{
+    KeyValue* pvar = find_keyvalue(vars, vars_count, (uint8_t*)key);
+
+    return dup_value(pvar ? pvar->value : NULL);
+}
+
+/* Copies what the feeds need from the front matter */
+int
+read_front_matter(const char* filename, FeedEntry* entry)
+{
+    FILE* input = fopen(filename, "r");
+
+    if (!input)
+        return 1;
+
+    input_filename = (char*)filename;
+    if (!load_front_matter(input))
+    {
+        entry->title = dup_page_value("title");
+        entry->date = dup_page_value("date");
+        entry->desc = dup_page_value("site-desc");
+        entry->author = dup_page_value("author");
+        entry->url = (char*)dup_page_value("permalink-url");
+    }
+    free_document();
+    input_filename = NULL;
+
+    fclose(input);
+    return 0;
+}
+
+/* The date is read as in process_timestamp: year-month-dayThh:mm:ss */
+BOOL
+parse_feed_date(const uint8_t* date, time_t* time)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (!date || sscanf((char*)date, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, 
+                &tm.tm_mday) != 3)
+        return FALSE;
+    if (strchr((char*)date, 'T'))
+        sscanf(strchr((char*)date, 'T') + 1, "%d:%d:%d", &tm.tm_hour, 
+                &tm.tm_min, &tm.tm_sec);
+    tm.tm_year -= 1900;
+    tm.tm_mon--;
+    *time = timegm(&tm);
+    return TRUE;
+}
 
-                    state |= ST_BLOCKQUOTE;
+int
+add_feed_entries(const char* dirname, const char* urlpath, 
+        FeedEntry** entries, size_t* entries_count)
+{
+    DIR* dir              = opendir(dirname);
+    struct dirent* dirent = NULL;
 
-                    pline++;
-                    colno++;
-                }
-                else 
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                }
-                break;
+    if (!dir)
+        return warning(1, (uint8_t*)"--feed: Cannot open directory '%s'", 
+                dirname);
 
-            case '!':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_FOOTNOTE_TEXT | ST_HEADING | ST_IMAGE
-                            | ST_INLINE_FOOTNOTE | ST_LINK | ST_MACRO_BODY 
-                            | ST_PRE))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+    while ((dirent = readdir(dir)))
+    {
+        char* filename = NULL;
+        char* url      = NULL;
+        size_t len     = strlen(dirent->d_name);
+        FeedEntry* entry = NULL;
+        struct stat st;
 
-                if (u8_strlen(pline) > 1 && *(pline+1) == '[')
-                {
-                    /* Output existing text up to ! */
-                    *ptoken = 0;
-                    process_text_token(line, first_line_in_doc,
-                            previous_line_blank, processed_start_of_line,
-                            read_yaml_macros_and_links, list_para, output,
-                            &token, &ptoken, &token_size, FALSE);
-                    processed_start_of_line = TRUE;
+        if (*dirent->d_name == '.')
+            continue;
 
-                    RESET_TOKEN(token, ptoken, token_size)
+        CALLOC(filename, char, strlen(dirname) + len + 2)
+        sprintf(filename, "%s/%s", dirname, dirent->d_name);
+        CALLOC(url, char, strlen(urlpath) + len + 7)
+        sprintf(url, "%s%s", urlpath, dirent->d_name);
 
-                    state |= ST_IMAGE;
-                    keep_token = TRUE;
-                    pline += 2;
-                    colno += 2;
-                }
-                else 
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                }
+        if (stat(filename, &st) < 0)
+            ;
+        else if (S_ISDIR(st.st_mode))
+        {
+            strcat(url, "/");
+            add_feed_entries(filename, url, entries, entries_count);
+        }
+        else if (len > 4 && !strcmp(dirent->d_name + len - 4, ".slw"))
+        {
+            (*entries_count)++;
+            REALLOCARRAY(*entries, FeedEntry, *entries_count)
+            entry = *entries + *entries_count - 1;
+            memset(entry, 0, sizeof(FeedEntry));
+
+            if (read_front_matter(filename, entry))
+                warning(1, (uint8_t*)"--feed: Cannot read '%s'", filename);
+            entry->dated = parse_feed_date(entry->date, &entry->time);
+            if (!entry->dated)
+                entry->time = st.st_mtime;
+            if (!entry->url)
+            {
+                strcpy(url + strlen(url) - 4, ".html");
+                entry->url = url;
+                url = NULL;
+            }
+            entry->filename = filename;
+            filename = NULL;
+        }
 
-                break;
+        free(filename);
+        free(url);
+    }
+    closedir(dir);
+    return 0;
+}
 
-            case '=':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_MACRO_BODY | ST_PRE | ST_TAG))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+int
+feed_entry_compare(const void* a, const void* b)
+{
+    const FeedEntry* entry_a = (const FeedEntry*)a;
+    const FeedEntry* entry_b = (const FeedEntry*)b;
+
+    /* Newest first, then by name, so that output doesn't depend on the
+     * order of the directory */
+    if (entry_a->time != entry_b->time)
+        return entry_a->time < entry_b->time ? 1 : -1;
+    return strcmp(entry_a->filename, entry_b->filename);
+}
 
-                if (colno != 1 && *(pline-1) == '[')
-                {
-                    state |= ST_LINK_MACRO;
-                    pline++;
-                    colno++;
-                }
-                else 
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                }
-                break;
+int
+print_feed_url(FILE* output, const uint8_t* site_url, const char* url)
+{
+    if (site_url && !strstr(url, "://"))
+        print_xml_escaped(output, site_url);
+    if (site_url && *url != '/' && !strstr(url, "://"))
+        putc('/', output);
+    print_xml_escaped(output, (uint8_t*)url);
+    return 0;
+}
 
-            case '[':
-                pline_len = u8_strlen(pline);
+/* Rendered as by {incdir}, in a child of its own */
+int
+render_feed_entry(FILE* output, void* arg)
+{
+    init_document();
+    return render_incdir_entry(output, arg);
+}
 
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_HEADING | ST_IMAGE | ST_MACRO_BODY | ST_PRE))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+/* Only with --feed-content are the pages parsed past their front matter */
+int
+print_feed_content(FILE* output, FeedEntry* entry)
+{
+    uint8_t* content   = NULL;
+    size_t content_len = 0;
 
-                if (state & ST_FOOTNOTE_TEXT)
-                {
-                    if (!read_yaml_macros_and_links && (state & ST_PARA_OPEN))
-                        print_output(output, "</p>\n");
-                    state &= ~(ST_FOOTNOTE_TEXT | ST_PARA_OPEN);
-                }
+    if (!capture_child_output(&render_feed_entry, entry->filename, 
+                &content, &content_len))
+        print_xml_escaped(output, content);
+    else
+        warning(1, (uint8_t*)"--feed: Cannot render '%s'", entry->filename);
+    free(content);
+    return 0;
+}
 
-                if (pline_len > 1 && *(pline+1) == '^')
-                {
-                    footnote_at_line_start = colno == 1;
-                    if (*token)
-                    {
-                        /* Output existing text up to [^ */
-                        *ptoken = 0;
-                        process_text_token(line, first_line_in_doc,
-                                previous_line_blank, processed_start_of_line,
-                                read_yaml_macros_and_links, list_para, output,
-                                &token, &ptoken, &token_size, TRUE);
-                    }
-                    processed_start_of_line = TRUE;
+int
+write_rss(FILE* output, FeedEntry* entries, size_t entries_count, 
+        const uint8_t* site_url, const char* urlpath)
+{
+    uint8_t* site_name = get_value(site_vars, site_vars_count, 
+            (uint8_t*)"site-name", NULL);
+    uint8_t* site_desc = get_value(site_vars, site_vars_count, 
+            (uint8_t*)"site-desc", NULL);
+    char date[KEYSIZE];
+
+    fprintf(output, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+            "<rss version=\"2.0\">\n<channel>\n<title>");
+    print_xml_escaped(output, site_name);
+    fprintf(output, "</title>\n<link>");
+    print_feed_url(output, site_url, urlpath);
+    fprintf(output, "</link>\n<description>");
+    print_xml_escaped(output, site_desc);
+    fprintf(output, "</description>\n<generator>slweb</generator>\n");
+
+    for (FeedEntry* entry = entries; entry < entries + entries_count; entry++)
+    {
+        if (!entry->dated)
+            continue;
+        strftime(date, KEYSIZE, "%a, %d %b %Y %H:%M:%S +0000", 
+                gmtime(&entry->time));
+        fprintf(output, "<item>\n<title>");
+        print_xml_escaped(output, entry->title);
+        fprintf(output, "</title>\n<link>");
+        print_feed_url(output, site_url, entry->url);
+        fprintf(output, "</link>\n<guid>");
+        print_feed_url(output, site_url, entry->url);
+        fprintf(output, "</guid>\n<pubDate>%s</pubDate>\n", date);
+        if (feed_content || entry->desc)
+        {
+            fprintf(output, "<description>");
+            if (feed_content)
+                print_feed_content(output, entry);
+            else
+                print_xml_escaped(output, entry->desc);
+            fprintf(output, "</description>\n");
+        }
+        fprintf(output, "</item>\n");
+    }
 
-                    RESET_TOKEN(token, ptoken, token_size)
-                    state |= ST_FOOTNOTE;
-                    pline += 2;
-                    colno += 2;
-                    break;
-                }
+    fprintf(output, "</channel>\n</rss>\n");
+    return 0;
+}
 
-                if (*token)
-                {
-                    /* Output existing text up to [ */
-                    *ptoken = 0;
-                    process_text_token(line, first_line_in_doc,
-                            previous_line_blank,
-                            processed_start_of_line,
-                            read_yaml_macros_and_links,
-                            list_para, output, &token, &ptoken, &token_size, 
-                            TRUE);
-                }
-                processed_start_of_line = TRUE;
+int
+write_atom(FILE* output, FeedEntry* entries, size_t entries_count, 
+        const uint8_t* site_url, const char* urlpath)
+{
+    uint8_t* site_name = get_value(site_vars, site_vars_count, 
+            (uint8_t*)"site-name", NULL);
+    uint8_t* site_desc = get_value(site_vars, site_vars_count, 
+            (uint8_t*)"site-desc", NULL);
+    uint8_t* author    = get_value(site_vars, site_vars_count, 
+            (uint8_t*)"author", NULL);
+    char* feed_url     = NULL;
+    char date[KEYSIZE];
+    FeedEntry* entry   = NULL;
+    time_t updated     = 0;
+
+    for (entry = entries; entry < entries + entries_count; entry++)
+        if (entry->dated && entry->time > updated)
+            updated = entry->time;
+    strftime(date, KEYSIZE, "%Y-%m-%dT%H:%M:%SZ", gmtime(&updated));
+
+    CALLOC(feed_url, char, strlen(urlpath) + strlen(FEED_ATOM_FILENAME) + 1)
+    sprintf(feed_url, "%s%s", urlpath, FEED_ATOM_FILENAME);
+
+    fprintf(output, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+            "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n<title>");
+    print_xml_escaped(output, site_name);
+    fprintf(output, "</title>\n");
+    if (site_desc)
+    {
+        fprintf(output, "<subtitle>");
+        print_xml_escaped(output, site_desc);
+        fprintf(output, "</subtitle>\n");
+    }
+    fprintf(output, "<id>");
+    print_feed_url(output, site_url, feed_url);
+    fprintf(output, "</id>\n<link rel=\"self\" href=\"");
+    print_feed_url(output, site_url, feed_url);
+    fprintf(output, "\" />\n<link href=\"");
+    print_feed_url(output, site_url, urlpath);
+    fprintf(output, "\" />\n<updated>%s</updated>\n"
+            "<generator>slweb</generator>\n", date);
+    /* Required of a feed whose entries don't all have their own */
+    fprintf(output, "<author><name>");
+    print_xml_escaped(output, author ? author : site_name);
+    fprintf(output, "</name></author>\n");
+
+    for (entry = entries; entry < entries + entries_count; entry++)
+    {
+        if (!entry->dated)
+            continue;
+        strftime(date, KEYSIZE, "%Y-%m-%dT%H:%M:%SZ", 
+                gmtime(&entry->time));
+        fprintf(output, "<entry>\n<title>");
+        print_xml_escaped(output, entry->title);
+        fprintf(output, "</title>\n<id>");
+        print_feed_url(output, site_url, entry->url);
+        fprintf(output, "</id>\n<link href=\"");
+        print_feed_url(output, site_url, entry->url);
+        fprintf(output, "\" />\n<updated>%s</updated>\n", date);
+        if (entry->author)
+        {
+            fprintf(output, "<author><name>");
+            print_xml_escaped(output, entry->author);
+            fprintf(output, "</name></author>\n");
+        }
+        if (entry->desc)
+        {
+            fprintf(output, "<summary>");
+            print_xml_escaped(output, entry->desc);
+            fprintf(output, "</summary>\n");
+        }
+        if (feed_content)
+        {
+            fprintf(output, "<content type=\"html\">");
+            print_feed_content(output, entry);
+            fprintf(output, "</content>\n");
+        }
+        fprintf(output, "</entry>\n");
+    }
 
-                RESET_TOKEN(token, ptoken, token_size)
-                state |= ST_LINK;
-                keep_token = TRUE;
-                *link_macro = 0;
-                pline++;
-                colno++;
-                break;
+    fprintf(output, "</feed>\n");
+    free(feed_url);
+    return 0;
+}
 
-            case '(':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_FOOTNOTE_TEXT | ST_HEADING
-                            | ST_INLINE_FOOTNOTE | ST_MACRO_BODY | ST_PRE))
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                else if (state & ST_LINK)
-                {
-                    uint8_t* tag = (uint8_t*)"<span>";
-                    size_t tag_len = u8_strlen(tag);
-                    size_t token_len = 0;
+int
+write_sitemap(FILE* output, FeedEntry* entries, size_t entries_count,
+        const uint8_t* site_url, const char* urlpath)
+{
+    char date[KEYSIZE];
 
-                    *ptoken = 0;
-                    token_len = u8_strlen(token);
+    fprintf(output, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+            "<urlset xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\">\n");
+    for (FeedEntry* entry = entries; entry < entries + entries_count; entry++)
+    {
+        strftime(date, KEYSIZE, "%Y-%m-%d", gmtime(&entry->time));
+        fprintf(output, "<url><loc>");
+        print_feed_url(output, site_url, entry->url);
+        fprintf(output, "</loc><lastmod>%s</lastmod></url>\n", date);
+    }
+    fprintf(output, "</urlset>\n");
+    return 0;
+}
 
-                    if (token_len + tag_len < BUFSIZE)
-                    {
-                        u8_strncat(token, tag, BUFSIZE-token_len-1);
-                        ptoken += tag_len;
-                    }
+int
+write_feed_file(const char* dirname, const char* name, feed_writer_t writer,
+        FeedEntry* entries, size_t entries_count, const uint8_t* site_url,
+        const char* urlpath)
+{
+    char* filename = NULL;
+    FILE* output   = NULL;
+    int result     = 0;
+
+    CALLOC(filename, char, strlen(dirname) + strlen(name) + 2)
+    sprintf(filename, "%s/%s", dirname, name);
+    if (!(output = fopen(filename, "w")))
+        result = error(errno, (uint8_t*)"--feed: Cannot open '%s' for"
+                " writing", filename);
+    else
+    {
+        writer(output, entries, entries_count, site_url, urlpath);
+        if (fclose(output))
+            result = error(errno, (uint8_t*)"--feed: Cannot write '%s'", 
+                    filename);
+    }
+    free(filename);
+    return result;
+}
 
-                    state |= ST_LINK_SPAN;
-                    pline++;
-                }
-                else
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                colno++;
-                break;
+int
+generate_feeds(char* dir)
+{
+    FeedEntry* entries   = NULL;
+    size_t entries_count = 0;
+    char* dirname        = NULL;
+    char* urlpath        = NULL;
+    uint8_t* site_url    = get_value(site_vars, site_vars_count, 
+            (uint8_t*)"site-url", NULL);
+    int result           = 0;
 
-            case ')':
-                if (ANY(state, ST_DISPLAY_FORMULA | ST_FORMULA))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+    /* Relative to basedir, as the URLs are */
+    while (*dir == '/')
+        dir++;
+    while (*dir && !strncmp(dir, "./", 2))
+        dir += 2;
+    if (!strcmp(dir, "."))
+        dir += 1;
+
+    CALLOC(dirname, char, strlen(basedir) + strlen(dir) + 2)
+    sprintf(dirname, "%s/%s", basedir, dir);
+    CALLOC(urlpath, char, strlen(dir) + 3)
+    sprintf(urlpath, "/%s%s", dir, 
+            *dir && *(dir + strlen(dir) - 1) != '/' ? "/" : "");
+
+    if (!site_url)
+        warning(1, (uint8_t*)"--feed: site-url not set, URLs will be"
+                " relative");
+
+    add_feed_entries(dirname, urlpath, &entries, &entries_count);
+    qsort(entries, entries_count, sizeof(FeedEntry), &feed_entry_compare);
+
+    if (write_feed_file(dirname, FEED_RSS_FILENAME, &write_rss, entries, 
+                entries_count, site_url, urlpath)
+            || write_feed_file(dirname, FEED_ATOM_FILENAME, &write_atom, 
+                entries, entries_count, site_url, urlpath)
+            || write_feed_file(dirname, FEED_SITEMAP_FILENAME, 
+                &write_sitemap, entries, entries_count, site_url, 
+                urlpath))
+        result = 1;
+
+    for (FeedEntry* entry = entries; entry < entries + entries_count; entry++)
+    {
+        free(entry->filename);
+        free(entry->url);
+        free(entry->title);
+        free(entry->date);
+        free(entry->desc);
+        free(entry->author);
+    }
+    free(entries);
+    free(urlpath);
+    free(dirname);
+    return result;
+}
 
-                if (state & ST_LINK_SPAN)
-                {
-                    if (u8_strlen(pline) > 1
-                            && *(pline+1) == ']')
-                    {
-                        uint8_t* tag = (uint8_t*)"</span>";
-                        size_t tag_len = u8_strlen(tag);
-                        size_t token_len = 0;
+int
+print_json_string(FILE* output, const uint8_t* text)
+{
+    const uint8_t* ptext = text;
 
-                        *ptoken = 0;
-                        token_len = u8_strlen(token);
+    putc('"', output);
+    while (ptext && *ptext)
+    {
+        if (*ptext == '"' || *ptext == '\\')
+            fprintf(output, "\\%c", *ptext);
+        else if (*ptext == '\n')
+            fputs("\\n", output);
+        else if (*ptext == '\t')
+            fputs("\\t", output);
+        else if (*ptext < 0x20)
+            fprintf(output, "\\u%04x", *ptext);
+        else
+            putc(*ptext, output);
+        ptext++;
+    }
+    putc('"', output);
+    return 0;
+}
 
-                        if (token_len + tag_len + 1 < BUFSIZE)
-                        {
-                            u8_strncat(token, tag, BUFSIZE-token_len-1);
-                            ptoken += tag_len;
-                        }
-                        state &= ~ST_LINK_SPAN;
-                    }
-                    pline++;
-                }
-                else if (ANY(state, ST_LINK_SECOND_ARG | ST_IMAGE_SECOND_ARG))
-                {
-                    *ptoken = 0;
-                    if (!read_yaml_macros_and_links)
-                    {
-                        if (state & ST_LINK_SECOND_ARG)
-                            process_inline_link(link_text, 
-                                    get_value(macros, macros_count, 
-                                        link_macro, NULL), 
-                                    token, output);
-                        else
-                            process_inline_image(link_text, token, output, 
-                                    add_image_links, add_figcaption);
-                    }
-                    RESET_TOKEN(token, ptoken, token_size)
-                    state &= ~(ST_LINK | ST_LINK_SECOND_ARG 
-                            | ST_IMAGE | ST_IMAGE_SECOND_ARG);
-                    pline++;
-                }
-                else
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                colno++;
-                break;
+int
+print_tsv_field(FILE* output, const uint8_t* text)
+{
+    const uint8_t* ptext = text;
+
+    while (ptext && *ptext)
+    {
+        if (*ptext == '\\')
+            fputs("\\\\", output);
+        else if (*ptext == '\n')
+            fputs("\\n", output);
+        else if (*ptext == '\t')
+            fputs("\\t", output);
+        else
+            putc(*ptext, output);
+        ptext++;
+    }
+    return 0;
+}
+
+/* Variables set more than once are printed as arrays */
+int
+print_front_matter_json(FILE* output, const char* filename)
+{
+    print_json_string(output, (uint8_t*)filename);
+    fputs(": {", output);
+    for (KeyValue* pvar = vars; pvar < vars + vars_count; pvar++)
+    {
+        size_t count = 0;
+        KeyValue* pother = NULL;
 
-            case ']':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_HEADING | ST_MACRO_BODY | ST_PRE))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+        if (find_keyvalue(vars, vars_count, pvar->key) != pvar)
+            continue;
+        for (pother = pvar; pother < vars + vars_count; pother++)
+            if (!u8_strcmp(pother->key, pvar->key))
+                count++;
+
+        fputs(pvar == vars ? "\n    " : ",\n    ", output);
+        print_json_string(output, pvar->key);
+        fputs(count > 1 ? ": [" : ": ", output);
+        for (pother = pvar; pother < vars + vars_count; pother++)
+        {
+            if (u8_strcmp(pother->key, pvar->key))
+                continue;
+            if (pother != pvar)
+                fputs(", ", output);
+            print_json_string(output, pother->value ? pother->value 
+                    : (uint8_t*)"");
+        }
+        if (count > 1)
+            putc(']', output);
+    }
+    fputs(vars_count ? "\n  }" : "}", output);
+    return 0;
+}
 
-                *ptoken = 0;
-                if (state & ST_INLINE_FOOTNOTE)
-                {
-                    process_inline_footnote(token, read_yaml_macros_and_links,
-                            output);
+int
+print_front_matter_tsv(FILE* output, const char* filename)
+{
+    for (KeyValue* pvar = vars; pvar < vars + vars_count; pvar++)
+    {
+        print_tsv_field(output, (uint8_t*)filename);
+        putc('\t', output);
+        print_tsv_field(output, pvar->key);
+        putc('\t', output);
+        print_tsv_field(output, pvar->value);
+        putc('\n', output);
+    }
+    return 0;
+}
 
-                    keep_token = FALSE;
-                    RESET_TOKEN(token, ptoken, token_size)
-                    state &= ~ST_INLINE_FOOTNOTE;
-                    pline++;
-                    colno++;
-                }
-                else if (state & ST_FOOTNOTE)
-                {
-                    BOOL footnote_definition = (u8_strlen(pline) > 1)
-                            && (*(pline+1) == ':') && footnote_at_line_start;
+/* 
+ * Prints the front matter of each file, as lines of file name, variable and
+ * value separated by tabs, or as a JSON object keyed by file name
+ */
+int
+print_front_matter(char** filenames, size_t filenames_count, BOOL json)
+{
+    char* stdin_filename = "-";
+    char** pfilename     = filenames;
+    size_t printed       = 0;
+    int result           = 0;
 
-                    process_footnote(token, 
-                            footnote_definition && read_yaml_macros_and_links,
-                            !footnote_definition && !read_yaml_macros_and_links,
-                            output);
+    if (!filenames_count)
+    {
+        filenames = pfilename = &stdin_filename;
+        filenames_count = 1;
+    }
 
-                    RESET_TOKEN(token, ptoken, token_size)
-                    state &= ~ST_FOOTNOTE;
-                    footnote_at_line_start = FALSE;
-                    if (footnote_definition)
-                    {
-                        state |= ST_FOOTNOTE_TEXT;
-                        pline++;
-                        colno++;
-                    }
-                    pline++;
-                    colno++;
-                }
-                else if (state & ST_LINK_SECOND_ARG)
-                {
-                    if (!read_yaml_macros_and_links)
-                        process_link(link_text, 
-                                get_value(macros, macros_count, 
-                                    link_macro, NULL), 
-                                token, output);
-                    RESET_TOKEN(token, ptoken, token_size)
-                    state &= ~(ST_LINK | ST_LINK_SECOND_ARG);
-                    pline++;
-                    colno++;
-                }
-                else if (state & ST_IMAGE_SECOND_ARG)
-                {
-                    if (!read_yaml_macros_and_links)
-                        process_image(link_text, token, output, 
-                                add_image_links, add_figcaption);
-                    RESET_TOKEN(token, ptoken, token_size)
-                    state &= ~(ST_IMAGE | ST_IMAGE_SECOND_ARG);
-                    pline++;
-                    colno++;
-                }
-                else if (u8_strlen(pline) > 1)
-                {
-                    size_t token_len = 0;
-                    switch (*(pline+1))
-                    {
-                        case ':':
-                            links_count++;
+    if (json)
+        fputs("{", stdout);
+    while (pfilename < filenames + filenames_count)
+    {
+        FILE* input = stdin;
 
-                            if (links_count > 1)
-                            {
-                                REALLOCARRAY(links, KeyValue, links_count)
-                                plinks = links + links_count - 1;
-                            }
-                            CALLOC(plinks->key, uint8_t, KEYSIZE)
-                            u8_strncpy(plinks->key, token, KEYSIZE-1);
-                            plinks->value = NULL;
-                            plinks->value_size = 0;
-                            pline += 2;
-                            colno += 2;
-                            while (pline && (*pline == ' ' || *pline == '\t'))
-                            {
-                                pline++;
-                                colno++;
-                            }
-                            RESET_TOKEN(token, ptoken, token_size)
-                            keep_token = FALSE;
-                            state |= ST_LINK_SECOND_ARG;
-                            break;
+        input_filename = *pfilename++;
+        lineno = 0;
+        colno = 1;
+        if (strcmp(input_filename, "-") 
+                && !(input = fopen(input_filename, "r")))
+        {
+            result = error(errno, (uint8_t*)"Cannot open file '%s'", 
+                    input_filename);
+            continue;
+        }
 
-                        case '[':
-                        case '(':
-                            token_len = u8_strlen(token);
-                            if (link_text)
-                            {
-                                if (token_len + 1 > link_size)
-                                {
-                                    link_size = token_len+1;
-                                    REALLOC(link_text, uint8_t, link_size)
-                                }
-                            }
-                            else
-                            {
-                                link_size = token_len+1;
-                                CALLOC(link_text, uint8_t, link_size)
-                            }
-                            u8_strncpy(link_text, token, link_size-1);
-                            *(link_text + token_len) = 0;
-                            pline += 2;
-                            colno += 2;
-                            RESET_TOKEN(token, ptoken, token_size)
-                            keep_token = FALSE;
-                            if (state & ST_LINK)
-                                state |= ST_LINK_SECOND_ARG;
-                            else
-                                state |= ST_IMAGE_SECOND_ARG;
-                            break;
-                        default:
-                            CHECKCOPY(token, ptoken, token_size, pline)
-                            colno++;
-                            state &= ~(ST_LINK | ST_IMAGE);
-                            break;
-                    }
-                }
-                else
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                }
-                break;
+        if (load_front_matter(input))
+            result = 1;
+        else if (json)
+        {
+            fputs(printed++ ? ",\n  " : "\n  ", stdout);
+            print_front_matter_json(stdout, input_filename);
+        }
+        else
+            print_front_matter_tsv(stdout, input_filename);
 
-            case '^':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_FOOTNOTE_TEXT | ST_IMAGE | ST_INLINE_FOOTNOTE 
-                            | ST_PRE | ST_YAML))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+        if (input != stdin)
+            fclose(input);
+        free_document();
+    }
+    if (json)
+        fputs("\n}\n", stdout);
 
-                if (u8_strlen(pline) > 1 && *(pline+1) == '[')
-                {
-                    /* Output existing text up to ^[ */
-                    *ptoken = 0;
-                    process_text_token(line, first_line_in_doc,
-                            previous_line_blank, processed_start_of_line,
-                            read_yaml_macros_and_links, list_para, output,
-                            &token, &ptoken, &token_size, TRUE);
-                    processed_start_of_line = TRUE;
+    input_filename = NULL;
+    return result;
+}
 
-                    RESET_TOKEN(token, ptoken, token_size)
-                    state |= ST_INLINE_FOOTNOTE;
-                    keep_token = TRUE;
-                    pline += 2;
-                    colno += 2;
-                    break;
-                }
+const char*
+get_mime_type(const char* filename)
+{
+    const MimeType* pmime_type = mime_types;
+    const char* dot = strrchr(filename, '.');
 
-                CHECKCOPY(token, ptoken, token_size, pline)
-                colno++;
-                break;
+    while (dot && pmime_type->ext)
+    {
+        if (!strcmp(dot, pmime_type->ext))
+            break;
+        pmime_type++;
+    }
+    if (!dot)
+        while (pmime_type->ext)
+            pmime_type++;
+    return pmime_type->type;
+}
 
-            case '\\':
-                *ptoken = 0;
-                if (ANY(state, ST_DISPLAY_FORMULA | ST_FORMULA 
-                            | ST_HTML_TAG | ST_IMAGE | ST_LINK 
-                            | ST_MACRO_BODY))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+int
+send_response_header(int client, int status, const char* status_text,
+        const char* content_type, size_t content_length)
+{
+    char header[BUFSIZE];
+    int header_len = snprintf(header, BUFSIZE, "HTTP/1.0 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %lu\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Connection: close\r\n"
+            "\r\n",
+            status, status_text, content_type, (ULONG)content_length);
+
+    return send_all(client, (uint8_t*)header, header_len);
+}
 
-                if (u8_strlen(pline) > 1)
-                {
-                    pline++;
-                    colno++;
+int
+send_error_page(int client, int status, const char* status_text)
+{
+    char body[BUFSIZE];
+    int body_len = snprintf(body, BUFSIZE, "<!DOCTYPE html>\n"
+            "<html>\n<head>\n<title>%d %s</title>\n</head>\n"
+            "<body>\n<h1>%d %s</h1>\n</body>\n</html>\n",
+            status, status_text, status, status_text);
+
+    send_response_header(client, status, status_text, 
+            "text/html; charset=utf-8", body_len);
+    return send_all(client, (uint8_t*)body, body_len);
+}
 
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                }
-                else
-                {
-                    pline = NULL;
-                    break;
-                }
+int
+serve_static(int client, const char* filename, BOOL head_only)
+{
+    struct stat fs;
+    off_t offset = 0;
+    int fd = open(filename, O_RDONLY);
 
-                colno++;
-                break;
+    if (fd < 0 || fstat(fd, &fs) < 0 || !S_ISREG(fs.st_mode))
+    {
+        if (fd >= 0)
+            close(fd);
+        return send_error_page(client, 404, "Not Found");
+    }
 
-            case '$':
-                if (ANY(state, ST_CODE | ST_CSV_BODY | ST_IMAGE | ST_PRE 
-                            | ST_YAML))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                    break;
-                }
+    send_response_header(client, 200, "OK", get_mime_type(filename), 
+            fs.st_size);
 
-                if (u8_strlen(pline) > 1
-                        && *(pline+1) == '$')
-                {
-                    if (state & ST_FORMULA)
-                        exit(error(1, (uint8_t*)"Display formula within an"
-                                    " open formula"));
+    /* Assets go straight from the page cache to the socket */
+    while (!head_only && offset < fs.st_size)
+    {
+        ssize_t sent = sendfile(client, fd, &offset, fs.st_size - offset);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            break;
+    }
 
-                    if (!(state & ST_DISPLAY_FORMULA))
-                    {
-                        /* Output existing text up to $$ */
-                        process_text_token(line, first_line_in_doc,
-                                previous_line_blank,
-                                processed_start_of_line,
-                                read_yaml_macros_and_links,
-                                list_para, output, &token, &ptoken, &token_size, 
-                                TRUE);
-                    }
-                    processed_start_of_line = TRUE;
+    close(fd);
+    return 0;
+}
+
+int
+render_page_child(FILE* output, void* arg)
+{
+    char* filename     = (char*)arg;
+    FILE* input        = NULL;
+    uint8_t* buffer    = NULL;
+    size_t buffer_size = 0;
+    uint8_t* page      = NULL;
+    size_t page_len    = 0;
+    FILE* page_output  = NULL;
+    IncludeJob job;
+    IncludeDep* pdep   = NULL;
+    int result         = 0;
+
+    /* Render as if invoked from the page's directory with -d . */
+    char* slash = strrchr(filename, '/');
+    if (slash)
+    {
+        *slash = 0;
+        if (chdir(filename) < 0)
+            exit(error(errno, (uint8_t*)"serve: Cannot change directory"
+                        " to '%s'", filename));
+        filename = slash+1;
+    }
+    set_basedir(".", &basedir, &basedir_size);
 
-                    state ^= ST_DISPLAY_FORMULA;
+    input_filename = filename;
+    if ((result = read_file_into_buffer(&buffer, &buffer_size, 
+                    input_filename, &input_dirname, &input)))
+        return result;
 
-                    if (state & ST_DISPLAY_FORMULA)
-                        keep_token = TRUE;
-                    else
-                    {
-                        *ptoken = 0;
+    /* Track the files the page reads, as for an include */
+    include_recording = TRUE;
+    include_volatile = FALSE;
+    if (site_defs_filename)
+        record_include_dep('f', (uint8_t*)site_defs_filename, site_defs_hash);
+
+    page_output = open_memstream((char**)&page, &page_len);
+    if (!page_output)
+        exit(error(errno, (uint8_t*)"serve: Cannot open memory stream"));
+    result = render_buffer(buffer, page_output, serve_body_only);
+    fclose(page_output);
+
+    /* Checked by the server, which stays in its own directory */
+    for (pdep = include_deps; pdep < include_deps + include_deps_count; 
+            pdep++)
+    {
+        char* path = pdep->kind == 'f' ? realpath((char*)pdep->key, NULL) 
+            : NULL;
+        if (path)
+        {
+            free(pdep->key);
+            pdep->key = (uint8_t*)path;
+        }
+    }
 
-                        if (!read_yaml_macros_and_links)
-                            process_formula(output, token, TRUE);
+    /* Only the page and its dependencies are sent back */
+    memset(&job, 0, sizeof(job));
+    job.filename = filename;
+    job.content_hash = hash_buffer(buffer, buffer_size-1);
+    include_vars_base = vars_count;
+    include_macros_base = macros_count;
+    links_count = 0;
+    if (!result)
+        write_include_entry(output, &job, page, page_len);
+
+    free(page);
+    return result;
+}
 
-                        keep_token = FALSE;
-                        RESET_TOKEN(token, ptoken, token_size)
-                    }
+int
+render_page(char* filename, IncludeCacheEntry** rendered)
+{
+    uint8_t* serialized   = NULL;
+    size_t serialized_len = 0;
+    size_t consumed       = 0;
 
-                    pline += 2;
-                    colno += 2;
-                }
-                else
-                {
-                    if (state & ST_DISPLAY_FORMULA)
-                        exit(error(1, (uint8_t*)"Formula within an open"
-                                    " display formula"));
+    *rendered = NULL;
+    if (!capture_child_output(&render_page_child, filename, &serialized,
+                &serialized_len))
+        *rendered = parse_include_entry(serialized, serialized_len, 
+                &consumed);
+    free(serialized);
 
-                    if (!(state & ST_FORMULA))
-                    {
-                        /* Output existing text up to $ */
-                        process_text_token(line, first_line_in_doc,
-                                previous_line_blank,
-                                processed_start_of_line,
-                                read_yaml_macros_and_links,
-                                list_para, output, &token, &ptoken, &token_size, 
-                                TRUE);
-                    }
-                    processed_start_of_line = TRUE;
+    if (!*rendered)
+        return warning(1, (uint8_t*)"serve: Rendering '%s' failed", filename);
 
-                    state ^= ST_FORMULA;
+    return 0;
+}
 
-                    if (state & ST_FORMULA)
-                        keep_token = TRUE;
-                    else
-                    {
-                        *ptoken = 0;
+BOOL
+rendered_page_valid(IncludeCacheEntry* rendered)
+{
+    IncludeDep* pdep = rendered->deps;
 
-                        if (!read_yaml_macros_and_links)
-                            process_formula(output, token, FALSE);
+    /* Uses {git-log} or {incdir}, rendered on every request */
+    if (rendered->is_volatile)
+        return FALSE;
 
-                        keep_token = FALSE;
-                        RESET_TOKEN(token, ptoken, token_size)
-                    }
+    /* The page's own definitions are in its source, only files matter */
+    while (pdep < rendered->deps + rendered->deps_count)
+    {
+        if (pdep->kind == 'f' && hash_file((char*)pdep->key) != pdep->hash)
+            return FALSE;
+        pdep++;
+    }
+    return TRUE;
+}
 
-                    pline++;
-                    colno++;
-                }
-                break;
+int
+thaw_defs(KeyValue* frozen, size_t list_count)
+{
+    KeyValue* pfrozen = frozen;
+    size_t size       = sizeof(KeyValue) * list_count;
 
-            case '1': case '2': case '3': case '4': case '5':
-            case '6': case '7': case '8': case '9': case '0':
-                if (ANY(state, ST_CODE | ST_DISPLAY_FORMULA | ST_FORMULA
-                            | ST_MACRO_BODY | ST_PRE | ST_YAML_VAL))
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                }
-                else if (colno == 1
-                        && u8_strlen(pline) > 1
-                        && (*(pline+1) == '.' || *(pline+1) == ')'))
-                {
-                    if (state & ST_LIST)
-                    {
-                        state &= ~ST_LIST;
-                        if (!read_yaml_macros_and_links)
-                        {
-                            process_list_item_end(output);
-                            process_list_end(output);
-                        }
-                    }
-                    if (!read_yaml_macros_and_links)
-                    {
-                        if (!(state & ST_NUMLIST))
-                            process_numlist_start(output);
-                        else
-                            process_list_item_end(output);
-                        process_list_item_start(output);
-                    }
+    if (!frozen)
+        return 0;
 
-                    processed_start_of_line = TRUE;
-                    skip_eol = FALSE;
+    /* Sized as in freeze_defs */
+    while (pfrozen < frozen + list_count)
+    {
+        size += u8_strlen(pfrozen->key) + 1 + pfrozen->value_size;
+        pfrozen++;
+    }
+    return munmap(frozen, size);
+}
 
-                    state |= ST_NUMLIST;
+int
+reload_site_defs()
+{
+    uint64_t hash = 0;
 
-                    pline += 2;
-                    colno += 2;
-                }
-                else
-                {
-                    CHECKCOPY(token, ptoken, token_size, pline)
-                    colno++;
-                }
-                break;
+    if (!site_defs_filename 
+            || (hash = hash_file(site_defs_filename)) == site_defs_hash)
+        return 0;
 
-            default:
-                CHECKCOPY(token, ptoken, token_size, pline)
-                colno++;
-            }
-        }
+    thaw_defs(site_vars, site_vars_count);
+    thaw_defs(site_macros, site_macros_count);
+    thaw_defs(site_links, site_links_count);
+    site_vars = site_macros = site_links = NULL;
+    site_vars_count = site_macros_count = site_links_count = 0;
 
-        *ptoken = 0;
+    /* Not tried again until the file changes */
+    site_defs_hash = hash;
+    return load_site_defs(site_defs_filename);
+}
 
-        if (*token && read_yaml_macros_and_links
-                && (state & ST_YAML_VAL))
-        {
-            *ptoken = 0;
-            pvars->value_size = u8_strlen(token)+1;
-            CALLOC(pvars->value, uint8_t, pvars->value_size)
-            u8_strncpy(pvars->value, token, pvars->value_size-1);
-        }
-        else if (keep_token)
-        {
-            size_t token_len = u8_strlen(token);
+PageCacheEntry*
+get_cached_page(char* filename)
+{
+    struct stat fs;
+    PageCacheEntry* entry = NULL;
+    PageCacheEntry* pentry = NULL;
+    uint8_t* source = NULL;
+    size_t source_size = 0;
+    char* source_dirname = NULL;
+    FILE* source_file = NULL;
+    uint64_t hash = 0;
+    BOOL deps_valid = FALSE;
+
+    if (stat(filename, &fs) < 0)
+        return NULL;
 
-            if (ptoken + 2 > token + token_size)
-            {
-                size_t old_size = token_size;
-                token_size += BUFSIZE;
-                REALLOC(token, uint8_t, token_size)
-                ptoken = token + old_size - 1;
-            }
-            u8_strncat(token, ANY(state, ST_IMAGE | ST_LINK)
-                        ? (uint8_t*)" " : (uint8_t*)"\n", 
-                    token_size - token_len - 1);
-            ptoken++;
-            *ptoken = 0;
-        }
-        else
-        {
-            if (*token)
-            {
-                *ptoken = 0;
-                size_t token_len = u8_strlen(token);
-                if (state & ST_MACRO_BODY)
-                {
-                    skip_eol = TRUE;
-                    if (read_yaml_macros_and_links)
-                    {
-                        if (pmacros->value)
-                        {
-                            size_t value_len = u8_strlen(pmacros->value);
+    reload_site_defs();
 
-                            if (pmacros->value_size < value_len + token_len + 1)
-                            {
-                                pmacros->value_size += BUFSIZE;
-                                REALLOC(pmacros->value, uint8_t, pmacros->value_size)
-                            }
-                            u8_strncat(pmacros->value, token, 
-                                    pmacros->value_size-value_len-1);
-                            u8_strncat(pmacros->value, (uint8_t*)"\n", 
-                                    pmacros->value_size-u8_strlen(pmacros->value)-1);
-                        }
-                        else
-                        {
-                            pmacros->value_size = BUFSIZE;
-                            CALLOC(pmacros->value, uint8_t, pmacros->value_size)
-                            u8_strncpy(pmacros->value, token, pmacros->value_size-1);
-                            u8_strncat(pmacros->value, (uint8_t*)"\n", 
-                                    pmacros->value_size-u8_strlen(pmacros->value)-1);
-                        }
-                    }
-                }
-                else if (state & ST_FOOTNOTE_TEXT)
-                {
-                    skip_eol = TRUE;
-                    if (read_yaml_macros_and_links)
-                    {
-                        if (pfootnotes->value)
-                        {
-                            size_t value_len = u8_strlen(pfootnotes->value);
+    for (pentry = page_cache; pentry < page_cache + SERVE_CACHE_ENTRIES; 
+            pentry++)
+    {
+        if (pentry->filename && !strcmp(pentry->filename, filename))
+            entry = pentry;
+    }
 
-                            if (pfootnotes->value_size < value_len + token_len + 1)
-                            {
-                                pfootnotes->value_size += BUFSIZE;
-                                REALLOC(pfootnotes->value, uint8_t, pfootnotes->value_size)
-                            }
-                            u8_strncat(pfootnotes->value, token,
-                                    pfootnotes->value_size-value_len-1);
-                            u8_strncat(pfootnotes->value, (uint8_t*)"\n",
-                                    pfootnotes->value_size-u8_strlen(pfootnotes->value)-1);
-                        }
-                        else
-                        {
-                            pfootnotes->value_size = BUFSIZE;
-                            CALLOC(pfootnotes->value, uint8_t, pfootnotes->value_size)
-                            u8_strncpy(pfootnotes->value, token, pfootnotes->value_size-1);
-                            u8_strncat(pfootnotes->value, (uint8_t*)"\n",
-                                    pfootnotes->value_size-u8_strlen(pfootnotes->value)-1);
-                        }
-                    }
-                }
-                else if (state & ST_LINK_SECOND_ARG)
-                {
-                    if (read_yaml_macros_and_links)
-                    {
-                        plinks->value_size = u8_strlen(token)+1;
-                        CALLOC(plinks->value, uint8_t, plinks->value_size)
-                        u8_strncpy(plinks->value, token, plinks->value_size-1);
-                    }
-                }
-                else if (state & ST_HEADING)
-                {
-                    state &= ~(ST_HEADING | ST_HEADING_TEXT);
-                    if (!read_yaml_macros_and_links)
-                        process_heading(token, output, heading_level);
-                    first_line_in_doc = FALSE;
-                    RESET_TOKEN(token, ptoken, token_size)
-                    heading_level = 0;
-                }
-                else if (!ANY(state, ST_DISPLAY_FORMULA | ST_FORMULA 
-                                | ST_IMAGE | ST_LINK))
-                    process_text_token(line, first_line_in_doc,
-                            previous_line_blank,
-                            processed_start_of_line,
-                            read_yaml_macros_and_links,
-                            list_para, output, &token, &ptoken, &token_size, 
-                            TRUE);
-            }
+    /* Includes, CSV files and the site definitions, as read by the page */
+    deps_valid = entry && rendered_page_valid(entry->rendered);
+    if (deps_valid && entry->mtime == fs.st_mtime && entry->size == fs.st_size)
+    {
+        entry->last_used = ++page_cache_tick;
+        return entry;
+    }
 
-            if (!ANY(state, ST_PRE | ST_IMAGE_SECOND_ARG | ST_LINK_SECOND_ARG)
-                        && (!*pbuffer || *pbuffer == '\n'))
+    /* Touched but possibly unchanged sources keep their rendered page */
+    if (read_file_into_buffer(&source, &source_size, filename, 
+                &source_dirname, &source_file))
+        return NULL;
+    hash = hash_buffer(source, source_size-1);
+    free(source);
+    free(source_dirname);
+
+    if (deps_valid && entry->hash == hash)
+    {
+        entry->mtime = fs.st_mtime;
+        entry->size = fs.st_size;
+        entry->last_used = ++page_cache_tick;
+        return entry;
+    }
+
+    if (!entry)
+    {
+        /* Reuse a free slot or evict the least recently used page */
+        entry = page_cache;
+        for (pentry = page_cache; pentry < page_cache + SERVE_CACHE_ENTRIES; 
+                pentry++)
+        {
+            if (!pentry->filename)
             {
-                if (state & ST_PARA_OPEN)
-                {
-                    if (!read_yaml_macros_and_links)
-                        print_output(output, "</p>");
-                    if (state & ST_LIST)
-                        skip_eol = TRUE;
-                    state &= ~ST_PARA_OPEN;
-                }
+                entry = pentry;
+                break;
+            }
+            if (pentry->last_used < entry->last_used)
+                entry = pentry;
+        }
+        free(entry->filename);
+        entry->filename = strdup(filename);
+    }
+    free_include_entry(entry->rendered);
+    entry->rendered = NULL;
 
-                if (!*pbuffer && (state & ST_LIST))
-                {
-                    if (!read_yaml_macros_and_links)
-                    {
-                        process_list_item_end(output);
-                        process_list_end(output);
-                    }
-                    state &= ~ST_LIST;
-                }
+    if (render_page(filename, &entry->rendered))
+    {
+        free(entry->filename);
+        entry->filename = NULL;
+        return NULL;
+    }
 
-                if (!*pbuffer && (state & ST_NUMLIST))
-                {
-                    if (!read_yaml_macros_and_links)
-                    {
-                        process_list_item_end(output);
-                        process_numlist_end(output);
-                    }
-                    state &= ~ST_NUMLIST;
-                }
+    entry->mtime = fs.st_mtime;
+    entry->size = fs.st_size;
+    entry->hash = hash;
+    entry->last_used = ++page_cache_tick;
+    return entry;
+}
 
-                if (!*pbuffer && (state & ST_FOOTNOTE_TEXT))
-                {
-                    state &= ~ST_FOOTNOTE_TEXT;
+int
+url_decode(char* url)
+{
+    char* src = url;
+    char* dst = url;
 
-                    *ptoken = 0;
-                    size_t token_len = u8_strlen(token);
+    while (*src)
+    {
+        if (*src == '%' && isxdigit((UBYTE)*(src+1)) 
+                && isxdigit((UBYTE)*(src+2)))
+        {
+            char hex[3] = { *(src+1), *(src+2), 0 };
+            *dst++ = (char)strtol(hex, NULL, 16);
+            src += 3;
+        }
+        else if (*src == '?' || *src == '#')
+            break;
+        else
+            *dst++ = *src++;
+    }
+    *dst = 0;
+    return 0;
+}
 
-                    skip_eol = TRUE;
-                    if (read_yaml_macros_and_links)
-                    {
-                        if (pfootnotes->value)
-                        {
-                            size_t value_len = u8_strlen(pfootnotes->value);
+int
+serve_request(int client)
+{
+    char* request = NULL;
+    size_t request_len = 0;
+    char* method = NULL;
+    char* path = NULL;
+    char* saveptr = NULL;
+    char* filename = NULL;
+    char* slw_filename = NULL;
+    size_t path_len = 0;
+    BOOL head_only = FALSE;
+    struct stat fs;
 
-                            if (pfootnotes->value_size < value_len + token_len + 1)
-                            {
-                                pfootnotes->value_size 
-                                    = value_len + token_len + 1;
-                                REALLOC(pfootnotes->value, uint8_t, pfootnotes->value_size)
-                            }
-                            u8_strncat(pfootnotes->value, token, pfootnotes->value_size-1);
-                        }
-                        else
-                        {
-                            pfootnotes->value_size = token_len + 1;
-                            CALLOC(pfootnotes->value, uint8_t, pfootnotes->value_size)
-                            u8_strncpy(pfootnotes->value, token, pfootnotes->value_size-1);
-                        }
-                    }
-                }
-            }
+    CALLOC(request, char, SERVE_REQUEST_SIZE)
+    while (request_len < SERVE_REQUEST_SIZE-1 && !strstr(request, "\r\n\r\n"))
+    {
+        ssize_t nread = read(client, request + request_len, 
+                SERVE_REQUEST_SIZE - request_len - 1);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread <= 0)
+            break;
+        request_len += nread;
+        *(request + request_len) = 0;
+    }
 
-            if (state & ST_BLOCKQUOTE 
-                    && (!*pbuffer || *pbuffer != '>'))
-            {
-                state &= ~ST_BLOCKQUOTE;
-                process_blockquote(output, TRUE);
-            }
+    method = strtok_r(request, " ", &saveptr);
+    path = strtok_r(NULL, " ", &saveptr);
+    if (!method || !path || *path != '/')
+    {
+        send_error_page(client, 400, "Bad Request");
+        free(request);
+        return 1;
+    }
 
-            if (ANY(state, ST_TABLE_HEADER | ST_TABLE_LINE) 
-                    && (!line_len || !*pbuffer))
-            {
-                if (!read_yaml_macros_and_links)
-                {
-                    warning(1, (uint8_t*)"Malformed table");
-                    process_table_end(output);
-                }
-                state &= ~(ST_TABLE_HEADER | ST_TABLE_LINE);
-            }
+    head_only = !strcmp(method, "HEAD");
+    if (!head_only && strcmp(method, "GET"))
+    {
+        send_error_page(client, 405, "Method Not Allowed");
+        free(request);
+        return 1;
+    }
 
-            if ((state & ST_TABLE) && (!line_len || !*pbuffer))
-            {
-                if (!read_yaml_macros_and_links)
-                    process_table_end(output);
-                state &= ~ST_TABLE;
-            }
+    url_decode(path);
+    if (strstr(path, "/..") || strchr(path, '\\'))
+    {
+        send_error_page(client, 403, "Forbidden");
+        free(request);
+        return 1;
+    }
 
-            previous_line_blank = FALSE;
+    fprintf(stderr, "%s: %s %s\n", PROGRAMNAME, method, path);
+
+    path_len = strlen(path);
+    CALLOC(filename, char, strlen(basedir) + path_len + BUFSIZE)
+    CALLOC(slw_filename, char, strlen(basedir) + path_len + BUFSIZE)
+    sprintf(filename, "%s%s", basedir, path);
+    if (*(filename + strlen(filename) - 1) == '/')
+        strcat(filename, "index.html");
+    else if (!stat(filename, &fs) && S_ISDIR(fs.st_mode))
+        strcat(filename, "/index.html");
+
+    /* Pages are rendered from their .slw source, everything else is static */
+    char* ext = strrchr(filename, '.');
+    if (ext && strrchr(filename, '/') < ext && !strcmp(ext, ".html"))
+        sprintf(slw_filename, "%.*s.slw", (int)(ext - filename), filename);
+    else if (!ext || strrchr(filename, '/') > ext)
+        sprintf(slw_filename, "%s.slw", filename);
+
+    if (*slw_filename && !access(slw_filename, R_OK))
+    {
+        PageCacheEntry* entry = get_cached_page(slw_filename);
+        if (entry)
+        {
+            send_response_header(client, 200, "OK", 
+                    "text/html; charset=utf-8", entry->rendered->fragment_len);
+            if (!head_only)
+                send_all(client, entry->rendered->fragment, 
+                        entry->rendered->fragment_len);
         }
+        else
+            send_error_page(client, 500, "Internal Server Error");
+    }
+    else
+        serve_static(client, filename, head_only);
 
-        if (!skip_eol && !keep_token && !read_yaml_macros_and_links 
-                && !ANY(state, ST_YAML | ST_YAML_VAL | ST_LINK_SECOND_ARG))
-                print_output(output, "\n");
+    free(slw_filename);
+    free(filename);
+    free(request);
+    return 0;
+}
 
-        if (!keep_token)
-            RESET_TOKEN(token, ptoken, token_size)
+BOOL
+addr_is_loopback(const struct sockaddr* addr)
+{
+    if (addr->sa_family == AF_INET)
+        return (ntohl(((struct sockaddr_in*)addr)->sin_addr.s_addr) >> 24) 
+            == 127;
+    if (addr->sa_family == AF_INET6)
+        return !memcmp(&((struct sockaddr_in6*)addr)->sin6_addr, 
+                &in6addr_loopback, sizeof(struct in6_addr));
+    return FALSE;
+}
 
-        if (!skip_change_first_line_in_doc
-                && !(state & ST_YAML))
-            first_line_in_doc = FALSE;
+int
+serve(char* addr, BOOL body_only)
+{
+    struct addrinfo hints;
+    struct addrinfo* addrinfo = NULL;
+    struct addrinfo* paddrinfo = NULL;
+    char* host = SERVE_DEFAULT_HOST;
+    char* port = addr;
+    char* colon = strrchr(addr, ':');
+    int server = -1;
+    int optval = 1;
+    int result = 0;
 
-        skip_change_first_line_in_doc = FALSE; 
-        if (line_len == 0)
-            previous_line_blank = TRUE;
+    if (colon)
+    {
+        *colon = 0;
+        port = colon+1;
+        if (*addr == '[' && *(colon-1) == ']')
+        {
+            *(colon-1) = 0;
+            addr++;
+        }
+        if (*addr)
+            host = addr;
+    }
+    if (!*port)
+        port = SERVE_DEFAULT_PORT;
 
-        /* Lasts until the end of line */
-        state &= ~(ST_YAML_VAL | ST_IMAGE_SECOND_ARG | ST_LINK_SECOND_ARG);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((result = getaddrinfo(host, port, &hints, &addrinfo)))
+        return error(1, (uint8_t*)"--serve: Cannot resolve '%s': %s", host,
+                gai_strerror(result));
+
+    for (paddrinfo = addrinfo; paddrinfo; paddrinfo = paddrinfo->ai_next)
+    {
+        if (!addr_is_loopback(paddrinfo->ai_addr))
+            continue;
+        server = socket(paddrinfo->ai_family, paddrinfo->ai_socktype,
+                paddrinfo->ai_protocol);
+        if (server < 0)
+            continue;
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        if (!bind(server, paddrinfo->ai_addr, paddrinfo->ai_addrlen)
+                && !listen(server, SERVE_BACKLOG))
+            break;
+        close(server);
+        server = -1;
     }
-    while (pbuffer && *pbuffer);
+    freeaddrinfo(addrinfo);
 
-    if (!read_yaml_macros_and_links 
-            && (footnote_count > 0 || inline_footnote_count > 0))
-        end_footnotes(output, add_footnote_div);
+    if (server < 0)
+        return error(1, (uint8_t*)"--serve: Cannot listen on %s:%s"
+                " (only loopback addresses are allowed)", host, port);
 
-    if (!read_yaml_macros_and_links && !body_only)
-        end_body_and_html(output);
+    serve_body_only = body_only;
+    signal(SIGPIPE, SIG_IGN);
+    CALLOC(page_cache, PageCacheEntry, SERVE_CACHE_ENTRIES)
 
-    if (link_text)
-        free(link_text);
+    fprintf(stderr, "%s: Serving '%s' at http://%s:%s/\n", PROGRAMNAME, 
+            basedir, host, port);
 
-    free(link_macro);
-    free(token);
-    free(line);
+    while (TRUE)
+    {
+        int client = accept(server, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        serve_request(client);
+        close(client);
+    }
 
-    return 0;
+    close(server);
+    return error(errno, (uint8_t*)"--serve: accept failed");
 }
 
 int
@@ -3693,6 +11148,13 @@ main(int argc, char** argv)
     char* arg;
     Command cmd = CMD_NONE;
     BOOL body_only = FALSE;
+    char* serve_addr = NULL;
+    char* feed_dir = NULL;
+    char front_matter = 0;
+    char** filenames = NULL;
+    size_t filenames_count = 0;
+    char** plugin_filenames = NULL;
+    size_t plugin_filenames_count = 0;
     int result = 0;
 
     basedir_size = 2;
@@ -3723,6 +11185,202 @@ main(int argc, char** argv)
                     if (result)
                         return result;
                 }
+                else if (startswith(arg, "defs"))
+                {
+                    arg += strlen("defs");
+                    if (*arg == '=')
+                        site_defs_filename = arg+1;
+                    else if (!*arg)
+                        cmd = CMD_DEFS;
+                    else
+                    {
+                        error(EINVAL, (uint8_t*)"Invalid argument: --defs%s", 
+                                arg);
+                        return usage();
+                    }
+                }
+                else if (startswith(arg, "assets"))
+                {
+                    arg += strlen("assets");
+                    if (*arg == '=')
+                        assets_dir = arg+1;
+                    else if (!*arg)
+                        cmd = CMD_ASSETS;
+                    else
+                    {
+                        error(EINVAL, (uint8_t*)"Invalid argument:"
+                                " --assets%s", arg);
+                        return usage();
+                    }
+                }
+                else if (startswith(arg, "feed-content"))
+                {
+                    arg += strlen("feed-content");
+                    feed_content = TRUE;
+                    if (*arg)
+                    {
+                        error(EINVAL, (uint8_t*)"Invalid argument:"
+                                " --feed-content%s", arg);
+                        return usage();
+                    }
+                }
+                else if (startswith(arg, "feed"))
+                {
+                    arg += strlen("feed");
+                    if (*arg == '=')
+                        feed_dir = arg+1;
+                    else if (!*arg)
+                        cmd = CMD_FEED;
+                    else
+                    {
+                        error(EINVAL, (uint8_t*)"Invalid argument: --feed%s", 
+                                arg);
+                        return usage();
+                    }
+                }
+                else if (startswith(arg, "doc-cache"))
+                {
+                    arg += strlen("doc-cache");
+                    if (*arg == '=')
+                        doc_cache_dir = arg+1;
+                    else if (!*arg)
+                        cmd = CMD_DOC_CACHE;
+                    else
+                    {
+                        error(EINVAL, (uint8_t*)"Invalid argument:"
+                                " --doc-cache%s", arg);
+                        return usage();
+                    }
+                }
+                else if (startswith(arg, "include-cache"))
+                {
+                    arg += strlen("include-cache");
+                    if (*arg == '=')
+                        include_cache_dir = arg+1;
+                    else if (!*arg)
+                        cmd = CMD_INCLUDE_CACHE;
+                    else
+                    {
+                        error(EINVAL, (uint8_t*)"Invalid argument:"
+                                " --include-cache%s", arg);
+                        return usage();
+                    }
+                }
+                else if (startswith(arg, "plugin"))
+                {
+                    arg += strlen("plugin");
+                    if (*arg == '=')
+                    {
+                        plugin_filenames_count++;
+                        REALLOCARRAY(plugin_filenames, char*, 
+                                plugin_filenames_count)
+                        plugin_filenames[plugin_filenames_count-1] = arg+1;
+                    }
+                    else if (!*arg)
+                        cmd = CMD_PLUGIN;
+                    else
+                    {
+                        error(EINVAL, (uint8_t*)"Invalid argument:"
+                                " --plugin%s", arg);
+                        return usage();
+                    }
+                }
+                else if (startswith(arg, "serve"))
+                {
+                    arg += strlen("serve");
+                    if (*arg == '=')
+                        serve_addr = arg+1;
+                    else if (!*arg)
+                        cmd = CMD_SERVE;
+                    else
+                    {
+                        error(EINVAL, (uint8_t*)"Invalid argument: --serve%s", 
+                                arg);
+                        return usage();
+                    }
+                }
+                else if (startswith(arg, "front-matter"))
+                {
+                    arg += strlen("front-matter");
+                    if (!*arg || !strcmp(arg, "=tsv"))
+                        front_matter = 't';
+                    else if (!strcmp(arg, "=json"))
+                        front_matter = 'j';
+                    else
+                    {
+                        error(EINVAL, (uint8_t*)"Invalid argument:"
+                                " --front-matter%s", arg);
+                        return usage();
+                    }
+                }
+                else if (startswith(arg, "gzip"))
+                {
+                    arg += strlen("gzip");
+                    use_gzip = TRUE;
+                    if (*arg == '=')
+                    {
+                        arg++;
+                        if (*arg < '1' || *arg > '9' || *(arg+1))
+                        {
+                            error(EINVAL, (uint8_t*)"Invalid argument:"
+                                    " --gzip=%s", arg);
+                            return usage();
+                        }
+                        gzip_level = *arg - '0';
+                    }
+                    else if (*arg)
+                    {
+                        error(EINVAL, (uint8_t*)"Invalid argument: --gzip%s", 
+                                arg);
+                        return usage();
+                    }
+                }
+                else if (startswith(arg, "inline-css"))
+                {
+                    char* end = NULL;
+
+                    arg += strlen("inline-css");
+                    inline_css = TRUE;
+                    if (*arg == '=')
+                    {
+                        errno = 0;
+                        inline_css_limit = strtoul(arg+1, &end, 10);
+                        if (errno || end == arg+1 || *end)
+                        {
+                            error(EINVAL, (uint8_t*)"Invalid argument:"
+                                    " --inline-css%s", arg);
+                            return usage();
+                        }
+                    }
+                    else if (*arg)
+                    {
+                        error(EINVAL, (uint8_t*)"Invalid argument:"
+                                " --inline-css%s", arg);
+                        return usage();
+                    }
+                }
+                else if (startswith(arg, "jobs="))
+                {
+                    char* end = NULL;
+
+                    arg += strlen("jobs=");
+                    errno = 0;
+                    parse_jobs = strtol(arg, &end, 10);
+                    if (errno || end == arg || *end || parse_jobs < 1)
+                    {
+                        error(EINVAL, (uint8_t*)"Invalid argument:"
+                                " --jobs=%s", arg);
+                        return usage();
+                    }
+                }
+                else if (!strcmp(arg, "katex"))
+                    use_katex = TRUE;
+                else if (!strcmp(arg, "minify"))
+                    minify_output = TRUE;
+                else if (!strcmp(arg, "stream"))
+                    stream_input = TRUE;
+                else if (!strcmp(arg, "timings"))
+                    show_timings = TRUE;
                 else if (!strcmp(arg, "help"))
                     return usage();
                 else
@@ -3763,8 +11421,31 @@ main(int argc, char** argv)
                 if (result)
                     return result;
             }
+            else if (cmd == CMD_SERVE)
+                serve_addr = arg;
+            else if (cmd == CMD_ASSETS)
+                assets_dir = arg;
+            else if (cmd == CMD_FEED)
+                feed_dir = arg;
+            else if (cmd == CMD_DEFS)
+                site_defs_filename = arg;
+            else if (cmd == CMD_DOC_CACHE)
+                doc_cache_dir = arg;
+            else if (cmd == CMD_INCLUDE_CACHE)
+                include_cache_dir = arg;
+            else if (cmd == CMD_PLUGIN)
+            {
+                plugin_filenames_count++;
+                REALLOCARRAY(plugin_filenames, char*, plugin_filenames_count)
+                plugin_filenames[plugin_filenames_count-1] = arg;
+            }
             else
+            {
+                filenames_count++;
+                REALLOCARRAY(filenames, char*, filenames_count)
+                *(filenames + filenames_count - 1) = arg;
                 input_filename = arg;
+            }
             cmd = CMD_NONE;
         }
     }
@@ -3772,16 +11453,151 @@ main(int argc, char** argv)
     if (cmd == CMD_BASEDIR)
         return error(1, (uint8_t*)"-d: Argument required");
 
+    if (cmd == CMD_SERVE)
+        return error(1, (uint8_t*)"--serve: Argument required");
+
+    if (cmd == CMD_ASSETS)
+        return error(1, (uint8_t*)"--assets: Argument required");
+
+    if (cmd == CMD_DEFS)
+        return error(1, (uint8_t*)"--defs: Argument required");
+
+    if (cmd == CMD_DOC_CACHE)
+        return error(1, (uint8_t*)"--doc-cache: Argument required");
+
+    if (cmd == CMD_FEED)
+        return error(1, (uint8_t*)"--feed: Argument required");
+
+    if (cmd == CMD_INCLUDE_CACHE)
+        return error(1, (uint8_t*)"--include-cache: Argument required");
+
+    if (cmd == CMD_PLUGIN)
+        return error(1, (uint8_t*)"--plugin: Argument required");
+
+    if (include_cache_dir && mkdir(include_cache_dir, 0755) < 0 
+            && errno != EEXIST)
+        return error(errno, (uint8_t*)"--include-cache: Cannot create"
+                " directory '%s'", include_cache_dir);
+
+    if (doc_cache_dir && mkdir(doc_cache_dir, 0755) < 0 && errno != EEXIST)
+        return error(errno, (uint8_t*)"--doc-cache: Cannot create"
+                " directory '%s'", doc_cache_dir);
+
     if (cmd == CMD_VERSION)
         return version();
 
+    for (size_t plugin = 0; plugin < plugin_filenames_count; plugin++)
+    {
+        result = load_plugin(plugin_filenames[plugin]);
+        if (result)
+            return result;
+    }
+    free(plugin_filenames);
+
+    if (assets_dir)
+    {
+        char* dirname = NULL;
+
+        /* Relative to basedir, which is the root of the site */
+        while (*assets_dir == '/')
+            assets_dir++;
+        if (!*assets_dir)
+            return error(EINVAL, (uint8_t*)"--assets: Invalid directory");
+
+        CALLOC(dirname, char, strlen(basedir) + strlen(assets_dir) + 2)
+        sprintf(dirname, "%s/%s", basedir, assets_dir);
+        if (mkdir(dirname, 0755) < 0 && errno != EEXIST)
+        {
+            result = error(errno, (uint8_t*)"--assets: Cannot create"
+                    " directory '%s'", dirname);
+            free(dirname);
+            return result;
+        }
+        free(dirname);
+    }
+
+    if (site_defs_filename && load_site_defs(site_defs_filename))
+        return 1;
+
+    if (front_matter)
+    {
+        result = print_front_matter(filenames, filenames_count, 
+                front_matter == 'j');
+        free(filenames);
+        free(basedir);
+        return result;
+    }
+
+    if (feed_dir)
+    {
+        if (input_filename || serve_addr)
+            return error(EINVAL, (uint8_t*)"--feed: Can't be used with a"
+                    " filename or --serve");
+        result = generate_feeds(feed_dir);
+        free(filenames);
+        free(basedir);
+        return result;
+    }
+
+    if (serve_addr)
+    {
+        if (input_filename)
+            return error(EINVAL, (uint8_t*)"--serve: Can't be used with a"
+                    " filename");
+        if (use_gzip)
+            return error(EINVAL, (uint8_t*)"--serve: Can't be used with"
+                    " --gzip");
+        return serve(serve_addr, body_only);
+    }
+
+    if (filenames_count > 1)
+    {
+        result = render_files(filenames, filenames_count, body_only);
+        free(filenames);
+        if (basedir)
+            free(basedir);
+        return result;
+    }
+    free(filenames);
+
     FILE* input        = NULL;
     FILE* output       = stdout;
+    GzipJob gzip;
     uint8_t* buffer    = NULL;
     size_t buffer_size = 0;
 
+    if (use_gzip)
+        output = start_gzip(&gzip, -1, STDOUT_FILENO);
+
+    if (stream_input)
+    {
+        if (!input_filename)
+            input = stdin;
+        else if ((result = open_input(input_filename, &input_dirname, &input)))
+            return result;
+
+        result = render_stream(input, output, body_only);
+
+        if (input != stdin)
+            fclose(input);
+        if (use_gzip && finish_gzip(&gzip, output))
+            result = 1;
+        if (basedir)
+            free(basedir);
+        free_document();
+        return result;
+    }
+
     if (input_filename)
-        read_file_into_buffer(&buffer, &buffer_size, input_filename, &input_dirname, &input);
+    {
+        if ((result = read_file_into_buffer(&buffer, &buffer_size, 
+                        input_filename, &input_dirname, &input)))
+        {
+            if (basedir)
+                free(basedir);
+            return result;
+        }
+    }
     else
     {
         uint8_t* bufline   = NULL;
@@ -3806,69 +11622,23 @@ main(int argc, char** argv)
             bufline_len = u8_strlen(bufline);
             if (buffer_len + bufline_len + 1 > buffer_size)
             {
-                buffer_size += BUFSIZE;
+                while (buffer_len + bufline_len + 1 > buffer_size)
+                    buffer_size *= 2;
                 REALLOC(buffer, uint8_t, buffer_size)
             }
-            u8_strncat(buffer, bufline, buffer_size-buffer_len-1);
+            memcpy(buffer + buffer_len, bufline, bufline_len + 1);
             buffer_len += bufline_len;
         }
         free(bufline);
     }
 
-    CALLOC(vars, KeyValue, 1)
-    vars->key = NULL;
-    vars->value = NULL;
-    vars->value_size = 0;
-
-    CALLOC(macros, KeyValue, 1)
-    macros->key = NULL;
-    macros->value = NULL;
-    macros->value_size = 0;
-
-    CALLOC(links, KeyValue, 1)
-    links->key = NULL;
-    links->value = NULL;
-    links->value_size = 0;
-
-    CALLOC(footnotes, KeyValue, 1)
-    footnotes->key = NULL;
-    footnotes->value = NULL;
-    footnotes->value_size = 0;
-
-    CALLOC(inline_footnotes, uint8_t*, 1)
-    *inline_footnotes = NULL;
-    inline_footnote_count = 0;
-
-    /* First pass: read YAML, macros and links */
-    result = slweb_parse(buffer, output, body_only, TRUE);
-
-    if (result)
-    {
-        free(buffer);
-        return result;
-    }
-
-    state = ST_NONE;
-    current_footnote = 0;
-    current_inline_footnote = 0;
-
-    /* Second pass: parse and output */
-    result = slweb_parse(buffer, output, body_only, FALSE);
+    result = render_buffer(buffer, output, body_only);
+    if (use_gzip && finish_gzip(&gzip, output))
+        result = 1;
 
     if (basedir)
         free(basedir);
-    if (input_dirname)
-        free(input_dirname);
-    if (inline_footnotes)
-        free(inline_footnotes);
-    free_keyvalue(&footnotes, footnote_count);
-    free_keyvalue(&links, links_count);
-    free_keyvalue(&macros, macros_count);
-    free_keyvalue(&vars, vars_count);
-    free(footnotes);
-    free(links);
-    free(macros);
-    free(vars);
+    free_document();
     free(buffer);
 
     return result;